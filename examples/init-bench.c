@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Controller bring-up benchmark; reports the time (in microseconds) spent in
+ * each phase of controller initialization for each of the given devices, the
+ * total time to initialize them one after another with nvme_init() and the
+ * time to initialize them concurrently with nvme_init_ctrls().
+ *
+ *   init-bench 0000:01:00.0 0000:02:00.0 ...
+ */
+
+#include <vfn/nvme.h>
+
+#include <nvme/types.h>
+
+#include "ccan/err/err.h"
+#include "ccan/opt/opt.h"
+#include "ccan/time/time.h"
+
+#include "common.h"
+
+enum phase {
+	PHASE_OPEN,
+	PHASE_RESET,
+	PHASE_ADMINQ,
+	PHASE_ENABLE,
+	PHASE_NRQS,
+	PHASE_IDENTIFY,
+
+	NR_PHASES,
+};
+
+static const char *phase_names[NR_PHASES] = {
+	"open", "reset", "adminq", "enable", "nrqs", "identify",
+};
+
+static struct opt_table opts[] = {
+	OPT_WITHOUT_ARG("-h|--help", opt_set_bool, &show_usage, "show usage"),
+	OPT_ENDTABLE,
+};
+
+static inline uint64_t lap(struct timemono *t)
+{
+	struct timemono now = time_mono();
+	uint64_t us = time_to_usec(timemono_between(now, *t));
+
+	*t = now;
+
+	return us;
+}
+
+/* run the steps of nvme_init() one by one */
+static void bench_phases(const char *bdf, uint64_t *us)
+{
+	struct nvme_ctrl ctrl = {};
+	union nvme_cmd cmd = {};
+	struct timemono t;
+	void *vaddr;
+
+	if (pgmap(&vaddr, NVME_IDENTIFY_DATA_SIZE) < 0)
+		err(1, "could not allocate aligned memory");
+
+	t = time_mono();
+
+	if (nvme_ctrl_init(&ctrl, bdf, NULL))
+		err(1, "%s: could not initialize controller", bdf);
+
+	us[PHASE_OPEN] = lap(&t);
+
+	if (nvme_reset(&ctrl))
+		err(1, "%s: could not reset controller", bdf);
+
+	us[PHASE_RESET] = lap(&t);
+
+	if (nvme_configure_adminq(&ctrl, 0x0))
+		err(1, "%s: could not configure admin queue", bdf);
+
+	us[PHASE_ADMINQ] = lap(&t);
+
+	if (nvme_enable(&ctrl))
+		err(1, "%s: could not enable controller", bdf);
+
+	us[PHASE_ENABLE] = lap(&t);
+
+	cmd.features = (struct nvme_cmd_features) {
+		.opcode = nvme_admin_set_features,
+		.fid = NVME_FEAT_FID_NUM_QUEUES,
+	};
+
+	if (nvme_admin(&ctrl, &cmd, NULL, 0, NULL))
+		err(1, "%s: could not set number of queues", bdf);
+
+	us[PHASE_NRQS] = lap(&t);
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = nvme_admin_identify,
+		.cns = NVME_IDENTIFY_CNS_CTRL,
+	};
+
+	if (nvme_admin(&ctrl, &cmd, vaddr, NVME_IDENTIFY_DATA_SIZE, NULL))
+		err(1, "%s: could not identify controller", bdf);
+
+	us[PHASE_IDENTIFY] = lap(&t);
+
+	nvme_close(&ctrl);
+
+	pgunmap(vaddr, NVME_IDENTIFY_DATA_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	const char **bdfs;
+	struct nvme_ctrl *ctrls;
+	struct timemono t;
+	uint64_t us[NR_PHASES];
+	int n;
+
+	opt_register_table(opts, NULL);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+
+	if (show_usage)
+		opt_usage_and_exit("BDF...");
+
+	if (argc < 2)
+		opt_usage_exit_fail("missing device(s)");
+
+	opt_free_table();
+
+	n = argc - 1;
+	bdfs = (const char **)&argv[1];
+	ctrls = znew_t(struct nvme_ctrl, n);
+
+	printf("%-14s", "device");
+	for (int p = 0; p < NR_PHASES; p++)
+		printf(" %10s", phase_names[p]);
+	printf("  (us)\n");
+
+	for (int i = 0; i < n; i++) {
+		bench_phases(bdfs[i], us);
+
+		printf("%-14s", bdfs[i]);
+		for (int p = 0; p < NR_PHASES; p++)
+			printf(" %10" PRIu64, us[p]);
+		printf("\n");
+	}
+
+	t = time_mono();
+
+	for (int i = 0; i < n; i++) {
+		if (nvme_init(&ctrls[i], bdfs[i], NULL))
+			err(1, "%s: could not initialize controller", bdfs[i]);
+	}
+
+	printf("\n%-16s %10" PRIu64 " us\n", "nvme_init", lap(&t));
+
+	for (int i = 0; i < n; i++)
+		nvme_close(&ctrls[i]);
+
+	t = time_mono();
+
+	if (nvme_init_ctrls(ctrls, bdfs, n, NULL, NULL))
+		err(1, "could not initialize controllers");
+
+	printf("%-16s %10" PRIu64 " us\n", "nvme_init_ctrls", lap(&t));
+
+	for (int i = 0; i < n; i++)
+		nvme_close(&ctrls[i]);
+
+	free(ctrls);
+
+	return 0;
+}
@@ -21,6 +21,7 @@ extern "C" {
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include <linux/types.h>
 
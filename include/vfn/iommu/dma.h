@@ -43,8 +43,9 @@ struct iova_vec {
  * @IOMMU_MAP_NOREAD: DMA is not allowed to read from this mapping
  *
  * IOMMU_MAP_EPHEMERAL may change how the iova is allocated. I.e., currently,
- * the vfio-based backend will allocate an IOVA from a reserved range of 64k.
- * The iommufd-based backend has no such restrictions.
+ * the vfio-based backend will allocate an IOVA from a reserved area (see
+ * iommu_set_ephemeral_area()). The iommufd-based backend has no such
+ * restrictions.
  */
 enum iommu_map_flags {
 	IOMMU_MAP_FIXED_IOVA	= 1 << 0,
@@ -107,6 +108,10 @@ int iommu_map_vaddr_align(struct iommu_ctx *ctx, void *vaddr, size_t len,
  * mappings created using iommu_map_vaddr(). If @len is not NULL, the length of
  * the mapping will be written to the pointee.
  *
+ * If deferred unmapping is enabled (see iommu_set_deferred_unmap()), @vaddr is
+ * removed from the iova map right away, but the IOMMU mapping is only removed
+ * when the queue of released ranges is flushed.
+ *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len);
@@ -121,6 +126,263 @@ int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len);
  */
 int iommu_unmap_all(struct iommu_ctx *ctx);
 
+/**
+ * iommu_map_fd - Map a file range to an I/O virtual address
+ * @ctx: &struct iommu_ctx
+ * @fd: file descriptor (e.g. a memfd)
+ * @offset: offset into the file
+ * @len: number of bytes to map
+ * @iova: output parameter for mapped I/O virtual address
+ * @flags: combination of enum iommu_map_flags; %IOMMU_MAP_EPHEMERAL is not
+ *         supported
+ *
+ * Allocate an I/O virtual address (iova) and program the IOMMU to map the
+ * pages backing @len bytes of @fd at @offset. If supported by the backend
+ * (iommufd with ``IOMMU_IOAS_MAP_FILE``), the file is pinned directly, without
+ * requiring a mapping of it in the process. Otherwise, the file range is
+ * mmap'ed (shared) and the mapping is mapped like iommu_map_vaddr().
+ *
+ * The mapping is identified by its iova and has no virtual address; the
+ * process (or any other process with access to the file) may mmap the file to
+ * access the memory.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_map_fd(struct iommu_ctx *ctx, int fd, off_t offset, size_t len, iova_t *iova,
+		 unsigned long flags);
+
+/**
+ * iommu_unmap_fd - Unmap a file range in the IOMMU
+ * @ctx: &struct iommu_ctx
+ * @iova: I/O virtual address of the mapping, as returned by iommu_map_fd()
+ * @len: output parameter for length of mapping
+ *
+ * Remove a mapping created with iommu_map_fd(). If @len is not NULL, the length
+ * of the mapping will be written to the pointee.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_unmap_fd(struct iommu_ctx *ctx, iova_t iova, size_t *len);
+
+/**
+ * iommu_set_deferred_unmap - Configure deferred unmapping
+ * @ctx: &struct iommu_ctx
+ * @threshold: maximum number of queued ranges; ``0`` disables deferred unmapping
+ *
+ * When enabled, iommu_unmap_vaddr() does not unmap the range in the IOMMU, but
+ * queues it. The queue is flushed when @threshold ranges have been queued, on
+ * iommu_flush_unmap() or iommu_unmap_all(), or when an iova cannot be
+ * allocated; adjacent ranges are unmapped using a single call to the kernel.
+ * Queued iovas are not reused until flushed.
+ *
+ * Until the queue is flushed, the device may still access the memory that was
+ * previously mapped at the queued iovas. The memory remains pinned, but must
+ * not be reused for other purposes if the device is untrusted.
+ *
+ * Any ranges queued prior to the call are flushed.
+ *
+ * Return: ``0`` on success, ``-1`` on error (failure to unmap a queued range)
+ * and sets ``errno``.
+ */
+int iommu_set_deferred_unmap(struct iommu_ctx *ctx, unsigned int threshold);
+
+/**
+ * iommu_flush_unmap - Flush deferred unmaps
+ * @ctx: &struct iommu_ctx
+ *
+ * Unmap all ranges queued by iommu_unmap_vaddr() while deferred unmapping is
+ * enabled (see iommu_set_deferred_unmap()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_flush_unmap(struct iommu_ctx *ctx);
+
+/**
+ * iommu_set_ephemeral_area - Configure the size of the ephemeral iova area
+ * @ctx: &struct iommu_ctx
+ * @len: size of the area in bytes
+ *
+ * The vfio-based backend allocates the iovas of %IOMMU_MAP_EPHEMERAL mappings
+ * from a dedicated area (4 MiB by default) that is split into chunks of
+ * 256 KiB. Each thread allocates from a chunk of its own without locking, and
+ * a chunk is recycled as soon as the thread has moved on to another chunk (or
+ * exited) and all mappings in it have been removed. Ephemeral mappings larger
+ * than a chunk are allocated like regular mappings.
+ *
+ * @len is rounded up to a multiple of the chunk size; the number of chunks
+ * bounds the number of threads that can concurrently do ephemeral mappings.
+ * The area is reserved when the first ephemeral mapping is made, so this must
+ * be called before that. Other backends do not reserve an area, and the call
+ * has no effect.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``EBUSY`` if
+ * the area has already been reserved).
+ */
+int iommu_set_ephemeral_area(struct iommu_ctx *ctx, size_t len);
+
+/**
+ * iommu_set_map_cache - Configure the mapping cache
+ * @ctx: &struct iommu_ctx
+ * @capacity: maximum number of cached mappings; ``0`` disables the cache
+ *
+ * Set the number of caller buffers that iommu_map_cache_get() keeps mapped. If
+ * the cache holds more than @capacity mappings, the least recently used ones
+ * are unmapped.
+ *
+ * The cache is disabled by default.
+ */
+void iommu_set_map_cache(struct iommu_ctx *ctx, unsigned int capacity);
+
+/**
+ * iommu_map_cache_get - Get the I/O virtual address of a transient buffer
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual memory address of the buffer
+ * @len: length of the buffer
+ * @iova: output parameter for the I/O virtual address
+ *
+ * If @vaddr is not already mapped, map it and keep it in the mapping cache
+ * instead of requiring the caller to unmap it after use. When the cache is
+ * full, the least recently used mapping is unmapped. This is used by
+ * nvme_sync() for buffers that are not mapped by the caller.
+ *
+ * The cached mapping is in use until the caller calls iommu_map_cache_put()
+ * (e.g., when the device is done with the buffer); mappings in use are never
+ * evicted.
+ *
+ * Since cached buffers stay mapped (and pinned), the cache must be told when a
+ * buffer is released to the system (e.g. with munmap() or free()) by calling
+ * iommu_map_cache_invalidate(). Otherwise, the IOMMU keeps mapping the old
+ * pages should the virtual address be reused.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``EOPNOTSUPP``
+ * if the cache is disabled, ``EBUSY`` if the buffer cannot be cached because
+ * the mappings in the way are in use).
+ */
+int iommu_map_cache_get(struct iommu_ctx *ctx, void *vaddr, size_t len, iova_t *iova);
+
+/**
+ * iommu_map_cache_put - Release a buffer returned by iommu_map_cache_get()
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual memory address given to iommu_map_cache_get()
+ *
+ * Drop the reference taken by a successful iommu_map_cache_get() on @vaddr,
+ * such that the mapping may be evicted again. Does nothing if @vaddr was not
+ * cached (i.e., it was mapped by someone else).
+ */
+void iommu_map_cache_put(struct iommu_ctx *ctx, void *vaddr);
+
+/**
+ * iommu_map_cache_invalidate - Invalidate cached mappings
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual memory address
+ * @len: length of the range
+ *
+ * Unmap all cached mappings overlapping the range [@vaddr, @vaddr + @len),
+ * including mappings in use; the range must not be in use by the device.
+ */
+void iommu_map_cache_invalidate(struct iommu_ctx *ctx, void *vaddr, size_t len);
+
+/**
+ * iommu_mirror_vaddr - Mirror a mapping into another context
+ * @dst: &struct iommu_ctx to mirror the mapping into
+ * @src: &struct iommu_ctx that has @vaddr mapped
+ * @vaddr: virtual memory address within a mapping in @src
+ * @iova: output parameter for the I/O virtual address of @vaddr
+ *
+ * Map the entire mapping of @src that contains @vaddr into @dst at the same
+ * I/O virtual address, without pinning the memory again. This requires both
+ * contexts to use iommufd (``IOMMU_IOAS_COPY``). With the vfio backend,
+ * devices must instead share a single context (see &struct nvme_ctrl_opts and
+ * vfio_pci_open()).
+ *
+ * The mirrored mapping is removed from @dst with iommu_unmap_vaddr().
+ *
+ * Return: ``0`` on success (or if the mapping has already been mirrored),
+ * ``-1`` on error and sets ``errno`` (``EOPNOTSUPP`` if the contexts do not
+ * support copying mappings, ``EEXIST`` if @vaddr is mapped at a different
+ * address in @dst).
+ */
+int iommu_mirror_vaddr(struct iommu_ctx *dst, struct iommu_ctx *src, void *vaddr,
+		       iova_t *iova);
+
+/**
+ * struct iommu_region - Registered memory region
+ * @ctx: &struct iommu_ctx
+ * @vaddr: start of the region
+ * @iova: I/O virtual address of @vaddr
+ * @len: length of the region
+ *
+ * Handle for a region registered with iommu_register_region(). The I/O virtual
+ * address of any byte in the region can be computed from the handle alone (see
+ * iommu_region_iova()), without looking up the iova map.
+ */
+struct iommu_region {
+	struct iommu_ctx *ctx;
+
+	void *vaddr;
+	iova_t iova;
+	size_t len;
+};
+
+/**
+ * iommu_register_region - Pin and map a memory region once
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual memory address of the region
+ * @len: length of the region in bytes
+ * @region: output parameter for the region handle
+ * @flags: combination of enum iommu_map_flags
+ *
+ * Map the region like iommu_map_vaddr() and fill in @region. This is intended
+ * for applications that manage their own buffer arenas; I/O within the region
+ * can then be set up using offsets into the handle (e.g. with
+ * nvme_rq_map_region()) instead of translating virtual addresses.
+ *
+ * The region must not overlap an existing mapping. If @flags includes
+ * %IOMMU_MAP_FIXED_IOVA, @region->iova must be initialized to the requested I/O
+ * virtual address.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_register_region(struct iommu_ctx *ctx, void *vaddr, size_t len,
+			  struct iommu_region *region, unsigned long flags);
+
+/**
+ * iommu_unregister_region - Unmap a registered memory region
+ * @region: &struct iommu_region
+ *
+ * Unmap a region registered with iommu_register_region() and clear @region.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_unregister_region(struct iommu_region *region);
+
+/**
+ * iommu_region_iova - Get the I/O virtual address of an offset into a region
+ * @region: &struct iommu_region
+ * @offset: offset into the region
+ *
+ * Return: the I/O virtual address of @offset. @offset is not checked against
+ * the length of the region.
+ */
+static inline iova_t iommu_region_iova(const struct iommu_region *region, size_t offset)
+{
+	return region->iova + offset;
+}
+
+/**
+ * iommu_region_contains - Check that a range is within a region
+ * @region: &struct iommu_region
+ * @offset: offset into the region
+ * @len: length of the range
+ *
+ * Return: ``true`` if [@offset, @offset + @len) is within @region.
+ */
+static inline bool iommu_region_contains(const struct iommu_region *region, size_t offset,
+					 size_t len)
+{
+	return offset <= region->len && len <= region->len - offset;
+}
+
 /**
  * iommu_alloc_same_iova - Allocate a buffer where the iova value is the same
  *	as the virtual address
@@ -131,21 +393,55 @@ int iommu_unmap_all(struct iommu_ctx *ctx);
  * to pass around both a virtual address and iova, allocate memory that
  * has the same virtual address as the iova.
  *
+ * Address space released by iommu_free_same_iova() is reused by later
+ * allocations.
+ *
  * Return: pointer to allocated memory or ``NULL`` on failure.
  */
 void *iommu_alloc_same_iova(struct iommu_ctx *ctx, size_t len);
 
+/**
+ * iommu_alloc_same_iova_flags - Allocate a buffer where the iova value is the
+ *	same as the virtual address
+ * @ctx: &struct iommu_ctx
+ * @len: number of bytes to map
+ * @flags: combination of enum pgmap_flags and PGMAP_NODE()
+ *
+ * Like iommu_alloc_same_iova(), but allows the memory to be backed by huge
+ * pages (see pgmapf()). The buffer (and, thus, the iova) is aligned to, and
+ * its length is rounded up to, pgmap_pagesize() of @flags.
+ *
+ * Return: pointer to allocated memory or ``NULL`` on failure.
+ */
+void *iommu_alloc_same_iova_flags(struct iommu_ctx *ctx, size_t len, unsigned long flags);
+
 /**
  * iommu_free_same_iova - Free memory allocated with iommu_alloc_same_iova()
  * @ctx: &struct iommu_ctx
  * @vaddr: virtual memory address to unmap
  *
- * Unmap memory allocated with iommu_alloc_same_iova().
+ * Unmap memory allocated with iommu_alloc_same_iova() or
+ * iommu_alloc_same_iova_flags(). If pooling is enabled (see
+ * iommu_set_same_iova_pool()) and there is room in the pool, the buffer is
+ * kept mapped instead.
  *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int iommu_free_same_iova(struct iommu_ctx *ctx, void *vaddr);
 
+/**
+ * iommu_set_same_iova_pool - Keep released same iova buffers mapped for reuse
+ * @ctx: &struct iommu_ctx
+ * @max: maximum number of bytes to keep pooled; zero disables pooling
+ *
+ * Keep up to @max bytes of buffers released by iommu_free_same_iova() mapped,
+ * such that a later allocation of the same (rounded up) length and flags is
+ * served without any system calls or IOMMU updates. Pooled buffers are handed
+ * out again as-is; they are not cleared. Lowering @max unmaps pooled buffers
+ * (largest first) until the pool fits.
+ */
+void iommu_set_same_iova_pool(struct iommu_ctx *ctx, size_t max);
+
 #ifndef IOMMU_IOAS_IOVA_RANGES
 struct iommu_iova_range {
 	iova_t __attribute__((aligned(8))) start;
@@ -160,12 +456,32 @@ struct iommu_iova_range {
  * @iova: output parameter
  *
  * Use the iova map within the iommu context to lookup and translate the given
- * virtual address into an I/O virtual address.
+ * virtual address into an I/O virtual address. Recent translations are cached
+ * per thread; the cache is invalidated when any mapping is removed.
  *
  * Return: ``true`` on success, ``false`` if no mapping was found.
  */
 bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, iova_t *iova);
 
+/**
+ * iommu_translate_vaddrv - Translate a vector of virtual addresses into iovas
+ * @ctx: &struct iommu_ctx
+ * @iov: array of iovecs
+ * @niov: number of iovecs in @iov
+ * @iova: output array of at least @niov elements
+ *
+ * Translate the base address of each iovec in @iov, storing the resulting I/O
+ * virtual addresses in @iova. The iova map is locked only once for the entire
+ * vector, and each lookup resumes from the previous one, making this cheaper
+ * than repeated calls to iommu_translate_vaddr() when the iovecs are sorted or
+ * reside within the same mapping.
+ *
+ * Return: the number of leading iovecs that were translated. If less than
+ * @niov, the entry at that index has no mapping.
+ */
+int iommu_translate_vaddrv(struct iommu_ctx *ctx, const struct iovec *iov, int niov,
+			   iova_t *iova);
+
 /**
  * iommu_translate_iova - Translate a I/O virtual address into a virtual address
  * @ctx: &struct iommu_ctx
@@ -47,16 +47,64 @@ struct iommu_dmabuf {
 	ssize_t len;
 };
 
+/**
+ * enum iommu_dmabuf_flags - Allocation flags for DMA buffers
+ * @IOMMU_DMABUF_HUGETLB_2M: Allocate from the 2 MiB hugetlbfs pool
+ * @IOMMU_DMABUF_HUGETLB_1G: Allocate from the 1 GiB hugetlbfs pool
+ * @IOMMU_DMABUF_THP: Back the buffer with transparent huge pages if possible
+ * @IOMMU_DMABUF_PREFAULT: Fault in the buffer before mapping it
+ * @IOMMU_DMABUF_SHARED: Back the buffer with shared memory such that it can be
+ *                       used by child processes (see %PGMAP_SHARED)
+ *
+ * These correspond to enum pgmap_flags and may be combined with enum
+ * iommu_map_flags. Huge page backed buffers are mapped at an IOVA aligned to
+ * the huge page size (unless %IOMMU_MAP_FIXED_IOVA or %IOMMU_MAP_EPHEMERAL is
+ * given), allowing the IOMMU to use large page table entries.
+ *
+ * The buffer may be placed on a NUMA node with IOMMU_DMABUF_NODE().
+ */
+enum iommu_dmabuf_flags {
+	IOMMU_DMABUF_HUGETLB_2M	= 1 << 16,
+	IOMMU_DMABUF_HUGETLB_1G	= 1 << 17,
+	IOMMU_DMABUF_THP	= 1 << 18,
+	IOMMU_DMABUF_PREFAULT	= 1 << 19,
+	IOMMU_DMABUF_SHARED	= 1 << 20,
+};
+
+/* enum iommu_dmabuf_flags are enum pgmap_flags shifted by this */
+#define IOMMU_DMABUF_PGMAP_SHIFT 16
+
+#define IOMMU_DMABUF_NODE_MASK (PGMAP_NODE_MASK << IOMMU_DMABUF_PGMAP_SHIFT)
+
+/**
+ * IOMMU_DMABUF_NODE - Place a DMA buffer on a NUMA node
+ * @node: NUMA node; see PGMAP_NODE()
+ *
+ * May be combined with enum iommu_dmabuf_flags.
+ */
+#define IOMMU_DMABUF_NODE(node) (PGMAP_NODE(node) << IOMMU_DMABUF_PGMAP_SHIFT)
+
+/**
+ * iommu_dmabuf_node - Get the NUMA node of DMA buffer allocation flags
+ * @flags: combination of enum iommu_map_flags, enum iommu_dmabuf_flags and
+ *         IOMMU_DMABUF_NODE()
+ *
+ * Return: the NUMA node given with IOMMU_DMABUF_NODE(), or ``-1`` if none.
+ */
+#define iommu_dmabuf_node(flags) pgmap_node((flags) >> IOMMU_DMABUF_PGMAP_SHIFT)
+
 /**
  * iommu_get_dmabuf - Allocate and map a DMA buffer
  * @ctx: &struct iommu_ctx
  * @buffer: uninitialized &struct iommu_dmabuf
  * @len: desired minimum length
- * @flags: combination of enum iommu_map_flags
+ * @flags: combination of enum iommu_map_flags, enum iommu_dmabuf_flags and
+ *         IOMMU_DMABUF_NODE()
  *
  * Allocate at least @len bytes and map the buffer within the IOVA address space
  * described by @ctx. The actual allocated and mapped length may be larger than
- * requestes due to alignment requirements.
+ * requestes due to alignment requirements (e.g., it is rounded up to the huge
+ * page size for huge page backed buffers).
  *
  * Return: On success, returns ``0``; on error, returns ``-1`` and sets
  * ``errno``.
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_IOMMU_DMAPOOL_H
+#define LIBVFN_IOMMU_DMAPOOL_H
+
+/**
+ * DOC: DMA memory pools
+ *
+ * A DMA memory pool allocates and maps a single large buffer up front and hands
+ * out small, power-of-two sized chunks of it (a cache line at minimum, up to
+ * %IOMMU_DMAPOOL_MAX_CHUNK bytes) with the I/O virtual address precomputed.
+ * Allocating and freeing a chunk does not require any system calls or IOMMU
+ * updates; freed chunks are kept in a per-thread cache and are only returned
+ * to the pool in batches.
+ *
+ * Chunks are aligned to their size, up to the page size.
+ *
+ * &struct iommu_dmachunk is registered as an "autovar" and can be
+ * automatically returned to the pool when going out of scope. For this reason,
+ * this header is not included in <vfn/iommu.h> and must explicitly be
+ * included.
+ *
+ * Required includes:
+ *   #include <vfn/iommu.h>
+ *   #include <vfn/support/autoptr.h>
+ *   #include <vfn/iommu/dmapool.h>
+ */
+
+#define IOMMU_DMAPOOL_MAX_CHUNK (1 << 16)
+
+struct iommu_dmapool;
+
+/**
+ * struct iommu_dmachunk - DMA pool chunk abstraction
+ * @pool: &struct iommu_dmapool the chunk was allocated from
+ * @vaddr: data buffer
+ * @iova: mapped address
+ * @len: length of @vaddr
+ *
+ * Convenience wrapper around a chunk allocated from a DMA pool.
+ */
+struct iommu_dmachunk {
+	struct iommu_dmapool *pool;
+
+	void *vaddr;
+	iova_t iova;
+	size_t len;
+};
+
+/**
+ * iommu_dmapool_create - Create a DMA memory pool
+ * @ctx: &struct iommu_ctx
+ * @len: size of the pool in bytes
+ * @flags: combination of enum iommu_map_flags and enum iommu_dmabuf_flags
+ *
+ * Allocate and map a buffer of at least @len bytes (see iommu_get_dmabuf()) to
+ * serve chunks from. The pool does not grow.
+ *
+ * Return: On success, returns a pointer to the pool; on error, returns ``NULL``
+ * and sets ``errno``.
+ */
+struct iommu_dmapool *iommu_dmapool_create(struct iommu_ctx *ctx, size_t len,
+					   unsigned long flags);
+
+/**
+ * iommu_dmapool_destroy - Destroy a DMA memory pool
+ * @pool: &struct iommu_dmapool
+ *
+ * Unmap and deallocate the pool and all per-thread caches. All chunks must have
+ * been freed and no other thread may use the pool concurrently (or exit, if it
+ * has used the pool).
+ */
+void iommu_dmapool_destroy(struct iommu_dmapool *pool);
+
+/**
+ * iommu_dmapool_forget - Release a DMA memory pool inherited from a parent
+ * @pool: &struct iommu_dmapool
+ *
+ * Like iommu_dmapool_destroy(), but leave the IOMMU mapping of the pool alone.
+ * This is for a process created with fork() that inherited @pool: it releases
+ * the process private copy of the pool state and unmaps the pool from the
+ * address space of the process, while the pool stays usable by the process
+ * that created it.
+ */
+void iommu_dmapool_forget(struct iommu_dmapool *pool);
+
+/**
+ * iommu_dmapool_alloc - Allocate a chunk from a DMA memory pool
+ * @pool: &struct iommu_dmapool
+ * @len: number of bytes to allocate
+ * @iova: output parameter for the I/O virtual address of the chunk
+ *
+ * Allocate a chunk of at least @len bytes. @len is rounded up to the next power
+ * of two (and at least a cache line).
+ *
+ * Return: On success, returns the virtual address of the chunk; on error,
+ * returns ``NULL`` and sets ``errno`` (``EINVAL`` if @len is zero or larger
+ * than %IOMMU_DMAPOOL_MAX_CHUNK, ``ENOMEM`` if the pool is exhausted).
+ */
+void *iommu_dmapool_alloc(struct iommu_dmapool *pool, size_t len, iova_t *iova);
+
+/**
+ * iommu_dmapool_free - Return a chunk to a DMA memory pool
+ * @pool: &struct iommu_dmapool
+ * @vaddr: virtual address of the chunk, as returned by iommu_dmapool_alloc()
+ */
+void iommu_dmapool_free(struct iommu_dmapool *pool, void *vaddr);
+
+/**
+ * iommu_dmapool_get - Allocate a chunk from a DMA memory pool
+ * @pool: &struct iommu_dmapool
+ * @chunk: uninitialized &struct iommu_dmachunk
+ * @len: number of bytes to allocate
+ *
+ * Like iommu_dmapool_alloc(), but fills in @chunk. The chunk is zeroed.
+ *
+ * If the pool is exhausted, the chunk is backed by a separately allocated
+ * buffer with an ephemeral mapping (see iommu_get_dmabuf()) instead.
+ * iommu_dmapool_put() releases either kind.
+ *
+ * Return: On success, returns ``0``; on error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int iommu_dmapool_get(struct iommu_dmapool *pool, struct iommu_dmachunk *chunk, size_t len);
+
+/**
+ * iommu_dmapool_put - Return a chunk to its DMA memory pool
+ * @chunk: &struct iommu_dmachunk
+ */
+void iommu_dmapool_put(struct iommu_dmachunk *chunk);
+
+static inline void __do_iommu_dmapool_put(void *p)
+{
+	struct iommu_dmachunk *chunk = (struct iommu_dmachunk *)p;
+
+	iommu_dmapool_put(chunk);
+}
+
+DEFINE_AUTOVAR_STRUCT(iommu_dmachunk, __do_iommu_dmapool_put);
+
+#endif /* LIBVFN_IOMMU_DMAPOOL_H */
@@ -37,12 +37,14 @@ extern "C" {
 #include <vfn/trace/events.h>
 #include <vfn/iommu.h>
 #include <vfn/iommu/dmabuf.h>
+#include <vfn/iommu/dmapool.h>
 #include <vfn/vfio.h>
 #include <vfn/nvme/types.h>
 #include <vfn/nvme/queue.h>
 #include <vfn/nvme/ctrl.h>
 #include <vfn/nvme/util.h>
 #include <vfn/nvme/rq.h>
+#include <vfn/nvme/pi.h>
 
 #ifdef __cplusplus
 }
@@ -20,6 +20,14 @@
  * @nsqr: number of submission queues to request
  * @ncqr: number of completion queues to request
  * @quirks: quirks to apply
+ * @dmabuf_flags: enum iommu_dmabuf_flags used when allocating queue memory,
+ *                request tracker pages and bounce buffers. Unless a node is
+ *                given with IOMMU_DMABUF_NODE(), the memory is placed on the
+ *                NUMA node of the controller (see nvme_set_queue_node()).
+ *                %IOMMU_DMABUF_SHARED is required for secondary processes
+ *                (see nvme_set_secondary())
+ * @ctx: iommu context to attach the controller to (e.g. the context of another
+ *       controller, see __iommu_ctx()), or ``NULL`` to use a new one
  *
  * **Note**: @nsqr and @ncqr are zeroes based values.
  */
@@ -27,11 +35,15 @@ struct nvme_ctrl_opts {
 	int nsqr, ncqr;
 #define NVME_QUIRK_BROKEN_DBBUF (1 << 0)
 	unsigned int quirks;
+	unsigned long dmabuf_flags;
+	struct iommu_ctx *ctx;
 };
 
 static const struct nvme_ctrl_opts nvme_ctrl_opts_default = {
 	.nsqr = 63, .ncqr = 63,
 	.quirks = 0x0,
+	.dmabuf_flags = 0x0,
+	.ctx = NULL,
 };
 
 /*
@@ -39,11 +51,16 @@ static const struct nvme_ctrl_opts nvme_ctrl_opts_default = {
  * @NVME_CTRL_F_ADMINISTRATIVE: controller type is admin
  * @NVME_CTRL_F_SGLS_SUPPORTED: SGLs are supported
  * @NVME_CTRL_F_SGLS_DWORD_ALIGNMENT: SGL data blocks require dword alignment
+ * @NVME_CTRL_F_SGLS_MPTR_SGL: MPTR may point to an SGL descriptor
+ * @NVME_CTRL_F_SECONDARY: handle is used by a secondary process (see
+ *                         nvme_set_secondary())
  */
 enum nvme_ctrl_feature_flags {
 	NVME_CTRL_F_ADMINISTRATIVE		= 1 << 0,
 	NVME_CTRL_F_SGLS_SUPPORTED		= 1 << 1,
 	NVME_CTRL_F_SGLS_DWORD_ALIGNMENT	= 1 << 2,
+	NVME_CTRL_F_SGLS_MPTR_SGL		= 1 << 3,
+	NVME_CTRL_F_SECONDARY			= 1 << 4,
 };
 
 /**
@@ -65,6 +82,9 @@ struct nvme_ctrl {
 	struct nvme_sq *sq;
 	struct nvme_cq *cq;
 
+	/* per-queue NUMA node (plus one; zero if not set) */
+	int *qnodes;
+
 	/**
 	 * @adminq: Admin queue pair
 	 */
@@ -73,6 +93,13 @@ struct nvme_ctrl {
 		struct nvme_cq *cq;
 	} adminq;
 
+	/* outstanding nvme_admin_async() commands, indexed by command identifier */
+	struct nvme_admin_req **admin_reqs;
+
+	/* AER completions set aside by nvme_admin_poll() without a callback */
+	struct nvme_cqe *aer_cqes;
+	int naer_cqes;
+
 	/**
 	 * @doorbells: mapped doorbell registers
 	 */
@@ -86,6 +113,11 @@ struct nvme_ctrl {
 		struct iommu_dmabuf eventidxs;
 	} dbbuf;
 
+	/**
+	 * @dmapool: pool for small, short-lived DMA buffers (e.g., identify data)
+	 */
+	struct iommu_dmapool *dmapool;
+
 	/**
 	 * @opts: controller options
 	 */
@@ -98,6 +130,9 @@ struct nvme_ctrl {
 		int nsqa, ncqa;
 		int mqes;
 		int mps;
+
+		/* capabilities register */
+		uint64_t cap;
 	} config;
 
 	/**
@@ -164,15 +199,110 @@ int nvme_ctrl_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ct
  */
 int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts);
 
+/**
+ * nvme_init_ctrls - Initialize multiple controllers concurrently
+ * @ctrls: Array of @n controllers to initialize
+ * @bdfs: Array of @n PCI device identifiers ("bus:device:function")
+ * @n: Number of controllers
+ * @opts: Controller configuration options (used for all controllers)
+ * @errs: Optional array of @n error numbers
+ *
+ * Like nvme_init(), but each initialization step is started on all controllers
+ * before waiting for any of them to finish it, such that the time spent waiting
+ * for the controllers to reset and become ready is overlapped. Independent
+ * admin commands (Set Features and Identify Controller) are also issued
+ * concurrently (see nvme_admin_async()).
+ *
+ * If @errs is not ``NULL``, ``errs[i]`` is set to ``0`` if ``ctrls[i]`` was
+ * successfully initialized and to the error number otherwise. A failed
+ * controller does not affect the initialization of the others.
+ *
+ * Return: ``0`` if all controllers were initialized. Otherwise, returns ``-1``
+ * and sets ``errno`` to the error number of the first controller that failed.
+ */
+int nvme_init_ctrls(struct nvme_ctrl *ctrls, const char *const *bdfs, int n,
+		    const struct nvme_ctrl_opts *opts, int *errs);
+
+/**
+ * typedef nvme_recover_cb - Outstanding request callback
+ * @ctrl: Controller reference
+ * @rq: Request tracker of a command that was outstanding
+ * @opaque: Opaque data pointer given to nvme_recover()
+ *
+ * See nvme_recover().
+ */
+typedef void (*nvme_recover_cb)(struct nvme_ctrl *ctrl, struct nvme_rq *rq, void *opaque);
+
+/**
+ * nvme_recover - Reset a controller and restore its queues
+ * @ctrl: Controller to recover
+ * @cb: Callback for each outstanding I/O request (may be ``NULL``)
+ * @opaque: Opaque data pointer passed to @cb
+ *
+ * Reset the controller (e.g., after a command timeout or a fatal status) and
+ * bring it back to the state it was in, without releasing any memory: the
+ * admin queue is reconfigured and the controller enabled, the number of queues
+ * and the doorbell buffers are configured again, and all I/O queues are
+ * recreated at the same addresses and with the same sizes. The queues (and the
+ * shadow doorbells) start out empty.
+ *
+ * Outstanding commands submitted with nvme_admin_async() are completed with a
+ * Command Aborted By Host status (see nvme_admin_abort()). Outstanding
+ * Asynchronous Event Requests are dropped and must be posted again.
+ *
+ * Each I/O request tracker that was acquired when the controller was reset is
+ * passed to @cb. The tracker stays acquired and keeps its data pointer mapping;
+ * the command must be submitted again (e.g., with nvme_rq_exec()) or the
+ * tracker released. The submission queue entry is not recovered, so the caller
+ * must keep track of the command (e.g., through &nvme_rq.opaque).
+ *
+ * All users of the queues must be quiesced for the duration of the call.
+ *
+ * Return: On success, returns the number of outstanding I/O requests. On error,
+ * returns ``-1`` and sets ``errno`` (``ENODEV`` if the controller is not
+ * accessible, ``EPERM`` if @ctrl is used by a secondary process).
+ */
+int nvme_recover(struct nvme_ctrl *ctrl, nvme_recover_cb cb, void *opaque);
+
 /**
  * nvme_close - Close a controller
  * @ctrl: Controller to close
  *
  * Uninitialize the controller, deleting any i/o queues and releasing VFIO
  * resources.
+ *
+ * For a secondary handle (see nvme_set_secondary()), only the resources private
+ * to the process are released; the controller, its queues and all mappings are
+ * left to the primary process.
  */
 void nvme_close(struct nvme_ctrl *ctrl);
 
+/**
+ * nvme_set_secondary - Use an inherited controller handle in a secondary process
+ * @ctrl: Controller initialized by the primary process
+ *
+ * A primary process initializes the controller (with %IOMMU_DMABUF_SHARED in
+ * &nvme_ctrl_opts.dmabuf_flags), creates the I/O queues and then hands queue
+ * pairs to secondary processes created with fork(). The queue memory, request
+ * tracker pages and doorbells are shared, so a secondary drives its queue pairs
+ * directly (e.g., with nvme_rq_acquire() and nvme_rq_exec()) at the same
+ * addresses and iovas as the primary.
+ *
+ * Call this in the secondary process before using @ctrl. The request trackers
+ * and completion queue state are private to each process, so a queue pair must
+ * only be used by the process it was handed to.
+ *
+ * A secondary process must not change the IOMMU mappings (the iova allocator
+ * is private to each process): data buffers must be mapped by the primary
+ * before the fork, backed by shared memory (e.g., iommu_get_dmabuf() with
+ * %IOMMU_DMABUF_SHARED). Admin commands are reserved for the primary process;
+ * nvme_sync() fails with ``EPERM`` on the admin queue or an unmapped buffer.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``EINVAL`` if
+ * the queue memory is not shared).
+ */
+int nvme_set_secondary(struct nvme_ctrl *ctrl);
+
 /**
  * nvme_get_ctrl - Get nvme_ctrl instance initialized
  * @bdf: PCI device identifier ("bus:device:function")
@@ -263,6 +393,25 @@ int nvme_configure_sq_mem(struct nvme_ctrl *ctrl, int qid, int qsize,
                           struct nvme_cq *cq, unsigned long flags,
                           struct iommu_dmabuf *mem);
 
+/**
+ * nvme_configure_sq_bounce - Configure a bounce buffer for a submission queue
+ * @ctrl: Controller of the submission queue
+ * @sq: Submission queue instance (see nvme_configure_sq())
+ * @len: Size of the bounce buffer of each request tracker
+ *
+ * Allocate and map a bounce buffer pool for @sq, giving each request tracker
+ * a private bounce buffer of @len bytes (rounded up to the memory page size).
+ * Since each request tracker owns its part of the pool, bouncing requires no
+ * locking.
+ *
+ * Once configured, nvme_rq_mapv() and friends fall back to copying the data
+ * through the bounce buffer instead of failing if the iovec cannot be mapped
+ * directly. See nvme_rq_mapv().
+ *
+ * Return: ``0`` on success, ``-1`` on error and set ``errno``.
+ */
+int nvme_configure_sq_bounce(struct nvme_ctrl *ctrl, struct nvme_sq *sq, size_t len);
+
 /**
  * nvme_configure_cq - Configure a completion queue instance
  * @ctrl: Controller to configure a completion queue instance
@@ -284,6 +433,26 @@ int nvme_configure_sq_mem(struct nvme_ctrl *ctrl, int qid, int qsize,
  */
 int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector);
 
+/**
+ * nvme_set_queue_node - Set the NUMA node of a queue pair
+ * @ctrl: Controller reference
+ * @qid: Queue identifier
+ * @node: NUMA node, or ``-1`` to use the default
+ *
+ * Place the memory of the submission and completion queues identified by @qid
+ * (the queue entries, request trackers, request tracker pages and bounce
+ * buffers) on @node when they are subsequently configured (e.g., with
+ * nvme_create_ioqpair()). This is typically the node of the thread polling the
+ * queue.
+ *
+ * By default, queue memory is placed on the node given in
+ * &nvme_ctrl_opts.dmabuf_flags or, if none, the NUMA node of the controller
+ * (``ctrl->pci.numa_node``).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_set_queue_node(struct nvme_ctrl *ctrl, int qid, int node);
+
 
 /**
  * nvme_configure_cq_mem - Configure a completion queue instance with pre-allocated memory.
@@ -444,6 +613,51 @@ int nvme_create_ioqpair(struct nvme_ctrl *ctrl, int qid, int qsize, int vector,
  */
 int nvme_delete_ioqpair(struct nvme_ctrl *ctrl, int qid);
 
+/**
+ * nvme_create_ioqpairs - Create multiple I/O Completion/Submission Queue Pairs
+ * @ctrl: Controller reference
+ * @qid: Queue identifier of the first queue pair
+ * @n: Number of queue pairs
+ * @qsize: Queue size
+ * @vector: Completion queue interrupt vector of the first queue pair
+ * @flags: See &enum nvme_create_iosq_flags
+ *
+ * Like nvme_create_ioqpair(), but create the queue pairs @qid to @qid + @n - 1.
+ * If @vector is not ``-1``, queue pair ``qid + i`` uses interrupt vector
+ * ``vector + i``.
+ *
+ * The Create I/O Completion Queue commands are issued back to back on the admin
+ * queue (see nvme_admin_async()), followed by the Create I/O Submission Queue
+ * commands, instead of waiting for each command to complete before issuing the
+ * next one.
+ *
+ * If any queue could not be created, the queues that were created are deleted
+ * again. Queues that the controller then fails to delete are left configured
+ * (and logged), since the controller may still access their memory; release
+ * them with nvme_delete_ioqpairs().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_create_ioqpairs(struct nvme_ctrl *ctrl, int qid, int n, int qsize, int vector,
+			 unsigned long flags);
+
+/**
+ * nvme_delete_ioqpairs - Delete multiple I/O Completion/Submission Queue Pairs
+ * @ctrl: See &struct nvme_ctrl
+ * @qid: Queue identifier of the first queue pair
+ * @n: Number of queue pairs
+ *
+ * Like nvme_delete_ioqpair(), but delete the queue pairs @qid to @qid + @n - 1,
+ * issuing the Delete I/O Submission Queue commands and then the Delete I/O
+ * Completion Queue commands back to back. The queue memory is released even if
+ * a command fails.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_delete_ioqpairs(struct nvme_ctrl *ctrl, int qid, int n);
+
 
 /**
  * nvme_discard_cq - Free resources related to the corresponding CQ
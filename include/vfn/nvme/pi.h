@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_PI_H
+#define LIBVFN_NVME_PI_H
+
+/**
+ * enum nvme_pi_format - Protection Information Format
+ * @NVME_PI_FORMAT_16B_GUARD: 16b Guard Protection Information (T10-DIF CRC16)
+ * @NVME_PI_FORMAT_32B_GUARD: 32b Guard Protection Information (not supported)
+ * @NVME_PI_FORMAT_64B_GUARD: 64b Guard Protection Information (NVMe CRC64)
+ *
+ * The values correspond to the Protection Information Format field of the
+ * Extended LBA Format data structure.
+ */
+enum nvme_pi_format {
+	NVME_PI_FORMAT_16B_GUARD	= 0x0,
+	NVME_PI_FORMAT_32B_GUARD	= 0x1,
+	NVME_PI_FORMAT_64B_GUARD	= 0x2,
+};
+
+/**
+ * enum nvme_pi_type - Protection Information Type
+ * @NVME_PI_TYPE1: Type 1 protection; reference tag is incremented per block
+ * @NVME_PI_TYPE2: Type 2 protection; reference tag is incremented per block
+ * @NVME_PI_TYPE3: Type 3 protection; reference tag is not checked
+ */
+enum nvme_pi_type {
+	NVME_PI_TYPE1			= 0x1,
+	NVME_PI_TYPE2			= 0x2,
+	NVME_PI_TYPE3			= 0x3,
+};
+
+/**
+ * enum nvme_pi_check - Protection Information checks
+ * @NVME_PI_CHECK_REFTAG: Check the reference tag
+ * @NVME_PI_CHECK_APPTAG: Check the application tag
+ * @NVME_PI_CHECK_GUARD: Check the guard
+ *
+ * The values correspond to the Protection Information Check (PRCHK) bits of
+ * the Protection Information (PRINFO) field in I/O commands.
+ */
+enum nvme_pi_check {
+	NVME_PI_CHECK_REFTAG		= 1 << 0,
+	NVME_PI_CHECK_APPTAG		= 1 << 1,
+	NVME_PI_CHECK_GUARD		= 1 << 2,
+};
+
+/**
+ * struct nvme_pi_conf - Protection Information configuration
+ * @format: Protection information format (see &enum nvme_pi_format)
+ * @type: Protection information type (see &enum nvme_pi_type)
+ * @lbads: Size of the logical block data in bytes
+ * @ms: Size of the metadata in bytes
+ * @extended: Metadata is transferred at the end of each logical block data
+ *            (extended LBA) instead of in a separate buffer
+ * @pi_first: Protection information is transferred as the first bytes of
+ *            metadata instead of the last bytes
+ * @prchk: Checks to perform (see &enum nvme_pi_check)
+ * @reftag: Initial logical block reference tag
+ * @apptag: Logical block application tag
+ * @appmask: Logical block application tag mask
+ *
+ * Describes the protection information of a namespace (as reported by the
+ * Identify Namespace data structure) along with the tags of a transfer.
+ */
+struct nvme_pi_conf {
+	enum nvme_pi_format format;
+	enum nvme_pi_type type;
+
+	size_t lbads;
+	size_t ms;
+	bool extended;
+	bool pi_first;
+
+	unsigned int prchk;
+	uint64_t reftag;
+	uint16_t apptag, appmask;
+};
+
+/**
+ * struct nvme_pi_error - Protection Information verification error
+ * @block: Index of the logical block within the transfer that failed
+ * @check: The check that failed (see &enum nvme_pi_check)
+ * @expected: Expected value of the failed field
+ * @actual: Actual value of the failed field
+ */
+struct nvme_pi_error {
+	unsigned int block;
+	enum nvme_pi_check check;
+	uint64_t expected, actual;
+};
+
+/**
+ * nvme_pi_generate - Generate protection information
+ * @conf: Protection information configuration (see &struct nvme_pi_conf)
+ * @data: Logical block data
+ * @meta: Metadata buffer (ignored if @conf specifies extended LBAs)
+ * @nlb: Number of logical blocks
+ *
+ * Generate the guard, application tag and reference tag for @nlb logical
+ * blocks and write the protection information into the metadata. If
+ * ``conf->extended`` is set, @data holds @nlb logical blocks with interleaved
+ * metadata and @meta is ignored. Otherwise, @meta holds the metadata of the
+ * @nlb logical blocks in @data.
+ *
+ * The guard covers the logical block data and any metadata bytes preceding
+ * the protection information.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_pi_generate(const struct nvme_pi_conf *conf, void *data, void *meta,
+		     unsigned int nlb);
+
+/**
+ * nvme_pi_verify - Verify protection information
+ * @conf: Protection information configuration (see &struct nvme_pi_conf)
+ * @data: Logical block data
+ * @meta: Metadata buffer (ignored if @conf specifies extended LBAs)
+ * @nlb: Number of logical blocks
+ * @err: Optional output parameter for error details (see &struct nvme_pi_error)
+ *
+ * Verify the protection information of @nlb logical blocks according to the
+ * checks enabled in ``conf->prchk``. See nvme_pi_generate() for the buffer
+ * layout. Logical blocks with an application tag of ``0xffff`` (and, for Type
+ * 3, a reference tag with all bits set) are not checked.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno. If verification
+ * fails, errno is set to ``EBADMSG`` and, if @err is not ``NULL``, the failing
+ * block and check are stored in @err.
+ */
+int nvme_pi_verify(const struct nvme_pi_conf *conf, const void *data, const void *meta,
+		   unsigned int nlb, struct nvme_pi_error *err);
+
+/**
+ * nvme_pi_prep_rw - Set up protection information fields of a command
+ * @conf: Protection information configuration (see &struct nvme_pi_conf)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @pract: Set the Protection Information Action (PRACT) bit
+ *
+ * Set the Protection Information (PRINFO) field of a Read, Write or Compare
+ * command to the checks in ``conf->prchk`` and @pract, and set the initial
+ * logical block reference tag and the logical block application tag and mask.
+ */
+void nvme_pi_prep_rw(const struct nvme_pi_conf *conf, union nvme_cmd *cmd, bool pract);
+
+#endif /* LIBVFN_NVME_PI_H */
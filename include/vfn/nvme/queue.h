@@ -63,6 +63,7 @@ struct nvme_sq {
 
 	struct iommu_dmabuf mem;
 	struct iommu_dmabuf pages;
+	struct iommu_dmabuf bounce;
 
 	uint16_t tail, ptail;
 	int qsize;
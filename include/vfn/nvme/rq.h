@@ -30,9 +30,38 @@ struct nvme_rq {
 		iova_t iova;
 	} page;
 
+	struct {
+		void *vaddr;
+		iova_t iova;
+	} meta;
+
+	struct {
+		void *vaddr;
+		iova_t iova;
+		size_t len;
+
+		struct iovec *iov;
+		int niov;
+	} bounce;
+
 	struct nvme_rq *rq_next;
 };
 
+/**
+ * nvme_rq_unbounce - Complete a bounced transfer
+ * @rq: Request tracker (&struct nvme_rq)
+ *
+ * If the data pointer of the command associated with @rq was set up using the
+ * bounce buffer of the request tracker (see nvme_configure_sq_bounce()) and the
+ * command transfers data from the controller, copy the data from the bounce
+ * buffer into the iovec given when the command was mapped.
+ *
+ * This is called automatically by nvme_rq_wait() (and nvme_rq_spin()) as well
+ * as when the request tracker is released. Users that reap completions
+ * themselves must call this before accessing the data.
+ */
+void nvme_rq_unbounce(struct nvme_rq *rq);
+
 /**
  * nvme_rq_reset - Reset a request tracker for reuse
  * @rq: &struct nvme_rq
@@ -41,6 +70,9 @@ struct nvme_rq {
  */
 static inline void nvme_rq_reset(struct nvme_rq *rq)
 {
+	if (rq->bounce.iov)
+		nvme_rq_unbounce(rq);
+
 	rq->opaque = NULL;
 }
 
@@ -242,6 +274,11 @@ int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *
  * PRP list page; for larger buffers, allocate a multi-page PRP list and call
  * nvme_mapv_prp() directly.
  *
+ * If a bounce buffer has been configured for the submission queue (see
+ * nvme_configure_sq_bounce()) and the iovec cannot be mapped directly (an entry
+ * is not mapped in the IOMMU or does not satisfy the alignment requirements),
+ * the entire transfer is bounced. See nvme_rq_mapv() for details.
+ *
  * Return: ``0`` on success, ``-1`` on error and sets errno.
  */
 int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
@@ -285,6 +322,9 @@ int nvme_rq_mapv_iova_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme
  * This helper uses a pre-allocated SGL segment list page within @rq and same
  * with calling ``nvme_mapv_sgl(ctrl, rq->page.vaddr, rq->page.iova, cmd, iova, niov)``;
  *
+ * Like nvme_rq_mapv_prp(), the transfer is bounced if the iovec cannot be
+ * mapped directly and a bounce buffer has been configured.
+ *
  * Return: ``0`` on success, ``-1`` on error and sets errno.
  */
 int nvme_rq_mapv_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
@@ -319,11 +359,84 @@ int nvme_rq_mapv_iova_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme
  *
  * Map the memory contained in @iov into the request SGL (if supported) or PRPs.
  *
+ * If the submission queue has a bounce buffer (see nvme_configure_sq_bounce())
+ * and any entry in @iov is not mapped in the IOMMU or does not satisfy the
+ * alignment requirements of the data pointer, the data is gathered into the
+ * bounce buffer of @rq instead (for commands that transfer data to the
+ * controller) and the bounce buffer is mapped. For commands that transfer data
+ * from the controller, the data is copied back into @iov by nvme_rq_unbounce().
+ * In that case, @iov must remain valid until the command completes.
+ *
+ * The data transfer direction is derived from the command opcode.
+ *
  * Return: ``0`` on success, ``-1`` on error and sets errno.
  */
 int nvme_rq_mapv(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		 struct iovec *iov, int niov);
 
+/**
+ * nvme_rq_map_region - Set up data pointer in the command from a registered
+ *                      memory region
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @region: &struct iommu_region (see iommu_register_region())
+ * @offset: offset into @region
+ * @len: length of the transfer
+ *
+ * Map @len bytes at @offset into @region into the request SGL (if supported) or
+ * PRPs. The I/O virtual address is computed from the region handle, so no
+ * lookup of the data buffer in the iova map is required.
+ *
+ * To map multiple ranges of a region, use iommu_region_iova() to fill in an
+ * array of &struct iova_vec and call nvme_rq_mapv_iova_prp() or
+ * nvme_rq_mapv_iova_sgl().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno (``EINVAL`` if the
+ * range is not within @region).
+ */
+int nvme_rq_map_region(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		       const struct iommu_region *region, size_t offset, size_t len);
+
+/**
+ * nvme_rq_map_meta - Set up the metadata pointer in the command
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @vaddr: Virtual address of the metadata buffer
+ *
+ * Set the Metadata Pointer (MPTR) of the command to the address of the
+ * contiguous metadata buffer at @vaddr. The buffer must be mapped in the IOMMU
+ * and be dword aligned.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_map_meta(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		     void *vaddr);
+
+/**
+ * nvme_rq_map_meta_sgl - Set up the metadata pointer in the command as an SGL
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @vaddr: Virtual address of the metadata buffer
+ * @len: Length of the metadata buffer
+ *
+ * Set up an SGL Data Block descriptor for the metadata buffer at @vaddr in a
+ * pre-allocated descriptor within @rq, point the Metadata Pointer (MPTR) of the
+ * command to it and set the PRP or SGL for Data Transfer (PSDT) field to
+ * indicate that both the data and metadata pointers are SGLs. This allows the
+ * controller to validate the length of the metadata transfer.
+ *
+ * The data pointer must be set up as an SGL (e.g. using nvme_rq_mapv_sgl()) and
+ * the controller must support MPTR containing an SGL descriptor
+ * (``NVME_CTRL_F_SGLS_MPTR_SGL``).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_map_meta_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+			 void *vaddr, size_t len);
+
 /**
  * nvme_rq_spin - Spin for completion of the command associated with the request
  *                tracker
@@ -282,6 +282,13 @@ __static_assert(sizeof(struct nvme_cqe) == 16);
 
 typedef void (*cqe_handler)(struct nvme_cqe *cqe);
 
+struct nvme_crc16_pi_tuple {
+	beint16_t guard;
+	beint16_t apptag;
+	beint32_t reftag;
+};
+__static_assert(sizeof(struct nvme_crc16_pi_tuple) == 8);
+
 struct nvme_crc64_pi_tuple {
 	beint64_t guard;
 	beint16_t apptag;
@@ -17,6 +17,7 @@
 	(((major) << 16) | ((minor) << 8) | (tertiary))
 
 #define NVME_CID_AER (1 << 15)
+#define NVME_CID_ASYNC (1 << 14)
 
 #define __mps_to_pageshift(mps) (12 + mps)
 #define __mps_to_pagesize(mps) (1ULL << __mps_to_pageshift(mps))
@@ -27,10 +28,28 @@
  * @buffer: buffer to calculate CRC for
  * @len: length of buffer
  *
+ * The CRC is returned inverted. To start a new CRC, use ``~0ULL`` as the
+ * starting value; to continue a CRC over another buffer, pass the inverted
+ * result of the previous call.
+ *
  * Return: the NVMe CRC64 calculated over buffer
  */
 uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len);
 
+/**
+ * nvme_crc16_t10dif - Calculate T10-DIF CRC16
+ * @crc: starting value
+ * @buffer: buffer to calculate CRC for
+ * @len: length of buffer
+ *
+ * Calculate the CRC used for the Guard field of 16b Guard Protection
+ * Information. To start a new CRC, use ``0`` as the starting value; to continue
+ * a CRC over another buffer, pass the result of the previous call.
+ *
+ * Return: the T10-DIF CRC16 calculated over buffer
+ */
+uint16_t nvme_crc16_t10dif(uint16_t crc, const unsigned char *buffer, size_t len);
+
 /**
  * nvme_cqe_ok - Check the status field of CQE
  * @cqe: Completion queue entry
@@ -84,6 +103,9 @@ int nvme_aer(struct nvme_ctrl *ctrl, void *opaque);
  * different from the one set in @sqe), the CQE is ignored and an error message
  * is logged.
  *
+ * If @buf is not mapped, it is mapped for the duration of the command, or kept
+ * mapped in the mapping cache if enabled (see iommu_set_map_cache()).
+ *
  * **Note**: This function should only be used for synchronous commands where no
  * spurious CQEs are expected to be posted on the completion queue. Any spurious
  * CQEs will be logged and dropped.
@@ -110,6 +132,90 @@ int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, v
 int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
 	       struct nvme_cqe *cqe_copy);
 
+/**
+ * typedef nvme_admin_cb - Admin command completion callback
+ * @ctrl: Controller reference
+ * @cqe: Completion queue entry of the command
+ * @opaque: Opaque data pointer given when the command was submitted
+ *
+ * See nvme_admin_async() and nvme_admin_poll(). @cqe is only valid for the
+ * duration of the callback.
+ */
+typedef void (*nvme_admin_cb)(struct nvme_ctrl *ctrl, struct nvme_cqe *cqe, void *opaque);
+
+/**
+ * nvme_admin_async - Submit an Admin command without waiting for completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sqe: Submission queue entry
+ * @buf: Command payload
+ * @len: Command payload length
+ * @cb: Completion callback (may be ``NULL``)
+ * @opaque: Opaque data pointer passed to @cb
+ *
+ * Submit a command to the admin submission queue and return immediately. When
+ * the command completes, @cb is called from nvme_admin_poll() (or from
+ * nvme_admin(), if called while the command is outstanding), after the request
+ * tracker has been released and @buf has been unmapped, so @cb may submit
+ * further commands.
+ *
+ * @buf is mapped as with nvme_sync() and must stay valid until the command
+ * completes.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EBUSY`` if no request tracker is available, ``EPERM`` if @ctrl
+ * is used by a secondary process).
+ */
+int nvme_admin_async(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
+		     nvme_admin_cb cb, void *opaque);
+
+/**
+ * nvme_admin_poll - Reap completions from the admin completion queue
+ * @ctrl: See &struct nvme_ctrl
+ * @aer_cb: Callback for Asynchronous Event Request completions (may be ``NULL``)
+ *
+ * Reap all completion queue entries currently posted to the admin completion
+ * queue without waiting. Completions of commands submitted with
+ * nvme_admin_async() are passed to their callbacks. Completions of
+ * Asynchronous Event Request commands (see nvme_aer()) are passed to @aer_cb
+ * along with the opaque data pointer given to nvme_aer(); their request
+ * trackers are released. If @aer_cb is ``NULL``, such completions (and those
+ * reaped by nvme_admin() and friends) are set aside with their trackers still
+ * acquired and passed on by the next call that gives an @aer_cb.
+ *
+ * This must not be called concurrently with other users reaping the admin
+ * completion queue (e.g., nvme_admin() from another thread).
+ *
+ * Return: On success, returns the number of completion queue entries reaped,
+ * plus the number of completions set aside earlier and passed to @aer_cb. On
+ * error, returns ``-1`` and sets ``errno`` (``EPERM`` if @ctrl is used by a
+ * secondary process).
+ */
+int nvme_admin_poll(struct nvme_ctrl *ctrl, nvme_admin_cb aer_cb);
+
+/**
+ * nvme_admin_abort - Abort all outstanding Admin commands
+ * @ctrl: See &struct nvme_ctrl
+ * @aer_cb: Callback for aborted Asynchronous Event Request commands (may be
+ *          ``NULL``)
+ *
+ * Complete all commands submitted with nvme_admin_async() that are still
+ * outstanding with a Command Aborted By Host status, as if the controller had
+ * posted the completion. Any other acquired admin request tracker is taken to
+ * be an outstanding Asynchronous Event Request (see nvme_aer()); it is released
+ * and passed to @aer_cb with the same status. Completions set aside by
+ * nvme_admin_poll() are passed to @aer_cb as posted, or dropped if @aer_cb is
+ * ``NULL``.
+ *
+ * The controller is not told about this; use it only when the controller will
+ * not complete the commands (i.e., it has been reset). Other users of the admin
+ * queue must be quiesced.
+ *
+ * Return: On success, returns the number of commands aborted. On error,
+ * returns ``-1`` and sets ``errno`` (``EPERM`` if @ctrl is used by a secondary
+ * process).
+ */
+int nvme_admin_abort(struct nvme_ctrl *ctrl, nvme_admin_cb aer_cb);
+
 /**
  * nvme_map_prp - Set up the Physical Region Pages in the data pointer of the
  *                command from a buffer that is contiguous in iova mapped
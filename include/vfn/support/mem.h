@@ -115,9 +115,113 @@ static inline void *reallocn(void *mem, unsigned int n, size_t sz)
 #define new_t(t, n) _new_t(t, n, mallocn)
 #define znew_t(t, n) _new_t(t, n, zmallocn)
 
+/**
+ * enum pgmap_flags - Flags for page mapped allocations
+ * @PGMAP_HUGETLB_2M: Allocate from the 2 MiB hugetlbfs pool (MAP_HUGETLB)
+ * @PGMAP_HUGETLB_1G: Allocate from the 1 GiB hugetlbfs pool (MAP_HUGETLB)
+ * @PGMAP_THP: Align the allocation to 2 MiB and advise the kernel to back it
+ *             with transparent huge pages (MADV_HUGEPAGE)
+ * @PGMAP_PREFAULT: Fault in the allocation before returning
+ * @PGMAP_SHARED: Back the allocation with a memfd (hugetlbfs for the hugetlb
+ *                flags) mapped shared, instead of private anonymous memory
+ *
+ * Hugetlbfs allocations fail (with ``errno`` set to ``ENOMEM``) if the pool is
+ * exhausted; transparent huge pages are best effort and silently fall back to
+ * base pages.
+ *
+ * Shared allocations stay shared with child processes after fork(), at the same
+ * address. Private memory is copied on write (or, if pinned for DMA, copied for
+ * the child right away), so only shared memory can be used for DMA by more
+ * than one process.
+ */
+enum pgmap_flags {
+	PGMAP_HUGETLB_2M	= 1 << 0,
+	PGMAP_HUGETLB_1G	= 1 << 1,
+	PGMAP_THP		= 1 << 2,
+	PGMAP_PREFAULT		= 1 << 3,
+	PGMAP_SHARED		= 1 << 4,
+};
+
+#define PGMAP_HUGE_MASK (PGMAP_HUGETLB_2M | PGMAP_HUGETLB_1G | PGMAP_THP)
+
+#define PGMAP_NODE_SHIFT 8
+#define PGMAP_NODE_MASK (0xffUL << PGMAP_NODE_SHIFT)
+#define PGMAP_MAX_NODE 254
+
+/**
+ * PGMAP_NODE - Place a page mapped allocation on a NUMA node
+ * @node: NUMA node (at most %PGMAP_MAX_NODE), or ``-1`` for none
+ *
+ * May be combined with enum pgmap_flags. The memory is bound to @node with the
+ * ``MPOL_PREFERRED`` policy before it is faulted in, so the kernel falls back
+ * to other nodes if @node is out of memory.
+ */
+#define PGMAP_NODE(node) \
+	((unsigned long)(((node) + 1) & 0xff) << PGMAP_NODE_SHIFT)
+
+/**
+ * pgmap_node - Get the NUMA node of a page mapped allocation
+ * @flags: combination of enum pgmap_flags and PGMAP_NODE()
+ *
+ * Return: the NUMA node given with PGMAP_NODE(), or ``-1`` if none.
+ */
+static inline int pgmap_node(unsigned long flags)
+{
+	return (int)((flags & PGMAP_NODE_MASK) >> PGMAP_NODE_SHIFT) - 1;
+}
+
+/**
+ * pgmap_pagesize - Get the page size used by a page mapped allocation
+ * @flags: combination of enum pgmap_flags
+ *
+ * Return: the size of the pages backing an allocation made with @flags and the
+ * alignment of its address and length.
+ */
+static inline size_t pgmap_pagesize(unsigned long flags)
+{
+	if (flags & PGMAP_HUGETLB_1G)
+		return 1ULL << 30;
+
+	if (flags & (PGMAP_HUGETLB_2M | PGMAP_THP))
+		return 1ULL << 21;
+
+	return __VFN_PAGESIZE;
+}
+
 ssize_t pgmap(void **mem, size_t sz);
 ssize_t pgmapn(void **mem, unsigned int n, size_t sz);
 
+/**
+ * pgmapf - Allocate page mapped memory
+ * @mem: output parameter for the allocated memory
+ * @sz: desired minimum length
+ * @flags: combination of enum pgmap_flags and PGMAP_NODE()
+ *
+ * Like pgmap(), but allows the memory to be backed by huge pages, to be placed
+ * on a specific NUMA node and to be pre-faulted. The length is rounded up to
+ * pgmap_pagesize() of @flags. Release the memory with pgunmap().
+ *
+ * Return: On success, returns the allocated length; on error, returns ``-1``
+ * and sets ``errno``.
+ */
+ssize_t pgmapf(void **mem, size_t sz, unsigned long flags);
+
+/**
+ * pgmapf_at - Allocate page mapped memory at a fixed address
+ * @addr: address of the allocation; must be aligned to pgmap_pagesize() of
+ *        @flags
+ * @sz: desired minimum length
+ * @flags: combination of enum pgmap_flags and PGMAP_NODE()
+ *
+ * Like pgmapf(), but places the memory at @addr. Existing mappings are never
+ * replaced. Release the memory with pgunmap().
+ *
+ * Return: On success, returns the allocated length; on error, returns ``-1``
+ * and sets ``errno`` (``EEXIST`` if the range overlaps an existing mapping,
+ * ``EINVAL`` if @addr is not suitably aligned).
+ */
+ssize_t pgmapf_at(void *addr, size_t sz, unsigned long flags);
+
 static inline void pgunmap(void *mem, size_t len)
 {
 	if (munmap(mem, len))
@@ -21,6 +21,8 @@
  * struct vfio_pci_device - vfio pci device state
  * @dev: &struct vfio_device
  * @classcode: pci class code
+ * @numa_node: NUMA node the device is attached to, or ``-1`` if unknown (or
+ *             the host is not a NUMA system)
  * @bdf: pci device identifier ("bus:device:function")
  * @config_region_info: pci configuration space region information
  * @bar_region_info: pci BAR region information
@@ -29,6 +31,7 @@ struct vfio_pci_device {
 	struct vfio_device dev;
 
 	unsigned long long classcode;
+	int numa_node;
 	char *bdf;
 
 	struct vfio_region_info config_region_info;
@@ -42,6 +45,11 @@ struct vfio_pci_device {
  *
  * Open the pci device identified by @bdf and initialize @pci.
  *
+ * If ``@pci->dev.ctx`` is set, the device is attached to that iommu context
+ * (e.g., the context of another opened device) instead of a new one, such that
+ * mappings are shared between the devices (pinned once and at the same I/O
+ * virtual addresses).
+ *
  * **Note**: When enabling SR-IOV on a vfio-pci owned PF, the VFs are not fully
  * isolated from the PF (e.g., the PF may reset itself). VFIO requires the use
  * of a "VF Token" to enable this configuration. This token may be passed as an
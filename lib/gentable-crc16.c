@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ccan/compiler/compiler.h"
+
+#define CRC16_T10DIF_POLY 0x8BB7
+
+/*
+ * Table 0 is the regular byte-wise lookup table; table n holds the crc of the
+ * byte followed by n zero bytes (for slicing-by-8).
+ */
+static uint16_t crc16_t10dif_table[8][256] = { 0 };
+
+static void generate(void)
+{
+	uint16_t crc;
+
+	for (int i = 0; i < 256; i++) {
+		crc = (uint16_t)(i << 8);
+
+		for (int j = 0; j < 8; j++) {
+			if (crc & 0x8000)
+				crc = (uint16_t)((crc << 1) ^ CRC16_T10DIF_POLY);
+			else
+				crc = (uint16_t)(crc << 1);
+		}
+
+		crc16_t10dif_table[0][i] = crc;
+	}
+
+	for (int i = 0; i < 256; i++) {
+		for (int n = 1; n < 8; n++) {
+			crc = crc16_t10dif_table[n - 1][i];
+			crc16_t10dif_table[n][i] =
+				(uint16_t)((crc << 8) ^ crc16_t10dif_table[0][crc >> 8]);
+		}
+	}
+}
+
+static void print(void)
+{
+	printf("/* GENERATED FILE; DO NOT EDIT! */\n");
+	printf("\n");
+	printf("static const uint16_t crc16_t10dif_table[8][256] = {\n");
+
+	for (int n = 0; n < 8; n++) {
+		printf("\t{\n");
+
+		for (int i = 0; i < 256; i++) {
+			if (i % 8 == 0)
+				printf("\t\t");
+
+			printf("0x%04" PRIx16, crc16_t10dif_table[n][i]);
+
+			if (i % 8 == 7)
+				printf(",\n");
+			else
+				printf(", ");
+		}
+
+		printf("\t},\n");
+	}
+
+	printf("};\n");
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	generate();
+	print();
+
+	return 0;
+}
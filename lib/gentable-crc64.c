@@ -30,7 +30,11 @@ static UNNEEDED int COEFFS[] = {
 
 #define CRC64_NVME_POLY 0x9A6C9329AC4BC9B5ULL
 
-static uint64_t crc64_nvme_table[256] = { 0 };
+/*
+ * Table 0 is the regular byte-wise lookup table; table n holds the crc of the
+ * byte followed by n zero bytes (for slicing-by-8).
+ */
+static uint64_t crc64_nvme_table[8][256] = { 0 };
 
 static void generate(void)
 {
@@ -48,7 +52,14 @@ static void generate(void)
 				crc = crc >> 1;
 		}
 
-		crc64_nvme_table[i] = crc;
+		crc64_nvme_table[0][i] = crc;
+	}
+
+	for (int i = 0; i < 256; i++) {
+		for (int n = 1; n < 8; n++) {
+			crc = crc64_nvme_table[n - 1][i];
+			crc64_nvme_table[n][i] = (crc >> 8) ^ crc64_nvme_table[0][crc & 0xff];
+		}
 	}
 }
 
@@ -56,18 +67,24 @@ static void print(void)
 {
 	printf("/* GENERATED FILE; DO NOT EDIT! */\n");
 	printf("\n");
-	printf("static const uint64_t crc64_nvme_table[256] = {\n");
+	printf("static const uint64_t crc64_nvme_table[8][256] = {\n");
 
-	for (int i = 0; i < 256; i++) {
-		if (i % 2 == 0)
-			printf("\t");
+	for (int n = 0; n < 8; n++) {
+		printf("\t{\n");
+
+		for (int i = 0; i < 256; i++) {
+			if (i % 2 == 0)
+				printf("\t\t");
+
+			printf("0x%016" PRIx64 "ULL", crc64_nvme_table[n][i]);
 
-		printf("0x%016" PRIx64 "ULL", crc64_nvme_table[i]);
+			if (i % 2 == 1)
+				printf(",\n");
+			else
+				printf(", ");
+		}
 
-		if (i % 2 == 1)
-			printf(",\n");
-		else
-			printf(", ");
+		printf("\t},\n");
 	}
 
 	printf("};\n");
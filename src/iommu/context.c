@@ -74,10 +74,40 @@ void iommu_ctx_init(struct iommu_ctx *ctx)
 	ctx->iova_ranges[0].last = IOVA_MAX_39BITS - 1;
 	ctx->iova_max = IOVA_MAX_39BITS - 1;
 
+	pthread_mutex_init(&ctx->same_iova.lock, NULL);
+	iova_allocator_init(&ctx->same_iova.free);
+	btree_init(&ctx->same_iova.bufs);
+	btree_init(&ctx->same_iova.pool);
+
 	iommu_init_next_same(ctx);
 
-	skiplist_init(&ctx->map.list);
-	pthread_rwlock_init(&ctx->map.lock, NULL);
+	iova_map_init(&ctx->map);
+
+	pthread_mutex_init(&ctx->fd_maps.lock, NULL);
+	btree_init(&ctx->fd_maps.maps);
+
+	pthread_mutex_init(&ctx->unmapq.lock, NULL);
+
+	pthread_mutex_init(&ctx->map_cache.lock, NULL);
+	btree_init(&ctx->map_cache.entries);
+	list_head_init(&ctx->map_cache.lru);
+}
+
+/*
+ * Release the state set up by iommu_ctx_init() and everything tracked by the
+ * context. The backend must not have released its own state yet, but the
+ * mappings may already be gone from the iommu.
+ */
+void iommu_ctx_destroy(struct iommu_ctx *ctx)
+{
+	iommu_unmapq_destroy(ctx);
+	iommu_map_cache_destroy(ctx);
+	iommu_fd_maps_destroy(ctx);
+	iommu_same_iova_destroy(ctx);
+	iova_map_destroy(&ctx->map);
+
+	free(ctx->iova_ranges);
+	ctx->iova_ranges = NULL;
 }
 
 bool iommu_ctx_is_iommufd(struct iommu_ctx *ctx)
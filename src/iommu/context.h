@@ -10,8 +10,13 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include "ccan/list/list.h"
+
+#include "util/btree.h"
 #include "util/skiplist.h"
 
+#include "iova_alloc.h"
+
 struct iommu_ctx;
 
 struct iommu_ctx_ops {
@@ -20,11 +25,21 @@ struct iommu_ctx_ops {
 			    unsigned long flags);
 	int (*iova_reserve_align)(struct iommu_ctx *ctx, size_t len, size_t align,
 				  iova_t *iova, unsigned long flags);
-	void (*iova_put_ephemeral)(struct iommu_ctx *ctx);
+	void (*iova_put)(struct iommu_ctx *ctx, iova_t iova, size_t len);
+	void (*iova_put_ephemeral)(struct iommu_ctx *ctx, iova_t iova);
+	int (*iova_set_ephemeral_area)(struct iommu_ctx *ctx, size_t len);
 	int (*dma_map)(struct iommu_ctx *ctx, void *vaddr, size_t len, iova_t *iova,
 		       unsigned long flags);
 	int (*dma_unmap)(struct iommu_ctx *ctx, iova_t iova, size_t len);
 	int (*dma_unmap_all)(struct iommu_ctx *ctx);
+	int (*dma_map_fd)(struct iommu_ctx *ctx, int fd, off_t offset, size_t len, iova_t *iova,
+			  unsigned long flags);
+	int (*dma_copy)(struct iommu_ctx *dst, struct iommu_ctx *src, iova_t iova, size_t len,
+			unsigned long flags);
+
+	/* take (and drop) a reference on behalf of a device sharing the context */
+	void (*ctx_get)(struct iommu_ctx *ctx);
+	void (*ctx_put)(struct iommu_ctx *ctx);
 
 	/* device ops */
 	int (*get_device_fd)(struct iommu_ctx *ctx, const char *bdf);
@@ -38,22 +53,157 @@ struct iova_mapping {
 
 	unsigned long flags;
 
+#ifndef IOVA_MAP_BTREE
 	struct skiplist_node list;
+#endif
+
+	/* link in the iova_map free list */
+	struct iova_mapping *next_free;
 };
 
+/*
+ * The iova map is read-mostly. Updates (map and unmap) are serialized by the
+ * write side of @lock and bump @seq (odd while an update is in progress), and
+ * translations are done without writing to shared memory by validating an
+ * optimistic lookup against @seq.
+ *
+ * A lockless reader may hold on to a mapping that is concurrently removed, so
+ * mappings are never freed, but kept on the @free list for reuse by later
+ * additions. Since all link pointers in a mapping always point to a mapping
+ * or a list head, a reader can never wander off into freed memory.
+ *
+ * The mappings are indexed by either a B-tree (the default) or a skiplist,
+ * selected at build time with the 'iova_map' option. Mappings are also indexed
+ * by iova in @iovas for reverse lookups (these always take the lock).
+ */
 struct iova_map {
 	pthread_rwlock_t lock;
+	unsigned int seq;
+
+#ifdef IOVA_MAP_BTREE
+	struct btree tree;
+#else
 	struct skiplist list;
+#endif
+
+	struct btree iovas;
+
+	struct iova_mapping *free;
+};
+
+struct iommu_unmap_range {
+	iova_t iova;
+	size_t len;
+
+	bool ephemeral;
+};
+
+/*
+ * Ranges released by iommu_unmap_vaddr() while deferred unmapping is enabled.
+ * They stay mapped in the IOMMU (and, thus, out of reuse by the iova
+ * allocator) until the queue is flushed, at which point adjacent ranges are
+ * unmapped together. @threshold is the capacity of @ranges; zero if deferred
+ * unmapping is disabled.
+ */
+struct iommu_unmap_queue {
+	pthread_mutex_t lock;
+
+	struct iommu_unmap_range *ranges;
+	unsigned int nranges, threshold;
+};
+
+struct iommu_map_cache_entry {
+	void *vaddr;
+	size_t len;
+	iova_t iova;
+
+	/* references taken by iommu_map_cache_get(); in use entries are not evicted */
+	unsigned int users;
+
+	struct list_node lru;
+};
+
+/*
+ * Caller buffers kept mapped by iommu_map_cache_get(), indexed by vaddr in
+ * @entries and linked on @lru in least recently used order (most recently used
+ * first). @capacity is zero if the cache is disabled. The cache may hold more
+ * than @capacity entries while they are in use; they are evicted when put.
+ */
+struct iommu_map_cache {
+	pthread_mutex_t lock;
+
+	struct btree entries;
+	struct list_head lru;
+	unsigned int nentries, capacity;
+};
+
+struct iommu_fd_mapping {
+	iova_t iova;
+	size_t len;
+
+	/* the fallback mmap of the file, if mapped through the process */
+	void *vaddr;
+};
+
+/*
+ * Mappings created by iommu_map_fd(), indexed by iova. These have no virtual
+ * address in the iova map unless the backend does not support mapping file
+ * descriptors and the file had to be mmap'ed.
+ */
+struct iommu_fd_maps {
+	pthread_mutex_t lock;
+
+	struct btree maps;
+};
+
+struct iommu_same_iova_buf {
+	void *vaddr;
+	size_t len;
+	unsigned long flags;
+
+	/* entry in the pool class of len, if pooled */
+	struct list_node list;
+};
+
+struct iommu_same_iova_class {
+	size_t len;
+	struct list_head bufs;
+};
+
+/*
+ * Address space of iommu_alloc_same_iova(). Fresh space is taken by bumping
+ * @next; space released by iommu_free_same_iova() (and alignment padding) is
+ * kept in @free and reused first. Live buffers are indexed by address in @bufs.
+ *
+ * If @pool_max is non-zero, released buffers stay mapped and are kept in @pool
+ * (len -> struct iommu_same_iova_class) for reuse, up to @pool_max bytes.
+ */
+struct iommu_same_iova {
+	pthread_mutex_t lock;
+
+	iova_t next;
+	struct iova_allocator free;
+
+	struct btree bufs;
+
+	struct btree pool;
+	size_t pooled, pool_max;
 };
 
 struct iommu_ctx {
 	struct iova_map map;
 	struct iommu_ctx_ops ops;
 
+	struct iommu_fd_maps fd_maps;
+
+	struct iommu_unmap_queue unmapq;
+	struct iommu_map_cache map_cache;
+
 	int nranges;
 	struct iommu_iova_range *iova_ranges;
 	iova_t iova_max;
-	iova_t iova_next_same;
+
+	struct iommu_same_iova same_iova;
 
 	bool iommufd;
 };
@@ -63,6 +213,13 @@ struct iommu_ctx *vfio_get_iommu_context(const char *bdf);
 struct iommu_ctx *iommufd_get_iommu_context(const char *name);
 
 void iommu_ctx_init(struct iommu_ctx *ctx);
+void iommu_ctx_destroy(struct iommu_ctx *ctx);
+void iova_map_init(struct iova_map *map);
+void iova_map_destroy(struct iova_map *map);
+void iommu_unmapq_destroy(struct iommu_ctx *ctx);
+void iommu_fd_maps_destroy(struct iommu_ctx *ctx);
+void iommu_map_cache_destroy(struct iommu_ctx *ctx);
+void iommu_same_iova_destroy(struct iommu_ctx *ctx);
 int iommu_iova_range_to_string(struct iommu_iova_range *range, char **str);
 
 /*
@@ -80,6 +237,7 @@ int iommu_iova_range_to_string(struct iommu_iova_range *range, char **str);
  */
 #define IOMMU_MAX_SAME_IOVA ((iova_t)((1ULL << 47) - 1))
 
+/* the free ranges are all below the bump pointer; forget them when it moves */
 static inline void iommu_init_next_same(struct iommu_ctx *ctx)
 {
 	iova_t max = ctx->iova_max;
@@ -87,5 +245,7 @@ static inline void iommu_init_next_same(struct iommu_ctx *ctx)
 	if (max > IOMMU_MAX_SAME_IOVA)
 		max = IOMMU_MAX_SAME_IOVA;
 
-	ctx->iova_next_same = (max / 4) + 1;
+	ctx->same_iova.next = (max / 4) + 1;
+
+	iova_allocator_clear(&ctx->same_iova.free);
 }
@@ -16,283 +16,1613 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
+#include <sys/mman.h>
+
 #include "ccan/compiler/compiler.h"
 #include "ccan/minmax/minmax.h"
 
-#include "vfn/iommu.h"
-#include "vfn/support.h"
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "context.h"
+
+static inline bool iova_mapping_contains(struct iova_mapping *m, void *vaddr)
+{
+	return vaddr >= m->vaddr && vaddr < m->vaddr + m->len;
+}
+
+/*
+ * Sequence counter helpers. Writers must hold the write side of map->lock.
+ */
+static inline void iova_map_write_begin(struct iova_map *map)
+{
+	__atomic_store_n(&map->seq, map->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void iova_map_write_end(struct iova_map *map)
+{
+	atomic_store_release(&map->seq, map->seq + 1);
+}
+
+static inline unsigned int iova_map_read_begin(struct iova_map *map)
+{
+	return atomic_load_acquire(&map->seq);
+}
+
+static inline bool iova_map_read_retry(struct iova_map *map, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&map->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* number of optimistic lookup attempts before falling back to the lock */
+#define IOVA_MAP_READ_RETRIES 4
+
+struct iova_key {
+	void *vaddr;
+
+	/* only set for optimistic (lockless) lookups */
+	struct iova_map *map;
+	unsigned int seq;
+
+#ifndef IOVA_MAP_BTREE
+	unsigned int visits;
+	bool stale;
+
+	/* search path of the previous lookup */
+	struct skiplist_node *path[SKIPLIST_LEVELS];
+	bool has_path;
+#endif
+};
+
+/*
+ * Index backends. The index must support lookups that run concurrently with
+ * updates (see struct iova_map).
+ */
+#ifdef IOVA_MAP_BTREE
+static inline void iova_index_init_mapping(struct iova_map *map UNUSED,
+					   struct iova_mapping *m UNUSED)
+{
+}
+
+static inline void iova_key_reset(struct iova_map *map UNUSED, struct iova_key *key UNUSED)
+{
+}
+
+static struct iova_mapping *iova_index_find(struct iova_map *map, struct iova_key *key)
+{
+	struct iova_mapping *m = btree_find_le(&map->tree, (uintptr_t)key->vaddr);
+
+	if (m && iova_mapping_contains(m, key->vaddr))
+		return m;
+
+	return NULL;
+}
+
+/* the mapping containing vaddr or, if none, the first mapping above it */
+static struct iova_mapping *iova_index_find_ge(struct iova_map *map, void *vaddr)
+{
+	struct iova_mapping *m = btree_find_le(&map->tree, (uintptr_t)vaddr);
+
+	if (m && iova_mapping_contains(m, vaddr))
+		return m;
+
+	return btree_find_ge(&map->tree, (uintptr_t)vaddr);
+}
+
+static int iova_index_insert(struct iova_map *map, struct iova_mapping *m)
+{
+	return btree_insert(&map->tree, (uintptr_t)m->vaddr, m);
+}
+
+static void iova_index_remove(struct iova_map *map, struct iova_mapping *m)
+{
+	btree_remove(&map->tree, (uintptr_t)m->vaddr);
+}
+
+static void iova_index_clear_with(struct iova_map *map, void (*fn)(void *opaque, void *m),
+				  void *opaque)
+{
+	btree_clear_with(&map->tree, fn, opaque);
+}
+#else
+/* how often (in node visits) an optimistic lookup checks for a racing update */
+#define IOVA_MAP_READ_CHECK_INTERVAL 16
+
+static int iova_cmp(const void *vaddr, const struct skiplist_node *n)
+{
+	struct iova_mapping *m = container_of_var(n, m, list);
+
+	if (vaddr < m->vaddr)
+		return -1;
+	else if (vaddr >= m->vaddr + m->len)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Like iova_cmp, but for optimistic lookups; bail out if the map is updated
+ * while we traverse it, since the links may then lead anywhere (including in
+ * circles). Reporting the key as smaller than anything makes the skiplist
+ * search descend and terminate without a match.
+ */
+static int iova_key_cmp(const void *key, const struct skiplist_node *n)
+{
+	struct iova_key *k = (struct iova_key *)key;
+
+	if (k->map) {
+		if (k->stale)
+			return -1;
+
+		if (!(++k->visits % IOVA_MAP_READ_CHECK_INTERVAL) &&
+		    atomic_load_acquire(&k->map->seq) != k->seq) {
+			k->stale = true;
+			return -1;
+		}
+	}
+
+	return iova_cmp(k->vaddr, n);
+}
+
+static inline void iova_index_init_mapping(struct iova_map *map, struct iova_mapping *m)
+{
+	/* make any link followed by a lockless reader look like the end of the list */
+	for (int k = 0; k < SKIPLIST_LEVELS; k++)
+		m->list.list[k].next = m->list.list[k].prev = &map->list.heads[k].n;
+}
+
+static inline void iova_key_reset(struct iova_map *map, struct iova_key *key)
+{
+	key->visits = 0;
+	key->stale = false;
+	key->has_path = false;
+
+	for (int k = 0; k < SKIPLIST_LEVELS; k++)
+		key->path[k] = &map->list.sentinel;
+}
+
+/* consecutive lookups with the same key resume from the previous search path */
+static struct iova_mapping *iova_index_find(struct iova_map *map, struct iova_key *key)
+{
+	struct skiplist_node *n;
+
+	if (key->has_path)
+		n = skiplist_find_from(&map->list, key, iova_key_cmp, key->path);
+	else
+		n = skiplist_find(&map->list, key, iova_key_cmp, key->path);
+
+	key->has_path = true;
+
+	return container_of_or_null(n, struct iova_mapping, list);
+}
+
+/* the mapping containing vaddr or, if none, the first mapping above it */
+static struct iova_mapping *iova_index_find_ge(struct iova_map *map, void *vaddr)
+{
+	struct skiplist_node *n = skiplist_find_ge(&map->list, vaddr, iova_cmp, NULL);
+
+	return container_of_or_null(n, struct iova_mapping, list);
+}
+
+static int iova_index_insert(struct iova_map *map, struct iova_mapping *m)
+{
+	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+
+	if (skiplist_find(&map->list, m->vaddr, iova_cmp, update)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	skiplist_link(&map->list, &m->list, update);
+
+	return 0;
+}
+
+static void iova_index_remove(struct iova_map *map, struct iova_mapping *m)
+{
+	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+
+	if (skiplist_find(&map->list, m->vaddr, iova_cmp, update))
+		skiplist_erase(&map->list, &m->list, update);
+}
+
+struct iova_index_iter {
+	void (*fn)(void *opaque, void *m);
+	void *opaque;
+};
+
+static void __iova_index_clear(void *opaque, struct skiplist_node *n)
+{
+	struct iova_index_iter *it = opaque;
+
+	it->fn(it->opaque, container_of(n, struct iova_mapping, list));
+}
+
+static void iova_index_clear_with(struct iova_map *map, void (*fn)(void *opaque, void *m),
+				  void *opaque)
+{
+	struct iova_index_iter it = {.fn = fn, .opaque = opaque};
+
+	skiplist_clear_with(&map->list, __iova_index_clear, &it);
+}
+#endif
+
+/*
+ * Per-thread, direct-mapped cache of recently translated mappings, indexed by
+ * 2 MiB frame number (DMA buffers are commonly backed by huge pages, and
+ * smaller, neighbouring mappings are rarely on the I/O path). Entries are
+ * tagged with the value of iova_map_gen at the time of the lookup that filled
+ * it, and iova_map_gen is bumped whenever a mapping is removed (or a map is
+ * destroyed), so that removing any mapping invalidates all cached entries in
+ * all threads.
+ */
+#define IOVA_TLB_ENTRIES 16
+#define IOVA_TLB_SHIFT 21
+
+struct iova_tlb_entry {
+	struct iova_map *map;
+	unsigned long gen;
+
+	void *vaddr;
+	size_t len;
+	iova_t iova;
+};
+
+static unsigned long iova_map_gen;
+static __thread struct iova_tlb_entry iova_tlb[IOVA_TLB_ENTRIES];
+
+static inline struct iova_tlb_entry *iova_tlb_entry(void *vaddr)
+{
+	return &iova_tlb[((uintptr_t)vaddr >> IOVA_TLB_SHIFT) & (IOVA_TLB_ENTRIES - 1)];
+}
+
+static inline void iova_map_invalidate(void)
+{
+	atomic_inc(&iova_map_gen);
+}
+
+static struct iova_mapping *iova_mapping_new(struct iova_map *map)
+{
+	struct iova_mapping *m = map->free;
+
+	if (m) {
+		map->free = m->next_free;
+		return m;
+	}
+
+	m = znew_t(struct iova_mapping, 1);
+
+	iova_index_init_mapping(map, m);
+
+	return m;
+}
+
+static void iova_mapping_recycle(struct iova_map *map, struct iova_mapping *m)
+{
+	m->next_free = map->free;
+	map->free = m;
+}
+
+void iova_map_init(struct iova_map *map)
+{
+#ifdef IOVA_MAP_BTREE
+	btree_init(&map->tree);
+#else
+	skiplist_init(&map->list);
+#endif
+
+	btree_init(&map->iovas);
+
+	pthread_rwlock_init(&map->lock, NULL);
+}
+
+static struct iova_mapping *__iova_map_find(struct iova_map *map, void *vaddr)
+{
+	struct iova_key key = {};
+
+	iova_key_reset(map, &key);
+	key.vaddr = vaddr;
+
+	return iova_index_find(map, &key);
+}
+
+static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, iova_t iova,
+			unsigned long flags)
+{
+	__autowrlock(&map->lock);
+
+	struct iova_mapping *m;
+	int ret;
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__iova_map_find(map, vaddr)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	m = iova_mapping_new(map);
+
+	iova_map_write_begin(map);
+
+	m->vaddr = vaddr;
+	m->len = len;
+	m->iova = iova;
+	m->flags = flags;
+
+	ret = iova_index_insert(map, m);
+	if (!ret && btree_insert(&map->iovas, m->iova, m)) {
+		iova_index_remove(map, m);
+		ret = -1;
+	}
+
+	iova_map_write_end(map);
+
+	if (ret)
+		iova_mapping_recycle(map, m);
+
+	return ret;
+}
+
+static void iova_map_remove(struct iova_map *map, void *vaddr)
+{
+	__autowrlock(&map->lock);
+
+	struct iova_mapping *m = __iova_map_find(map, vaddr);
+
+	if (!m)
+		return;
+
+	iova_map_write_begin(map);
+
+	iova_index_remove(map, m);
+	btree_remove(&map->iovas, m->iova);
+
+	iova_map_write_end(map);
+
+	iova_map_invalidate();
+
+	iova_mapping_recycle(map, m);
+}
+
+static struct iova_mapping *iova_map_find(struct iova_map *map, void *vaddr)
+{
+	__autordlock(&map->lock);
+
+	return __iova_map_find(map, vaddr);
+}
+
+/* check if any mapping overlaps [vaddr; vaddr + len) */
+static bool iova_map_overlaps(struct iova_map *map, void *vaddr, size_t len)
+{
+	__autordlock(&map->lock);
+
+	struct iova_mapping *m = iova_index_find_ge(map, vaddr);
+
+	return m && m->vaddr < vaddr + len;
+}
+
+struct iova_map_clear_ctx {
+	struct iova_map *map;
+	void (*fn)(void *opaque, struct iova_mapping *m);
+	void *opaque;
+};
+
+static void __clear_mapping(void *opaque, void *m)
+{
+	struct iova_map_clear_ctx *c = opaque;
+
+	if (c->fn)
+		c->fn(c->opaque, m);
+
+	iova_mapping_recycle(c->map, m);
+}
+
+static void iova_map_clear_with(struct iova_map *map,
+				void (*fn)(void *opaque, struct iova_mapping *m), void *opaque)
+{
+	__autowrlock(&map->lock);
+
+	struct iova_map_clear_ctx c = {
+		.map = map,
+		.fn = fn,
+		.opaque = opaque,
+	};
+
+	iova_map_write_begin(map);
+
+	iova_index_clear_with(map, __clear_mapping, &c);
+	btree_clear_with(&map->iovas, NULL, NULL);
+
+	iova_map_write_end(map);
+
+	iova_map_invalidate();
+}
+
+static void iova_map_clear(struct iova_map *map)
+{
+	iova_map_clear_with(map, NULL, NULL);
+}
+
+/*
+ * Release all memory held by the map. There must be no concurrent readers;
+ * clearing the map also invalidates the translations cached by all threads,
+ * such that a map later allocated at the same address does not hit them.
+ */
+void iova_map_destroy(struct iova_map *map)
+{
+	struct iova_mapping *m, *next;
+
+	iova_map_clear(map);
+
+	for (m = map->free; m; m = next) {
+		next = m->next_free;
+		free(m);
+	}
+
+	map->free = NULL;
+
+#ifdef IOVA_MAP_BTREE
+	btree_destroy(&map->tree);
+#endif
+
+	btree_destroy(&map->iovas);
+
+	pthread_rwlock_destroy(&map->lock);
+}
+
+static int __translate_vaddrv(struct iova_map *map, struct iova_key *key,
+			      const struct iovec *iov, int niov, iova_t *iova,
+			      struct iova_tlb_entry *hit)
+{
+	struct iova_mapping *m = NULL;
+
+	iova_key_reset(map, key);
+
+	for (int i = 0; i < niov; i++) {
+		key->vaddr = iov[i].iov_base;
+
+		/* neighbouring entries are likely to hit the same mapping */
+		if (!m || !iova_mapping_contains(m, key->vaddr)) {
+			m = iova_index_find(map, key);
+			if (!m)
+				return i;
+		}
+
+		iova[i] = m->iova + (key->vaddr - m->vaddr);
+	}
+
+	if (hit && m) {
+		hit->vaddr = m->vaddr;
+		hit->len = m->len;
+		hit->iova = m->iova;
+	}
+
+	return niov;
+}
+
+static int iova_map_translate_locked(struct iova_map *map, const struct iovec *iov, int niov,
+				     iova_t *iova, struct iova_tlb_entry *hit)
+{
+	__autordlock(&map->lock);
+
+	struct iova_key key = {};
+
+	return __translate_vaddrv(map, &key, iov, niov, iova, hit);
+}
+
+static int iova_map_translate(struct iova_map *map, const struct iovec *iov, int niov,
+			      iova_t *iova, struct iova_tlb_entry *hit)
+{
+	struct iova_key key = {.map = map};
+	int ret;
+
+	for (int i = 0; i < IOVA_MAP_READ_RETRIES; i++) {
+		key.seq = iova_map_read_begin(map);
+		if (key.seq & 1)
+			continue;
+
+		ret = __translate_vaddrv(map, &key, iov, niov, iova, hit);
+
+		if (!iova_map_read_retry(map, key.seq))
+			return ret;
+	}
+
+	/* too much contention with writers; take the lock */
+	return iova_map_translate_locked(map, iov, niov, iova, hit);
+}
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, iova_t *iova)
+{
+	struct iova_tlb_entry *e = iova_tlb_entry(vaddr), hit;
+	unsigned long gen = atomic_load_acquire(&iova_map_gen);
+	struct iovec iov = {.iov_base = vaddr};
+
+	if (e->map == &ctx->map && e->gen == gen &&
+	    vaddr >= e->vaddr && vaddr < e->vaddr + e->len) {
+		*iova = e->iova + (vaddr - e->vaddr);
+		return true;
+	}
+
+	if (iova_map_translate(&ctx->map, &iov, 1, iova, &hit) != 1)
+		return false;
+
+	/* tag with the generation read prior to the lookup */
+	hit.map = &ctx->map;
+	hit.gen = gen;
+
+	*e = hit;
+
+	return true;
+}
+
+int iommu_translate_vaddrv(struct iommu_ctx *ctx, const struct iovec *iov, int niov,
+			   iova_t *iova)
+{
+	return iova_map_translate(&ctx->map, iov, niov, iova, NULL);
+}
+
+static int __cmp_unmap_range(const void *a, const void *b)
+{
+	const struct iommu_unmap_range *x = a, *y = b;
+
+	if (x->iova < y->iova)
+		return -1;
+
+	return x->iova > y->iova;
+}
+
+/*
+ * Unmap all queued ranges, issuing a single unmap for each run of adjacent
+ * ranges. Ephemeral and regular ranges are never coalesced, since the backend
+ * recycles their iovas differently. Must be called with q->lock held.
+ */
+static int __iommu_unmapq_flush(struct iommu_ctx *ctx)
+{
+	struct iommu_unmap_queue *q = &ctx->unmapq;
+	struct iommu_unmap_range *r = q->ranges;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (!q->nranges)
+		return 0;
+
+	qsort(r, q->nranges, sizeof(*r), __cmp_unmap_range);
+
+	for (i = 0; i < q->nranges; i = j) {
+		iova_t end = r[i].iova + r[i].len;
+
+		for (j = i + 1; j < q->nranges; j++) {
+			if (r[j].iova != end || r[j].ephemeral != r[i].ephemeral)
+				break;
+
+			end += r[j].len;
+		}
+
+		if (ctx->ops.dma_unmap(ctx, r[i].iova, end - r[i].iova)) {
+			log_debug("failed to unmap dma (iova 0x%" PRIx64 " len %" PRIu64 ")\n",
+				  r[i].iova, end - r[i].iova);
+			ret = -1;
+		}
+
+		if (!r[i].ephemeral || !ctx->ops.iova_put_ephemeral)
+			continue;
+
+		for (unsigned int k = i; k < j; k++)
+			ctx->ops.iova_put_ephemeral(ctx, r[k].iova);
+	}
+
+	q->nranges = 0;
+
+	return ret;
+}
+
+static bool __iommu_unmapq_add(struct iommu_ctx *ctx, struct iova_mapping *m)
+{
+	struct iommu_unmap_queue *q = &ctx->unmapq;
+
+	__autolock(&q->lock);
+
+	if (!q->threshold)
+		return false;
+
+	q->ranges[q->nranges++] = (struct iommu_unmap_range) {
+		.iova = m->iova,
+		.len = m->len,
+		.ephemeral = !!(m->flags & IOMMU_MAP_EPHEMERAL),
+	};
+
+	if (q->nranges == q->threshold && __iommu_unmapq_flush(ctx))
+		log_debug("failed to flush deferred unmaps\n");
+
+	return true;
+}
+
+/*
+ * Queue the iova range of @m for unmapping if deferred unmapping is enabled,
+ * flushing the queue if it is full. Returns true if the range was queued.
+ */
+static inline bool iommu_unmapq_add(struct iommu_ctx *ctx, struct iova_mapping *m)
+{
+	if (!atomic_load_acquire(&ctx->unmapq.threshold))
+		return false;
+
+	return __iommu_unmapq_add(ctx, m);
+}
+
+static bool __iommu_unmapq_flush_pending(struct iommu_ctx *ctx)
+{
+	struct iommu_unmap_queue *q = &ctx->unmapq;
+
+	__autolock(&q->lock);
+
+	if (!q->nranges)
+		return false;
+
+	if (__iommu_unmapq_flush(ctx))
+		log_debug("failed to flush deferred unmaps\n");
+
+	return true;
+}
+
+/*
+ * Flush the queue if anything is pending, such that iovas held up by deferred
+ * unmaps can be reused. Returns true if there was anything to flush.
+ */
+static inline bool iommu_unmapq_flush_pending(struct iommu_ctx *ctx)
+{
+	if (!atomic_load_acquire(&ctx->unmapq.threshold))
+		return false;
+
+	return __iommu_unmapq_flush_pending(ctx);
+}
+
+int iommu_set_deferred_unmap(struct iommu_ctx *ctx, unsigned int threshold)
+{
+	struct iommu_unmap_queue *q = &ctx->unmapq;
+	int ret;
+
+	__autolock(&q->lock);
+
+	ret = __iommu_unmapq_flush(ctx);
+
+	free(q->ranges);
+	q->ranges = threshold ? new_t(struct iommu_unmap_range, threshold) : NULL;
+
+	atomic_store_release(&q->threshold, threshold);
+
+	return ret;
+}
+
+int iommu_flush_unmap(struct iommu_ctx *ctx)
+{
+	__autolock(&ctx->unmapq.lock);
+
+	return __iommu_unmapq_flush(ctx);
+}
+
+void iommu_unmapq_destroy(struct iommu_ctx *ctx)
+{
+	struct iommu_unmap_queue *q = &ctx->unmapq;
+
+	/* drops the ephemeral references of queued ranges */
+	if (iommu_flush_unmap(ctx))
+		log_debug("failed to flush deferred unmaps\n");
+
+	free(q->ranges);
+	q->ranges = NULL;
+	q->threshold = 0;
+
+	pthread_mutex_destroy(&q->lock);
+}
+
+int iommu_set_ephemeral_area(struct iommu_ctx *ctx, size_t len)
+{
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctx->ops.iova_set_ephemeral_area)
+		return 0;
+
+	return ctx->ops.iova_set_ephemeral_area(ctx, len);
+}
+
+/* return an iova reserved by iommu_map_vaddr() or iommu_map_vaddr_align() */
+static void __iommu_iova_put(struct iommu_ctx *ctx, iova_t iova, size_t len, unsigned long flags)
+{
+	if (flags & IOMMU_MAP_FIXED_IOVA)
+		return;
+
+	if (flags & IOMMU_MAP_EPHEMERAL && ctx->ops.iova_put_ephemeral)
+		ctx->ops.iova_put_ephemeral(ctx, iova);
+
+	if (ctx->ops.iova_put)
+		ctx->ops.iova_put(ctx, iova, len);
+}
+
+/* map and track an iova reserved by the caller; the iova is returned on error */
+static int __iommu_map_reserved(struct iommu_ctx *ctx, void *vaddr, size_t len, iova_t *iova,
+				unsigned long flags, bool *retry)
+{
+	if (ctx->ops.dma_map(ctx, vaddr, len, iova, flags)) {
+		__iommu_iova_put(ctx, *iova, len, flags);
+
+		*retry = iommu_unmapq_flush_pending(ctx);
+		if (!*retry)
+			log_debug("failed to map dma\n");
+
+		return -1;
+	}
+
+	if (iova_map_add(&ctx->map, vaddr, len, *iova, flags)) {
+		log_debug("failed to add mapping\n");
+
+		log_fatal_if(ctx->ops.dma_unmap(ctx, *iova, len), "dma_unmap");
+
+		if (flags & IOMMU_MAP_EPHEMERAL && ctx->ops.iova_put_ephemeral)
+			ctx->ops.iova_put_ephemeral(ctx, *iova);
+
+		*retry = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, iova_t *iova,
+		    unsigned long flags)
+{
+	iova_t _iova;
+	bool retry;
+
+	if (iommu_translate_vaddr(ctx, vaddr, &_iova))
+		goto out;
+
+retry:
+	if (flags & IOMMU_MAP_FIXED_IOVA) {
+		_iova = *iova;
+	} else if (ctx->ops.iova_reserve && ctx->ops.iova_reserve(ctx, len, &_iova, flags)) {
+		if (iommu_unmapq_flush_pending(ctx))
+			goto retry;
+
+		log_debug("failed to allocate iova\n");
+		return -1;
+	}
+
+	if (__iommu_map_reserved(ctx, vaddr, len, &_iova, flags, &retry)) {
+		if (retry)
+			goto retry;
+
+		return -1;
+	}
+
+out:
+	if (iova)
+		*iova = _iova;
+
+	return 0;
+}
+
+int iommu_map_vaddr_align(struct iommu_ctx *ctx, void *vaddr, size_t len,
+			  size_t align, iova_t *iova, unsigned long flags)
+{
+	iova_t _iova;
+	bool retry;
+
+	if (flags & IOMMU_MAP_FIXED_IOVA) {
+		log_debug("IOMMU_MAP_FIXED_IOVA is not supported with alignment\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (iommu_translate_vaddr(ctx, vaddr, &_iova))
+		goto out;
+
+	if (!ctx->ops.iova_reserve_align) {
+		log_debug("backend does not support aligned iova reservation\n");
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+retry:
+	if (ctx->ops.iova_reserve_align(ctx, len, align, &_iova, flags)) {
+		if (iommu_unmapq_flush_pending(ctx))
+			goto retry;
+
+		log_debug("failed to allocate aligned iova\n");
+		return -1;
+	}
+
+	if (__iommu_map_reserved(ctx, vaddr, len, &_iova, flags, &retry)) {
+		if (retry)
+			goto retry;
+
+		return -1;
+	}
+
+out:
+	if (iova)
+		*iova = _iova;
+
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
+{
+	struct iova_mapping *m;
+
+	m = iova_map_find(&ctx->map, vaddr);
+	if (!m) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (len)
+		*len = m->len;
+
+	if (iommu_unmapq_add(ctx, m)) {
+		iova_map_remove(&ctx->map, m->vaddr);
+
+		return 0;
+	}
+
+	if (ctx->ops.dma_unmap(ctx, m->iova, m->len)) {
+		log_debug("failed to unmap dma\n");
+		return -1;
+	}
+
+	if (m->flags & IOMMU_MAP_EPHEMERAL && ctx->ops.iova_put_ephemeral)
+		ctx->ops.iova_put_ephemeral(ctx, m->iova);
+
+	iova_map_remove(&ctx->map, m->vaddr);
+
+	return 0;
+}
+
+static int __fd_maps_insert(struct iommu_ctx *ctx, struct iommu_fd_mapping *m)
+{
+	__autolock(&ctx->fd_maps.lock);
+
+	return btree_insert(&ctx->fd_maps.maps, m->iova, m);
+}
+
+static struct iommu_fd_mapping *__fd_maps_remove(struct iommu_ctx *ctx, iova_t iova)
+{
+	__autolock(&ctx->fd_maps.lock);
+
+	return btree_remove(&ctx->fd_maps.maps, iova);
+}
+
+/* fallback for backends that can only map virtual addresses */
+static int __map_fd_mmap(struct iommu_ctx *ctx, int fd, off_t offset, size_t len, iova_t *iova,
+			 unsigned long flags, void **vaddr)
+{
+	int prot = PROT_READ | ((flags & IOMMU_MAP_NOWRITE) ? 0 : PROT_WRITE);
+	void *mem;
+
+	mem = mmap(NULL, len, prot, MAP_SHARED, fd, offset);
+	if (mem == MAP_FAILED) {
+		log_debug("failed to mmap fd %d\n", fd);
+		return -1;
+	}
+
+	if (iommu_map_vaddr(ctx, mem, len, iova, flags)) {
+		munmap(mem, len);
+		return -1;
+	}
+
+	*vaddr = mem;
+
+	return 0;
+}
+
+int iommu_map_fd(struct iommu_ctx *ctx, int fd, off_t offset, size_t len, iova_t *iova,
+		 unsigned long flags)
+{
+	struct iommu_fd_mapping *m;
+	iova_t _iova = (flags & IOMMU_MAP_FIXED_IOVA) ? *iova : 0;
+	void *vaddr = NULL;
+
+	if (!len || (flags & IOMMU_MAP_EPHEMERAL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctx->ops.dma_map_fd || ctx->ops.dma_map_fd(ctx, fd, offset, len, &_iova, flags)) {
+		if (ctx->ops.dma_map_fd && errno != ENOTTY && errno != EOPNOTSUPP) {
+			log_debug("failed to map fd %d\n", fd);
+			return -1;
+		}
+
+		if (__map_fd_mmap(ctx, fd, offset, len, &_iova, flags, &vaddr))
+			return -1;
+	}
+
+	m = znew_t(struct iommu_fd_mapping, 1);
+
+	*m = (struct iommu_fd_mapping) {
+		.iova = _iova,
+		.len = len,
+		.vaddr = vaddr,
+	};
+
+	if (__fd_maps_insert(ctx, m)) {
+		log_debug("failed to add fd mapping\n");
+
+		if (vaddr) {
+			iommu_unmap_vaddr(ctx, vaddr, NULL);
+			munmap(vaddr, len);
+		} else {
+			ctx->ops.dma_unmap(ctx, _iova, len);
+		}
+
+		free(m);
+
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (iova)
+		*iova = _iova;
+
+	return 0;
+}
+
+int iommu_unmap_fd(struct iommu_ctx *ctx, iova_t iova, size_t *len)
+{
+	struct iommu_fd_mapping *m;
+
+	m = __fd_maps_remove(ctx, iova);
+	if (!m) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (m->vaddr) {
+		if (iommu_unmap_vaddr(ctx, m->vaddr, NULL))
+			goto err;
+
+		munmap(m->vaddr, m->len);
+	} else if (ctx->ops.dma_unmap(ctx, m->iova, m->len)) {
+		log_debug("failed to unmap dma\n");
+		goto err;
+	}
+
+	if (len)
+		*len = m->len;
+
+	free(m);
+
+	return 0;
+
+err:
+	log_fatal_if(__fd_maps_insert(ctx, m), "failed to restore fd mapping\n");
+
+	return -1;
+}
+
+static void __fd_map_clear(void *opaque, void *val)
+{
+	struct iommu_ctx *ctx = opaque;
+	struct iommu_fd_mapping *m = val;
+
+	if (m->vaddr)
+		munmap(m->vaddr, m->len);
+	else if (ctx)
+		log_fatal_if(ctx->ops.dma_unmap(ctx, m->iova, m->len),
+			     "failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n", m->iova, m->len);
+
+	free(m);
+}
+
+/*
+ * Drop all fd mappings. Mappings without a virtual address are unmapped if
+ * @unmap is set; those with one must already have been unmapped through the
+ * iova map.
+ */
+static void iommu_fd_maps_clear(struct iommu_ctx *ctx, bool unmap)
+{
+	__autolock(&ctx->fd_maps.lock);
+
+	btree_clear_with(&ctx->fd_maps.maps, __fd_map_clear, unmap ? ctx : NULL);
+}
+
+void iommu_fd_maps_destroy(struct iommu_ctx *ctx)
+{
+	iommu_fd_maps_clear(ctx, false);
+
+	btree_destroy(&ctx->fd_maps.maps);
+
+	pthread_mutex_destroy(&ctx->fd_maps.lock);
+}
+
+/* check that the cached mapping has not been removed behind our back */
+static bool __map_cache_valid(struct iommu_ctx *ctx, struct iommu_map_cache_entry *e)
+{
+	iova_t iova;
+
+	return iommu_translate_vaddr(ctx, e->vaddr, &iova) && iova == e->iova;
+}
+
+static void __map_cache_drop(struct iommu_ctx *ctx, struct iommu_map_cache_entry *e)
+{
+	struct iommu_map_cache *c = &ctx->map_cache;
+
+	btree_remove(&c->entries, (uint64_t)e->vaddr);
+	list_del(&e->lru);
+	c->nentries--;
+
+	if (__map_cache_valid(ctx, e) && iommu_unmap_vaddr(ctx, e->vaddr, NULL))
+		log_debug("failed to unmap cached mapping (vaddr %p)\n", e->vaddr);
+
+	free(e);
+}
+
+/* the least recently used entry that is not in use, if any */
+static struct iommu_map_cache_entry *__map_cache_victim(struct iommu_map_cache *c)
+{
+	struct iommu_map_cache_entry *e;
+
+	list_for_each_rev(&c->lru, e, lru) {
+		if (!e->users)
+			return e;
+	}
+
+	return NULL;
+}
+
+/* the entry that contains @vaddr, if any */
+static struct iommu_map_cache_entry *__map_cache_find(struct iommu_map_cache *c, void *vaddr)
+{
+	struct iommu_map_cache_entry *e = btree_find_le(&c->entries, (uint64_t)vaddr);
+
+	if (e && vaddr < e->vaddr + e->len)
+		return e;
 
-#include "context.h"
+	return NULL;
+}
 
-static int iova_cmp(const void *vaddr, const struct skiplist_node *n)
+void iommu_set_map_cache(struct iommu_ctx *ctx, unsigned int capacity)
 {
-	struct iova_mapping *m = container_of_var(n, m, list);
+	struct iommu_map_cache *c = &ctx->map_cache;
+	struct iommu_map_cache_entry *e;
 
-	if (vaddr < m->vaddr)
-		return -1;
-	else if (vaddr >= m->vaddr + m->len)
-		return 1;
+	__autolock(&c->lock);
 
-	return 0;
+	/* entries in use are evicted when put */
+	while (c->nentries > capacity && (e = __map_cache_victim(c)))
+		__map_cache_drop(ctx, e);
+
+	c->capacity = capacity;
 }
 
-static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, iova_t iova,
-			unsigned long flags)
+int iommu_map_cache_get(struct iommu_ctx *ctx, void *vaddr, size_t len, iova_t *iova)
 {
-	__autowrlock(&map->lock);
+	struct iommu_map_cache *c = &ctx->map_cache;
+	struct iommu_map_cache_entry *e;
 
-	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
-	struct iova_mapping *m;
+	__autolock(&c->lock);
 
-	if (!len) {
-		errno = EINVAL;
+	if (!c->capacity) {
+		errno = EOPNOTSUPP;
 		return -1;
 	}
 
-	if (skiplist_find(&map->list, vaddr, iova_cmp, update)) {
-		errno = EEXIST;
+	e = __map_cache_find(c, vaddr);
+	if (e) {
+		if (vaddr + len <= e->vaddr + e->len && __map_cache_valid(ctx, e)) {
+			list_del(&e->lru);
+			list_add(&c->lru, &e->lru);
+
+			e->users++;
+
+			*iova = e->iova + (vaddr - e->vaddr);
+
+			return 0;
+		}
+
+		/* the device may still be accessing it */
+		if (e->users) {
+			errno = EBUSY;
+			return -1;
+		}
+
+		/* too short or removed by the owner; map it again */
+		__map_cache_drop(ctx, e);
+	}
+
+	/* mapped by someone else */
+	if (iommu_translate_vaddr(ctx, vaddr, iova))
+		return 0;
+
+	if (c->nentries >= c->capacity) {
+		e = __map_cache_victim(c);
+		if (!e) {
+			errno = EBUSY;
+			return -1;
+		}
+
+		__map_cache_drop(ctx, e);
+	}
+
+	e = znew_t(struct iommu_map_cache_entry, 1);
+
+	if (iommu_map_vaddr(ctx, vaddr, len, &e->iova, 0x0)) {
+		free(e);
 		return -1;
 	}
 
-	m = znew_t(struct iova_mapping, 1);
+	e->vaddr = vaddr;
+	e->len = len;
+	e->users = 1;
 
-	m->vaddr = vaddr;
-	m->len = len;
-	m->iova = iova;
-	m->flags = flags;
+	if (btree_insert(&c->entries, (uint64_t)vaddr, e)) {
+		log_debug("failed to insert cached mapping\n");
 
-	skiplist_link(&map->list, &m->list, update);
+		iommu_unmap_vaddr(ctx, vaddr, NULL);
+		free(e);
+
+		errno = ENOMEM;
+		return -1;
+	}
+
+	list_add(&c->lru, &e->lru);
+	c->nentries++;
+
+	*iova = e->iova;
 
 	return 0;
 }
 
-static void iova_map_remove(struct iova_map *map, void *vaddr)
+void iommu_map_cache_put(struct iommu_ctx *ctx, void *vaddr)
 {
-	__autowrlock(&map->lock);
+	struct iommu_map_cache *c = &ctx->map_cache;
+	struct iommu_map_cache_entry *e;
 
-	struct skiplist_node *n, *update[SKIPLIST_LEVELS] = {};
+	__autolock(&c->lock);
 
-	n = skiplist_find(&map->list, vaddr, iova_cmp, update);
-	if (!n)
+	/* not cached, or dropped by iommu_map_cache_invalidate() */
+	e = __map_cache_find(c, vaddr);
+	if (!e || !e->users)
 		return;
 
-	skiplist_erase(&map->list, n, update);
+	if (!--e->users && c->nentries > c->capacity)
+		__map_cache_drop(ctx, e);
 }
 
-static struct iova_mapping *iova_map_find(struct iova_map *map, void *vaddr)
+void iommu_map_cache_invalidate(struct iommu_ctx *ctx, void *vaddr, size_t len)
 {
-	__autordlock(&map->lock);
+	struct iommu_map_cache *c = &ctx->map_cache;
+	struct iommu_map_cache_entry *e, *next;
+
+	__autolock(&c->lock);
 
-	return container_of_or_null(skiplist_find(&map->list, vaddr, iova_cmp, NULL),
-				    struct iova_mapping, list);
+	list_for_each_safe(&c->lru, e, next, lru) {
+		if (e->vaddr < vaddr + len && vaddr < e->vaddr + e->len)
+			__map_cache_drop(ctx, e);
+	}
 }
 
-static void iova_map_clear_with(struct iova_map *map, skiplist_iter_fn fn, void *opaque)
+static void __free_entry(void *opaque UNUSED, void *val)
 {
-	__autowrlock(&map->lock);
+	free(val);
+}
+
+/* forget all cached mappings; used when all mappings are removed anyway */
+static void iommu_map_cache_clear(struct iommu_ctx *ctx)
+{
+	struct iommu_map_cache *c = &ctx->map_cache;
+
+	__autolock(&c->lock);
 
-	skiplist_clear_with(&map->list, fn, opaque);
+	btree_clear_with(&c->entries, __free_entry, NULL);
+	list_head_init(&c->lru);
+
+	c->nentries = 0;
 }
 
-static void UNUSED iova_map_clear(struct iova_map *map)
+void iommu_map_cache_destroy(struct iommu_ctx *ctx)
 {
-	iova_map_clear_with(map, NULL, NULL);
+	iommu_map_cache_clear(ctx);
+
+	btree_destroy(&ctx->map_cache.entries);
+
+	pthread_mutex_destroy(&ctx->map_cache.lock);
 }
 
-bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, iova_t *iova)
+static bool __same_iova_pool_add(struct iommu_same_iova *s, struct iommu_same_iova_buf *buf)
 {
-	struct iova_mapping *m = iova_map_find(&ctx->map, vaddr);
+	struct iommu_same_iova_class *c = btree_find(&s->pool, buf->len);
 
-	if (m) {
-		*iova = m->iova + (vaddr - m->vaddr);
-		return true;
+	if (!c) {
+		c = znew_t(struct iommu_same_iova_class, 1);
+		c->len = buf->len;
+		list_head_init(&c->bufs);
+
+		if (btree_insert(&s->pool, c->len, c)) {
+			free(c);
+			return false;
+		}
 	}
 
-	return false;
+	list_add(&c->bufs, &buf->list);
+	s->pooled += buf->len;
+
+	return true;
 }
 
-int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, iova_t *iova,
-		    unsigned long flags)
+static void __same_iova_pool_del(struct iommu_same_iova *s, struct iommu_same_iova_class *c,
+				 struct iommu_same_iova_buf *buf)
 {
-	iova_t _iova;
+	list_del(&buf->list);
+	s->pooled -= buf->len;
 
-	if (iommu_translate_vaddr(ctx, vaddr, &_iova))
-		goto out;
+	if (list_empty(&c->bufs)) {
+		btree_remove(&s->pool, c->len);
+		free(c);
+	}
+}
 
-	if (flags & IOMMU_MAP_FIXED_IOVA) {
-		_iova = *iova;
-	} else if (ctx->ops.iova_reserve && ctx->ops.iova_reserve(ctx, len, &_iova, flags)) {
-		log_debug("failed to allocate iova\n");
-		return -1;
+/* take a pooled buffer allocated with the same length and flags */
+static struct iommu_same_iova_buf *__same_iova_pool_take(struct iommu_same_iova *s, size_t len,
+							  unsigned long flags)
+{
+	struct iommu_same_iova_class *c = btree_find(&s->pool, len);
+	struct iommu_same_iova_buf *buf;
+
+	if (!c)
+		return NULL;
+
+	list_for_each(&c->bufs, buf, list) {
+		if (buf->flags == flags) {
+			__same_iova_pool_del(s, c, buf);
+			return buf;
+		}
 	}
 
-	if (ctx->ops.dma_map(ctx, vaddr, len, &_iova, flags)) {
-		log_debug("failed to map dma\n");
-		return -1;
+	return NULL;
+}
+
+/* release the memory and address space of an unmapped buffer */
+static void __same_iova_release(struct iommu_same_iova *s, struct iommu_same_iova_buf *buf)
+{
+	pgunmap(buf->vaddr, buf->len);
+
+	iova_allocator_put(&s->free, (iova_t)buf->vaddr, buf->len);
+
+	free(buf);
+}
+
+/* release pooled buffers (largest first) until at most @max bytes are pooled */
+static void __same_iova_pool_shrink(struct iommu_ctx *ctx, size_t max, bool unmap)
+{
+	struct iommu_same_iova *s = &ctx->same_iova;
+
+	while (s->pooled > max) {
+		struct iommu_same_iova_class *c = btree_find_le(&s->pool, UINT64_MAX);
+		struct iommu_same_iova_buf *buf;
+
+		buf = list_top(&c->bufs, struct iommu_same_iova_buf, list);
+
+		__same_iova_pool_del(s, c, buf);
+
+		if (unmap && iommu_unmap_vaddr(ctx, buf->vaddr, NULL)) {
+			log_debug("failed to unmap pooled buffer (vaddr %p)\n", buf->vaddr);
+
+			free(buf);
+			continue;
+		}
+
+		__same_iova_release(s, buf);
 	}
+}
 
-	if (iova_map_add(&ctx->map, vaddr, len, _iova, flags)) {
-		log_debug("failed to add mapping\n");
-		return -1;
+void iommu_set_same_iova_pool(struct iommu_ctx *ctx, size_t max)
+{
+	__autolock(&ctx->same_iova.lock);
+
+	ctx->same_iova.pool_max = max;
+
+	__same_iova_pool_shrink(ctx, max, true);
+}
+
+/* the pooled buffers are no longer mapped; used when all mappings are removed */
+static void iommu_same_iova_pool_clear(struct iommu_ctx *ctx)
+{
+	__autolock(&ctx->same_iova.lock);
+
+	__same_iova_pool_shrink(ctx, 0, false);
+}
+
+void iommu_same_iova_destroy(struct iommu_ctx *ctx)
+{
+	struct iommu_same_iova *s = &ctx->same_iova;
+
+	iommu_same_iova_pool_clear(ctx);
+
+	/* the memory of live buffers may still be referenced by the caller */
+	btree_clear_with(&s->bufs, __free_entry, NULL);
+
+	btree_destroy(&s->bufs);
+	btree_destroy(&s->pool);
+
+	iova_allocator_destroy(&s->free);
+
+	pthread_mutex_destroy(&s->lock);
+}
+
+static void __unmap_mapping(void *opaque, struct iova_mapping *m)
+{
+	struct iommu_ctx *ctx = opaque;
+
+	log_fatal_if(ctx->ops.dma_unmap(ctx, m->iova, m->len),
+		     "failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n", m->iova, m->len);
+}
+
+int iommu_unmap_all(struct iommu_ctx *ctx)
+{
+	/* drops the ephemeral references of queued ranges */
+	if (iommu_flush_unmap(ctx))
+		log_debug("failed to flush deferred unmaps\n");
+
+	iommu_map_cache_clear(ctx);
+
+	if (ctx->ops.dma_unmap_all) {
+		if (ctx->ops.dma_unmap_all(ctx)) {
+			log_debug("failed to unmap dma\n");
+			return -1;
+		}
+
+		iova_map_clear(&ctx->map);
+		iommu_fd_maps_clear(ctx, false);
+	} else {
+		iova_map_clear_with(&ctx->map, __unmap_mapping, ctx);
+		iommu_fd_maps_clear(ctx, true);
 	}
 
-out:
-	if (iova)
-		*iova = _iova;
+	iommu_same_iova_pool_clear(ctx);
 
 	return 0;
 }
 
-int iommu_map_vaddr_align(struct iommu_ctx *ctx, void *vaddr, size_t len,
-			  size_t align, iova_t *iova, unsigned long flags)
+int iommu_mirror_vaddr(struct iommu_ctx *dst, struct iommu_ctx *src, void *vaddr,
+		       iova_t *iova)
 {
+	struct iova_mapping *m;
+	unsigned long flags;
 	iova_t _iova;
 
-	if (flags & IOMMU_MAP_FIXED_IOVA) {
-		log_debug("IOMMU_MAP_FIXED_IOVA is not supported with alignment\n");
-		errno = EINVAL;
+	m = iova_map_find(&src->map, vaddr);
+	if (!m) {
+		errno = ENOENT;
 		return -1;
 	}
 
-	if (iommu_translate_vaddr(ctx, vaddr, &_iova))
-		goto out;
+	_iova = m->iova + (uint64_t)(vaddr - m->vaddr);
+	flags = (m->flags & ~IOMMU_MAP_EPHEMERAL) | IOMMU_MAP_FIXED_IOVA;
 
-	if (!ctx->ops.iova_reserve_align) {
-		log_debug("backend does not support aligned iova reservation\n");
-		errno = EOPNOTSUPP;
+	/* already mirrored */
+	if (iommu_translate_vaddr(dst, vaddr, iova)) {
+		if (*iova == _iova)
+			return 0;
+
+		errno = EEXIST;
 		return -1;
 	}
 
-	if (ctx->ops.iova_reserve_align(ctx, len, align, &_iova, flags)) {
-		log_debug("failed to allocate aligned iova\n");
+	if (!dst->ops.dma_copy || dst->ops.dma_copy != src->ops.dma_copy) {
+		errno = EOPNOTSUPP;
 		return -1;
 	}
 
-	if (ctx->ops.dma_map(ctx, vaddr, len, &_iova, flags)) {
-		log_debug("failed to map dma\n");
+	if (dst->ops.dma_copy(dst, src, m->iova, m->len, flags)) {
+		log_debug("failed to copy mapping\n");
 		return -1;
 	}
 
-	if (iova_map_add(&ctx->map, vaddr, len, _iova, flags)) {
+	if (iova_map_add(&dst->map, m->vaddr, m->len, m->iova, flags)) {
 		log_debug("failed to add mapping\n");
+
+		dst->ops.dma_unmap(dst, m->iova, m->len);
+
 		return -1;
 	}
 
-out:
-	if (iova)
-		*iova = _iova;
+	*iova = _iova;
 
 	return 0;
 }
 
-int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
+int iommu_register_region(struct iommu_ctx *ctx, void *vaddr, size_t len,
+			  struct iommu_region *region, unsigned long flags)
 {
-	struct iova_mapping *m;
+	iova_t iova = region->iova;
 
-	m = iova_map_find(&ctx->map, vaddr);
-	if (!m) {
-		errno = ENOENT;
+	if (!len) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	if (len)
-		*len = m->len;
-
-	if (ctx->ops.dma_unmap(ctx, m->iova, m->len)) {
-		log_debug("failed to unmap dma\n");
+	/* do not hand out a handle for someone else's mapping */
+	if (iova_map_overlaps(&ctx->map, vaddr, len)) {
+		errno = EEXIST;
 		return -1;
 	}
 
-	if (m->flags & IOMMU_MAP_EPHEMERAL && ctx->ops.iova_put_ephemeral)
-		ctx->ops.iova_put_ephemeral(ctx);
-
-	iova_map_remove(&ctx->map, m->vaddr);
+	if (iommu_map_vaddr(ctx, vaddr, len, &iova, flags))
+		return -1;
 
-	free(m);
+	*region = (struct iommu_region) {
+		.ctx = ctx,
+		.vaddr = vaddr,
+		.iova = iova,
+		.len = len,
+	};
 
 	return 0;
 }
 
-static void __unmap_mapping(void *opaque, struct skiplist_node *n)
+int iommu_unregister_region(struct iommu_region *region)
 {
-	struct iommu_ctx *ctx = opaque;
-	struct iova_mapping *m = container_of_var(n, m, list);
+	if (iommu_unmap_vaddr(region->ctx, region->vaddr, NULL))
+		return -1;
 
-	log_fatal_if(ctx->ops.dma_unmap(ctx, m->iova, m->len),
-		     "failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n", m->iova, m->len);
+	memset(region, 0x0, sizeof(*region));
 
-	free(m);
+	return 0;
 }
 
-int iommu_unmap_all(struct iommu_ctx *ctx)
+static int __same_iova_map_at(struct iommu_ctx *ctx, iova_t iova, size_t len,
+			      unsigned long flags)
 {
-	if (ctx->ops.dma_unmap_all) {
-		if (ctx->ops.dma_unmap_all(ctx)) {
-			log_debug("failed to unmap dma\n");
-			return -1;
-		}
+	void *vaddr = (void *)iova;
+	int err;
 
-		iova_map_clear(&ctx->map);
+	if (pgmapf_at(vaddr, len, flags) < 0)
+		return -1;
 
-		return 0;
-	}
+	/* the iova may still be held up by a deferred unmap */
+	if (iommu_map_vaddr(ctx, vaddr, len, &iova, IOMMU_MAP_FIXED_IOVA) &&
+	    (!iommu_unmapq_flush_pending(ctx) ||
+	     iommu_map_vaddr(ctx, vaddr, len, &iova, IOMMU_MAP_FIXED_IOVA))) {
+		err = errno;
 
-	iova_map_clear_with(&ctx->map, __unmap_mapping, ctx);
+		log_debug("unable to map iova at %p\n", vaddr);
+		pgunmap(vaddr, len);
+
+		errno = err;
+		return -1;
+	}
 
 	return 0;
 }
 
-void *iommu_alloc_same_iova(struct iommu_ctx *ctx, size_t len)
+/* map @len bytes of unused same iova space, preferring released space */
+static void *__same_iova_map(struct iommu_ctx *ctx, size_t len, unsigned long flags)
 {
+	struct iommu_same_iova *s = &ctx->same_iova;
+	size_t align = pgmap_pagesize(flags);
 	iova_t iova;
-	void *vaddr;
 
-	len = ALIGN_UP(len, __VFN_PAGESIZE);
+	while (iova_allocator_get_align(&s->free, len, align, &iova)) {
+		if (!__same_iova_map_at(ctx, iova, len, flags))
+			return (void *)iova;
 
-retry:
-	if (ctx->iova_next_same + len >= ctx->iova_max ||
-	    ctx->iova_next_same + len >= IOMMU_MAX_SAME_IOVA) {
-		log_debug("same iova space is full\n");
-		errno = ENOMEM;
-		return NULL;
+		if (errno != EEXIST) {
+			iova_allocator_put(&s->free, iova, len);
+			return NULL;
+		}
+
+		/* taken by someone else since it was released; forget about it */
+		log_debug("unable to reuse memory at %08" PRIx64 ", retrying\n", iova);
 	}
 
-	vaddr = mmap((void *)ctx->iova_next_same, len, PROT_READ | PROT_WRITE,
-		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, 0, 0);
-	if (vaddr == MAP_FAILED) {
-		if (errno == EEXIST) {
-			log_debug("unable to map memory at %08lx, retrying\n", ctx->iova_next_same);
-			ctx->iova_next_same += len;
-			goto retry;
+	for (;;) {
+		iova = ALIGN_UP(s->next, align);
+
+		if (iova + len >= ctx->iova_max || iova + len >= IOMMU_MAX_SAME_IOVA) {
+			log_debug("same iova space is full\n");
+			errno = ENOMEM;
+			return NULL;
 		}
 
-		log_debug("unable to map memory at %08lx: %m\n", ctx->iova_next_same);
-		return NULL;
+		/* keep the alignment padding for smaller allocations */
+		if (iova > s->next)
+			iova_allocator_put(&s->free, s->next, iova - s->next);
+
+		s->next = iova + len;
+
+		if (!__same_iova_map_at(ctx, iova, len, flags))
+			return (void *)iova;
+
+		if (errno != EEXIST) {
+			log_debug("unable to map memory at %08" PRIx64 ": %m\n", iova);
+			return NULL;
+		}
+
+		log_debug("unable to map memory at %08" PRIx64 ", retrying\n", iova);
+	}
+}
+
+void *iommu_alloc_same_iova_flags(struct iommu_ctx *ctx, size_t len, unsigned long flags)
+{
+	struct iommu_same_iova *s = &ctx->same_iova;
+	struct iommu_same_iova_buf *buf;
+
+	__autolock(&s->lock);
+
+	len = ALIGN_UP(len, pgmap_pagesize(flags));
+
+	buf = __same_iova_pool_take(s, len, flags);
+	if (!buf) {
+		void *vaddr = __same_iova_map(ctx, len, flags);
+
+		if (!vaddr)
+			return NULL;
+
+		buf = znew_t(struct iommu_same_iova_buf, 1);
+		buf->vaddr = vaddr;
+		buf->len = len;
+		buf->flags = flags;
 	}
 
-	iova = (iova_t)vaddr;
+	if (btree_insert(&s->bufs, (uint64_t)buf->vaddr, buf)) {
+		log_debug("failed to insert same iova buffer\n");
 
-	if (iommu_map_vaddr(ctx, vaddr, len, &iova, IOMMU_MAP_FIXED_IOVA)) {
-		log_debug("unable to map iova at %p\n", vaddr);
-		munmap(vaddr, len);
+		if (!iommu_unmap_vaddr(ctx, buf->vaddr, NULL))
+			__same_iova_release(s, buf);
+
+		errno = ENOMEM;
 		return NULL;
 	}
 
-	ctx->iova_next_same += len;
+	return buf->vaddr;
+}
 
-	return vaddr;
+void *iommu_alloc_same_iova(struct iommu_ctx *ctx, size_t len)
+{
+	return iommu_alloc_same_iova_flags(ctx, len, 0x0);
 }
 
 int iommu_free_same_iova(struct iommu_ctx *ctx, void *vaddr)
 {
-	size_t len;
+	struct iommu_same_iova *s = &ctx->same_iova;
+	struct iommu_same_iova_buf *buf;
+
+	__autolock(&s->lock);
 
-	if (iommu_unmap_vaddr(ctx, vaddr, &len))
+	buf = btree_find(&s->bufs, (uint64_t)vaddr);
+	if (!buf) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (s->pooled + buf->len <= s->pool_max && __same_iova_pool_add(s, buf)) {
+		btree_remove(&s->bufs, (uint64_t)vaddr);
+		return 0;
+	}
+
+	/* the mapping is already gone if all mappings were removed */
+	if (iommu_unmap_vaddr(ctx, vaddr, NULL) && errno != ENOENT)
 		return -1;
 
-	return munmap(vaddr, len);
+	btree_remove(&s->bufs, (uint64_t)vaddr);
+
+	__same_iova_release(s, buf);
+
+	return 0;
 }
 
 int iommu_get_iova_ranges(struct iommu_ctx *ctx, struct iommu_iova_range **ranges)
@@ -310,17 +1640,14 @@ ssize_t iommu_translate_iova(struct iommu_ctx *ctx, iova_t iova, void **vaddr)
 {
 	__autordlock(&ctx->map.lock);
 
-	struct skiplist_node *n, *next;
-	struct iova_mapping *m;
+	struct iova_mapping *m = btree_find_le(&ctx->map.iovas, iova);
 
-	skiplist_for_each_safe(&ctx->map.list, n, next, 0) {
-		m = container_of_var(n, m, list);
-		if (iova >= m->iova && iova < m->iova + m->len) {
-			*vaddr = m->vaddr + (iova - m->iova);
-			return m->len - (iova - m->iova);
-		}
+	if (!m || iova >= m->iova + m->len) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	errno = EINVAL;
-	return -1;
+	*vaddr = m->vaddr + (iova - m->iova);
+
+	return m->len - (iova - m->iova);
 }
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Translation scaling benchmark; reports the aggregate number of
+ * vaddr-to-iova translations per second for an increasing number of threads,
+ * with and without taking the iova map lock and with and without the
+ * per-thread translation cache, spreading translations over all mappings or
+ * just a few "hot" ones. Each configuration is also run with a concurrent
+ * writer continuously adding and removing mappings. Translations are verified and
+ * the benchmark fails if any of them are wrong.
+ *
+ * Usage: dma_bench [max threads] (defaults to the number of online cpus)
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ccan/time/time.h"
+
+#include "dma.c"
+
+#define NMAPPINGS 1024
+#define MAPPING_LEN (2ULL << 20)
+#define VADDR_BASE 0x100000000000ULL
+#define IOVA_BASE 0x10000000ULL
+#define CHURN_BASE (VADDR_BASE + NMAPPINGS * MAPPING_LEN)
+#define CHURN_MAPPINGS 64
+#define HOT_MAPPINGS 8
+
+#define ITERATIONS (1 << 22)
+
+enum mode {
+	MODE_LOCKED,
+	MODE_LOCKLESS,
+	MODE_CACHED,
+};
+
+static const char * const mode_str[] = {
+	[MODE_LOCKED] = "locked",
+	[MODE_LOCKLESS] = "lockless",
+	[MODE_CACHED] = "cached",
+};
+
+static struct iommu_ctx ctx;
+
+static pthread_barrier_t barrier;
+static enum mode mode;
+static unsigned int nmappings;
+static bool stop;
+static uint64_t errors;
+
+static int __dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		     iova_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+static int __dma_unmap(struct iommu_ctx *ctx UNUSED, iova_t iova UNUSED, size_t len UNUSED)
+{
+	return 0;
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *state = x;
+}
+
+static void *reader(void *opaque)
+{
+	uint64_t state = (uintptr_t)opaque * 0x9e3779b97f4a7c15ULL + 1, bad = 0;
+
+	pthread_barrier_wait(&barrier);
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		uint64_t r = xorshift64(&state), off;
+		struct iovec iov;
+		iova_t iova;
+		bool found;
+
+		off = (r % nmappings) * MAPPING_LEN + ((r >> 32) % MAPPING_LEN);
+		iov.iov_base = (void *)(VADDR_BASE + off);
+
+		switch (mode) {
+		case MODE_LOCKED:
+			found = iova_map_translate_locked(&ctx.map, &iov, 1, &iova, NULL) == 1;
+			break;
+		case MODE_LOCKLESS:
+			found = iova_map_translate(&ctx.map, &iov, 1, &iova, NULL) == 1;
+			break;
+		case MODE_CACHED:
+		default:
+			found = iommu_translate_vaddr(&ctx, iov.iov_base, &iova);
+			break;
+		}
+
+		if (!found || iova != IOVA_BASE + off)
+			bad++;
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	if (bad)
+		__atomic_fetch_add(&errors, bad, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+static void *writer(void *opaque UNUSED)
+{
+	uint64_t rounds = 0;
+
+	while (!atomic_load_acquire(&stop)) {
+		for (int i = 0; i < CHURN_MAPPINGS; i++) {
+			void *vaddr = (void *)(CHURN_BASE + i * MAPPING_LEN);
+			iova_t iova = IOVA_BASE + (vaddr - (void *)VADDR_BASE);
+
+			if (iommu_map_vaddr(&ctx, vaddr, MAPPING_LEN, &iova, IOMMU_MAP_FIXED_IOVA))
+				err(1, "could not map");
+		}
+
+		for (int i = 0; i < CHURN_MAPPINGS; i++) {
+			if (iommu_unmap_vaddr(&ctx, (void *)(CHURN_BASE + i * MAPPING_LEN), NULL))
+				err(1, "could not unmap");
+		}
+
+		rounds++;
+	}
+
+	return (void *)(uintptr_t)rounds;
+}
+
+static double bench(int nthreads, bool churn, uint64_t *rounds)
+{
+	pthread_t threads[nthreads], wthread;
+	struct timemono start;
+	uint64_t nsec;
+	void *ret;
+
+	pthread_barrier_init(&barrier, NULL, (unsigned int)nthreads + 1);
+
+	stop = false;
+
+	if (churn && pthread_create(&wthread, NULL, writer, NULL))
+		err(1, "could not create writer thread");
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, reader, (void *)(uintptr_t)i))
+			err(1, "could not create reader thread");
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = time_mono();
+	pthread_barrier_wait(&barrier);
+	nsec = time_to_nsec(timemono_since(start));
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (churn) {
+		atomic_store_release(&stop, true);
+		pthread_join(wthread, &ret);
+
+		*rounds = (uintptr_t)ret;
+	}
+
+	pthread_barrier_destroy(&barrier);
+
+	return (double)nthreads * ITERATIONS / (double)nsec * 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+	long ncpus = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	iova_map_init(&ctx.map);
+
+	ctx.ops.dma_map = __dma_map;
+	ctx.ops.dma_unmap = __dma_unmap;
+
+	for (int i = 0; i < NMAPPINGS; i++) {
+		iova_t iova = IOVA_BASE + i * MAPPING_LEN;
+
+		if (iommu_map_vaddr(&ctx, (void *)(VADDR_BASE + i * MAPPING_LEN), MAPPING_LEN,
+				    &iova, IOMMU_MAP_FIXED_IOVA))
+			err(1, "could not map");
+	}
+
+	printf("%-8s %8s %8s %16s %16s %12s\n", "mode", "maps", "threads", "Mtrans/s",
+	       "Mtrans/s (churn)", "churn rounds");
+
+	for (mode = MODE_LOCKED; mode <= MODE_CACHED; mode++) {
+		for (nmappings = NMAPPINGS; nmappings >= HOT_MAPPINGS; nmappings /= NMAPPINGS / HOT_MAPPINGS) {
+			for (int nthreads = 1; nthreads <= ncpus; nthreads *= 2) {
+				uint64_t rounds = 0;
+				double mtps, mtps_churn;
+
+				mtps = bench(nthreads, false, NULL);
+				mtps_churn = bench(nthreads, true, &rounds);
+
+				printf("%-8s %8u %8d %16.1f %16.1f %12" PRIu64 "\n", mode_str[mode],
+				       nmappings, nthreads, mtps, mtps_churn, rounds);
+			}
+		}
+	}
+
+	iommu_unmap_all(&ctx);
+
+	if (errors) {
+		fprintf(stderr, "%" PRIu64 " translations failed\n", errors);
+		return 1;
+	}
+
+	return 0;
+}
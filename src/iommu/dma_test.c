@@ -0,0 +1,547 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+#include <unistd.h>
+
+#include "ccan/tap/tap.h"
+
+#include "dma.c"
+
+#define NMAPPINGS 256
+#define MAPPING_LEN 0x10000ULL
+#define VADDR_BASE 0x7f0000000000ULL
+#define IOVA_BASE 0x100000000ULL
+#define PAGE 0x1000ULL
+
+static struct iommu_ctx ctx, ctx2;
+
+static unsigned int nmaps, map_fails;
+static iova_t next_iova = IOVA_BASE + 2 * NMAPPINGS * MAPPING_LEN;
+
+static int __dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len,
+		     iova_t *iova, unsigned long flags)
+{
+	nmaps++;
+
+	if (map_fails) {
+		map_fails--;
+
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (!(flags & IOMMU_MAP_FIXED_IOVA)) {
+		*iova = next_iova;
+		next_iova += len;
+	}
+
+	return 0;
+}
+
+static unsigned int nunmaps, nputs;
+static iova_t unmap_iova;
+static size_t unmap_len;
+
+static int __dma_unmap(struct iommu_ctx *ctx UNUSED, iova_t iova, size_t len)
+{
+	nunmaps++;
+	unmap_iova = iova;
+	unmap_len = len;
+
+	return 0;
+}
+
+static void __iova_put_ephemeral(struct iommu_ctx *ctx UNUSED, iova_t iova UNUSED)
+{
+	nputs++;
+}
+
+/* iovas reserved and returned through the iova ops */
+static unsigned int nreserved;
+
+static int __iova_reserve(struct iommu_ctx *ctx UNUSED, size_t len, iova_t *iova,
+			  unsigned long flags UNUSED)
+{
+	nreserved++;
+
+	*iova = next_iova;
+	next_iova += len;
+
+	return 0;
+}
+
+static int __iova_reserve_align(struct iommu_ctx *ctx UNUSED, size_t len, size_t align,
+				iova_t *iova, unsigned long flags UNUSED)
+{
+	nreserved++;
+
+	*iova = ALIGN_UP(next_iova, align);
+	next_iova = *iova + len;
+
+	return 0;
+}
+
+static void __iova_put(struct iommu_ctx *ctx UNUSED, iova_t iova UNUSED, size_t len UNUSED)
+{
+	nreserved--;
+}
+
+static unsigned int ncopies;
+
+static int __dma_copy(struct iommu_ctx *dst UNUSED, struct iommu_ctx *src UNUSED,
+		      iova_t iova UNUSED, size_t len UNUSED, unsigned long flags UNUSED)
+{
+	ncopies++;
+
+	return 0;
+}
+
+static int map_fd_errno;
+
+static int __dma_map_fd(struct iommu_ctx *ctx UNUSED, int fd UNUSED, off_t offset UNUSED,
+			size_t len, iova_t *iova, unsigned long flags UNUSED)
+{
+	if (map_fd_errno) {
+		errno = map_fd_errno;
+		return -1;
+	}
+
+	*iova = next_iova;
+	next_iova += len;
+
+	return 0;
+}
+
+/* mappings are placed in reverse order of their iovas */
+static inline void *vaddr_of(int i)
+{
+	return (void *)(VADDR_BASE + (uint64_t)i * 2 * MAPPING_LEN);
+}
+
+static inline iova_t iova_of(int i)
+{
+	return IOVA_BASE + (uint64_t)(NMAPPINGS - 1 - i) * MAPPING_LEN;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	bool fwd = true, rev = true, holes = true;
+	struct iovec iov[NMAPPINGS];
+	iova_t iova, iovas[NMAPPINGS];
+	struct iommu_region region;
+	void *vaddr, *same[4];
+	size_t len;
+	int i, fd;
+
+	plan_tests(72);
+
+	iova_map_init(&ctx.map);
+
+	ctx.ops.dma_map = __dma_map;
+	ctx.ops.dma_unmap = __dma_unmap;
+	ctx.ops.iova_put_ephemeral = __iova_put_ephemeral;
+
+	btree_init(&ctx.map_cache.entries);
+	list_head_init(&ctx.map_cache.lru);
+
+	for (i = 0; i < NMAPPINGS; i++) {
+		iova = iova_of(i);
+
+		if (iommu_map_vaddr(&ctx, vaddr_of(i), MAPPING_LEN, &iova, IOMMU_MAP_FIXED_IOVA))
+			break;
+	}
+
+	ok(i == NMAPPINGS, "map %d regions", NMAPPINGS);
+
+	iova = 0;
+	ok(iommu_map_vaddr(&ctx, vaddr_of(3) + 0x100, 0x1000, &iova, 0) == 0 &&
+	   iova == iova_of(3) + 0x100, "map inside existing mapping returns existing iova");
+
+	for (i = 0; i < NMAPPINGS; i++) {
+		if (!iommu_translate_vaddr(&ctx, vaddr_of(i) + 0x1234, &iova) ||
+		    iova != iova_of(i) + 0x1234)
+			fwd = false;
+
+		if (iommu_translate_iova(&ctx, iova_of(i) + 0x1234, &vaddr) !=
+		    (ssize_t)(MAPPING_LEN - 0x1234) || vaddr != vaddr_of(i) + 0x1234)
+			rev = false;
+
+		if (iommu_translate_vaddr(&ctx, vaddr_of(i) + MAPPING_LEN, &iova))
+			holes = false;
+	}
+
+	ok(fwd, "translate vaddr");
+	ok(rev, "translate iova");
+	ok(holes, "translate unmapped vaddr fails");
+
+	ok(iommu_translate_iova(&ctx, IOVA_BASE - 1, &vaddr) == -1 && errno == EINVAL,
+	   "translate iova below all mappings fails");
+	ok(iommu_translate_iova(&ctx, iova_of(0) + MAPPING_LEN, &vaddr) == -1,
+	   "translate iova above all mappings fails");
+
+	for (i = 0; i < NMAPPINGS; i++) {
+		iov[i].iov_base = vaddr_of(i) + (uint64_t)i * 8;
+		iov[i].iov_len = 8;
+	}
+
+	ok(iommu_translate_vaddrv(&ctx, iov, NMAPPINGS, iovas) == NMAPPINGS,
+	   "translate iovec");
+
+	fwd = true;
+	for (i = 0; i < NMAPPINGS; i++) {
+		if (iovas[i] != iova_of(i) + (uint64_t)i * 8)
+			fwd = false;
+	}
+
+	ok(fwd, "translated iovec entries are correct");
+
+	iov[7].iov_base = vaddr_of(7) + MAPPING_LEN;
+	ok(iommu_translate_vaddrv(&ctx, iov, NMAPPINGS, iovas) == 7,
+	   "translate iovec stops at unmapped entry");
+
+	/* warm the per-thread cache, then check that unmap invalidates it */
+	ok(iommu_translate_vaddr(&ctx, vaddr_of(5), &iova) && iova == iova_of(5),
+	   "translate vaddr (cached)");
+	ok(iommu_unmap_vaddr(&ctx, vaddr_of(5), NULL) == 0, "unmap");
+	ok(!iommu_translate_vaddr(&ctx, vaddr_of(5), &iova), "translate unmapped vaddr fails");
+	ok(iommu_translate_iova(&ctx, iova_of(5), &vaddr) == -1, "translate unmapped iova fails");
+
+	/* register a region in the hole left by the unmap */
+	region.iova = iova_of(5);
+	ok(iommu_register_region(&ctx, vaddr_of(5), MAPPING_LEN, &region,
+				 IOMMU_MAP_FIXED_IOVA) == 0 &&
+	   region.vaddr == vaddr_of(5) && region.iova == iova_of(5) &&
+	   region.len == MAPPING_LEN, "register region");
+	ok(iommu_region_iova(&region, 0x1234) == iova_of(5) + 0x1234 &&
+	   iommu_translate_vaddr(&ctx, vaddr_of(5) + 0x1234, &iova) &&
+	   iova == iommu_region_iova(&region, 0x1234), "region iova matches translation");
+	ok(iommu_region_contains(&region, 0x1000, MAPPING_LEN - 0x1000) &&
+	   !iommu_region_contains(&region, 0x1000, MAPPING_LEN) &&
+	   !iommu_region_contains(&region, SIZE_MAX, 0x2), "region bounds");
+	ok(iommu_register_region(&ctx, vaddr_of(6) - 0x1000, 0x2000, &region, 0) == -1 &&
+	   errno == EEXIST, "register overlapping region fails");
+	ok(iommu_register_region(&ctx, vaddr_of(6) - 0x1000, MAPPING_LEN + 0x2000, &region,
+				 0) == -1 && errno == EEXIST, "register region spanning a mapping fails");
+	ok(iommu_unregister_region(&region) == 0 && !region.ctx &&
+	   !iommu_translate_vaddr(&ctx, vaddr_of(5), &iova), "unregister region");
+
+	/* deferred unmapping; four mappings placed after the others */
+	ok(iommu_set_deferred_unmap(&ctx, 4) == 0, "enable deferred unmap");
+
+	for (i = NMAPPINGS; i < NMAPPINGS + 4; i++) {
+		iova = IOVA_BASE + (uint64_t)i * MAPPING_LEN;
+
+		iommu_map_vaddr(&ctx, vaddr_of(i), MAPPING_LEN, &iova,
+				IOMMU_MAP_FIXED_IOVA |
+				(i < NMAPPINGS + 2 ? IOMMU_MAP_EPHEMERAL : 0));
+	}
+
+	nunmaps = nputs = 0;
+
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS + 1), NULL);
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS + 3), NULL);
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS + 2), NULL);
+
+	ok(nunmaps == 0 && nputs == 0 &&
+	   !iommu_translate_vaddr(&ctx, vaddr_of(NMAPPINGS + 2), &iova),
+	   "unmap is deferred");
+
+	/* the queue is full; adjacent ranges are only merged with ranges of the same kind */
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS), NULL);
+
+	ok(nunmaps == 2 && nputs == 2, "full queue is flushed and coalesced");
+
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS - 1), NULL);
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS - 2), NULL);
+
+	ok(nunmaps == 2, "unmap is deferred again");
+	ok(iommu_flush_unmap(&ctx) == 0 && nunmaps == 3 && unmap_iova == iova_of(NMAPPINGS - 1) &&
+	   unmap_len == 2 * MAPPING_LEN, "flush coalesces adjacent ranges");
+	ok(iommu_flush_unmap(&ctx) == 0 && nunmaps == 3, "flush of empty queue");
+
+	ok(iommu_set_deferred_unmap(&ctx, 0) == 0, "disable deferred unmap");
+
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS - 3), NULL);
+
+	ok(nunmaps == 4, "unmap is immediate");
+
+	/* mapping cache with room for two buffers */
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 8), MAPPING_LEN, &iova) == -1 &&
+	   errno == EOPNOTSUPP, "map cache is disabled by default");
+
+	iommu_set_map_cache(&ctx, 2);
+
+	nmaps = nunmaps = 0;
+
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 8), MAPPING_LEN, &iovas[0]) == 0 &&
+	   iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 8), MAPPING_LEN, &iova) == 0 &&
+	   iova == iovas[0] && nmaps == 1, "map cache hit");
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 8) + 0x10, 0x10, &iova) == 0 &&
+	   iova == iovas[0] + 0x10 && nmaps == 1, "map cache hit within a cached buffer");
+
+	for (i = 0; i < 3; i++)
+		iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 8));
+
+	ok(iommu_map_cache_get(&ctx, vaddr_of(0), MAPPING_LEN, &iova) == 0 &&
+	   iova == iova_of(0) && ctx.map_cache.nentries == 1, "existing mapping is not cached");
+
+	iommu_map_cache_put(&ctx, vaddr_of(0));
+
+	iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 9), MAPPING_LEN, &iova);
+	iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 9));
+	iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 8), MAPPING_LEN, &iova);
+	iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 8));
+	iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 10), MAPPING_LEN, &iova);
+	iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 10));
+
+	ok(nmaps == 3 && nunmaps == 1 &&
+	   !iommu_translate_vaddr(&ctx, vaddr_of(NMAPPINGS + 9), &iova) &&
+	   iommu_translate_vaddr(&ctx, vaddr_of(NMAPPINGS + 8), &iova),
+	   "least recently used mapping is evicted");
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 8), 2 * MAPPING_LEN, &iova) == 0 &&
+	   nmaps == 4 && nunmaps == 2, "map cache miss on larger buffer");
+
+	iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 8));
+	iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS + 10), NULL);
+
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 10), MAPPING_LEN, &iova) == 0 &&
+	   nmaps == 5 && nunmaps == 3, "map cache miss on removed mapping");
+
+	iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 10));
+	iommu_map_cache_invalidate(&ctx, vaddr_of(NMAPPINGS + 8) + MAPPING_LEN, 0x1000);
+
+	ok(nunmaps == 4 && ctx.map_cache.nentries == 1 &&
+	   !iommu_translate_vaddr(&ctx, vaddr_of(NMAPPINGS + 8), &iova), "invalidate");
+
+	/* mappings in use are not evicted */
+	iommu_set_map_cache(&ctx, 1);
+
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 10), MAPPING_LEN, &iova) == 0 &&
+	   iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 9), MAPPING_LEN, &iova) == -1 &&
+	   errno == EBUSY && nunmaps == 4, "map cache full of mappings in use");
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 10), 2 * MAPPING_LEN, &iova) == -1 &&
+	   errno == EBUSY && nunmaps == 4, "mapping in use is not replaced");
+
+	iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 10));
+
+	ok(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 9), MAPPING_LEN, &iova) == 0 &&
+	   nunmaps == 5 && !iommu_translate_vaddr(&ctx, vaddr_of(NMAPPINGS + 10), &iova),
+	   "put mapping is evicted");
+
+	iommu_set_map_cache(&ctx, 0);
+
+	ok(nunmaps == 5 && ctx.map_cache.nentries == 1 &&
+	   iommu_translate_vaddr(&ctx, vaddr_of(NMAPPINGS + 9), &iova),
+	   "disable map cache keeps mappings in use");
+
+	iommu_map_cache_put(&ctx, vaddr_of(NMAPPINGS + 9));
+
+	ok(nunmaps == 6 && ctx.map_cache.nentries == 0 &&
+	   !iommu_translate_vaddr(&ctx, vaddr_of(NMAPPINGS + 9), &iova), "disable map cache");
+
+	/* same iova allocations */
+	ctx.iova_max = IOMMU_MAX_SAME_IOVA;
+	iommu_init_next_same(&ctx);
+
+	nmaps = nunmaps = 0;
+
+	same[0] = iommu_alloc_same_iova(&ctx, 3 * PAGE);
+	same[1] = iommu_alloc_same_iova(&ctx, PAGE);
+
+	ok(same[0] && iommu_translate_vaddr(&ctx, same[0], &iova) && iova == same_iova(same[0]) &&
+	   same[1] == same[0] + 3 * PAGE && nmaps == 2, "alloc same iova");
+	ok(iommu_free_same_iova(&ctx, same[0]) == 0 && nunmaps == 1 &&
+	   !iommu_translate_vaddr(&ctx, same[0], &iova), "free same iova");
+	ok(iommu_alloc_same_iova(&ctx, 2 * PAGE) == same[0] &&
+	   iommu_alloc_same_iova(&ctx, PAGE) == same[0] + 2 * PAGE, "released space is reused");
+
+	same[2] = iommu_alloc_same_iova_flags(&ctx, PAGE, PGMAP_THP);
+
+	ok(same[2] && ALIGNED((uintptr_t)same[2], 1ULL << 21) &&
+	   iommu_translate_vaddr(&ctx, same[2] + (1ULL << 21) - 1, &iova) &&
+	   btree_find(&ctx.same_iova.free.ranges, same_iova(same[1]) + PAGE),
+	   "alloc huge same iova keeps the alignment padding");
+	ok(iommu_alloc_same_iova(&ctx, PAGE) == same[1] + PAGE,
+	   "alignment padding is reused");
+	ok(iommu_free_same_iova(&ctx, same[0] + PAGE) == -1 && errno == ENOENT,
+	   "free unknown same iova fails");
+
+	iommu_set_same_iova_pool(&ctx, 4 * PAGE);
+
+	nmaps = nunmaps = 0;
+
+	ok(iommu_free_same_iova(&ctx, same[1]) == 0 && nunmaps == 0 &&
+	   ctx.same_iova.pooled == PAGE && iommu_alloc_same_iova(&ctx, PAGE) == same[1] &&
+	   nmaps == 0 && ctx.same_iova.pooled == 0, "pooled buffer is reused");
+
+	iommu_free_same_iova(&ctx, same[1]);
+	iommu_free_same_iova(&ctx, same[2]);
+
+	ok(nunmaps == 1 && ctx.same_iova.pooled == PAGE, "pool is bounded");
+
+	/* mirror mappings into another context */
+	iova_map_init(&ctx2.map);
+	ctx2.ops = ctx.ops;
+
+	ok(iommu_mirror_vaddr(&ctx2, &ctx, vaddr_of(1) + 0x10, &iova) == -1 && errno == EOPNOTSUPP,
+	   "mirror requires copy support");
+
+	ctx.ops.dma_copy = ctx2.ops.dma_copy = __dma_copy;
+
+	ok(iommu_mirror_vaddr(&ctx2, &ctx, vaddr_of(1) + 0x10, &iova) == 0 &&
+	   iova == iova_of(1) + 0x10 && ncopies == 1, "mirror");
+	ok(iommu_translate_vaddr(&ctx2, vaddr_of(1) + MAPPING_LEN - 1, &iova) &&
+	   iova == iova_of(1) + MAPPING_LEN - 1, "mirror maps the entire mapping");
+	ok(iommu_mirror_vaddr(&ctx2, &ctx, vaddr_of(1), &iova) == 0 && iova == iova_of(1) &&
+	   ncopies == 1, "mirror is idempotent");
+	ok(iommu_mirror_vaddr(&ctx2, &ctx, vaddr_of(1) + MAPPING_LEN, &iova) == -1 &&
+	   errno == ENOENT, "mirror unmapped vaddr fails");
+
+	/* file mappings; first through the mmap fallback */
+	fd = memfd_create("dma_test", 0);
+	assert(fd >= 0 && ftruncate(fd, 4 * MAPPING_LEN) == 0);
+
+	nmaps = nunmaps = 0;
+
+	ok(iommu_map_fd(&ctx, fd, MAPPING_LEN, MAPPING_LEN, &iovas[0], 0x0) == 0 && nmaps == 1 &&
+	   iommu_translate_iova(&ctx, iovas[0], &vaddr) == MAPPING_LEN, "map fd (mmap fallback)");
+	ok(iommu_unmap_fd(&ctx, iovas[0], &len) == 0 && len == MAPPING_LEN && nunmaps == 1 &&
+	   iommu_translate_iova(&ctx, iovas[0], &vaddr) == -1, "unmap fd (mmap fallback)");
+	ok(iommu_unmap_fd(&ctx, iovas[0], NULL) == -1 && errno == ENOENT, "unmap unknown fd mapping");
+
+	ctx.ops.dma_map_fd = __dma_map_fd;
+
+	ok(iommu_map_fd(&ctx, fd, 0, MAPPING_LEN, &iovas[0], 0x0) == 0 && nmaps == 1 &&
+	   iommu_translate_iova(&ctx, iovas[0], &vaddr) == -1, "map fd");
+	ok(iommu_unmap_fd(&ctx, iovas[0], NULL) == 0 && nunmaps == 2 && unmap_iova == iovas[0],
+	   "unmap fd");
+
+	map_fd_errno = ENOTTY;
+
+	ok(iommu_map_fd(&ctx, fd, 0, MAPPING_LEN, &iovas[0], 0x0) == 0 && nmaps == 2,
+	   "map fd falls back if unsupported by the kernel");
+
+	map_fd_errno = ENOMEM;
+
+	ok(iommu_map_fd(&ctx, fd, 0, MAPPING_LEN, &iovas[1], 0x0) == -1 && errno == ENOMEM &&
+	   nmaps == 2, "map fd fails");
+
+	close(fd);
+
+	/* failed mappings return their iova */
+	ctx.ops.iova_reserve = __iova_reserve;
+	ctx.ops.iova_reserve_align = __iova_reserve_align;
+	ctx.ops.iova_put = __iova_put;
+
+	nreserved = nputs = 0;
+	map_fails = 1;
+
+	ok(iommu_map_vaddr(&ctx, vaddr_of(NMAPPINGS), MAPPING_LEN, &iova, 0x0) == -1 &&
+	   nreserved == 0, "failed map returns the iova");
+
+	map_fails = 1;
+
+	ok(iommu_map_vaddr(&ctx, vaddr_of(NMAPPINGS), MAPPING_LEN, &iova,
+			   IOMMU_MAP_EPHEMERAL) == -1 && nreserved == 0 && nputs == 1,
+	   "failed ephemeral map returns the iova");
+
+	map_fails = 1;
+
+	ok(iommu_map_vaddr_align(&ctx, vaddr_of(NMAPPINGS), MAPPING_LEN, MAPPING_LEN, &iova,
+				 0x0) == -1 && nreserved == 0, "failed aligned map returns the iova");
+
+	/* with a deferred unmap pending, the map is retried after flushing the queue */
+	ok(iommu_set_deferred_unmap(&ctx, 4) == 0 &&
+	   iommu_map_vaddr(&ctx, vaddr_of(NMAPPINGS), MAPPING_LEN, &iova, 0x0) == 0 &&
+	   iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS), NULL) == 0, "defer an unmap");
+
+	nreserved = 0;
+	map_fails = 1;
+
+	ok(iommu_map_vaddr_align(&ctx, vaddr_of(NMAPPINGS), MAPPING_LEN, MAPPING_LEN, &iova,
+				 0x0) == 0 && nreserved == 1 && ALIGNED(iova, MAPPING_LEN) &&
+	   iommu_set_deferred_unmap(&ctx, 0) == 0,
+	   "aligned map is retried after flushing deferred unmaps");
+
+	iommu_unmap_all(&ctx);
+
+	ok(!iommu_translate_vaddr(&ctx, vaddr_of(0), &iova) &&
+	   iommu_translate_iova(&ctx, iova_of(0), &vaddr) == -1 &&
+	   !ctx.fd_maps.maps.root && !ctx.same_iova.pooled, "unmap all");
+
+	/* the translation cached by this thread must not outlive the map */
+	assert(iommu_map_vaddr(&ctx2, vaddr_of(2), MAPPING_LEN, &iova, 0x0) == 0 &&
+	       iommu_translate_vaddr(&ctx2, vaddr_of(2), &iova));
+
+	iova_map_destroy(&ctx2.map);
+	iova_map_init(&ctx2.map);
+
+	ok(!iommu_translate_vaddr(&ctx2, vaddr_of(2), &iova) && !ctx2.map.free &&
+	   !ctx2.map.iovas.root, "destroyed map");
+
+	iommu_set_map_cache(&ctx, 1);
+	assert(iommu_map_cache_get(&ctx, vaddr_of(NMAPPINGS + 8), MAPPING_LEN, &iova) == 0);
+
+	iommu_map_cache_destroy(&ctx);
+
+	ok(!ctx.map_cache.nentries && !ctx.map_cache.entries.root &&
+	   !ctx.map_cache.entries.free, "destroyed map cache");
+
+	assert(iommu_set_deferred_unmap(&ctx, 4) == 0 &&
+	       iommu_map_vaddr(&ctx, vaddr_of(NMAPPINGS), MAPPING_LEN, &iova, 0x0) == 0 &&
+	       iommu_unmap_vaddr(&ctx, vaddr_of(NMAPPINGS), NULL) == 0);
+
+	nunmaps = 0;
+
+	iommu_unmapq_destroy(&ctx);
+
+	ok(nunmaps == 1 && !ctx.unmapq.ranges && !ctx.unmapq.threshold,
+	   "destroyed unmap queue flushes pending unmaps");
+
+	iommu_set_same_iova_pool(&ctx, 4 * PAGE);
+
+	same[0] = iommu_alloc_same_iova(&ctx, PAGE);
+	same[1] = iommu_alloc_same_iova(&ctx, 2 * PAGE);
+	assert(same[0] && same[1] && iommu_free_same_iova(&ctx, same[1]) == 0);
+
+	iommu_same_iova_destroy(&ctx);
+
+	ok(!ctx.same_iova.pooled && !ctx.same_iova.bufs.root && !ctx.same_iova.bufs.free &&
+	   !ctx.same_iova.pool.root && !ctx.same_iova.pool.free &&
+	   !ctx.same_iova.free.ranges.root, "destroyed same iova allocator");
+
+	pgunmap(same[0], PAGE);
+
+	fd = memfd_create("dma_test", 0);
+	assert(fd >= 0 && ftruncate(fd, MAPPING_LEN) == 0);
+
+	map_fd_errno = 0;
+	assert(iommu_map_fd(&ctx, fd, 0, MAPPING_LEN, &iovas[0], 0x0) == 0);
+
+	nunmaps = 0;
+
+	iommu_fd_maps_destroy(&ctx);
+
+	ok(nunmaps == 0 && !ctx.fd_maps.maps.root && !ctx.fd_maps.maps.free,
+	   "destroyed fd mappings");
+
+	close(fd);
+
+	return exit_status();
+}
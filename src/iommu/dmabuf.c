@@ -10,6 +10,7 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include <errno.h>
 #include <string.h>
 
 #include <sys/types.h>
@@ -21,16 +22,39 @@
 
 #include <vfn/support.h>
 
+#define PGMAP_FLAGS_MASK (PGMAP_HUGE_MASK | PGMAP_PREFAULT | PGMAP_SHARED | PGMAP_NODE_MASK)
+
+static int __map(struct iommu_ctx *ctx, struct iommu_dmabuf *buffer, unsigned long flags,
+		 unsigned long pgflags)
+{
+	if (!(pgflags & PGMAP_HUGE_MASK) || (flags & (IOMMU_MAP_FIXED_IOVA | IOMMU_MAP_EPHEMERAL)))
+		return iommu_map_vaddr(ctx, buffer->vaddr, buffer->len, &buffer->iova, flags);
+
+	/* align the iova so that the iommu can use huge page table entries */
+	if (!iommu_map_vaddr_align(ctx, buffer->vaddr, buffer->len, pgmap_pagesize(pgflags),
+				   &buffer->iova, flags))
+		return 0;
+
+	if (errno != EOPNOTSUPP)
+		return -1;
+
+	return iommu_map_vaddr(ctx, buffer->vaddr, buffer->len, &buffer->iova, flags);
+}
+
 int iommu_get_dmabuf(struct iommu_ctx *ctx, struct iommu_dmabuf *buffer, size_t len,
 		     unsigned long flags)
 {
+	unsigned long pgflags = (flags >> IOMMU_DMABUF_PGMAP_SHIFT) & PGMAP_FLAGS_MASK;
+
+	flags &= ~((unsigned long)PGMAP_FLAGS_MASK << IOMMU_DMABUF_PGMAP_SHIFT);
+
 	buffer->ctx = ctx;
 
-	buffer->len = pgmap(&buffer->vaddr, len);
+	buffer->len = pgmapf(&buffer->vaddr, len, pgflags);
 	if (buffer->len < 0)
 		return -1;
 
-	if (iommu_map_vaddr(ctx, buffer->vaddr, buffer->len, &buffer->iova, flags)) {
+	if (__map(ctx, buffer, flags, pgflags)) {
 		pgunmap(buffer->vaddr, buffer->len);
 		return -1;
 	}
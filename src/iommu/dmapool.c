@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/dmapool: " fmt
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#include "ccan/list/list.h"
+#include "ccan/minmax/minmax.h"
+
+#include <vfn/iommu.h>
+
+#include <vfn/support/autoptr.h>
+#include <vfn/iommu/dmabuf.h>
+#include <vfn/iommu/dmapool.h>
+
+#include <vfn/support.h>
+
+/*
+ * The pool is carved into slabs on demand; each slab serves chunks of a single
+ * size class. Slabs are never returned, so the pool adapts to the first
+ * workload that uses it.
+ */
+#define DMAPOOL_MIN_SHIFT 6
+#define DMAPOOL_MAX_SHIFT 16
+#define DMAPOOL_NR_CLASSES (DMAPOOL_MAX_SHIFT - DMAPOOL_MIN_SHIFT + 1)
+
+#define DMAPOOL_SLAB_SHIFT DMAPOOL_MAX_SHIFT
+#define DMAPOOL_SLAB_SIZE (1ULL << DMAPOOL_SLAB_SHIFT)
+#define DMAPOOL_SLAB_UNUSED 0xff
+
+/*
+ * Per-thread cache limits (per size class). A refill moves at most a quarter of
+ * a slab to the cache, so a thread using a few large chunks does not strand a
+ * whole slab; a cache flushes a batch back to the pool when it holds more than
+ * two batches.
+ */
+#define DMAPOOL_TCACHE_BATCH 16
+
+/* overlaid on free chunks */
+struct dmapool_chunk {
+	struct dmapool_chunk *next;
+};
+
+struct dmapool_tcache {
+	struct iommu_dmapool *pool;
+	struct list_node list;
+
+	struct dmapool_chunk *chunks[DMAPOOL_NR_CLASSES];
+	unsigned int nchunks[DMAPOOL_NR_CLASSES];
+};
+
+struct iommu_dmapool {
+	struct iommu_dmabuf buf;
+
+	pthread_key_t key;
+
+	/* protects everything below */
+	pthread_mutex_t lock;
+
+	struct dmapool_chunk *chunks[DMAPOOL_NR_CLASSES];
+
+	uint8_t *slab_class;
+	size_t nslabs, next_slab;
+
+	struct list_head tcaches;
+};
+
+static inline unsigned int __class(size_t len)
+{
+	if (len <= (1 << DMAPOOL_MIN_SHIFT))
+		return 0;
+
+	return (unsigned int)(64 - __builtin_clzll(len - 1)) - DMAPOOL_MIN_SHIFT;
+}
+
+static inline size_t __class_size(unsigned int class)
+{
+	return (size_t)1 << (class + DMAPOOL_MIN_SHIFT);
+}
+
+static inline unsigned int __batch(unsigned int class)
+{
+	size_t n = (DMAPOOL_SLAB_SIZE / __class_size(class)) / 4;
+
+	return (unsigned int)clamp_t(size_t, n, 1, DMAPOOL_TCACHE_BATCH);
+}
+
+static inline bool __in_pool(struct iommu_dmapool *pool, void *vaddr)
+{
+	return vaddr >= pool->buf.vaddr && vaddr < pool->buf.vaddr + pool->buf.len;
+}
+
+static inline void __push(struct dmapool_chunk **head, struct dmapool_chunk *chunk)
+{
+	chunk->next = *head;
+	*head = chunk;
+}
+
+static inline struct dmapool_chunk *__pop(struct dmapool_chunk **head)
+{
+	struct dmapool_chunk *chunk = *head;
+
+	if (chunk)
+		*head = chunk->next;
+
+	return chunk;
+}
+
+/* move up to n chunks of the given class from the pool to the cache */
+static unsigned int __refill(struct iommu_dmapool *pool, struct dmapool_tcache *tc,
+			     unsigned int class, unsigned int n)
+{
+	unsigned int i;
+
+	__autolock(&pool->lock);
+
+	if (!pool->chunks[class] && pool->next_slab < pool->nslabs) {
+		size_t slab = pool->next_slab++;
+		void *base = pool->buf.vaddr + (slab << DMAPOOL_SLAB_SHIFT);
+		size_t size = __class_size(class);
+
+		pool->slab_class[slab] = (uint8_t)class;
+
+		for (size_t off = DMAPOOL_SLAB_SIZE; off > 0; off -= size)
+			__push(&pool->chunks[class], base + off - size);
+	}
+
+	for (i = 0; i < n && pool->chunks[class]; i++)
+		__push(&tc->chunks[class], __pop(&pool->chunks[class]));
+
+	tc->nchunks[class] += i;
+
+	return i;
+}
+
+/* move n chunks of the given class from the cache back to the pool */
+static void __flush(struct iommu_dmapool *pool, struct dmapool_tcache *tc, unsigned int class,
+		    unsigned int n)
+{
+	__autolock(&pool->lock);
+
+	for (unsigned int i = 0; i < n; i++)
+		__push(&pool->chunks[class], __pop(&tc->chunks[class]));
+
+	tc->nchunks[class] -= n;
+}
+
+static void __tcache_release(void *p)
+{
+	struct dmapool_tcache *tc = p;
+	struct iommu_dmapool *pool = tc->pool;
+
+	for (unsigned int class = 0; class < DMAPOOL_NR_CLASSES; class++)
+		__flush(pool, tc, class, tc->nchunks[class]);
+
+	{
+		__autolock(&pool->lock);
+
+		list_del(&tc->list);
+	}
+
+	free(tc);
+}
+
+static struct dmapool_tcache *__tcache(struct iommu_dmapool *pool)
+{
+	struct dmapool_tcache *tc = pthread_getspecific(pool->key);
+
+	if (likely(tc))
+		return tc;
+
+	tc = znew_t(struct dmapool_tcache, 1);
+	tc->pool = pool;
+
+	if (pthread_setspecific(pool->key, tc)) {
+		free(tc);
+		return NULL;
+	}
+
+	{
+		__autolock(&pool->lock);
+
+		list_add_tail(&pool->tcaches, &tc->list);
+	}
+
+	return tc;
+}
+
+struct iommu_dmapool *iommu_dmapool_create(struct iommu_ctx *ctx, size_t len,
+					   unsigned long flags)
+{
+	struct iommu_dmapool *pool;
+	int err;
+
+	pool = znew_t(struct iommu_dmapool, 1);
+
+	err = pthread_key_create(&pool->key, __tcache_release);
+	if (err) {
+		free(pool);
+
+		errno = err;
+		return NULL;
+	}
+
+	if (iommu_get_dmabuf(ctx, &pool->buf, ALIGN_UP(len, DMAPOOL_SLAB_SIZE), flags)) {
+		pthread_key_delete(pool->key);
+		free(pool);
+
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	list_head_init(&pool->tcaches);
+
+	pool->nslabs = (size_t)pool->buf.len >> DMAPOOL_SLAB_SHIFT;
+	pool->slab_class = xmalloc(pool->nslabs);
+
+	memset(pool->slab_class, DMAPOOL_SLAB_UNUSED, pool->nslabs);
+
+	return pool;
+}
+
+static void __dmapool_free(struct iommu_dmapool *pool)
+{
+	struct dmapool_tcache *tc, *next;
+
+	pthread_key_delete(pool->key);
+
+	list_for_each_safe(&pool->tcaches, tc, next, list)
+		free(tc);
+
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->slab_class);
+	free(pool);
+}
+
+void iommu_dmapool_destroy(struct iommu_dmapool *pool)
+{
+	if (!pool)
+		return;
+
+	iommu_put_dmabuf(&pool->buf);
+
+	__dmapool_free(pool);
+}
+
+void iommu_dmapool_forget(struct iommu_dmapool *pool)
+{
+	if (!pool)
+		return;
+
+	/* the iommu mapping belongs to the process that created the pool */
+	pgunmap(pool->buf.vaddr, (size_t)pool->buf.len);
+
+	__dmapool_free(pool);
+}
+
+void *iommu_dmapool_alloc(struct iommu_dmapool *pool, size_t len, iova_t *iova)
+{
+	struct dmapool_tcache *tc;
+	struct dmapool_chunk *chunk;
+	unsigned int class;
+
+	if (!len || len > IOMMU_DMAPOOL_MAX_CHUNK) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tc = __tcache(pool);
+	if (!tc)
+		return NULL;
+
+	class = __class(len);
+
+	if (!tc->chunks[class] && !__refill(pool, tc, class, __batch(class))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	chunk = __pop(&tc->chunks[class]);
+	tc->nchunks[class]--;
+
+	if (iova)
+		*iova = pool->buf.iova + (uint64_t)((void *)chunk - pool->buf.vaddr);
+
+	return chunk;
+}
+
+void iommu_dmapool_free(struct iommu_dmapool *pool, void *vaddr)
+{
+	struct dmapool_tcache *tc;
+	size_t slab;
+	unsigned int class;
+
+	if (!vaddr)
+		return;
+
+	log_fatal_if(!__in_pool(pool, vaddr), "chunk %p does not belong to the pool\n", vaddr);
+
+	slab = (size_t)(vaddr - pool->buf.vaddr) >> DMAPOOL_SLAB_SHIFT;
+	class = pool->slab_class[slab];
+
+	log_fatal_if(class == DMAPOOL_SLAB_UNUSED, "chunk %p was never allocated\n", vaddr);
+
+	tc = __tcache(pool);
+	log_fatal_if(!tc, "could not allocate per-thread cache\n");
+
+	__push(&tc->chunks[class], vaddr);
+
+	if (++tc->nchunks[class] > 2 * __batch(class))
+		__flush(pool, tc, class, __batch(class));
+}
+
+int iommu_dmapool_get(struct iommu_dmapool *pool, struct iommu_dmachunk *chunk, size_t len)
+{
+	struct iommu_dmabuf buf;
+
+	chunk->pool = pool;
+
+	chunk->vaddr = iommu_dmapool_alloc(pool, len, &chunk->iova);
+	if (chunk->vaddr) {
+		chunk->len = __class_size(__class(len));
+
+		memset(chunk->vaddr, 0x0, chunk->len);
+
+		return 0;
+	}
+
+	if (errno != ENOMEM)
+		return -1;
+
+	/* the pool is exhausted (or stranded in other threads' caches) */
+	if (iommu_get_dmabuf(pool->buf.ctx, &buf, len, IOMMU_MAP_EPHEMERAL))
+		return -1;
+
+	chunk->vaddr = buf.vaddr;
+	chunk->iova = buf.iova;
+	chunk->len = (size_t)buf.len;
+
+	return 0;
+}
+
+void iommu_dmapool_put(struct iommu_dmachunk *chunk)
+{
+	if (!chunk->vaddr)
+		return;
+
+	if (__in_pool(chunk->pool, chunk->vaddr)) {
+		iommu_dmapool_free(chunk->pool, chunk->vaddr);
+	} else {
+		struct iommu_dmabuf buf = {
+			.ctx = chunk->pool->buf.ctx,
+			.vaddr = chunk->vaddr,
+			.iova = chunk->iova,
+			.len = (ssize_t)chunk->len,
+		};
+
+		iommu_put_dmabuf(&buf);
+	}
+
+	memset(chunk, 0x0, sizeof(*chunk));
+}
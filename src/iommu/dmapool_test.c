@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/tap/tap.h"
+
+#include "dmapool.c"
+
+#define POOL_SIZE (8 * DMAPOOL_SLAB_SIZE)
+#define IOVA_BASE 0x100000000ULL
+
+#define NTHREADS 4
+#define NALLOCS 64
+#define ROUNDS 1000
+
+/* the size of the controller pool */
+#define SMALL_POOL_SLABS 4
+#define SMALL_POOL_THREADS (SMALL_POOL_SLABS + 1)
+
+int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer, size_t len,
+		     unsigned long flags UNUSED)
+{
+	buffer->len = pgmap(&buffer->vaddr, len);
+	if (buffer->len < 0)
+		return -1;
+
+	buffer->iova = IOVA_BASE;
+
+	return 0;
+}
+
+static int nputs;
+
+void iommu_put_dmabuf(struct iommu_dmabuf *buffer)
+{
+	nputs++;
+
+	pgunmap(buffer->vaddr, buffer->len);
+}
+
+static struct iommu_dmapool *pool;
+
+static pthread_barrier_t barrier;
+
+/* get and put a page and keep the thread (and its cache) alive until all did */
+static void *getter(void *opaque UNUSED)
+{
+	int ret;
+
+	{
+		__autovar_s(iommu_dmachunk) chunk = {};
+
+		ret = iommu_dmapool_get(pool, &chunk, 4096);
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	return ret ? (void *)1 : NULL;
+}
+
+/* each thread stamps its chunks and checks that nobody else overwrote them */
+static void *worker(void *opaque)
+{
+	uintptr_t id = (uintptr_t)opaque;
+	void *chunks[NALLOCS];
+
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < NALLOCS; i++) {
+			chunks[i] = iommu_dmapool_alloc(pool, 64 << (i % 4), NULL);
+			if (!chunks[i])
+				return (void *)1;
+
+			*(uintptr_t *)chunks[i] = id;
+		}
+
+		for (int i = 0; i < NALLOCS; i++) {
+			if (*(uintptr_t *)chunks[i] != id)
+				return (void *)1;
+
+			iommu_dmapool_free(pool, chunks[i]);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	pthread_t threads[max_t(int, NTHREADS, SMALL_POOL_THREADS)];
+	bool aligned = true, distinct = true, threaded = true;
+	void *chunks[DMAPOOL_SLAB_SIZE / 4096], *vaddr;
+	iova_t iova;
+	int i, n;
+
+	plan_tests(17);
+
+	pool = iommu_dmapool_create(NULL, POOL_SIZE, 0x0);
+	ok(pool && pool->nslabs == POOL_SIZE / DMAPOOL_SLAB_SIZE, "create");
+
+	vaddr = iommu_dmapool_alloc(pool, 100, &iova);
+	ok(vaddr && iova == IOVA_BASE + (uint64_t)(vaddr - pool->buf.vaddr),
+	   "alloc precomputes iova");
+	ok(ALIGNED((uintptr_t)vaddr, 128), "chunks are aligned to their size");
+
+	iommu_dmapool_free(pool, vaddr);
+	ok(iommu_dmapool_alloc(pool, 128, NULL) == vaddr, "free reuses chunk");
+	iommu_dmapool_free(pool, vaddr);
+
+	ok(!iommu_dmapool_alloc(pool, 0, NULL) && errno == EINVAL, "alloc zero fails");
+	ok(!iommu_dmapool_alloc(pool, IOMMU_DMAPOOL_MAX_CHUNK + 1, NULL) && errno == EINVAL,
+	   "alloc too large fails");
+
+	/* a slab worth of pages */
+	for (i = 0; i < (int)ARRAY_SIZE(chunks); i++) {
+		chunks[i] = iommu_dmapool_alloc(pool, 4096, NULL);
+		if (!chunks[i] || !ALIGNED((uintptr_t)chunks[i], 4096))
+			aligned = false;
+
+		for (int j = 0; j < i; j++) {
+			if (chunks[j] == chunks[i])
+				distinct = false;
+		}
+	}
+
+	ok(aligned, "page chunks are page aligned");
+	ok(distinct, "chunks are distinct");
+
+	for (i = 0; i < (int)ARRAY_SIZE(chunks); i++)
+		iommu_dmapool_free(pool, chunks[i]);
+
+	for (i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)(i + 1));
+
+	for (i = 0; i < NTHREADS; i++) {
+		void *ret;
+
+		pthread_join(threads[i], &ret);
+		if (ret)
+			threaded = false;
+	}
+
+	ok(threaded, "concurrent alloc and free");
+
+	{
+		__autovar_s(iommu_dmachunk) chunk = {};
+
+		ok(iommu_dmapool_get(pool, &chunk, 512) == 0 && chunk.len == 512 &&
+		   chunk.iova == IOVA_BASE + (uint64_t)(chunk.vaddr - pool->buf.vaddr), "get");
+
+		iommu_dmapool_put(&chunk);
+		ok(chunk.vaddr == NULL, "put");
+	}
+
+	/* five slabs have been assigned to smaller classes by now */
+	for (n = 0; iommu_dmapool_alloc(pool, IOMMU_DMAPOOL_MAX_CHUNK, NULL); n++)
+		;
+
+	ok(n == (int)pool->nslabs - 5 && errno == ENOMEM, "alloc fails when exhausted");
+
+	{
+		__autovar_s(iommu_dmachunk) chunk = {};
+
+		ok(iommu_dmapool_get(pool, &chunk, IOMMU_DMAPOOL_MAX_CHUNK) == 0 &&
+		   !__in_pool(pool, chunk.vaddr) && chunk.len == IOMMU_DMAPOOL_MAX_CHUNK,
+		   "get falls back to an ephemeral buffer when exhausted");
+
+		iommu_dmapool_put(&chunk);
+		ok(chunk.vaddr == NULL, "put ephemeral buffer");
+	}
+
+	iommu_dmapool_destroy(pool);
+
+	/* more threads than slabs, all holding on to their caches */
+	pool = iommu_dmapool_create(NULL, SMALL_POOL_SLABS * DMAPOOL_SLAB_SIZE, 0x0);
+
+	vaddr = iommu_dmapool_alloc(pool, 4096, NULL);
+	ok(vaddr && pool->chunks[__class(4096)], "refill does not take a whole slab");
+	iommu_dmapool_free(pool, vaddr);
+
+	pthread_barrier_init(&barrier, NULL, SMALL_POOL_THREADS);
+
+	for (i = 0; i < SMALL_POOL_THREADS; i++)
+		pthread_create(&threads[i], NULL, getter, NULL);
+
+	threaded = true;
+
+	for (i = 0; i < SMALL_POOL_THREADS; i++) {
+		void *ret;
+
+		pthread_join(threads[i], &ret);
+		if (ret)
+			threaded = false;
+	}
+
+	ok(threaded && pool->next_slab < pool->nslabs, "more threads than slabs share slabs");
+
+	pthread_barrier_destroy(&barrier);
+
+	iommu_dmapool_destroy(pool);
+
+	/* an inherited pool is released without touching the iommu mapping */
+	pool = iommu_dmapool_create(NULL, DMAPOOL_SLAB_SIZE, 0x0);
+	nputs = 0;
+
+	iommu_dmapool_free(pool, iommu_dmapool_alloc(pool, 64, NULL));
+	iommu_dmapool_forget(pool);
+
+	ok(nputs == 0, "forget does not unmap");
+
+	return exit_status();
+}
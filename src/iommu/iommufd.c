@@ -214,7 +214,8 @@ close_dev:
 
 static void iommu_ioas_destroy(struct iommu_ioas *ioas)
 {
-	free(ioas->ctx.iova_ranges);
+	iommu_ctx_destroy(&ioas->ctx);
+
 	free(ioas->name);
 	free(ioas);
 }
@@ -300,6 +301,95 @@ static int iommu_ioas_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_t len,
 	return 0;
 }
 
+#ifdef HAVE_IOMMU_IOAS_MAP_FILE
+static int iommu_ioas_do_dma_map_fd(struct iommu_ctx *ctx, int fd, off_t offset, size_t len,
+				    iova_t *iova, unsigned long flags)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+
+	struct iommu_ioas_map_file map = {
+		.size = sizeof(map),
+		.flags = IOMMU_IOAS_MAP_READABLE | IOMMU_IOAS_MAP_WRITEABLE,
+		.ioas_id = ioas->id,
+		.fd = fd,
+		.start = (uint64_t)offset,
+		.length = len,
+	};
+
+	if (flags & IOMMU_MAP_FIXED_IOVA) {
+		map.flags |= IOMMU_IOAS_MAP_FIXED_IOVA;
+		map.iova = (uint64_t)*iova;
+	}
+
+	if (flags & IOMMU_MAP_NOWRITE)
+		map.flags &= ~IOMMU_IOAS_MAP_WRITEABLE;
+
+	if (flags & IOMMU_MAP_NOREAD)
+		map.flags &= ~IOMMU_IOAS_MAP_READABLE;
+
+	trace_guard(IOMMUFD_IOAS_MAP_FILE) {
+		if (flags & IOMMU_MAP_FIXED_IOVA)
+			trace_emit("fd %d offset %jd iova 0x%" PRIx64 " len %zu\n", fd,
+				   (intmax_t)offset, *iova, len);
+		else
+			trace_emit("fd %d offset %jd iova AUTO len %zu\n", fd, (intmax_t)offset,
+				   len);
+	}
+
+	if (ioctl(__iommufd, IOMMU_IOAS_MAP_FILE, &map)) {
+		log_debug("failed to map file\n");
+		return -1;
+	}
+
+	if (flags & IOMMU_MAP_FIXED_IOVA)
+		return 0;
+
+	*iova = (iova_t)map.iova;
+
+	trace_guard(IOMMUFD_IOAS_MAP_FILE) {
+		trace_emit("allocated iova 0x%" PRIx64 "\n", *iova);
+	}
+
+	return 0;
+}
+#endif
+
+static int iommu_ioas_do_dma_copy(struct iommu_ctx *dst, struct iommu_ctx *src, iova_t iova,
+				  size_t len, unsigned long flags)
+{
+	struct iommu_ioas *dst_ioas = container_of_var(dst, dst_ioas, ctx);
+	struct iommu_ioas *src_ioas = container_of_var(src, src_ioas, ctx);
+
+	struct iommu_ioas_copy copy = {
+		.size = sizeof(copy),
+		.flags = IOMMU_IOAS_MAP_FIXED_IOVA | IOMMU_IOAS_MAP_READABLE |
+			IOMMU_IOAS_MAP_WRITEABLE,
+		.dst_ioas_id = dst_ioas->id,
+		.src_ioas_id = src_ioas->id,
+		.length = len,
+		.dst_iova = (uint64_t)iova,
+		.src_iova = (uint64_t)iova,
+	};
+
+	if (flags & IOMMU_MAP_NOWRITE)
+		copy.flags &= ~IOMMU_IOAS_MAP_WRITEABLE;
+
+	if (flags & IOMMU_MAP_NOREAD)
+		copy.flags &= ~IOMMU_IOAS_MAP_READABLE;
+
+	trace_guard(IOMMUFD_IOAS_COPY_DMA) {
+		trace_emit("ioas %" PRIu32 " -> %" PRIu32 " iova 0x%" PRIx64 " len %zu\n",
+			   src_ioas->id, dst_ioas->id, iova, len);
+	}
+
+	if (ioctl(__iommufd, IOMMU_IOAS_COPY, &copy)) {
+		log_debug("failed to copy mapping\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int iommu_ioas_do_dma_unmap(struct iommu_ctx *ctx, iova_t iova, size_t len)
 {
 	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
@@ -335,6 +425,10 @@ static const struct iommu_ctx_ops iommufd_ops = {
 	.dma_map = iommu_ioas_do_dma_map,
 	.dma_unmap = iommu_ioas_do_dma_unmap,
 	.dma_unmap_all = iommu_ioas_do_dma_unmap_all,
+#ifdef HAVE_IOMMU_IOAS_MAP_FILE
+	.dma_map_fd = iommu_ioas_do_dma_map_fd,
+#endif
+	.dma_copy = iommu_ioas_do_dma_copy,
 };
 
 static int iommu_ioas_init(struct iommu_ioas *ioas)
@@ -435,6 +529,7 @@ struct iommu_ctx *iommufd_get_iommu_context(const char *name)
 		log_fatal_if(iommufd_open(), "could not open /dev/iommu\n");
 
 	if (iommu_ioas_init(ioas) < 0) {
+		iommu_ctx_destroy(&ioas->ctx);
 		free(ioas);
 		return NULL;
 	}
@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "iova_alloc.h"
+
+/*
+ * The number of free ranges that iova_allocator_get_align() inspects looking
+ * for the best aligned fit before settling for the first range that is large
+ * enough to fit regardless of its alignment.
+ */
+#define IOVA_ALLOC_ALIGN_SCAN 32
+
+void iova_allocator_init(struct iova_allocator *a)
+{
+	btree_init(&a->ranges);
+	btree_init(&a->sizes);
+}
+
+static void __link(struct iova_allocator *a, struct iova_free_range *r)
+{
+	struct iova_size_class *c = btree_find(&a->sizes, r->len);
+
+	if (!c) {
+		c = znew_t(struct iova_size_class, 1);
+		c->len = r->len;
+		list_head_init(&c->ranges);
+
+		if (btree_insert(&a->sizes, c->len, c)) {
+			log_debug("failed to insert size class\n");
+			free(c);
+			free(r);
+			return;
+		}
+	}
+
+	if (btree_insert(&a->ranges, r->start, r)) {
+		log_debug("failed to insert free iova range 0x%"PRIx64"\n", r->start);
+
+		if (list_empty(&c->ranges)) {
+			btree_remove(&a->sizes, c->len);
+			free(c);
+		}
+
+		free(r);
+		return;
+	}
+
+	list_add(&c->ranges, &r->list);
+}
+
+static void __unlink(struct iova_allocator *a, struct iova_free_range *r)
+{
+	struct iova_size_class *c;
+
+	btree_remove(&a->ranges, r->start);
+
+	list_del(&r->list);
+
+	/* drop the size class with its last range */
+	c = btree_find(&a->sizes, r->len);
+	if (c && list_empty(&c->ranges)) {
+		btree_remove(&a->sizes, c->len);
+		free(c);
+	}
+}
+
+static struct iova_free_range *__range_new(iova_t start, uint64_t len)
+{
+	struct iova_free_range *r = znew_t(struct iova_free_range, 1);
+
+	r->start = start;
+	r->len = len;
+
+	return r;
+}
+
+bool iova_allocator_get(struct iova_allocator *a, size_t len, iova_t *iova)
+{
+	struct iova_size_class *c;
+	struct iova_free_range *r;
+
+	/* the smallest size class that fits is the best fit */
+	c = btree_find_ge(&a->sizes, len);
+	if (!c)
+		return false;
+
+	r = list_top(&c->ranges, struct iova_free_range, list);
+
+	*iova = r->start;
+
+	__unlink(a, r);
+
+	if (r->len == len) {
+		free(r);
+		return true;
+	}
+
+	r->start += len;
+	r->len -= len;
+
+	__link(a, r);
+
+	return true;
+}
+
+/* returns the number of usable bytes in r after aligning its start */
+static inline uint64_t __avail_aligned(struct iova_free_range *r, size_t align,
+				       iova_t *aligned)
+{
+	*aligned = ALIGN_UP(r->start, align);
+
+	/* overflow or the alignment eats the entire range */
+	if (*aligned < r->start || *aligned - r->start >= r->len)
+		return 0;
+
+	return r->len - (*aligned - r->start);
+}
+
+bool iova_allocator_get_align(struct iova_allocator *a, size_t len, size_t align,
+			      iova_t *iova)
+{
+	struct iova_free_range *r, *best = NULL;
+	struct iova_size_class *c;
+	uint64_t avail, best_avail = UINT64_MAX, end;
+	iova_t aligned, best_aligned = 0;
+	unsigned int scanned = 0;
+
+	/*
+	 * Walk the size classes in ascending order, keeping the range with the
+	 * least usable space left after alignment. A size class of length L
+	 * cannot do better than L - (align - 1), so stop once that exceeds the
+	 * best fit found so far.
+	 */
+	for (c = btree_find_ge(&a->sizes, len); c; c = btree_find_ge(&a->sizes, c->len + 1)) {
+		if (c->len - min_t(uint64_t, c->len, align - 1) >= best_avail)
+			break;
+
+		list_for_each(&c->ranges, r, list) {
+			avail = __avail_aligned(r, align, &aligned);
+
+			if (avail >= len && avail < best_avail) {
+				best = r;
+				best_avail = avail;
+				best_aligned = aligned;
+
+				if (avail == len)
+					goto found;
+			}
+
+			if (++scanned == IOVA_ALLOC_ALIGN_SCAN)
+				goto fallback;
+		}
+
+		if (c->len == UINT64_MAX)
+			break;
+	}
+
+fallback:
+	if (best)
+		goto found;
+
+	/* any range of at least len + align - 1 fits regardless of its start */
+	if (len + align - 1 < len)
+		return false;
+
+	c = btree_find_ge(&a->sizes, len + align - 1);
+	if (!c)
+		return false;
+
+	best = list_top(&c->ranges, struct iova_free_range, list);
+	__avail_aligned(best, align, &best_aligned);
+
+found:
+	*iova = best_aligned;
+
+	end = best->start + best->len;
+
+	__unlink(a, best);
+
+	/* return the leftover after the allocated region */
+	if (best_aligned + len < end)
+		__link(a, __range_new(best_aligned + len, end - (best_aligned + len)));
+
+	/* and the alignment padding before it */
+	if (best_aligned > best->start) {
+		best->len = best_aligned - best->start;
+		__link(a, best);
+	} else {
+		free(best);
+	}
+
+	return true;
+}
+
+void iova_allocator_put(struct iova_allocator *a, iova_t start, size_t len)
+{
+	struct iova_free_range *prev, *next;
+
+	prev = btree_find_le(&a->ranges, start);
+	if (prev && prev->start + prev->len != start)
+		prev = NULL;
+
+	next = btree_find(&a->ranges, start + len);
+
+	if (prev) {
+		__unlink(a, prev);
+		prev->len += len;
+
+		if (next) {
+			__unlink(a, next);
+			prev->len += next->len;
+			free(next);
+		}
+
+		__link(a, prev);
+
+		return;
+	}
+
+	if (next) {
+		__unlink(a, next);
+		next->start = start;
+		next->len += len;
+
+		__link(a, next);
+
+		return;
+	}
+
+	__link(a, __range_new(start, len));
+}
+
+static void __free(void *opaque UNUSED, void *val)
+{
+	free(val);
+}
+
+void iova_allocator_clear(struct iova_allocator *a)
+{
+	btree_clear_with(&a->ranges, __free, NULL);
+	btree_clear_with(&a->sizes, __free, NULL);
+}
+
+void iova_allocator_destroy(struct iova_allocator *a)
+{
+	iova_allocator_clear(a);
+
+	btree_destroy(&a->ranges);
+	btree_destroy(&a->sizes);
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_SRC_IOMMU_IOVA_ALLOC_H
+#define LIBVFN_SRC_IOMMU_IOVA_ALLOC_H
+
+#include "ccan/list/list.h"
+
+#include "util/btree.h"
+
+/*
+ * Segregated-fit allocator for released iova ranges.
+ *
+ * Free ranges are indexed twice: by start address (for coalescing with the
+ * neighbouring ranges when a range is put back) and by length, grouped in
+ * exact-size classes (for best-fit lookups). Both are b-trees, so getting and
+ * putting a range is logarithmic in the number of free fragments.
+ *
+ * The allocator does no locking of its own.
+ */
+
+struct iova_free_range {
+	iova_t start;
+	uint64_t len;
+
+	/* entry in the size class of len */
+	struct list_node list;
+};
+
+struct iova_size_class {
+	uint64_t len;
+	struct list_head ranges;
+};
+
+struct iova_allocator {
+	/* start -> struct iova_free_range */
+	struct btree ranges;
+
+	/* len -> struct iova_size_class */
+	struct btree sizes;
+};
+
+void iova_allocator_init(struct iova_allocator *a);
+void iova_allocator_clear(struct iova_allocator *a);
+void iova_allocator_destroy(struct iova_allocator *a);
+bool iova_allocator_get(struct iova_allocator *a, size_t len, iova_t *iova);
+bool iova_allocator_get_align(struct iova_allocator *a, size_t len, size_t align, iova_t *iova);
+void iova_allocator_put(struct iova_allocator *a, iova_t start, size_t len);
+
+#endif /* LIBVFN_SRC_IOMMU_IOVA_ALLOC_H */
@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Iova allocator fragmentation benchmark; reports the average time (in
+ * nanoseconds) of a get/put pair with 10^2 to 10^5 free fragments.
+ *
+ * The free space is fragmented by allocating small ranges of random sizes and
+ * releasing every other one; the rest stay allocated for the duration of the
+ * run. The benchmark then churns a ring of CHURN_LIVE allocations by releasing
+ * the oldest one and allocating a new one of random size (a quarter of them
+ * aligned and most of them too large for the fragments), which keeps the
+ * number of fragments roughly constant.
+ *
+ * The segregated-fit allocator is compared to a linear best-fit search over all
+ * free ranges (the previous vfio type1 strategy); the latter is not run beyond
+ * LINEAR_MAX_FRAGMENTS.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ccan/time/time.h"
+
+#include "iova_alloc.c"
+
+#define PAGE 0x1000ULL
+#define BASE 0x100000000ULL
+#define MAX_PAGES (1ULL << 30)
+#define MAX_LEN 16
+#define FRAGMENT_MAX_LEN 4
+
+#define MAX_FRAGMENTS 100000
+#define LINEAR_MAX_FRAGMENTS 10000
+
+#define CHURN 200000
+#define CHURN_LIVE 256
+
+struct alloc {
+	iova_t iova;
+	size_t len;
+};
+
+static struct alloc *allocs;
+static struct alloc ring[CHURN_LIVE];
+
+struct best_fit {
+	size_t len, align;
+
+	struct iova_free_range *best;
+	uint64_t best_avail;
+	iova_t best_aligned;
+};
+
+static bool __best_fit(void *opaque, uint64_t key UNUSED, void *val)
+{
+	struct best_fit *s = opaque;
+	iova_t aligned;
+	uint64_t avail = __avail_aligned(val, s->align, &aligned);
+
+	if (avail >= s->len && avail < s->best_avail) {
+		s->best = val;
+		s->best_avail = avail;
+		s->best_aligned = aligned;
+
+		if (avail == s->len)
+			return false;
+	}
+
+	return true;
+}
+
+static bool linear_get(struct iova_allocator *a, size_t len, size_t align, iova_t *iova)
+{
+	struct best_fit s = {.len = len, .align = align, .best_avail = UINT64_MAX};
+	struct iova_free_range *r;
+	uint64_t end;
+
+	btree_for_each(&a->ranges, __best_fit, &s);
+
+	r = s.best;
+	if (!r)
+		return false;
+
+	*iova = s.best_aligned;
+
+	end = r->start + r->len;
+
+	__unlink(a, r);
+
+	if (s.best_aligned + len < end)
+		__link(a, __range_new(s.best_aligned + len, end - (s.best_aligned + len)));
+
+	if (s.best_aligned > r->start) {
+		r->len = s.best_aligned - r->start;
+		__link(a, r);
+	} else {
+		free(r);
+	}
+
+	return true;
+}
+
+static bool get(struct iova_allocator *a, bool linear, size_t len, size_t align, iova_t *iova)
+{
+	if (linear)
+		return linear_get(a, len, align, iova);
+
+	if (align == PAGE)
+		return iova_allocator_get(a, len, iova);
+
+	return iova_allocator_get_align(a, len, align, iova);
+}
+
+static inline size_t random_len(unsigned int max)
+{
+	return (size_t)(1 + random() % max) * PAGE;
+}
+
+static inline size_t random_align(void)
+{
+	return random() % 4 ? PAGE : PAGE << (random() % 5);
+}
+
+static bool __count(void *opaque, uint64_t key UNUSED, void *val UNUSED)
+{
+	(*(long *)opaque)++;
+
+	return true;
+}
+
+static double bench(unsigned int n, bool linear, long *fragments)
+{
+	struct iova_allocator a;
+	struct timemono start;
+	double ns;
+
+	iova_allocator_init(&a);
+	iova_allocator_put(&a, BASE, MAX_PAGES * PAGE);
+
+	srandom(n);
+
+	/* fragment; 2n allocations with every other one released */
+	for (unsigned int i = 0; i < 2 * n; i++) {
+		allocs[i].len = random_len(FRAGMENT_MAX_LEN);
+
+		if (!iova_allocator_get(&a, allocs[i].len, &allocs[i].iova))
+			errx(1, "failed to fragment");
+	}
+
+	for (unsigned int i = 0; i < 2 * n; i += 2)
+		iova_allocator_put(&a, allocs[i].iova, allocs[i].len);
+
+	for (unsigned int i = 0; i < CHURN_LIVE; i++)
+		ring[i].len = 0;
+
+	start = time_mono();
+
+	for (unsigned int i = 0; i < CHURN; i++) {
+		struct alloc *x = &ring[i % CHURN_LIVE];
+
+		if (x->len)
+			iova_allocator_put(&a, x->iova, x->len);
+
+		x->len = random_len(MAX_LEN);
+
+		if (!get(&a, linear, x->len, random_align(), &x->iova))
+			errx(1, "failed to allocate");
+	}
+
+	ns = (double)time_to_nsec(timemono_since(start)) / CHURN;
+
+	*fragments = 0;
+	btree_for_each(&a.ranges, __count, fragments);
+
+	iova_allocator_destroy(&a);
+
+	return ns;
+}
+
+int main(void)
+{
+	allocs = znew_t(struct alloc, 2 * MAX_FRAGMENTS);
+
+	printf("%-10s %10s %10s %12s  (ns/op)\n", "allocator", "fragments", "(actual)", "get+put");
+
+	for (unsigned int n = 100; n <= MAX_FRAGMENTS; n *= 10) {
+		long fragments;
+		double ns;
+
+		ns = bench(n, false, &fragments);
+		printf("%-10s %10u %10ld %12.1f\n", "segfit", n, fragments, ns);
+
+		if (n > LINEAR_MAX_FRAGMENTS) {
+			printf("%-10s %10u %10s %12s\n", "linear", n, "-", "-");
+			continue;
+		}
+
+		ns = bench(n, true, &fragments);
+		printf("%-10s %10u %10ld %12.1f\n", "linear", n, fragments, ns);
+	}
+
+	free(allocs);
+
+	return 0;
+}
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "iova_alloc.c"
+
+#define PAGE 0x1000ULL
+#define BASE 0x100000000ULL
+
+#define NPAGES 4096
+#define NALLOCS 256
+#define ROUNDS 20000
+
+static struct iova_allocator a;
+
+struct count_state {
+	long ranges;
+	uint64_t start, len;
+	bool sorted;
+};
+
+/* counts the free ranges and checks that they are sorted and fully coalesced */
+static bool __count(void *opaque, uint64_t key, void *val)
+{
+	struct count_state *s = opaque;
+	struct iova_free_range *r = val;
+
+	if (key != r->start || (s->ranges && s->start + s->len >= r->start))
+		s->sorted = false;
+
+	s->ranges++;
+	s->start = r->start;
+	s->len = r->len;
+
+	return true;
+}
+
+static long count_ranges(void)
+{
+	struct count_state s = {.sorted = true};
+
+	btree_for_each(&a.ranges, __count, &s);
+
+	return s.sorted ? s.ranges : -1;
+}
+
+static struct {
+	iova_t iova;
+	size_t len;
+} allocs[NALLOCS];
+
+static bool used[NPAGES];
+
+/* mark the pages of an allocation; fails if any of them are already in use */
+static bool mark(iova_t iova, size_t len, bool in_use)
+{
+	if (iova < BASE || iova + len > BASE + NPAGES * PAGE)
+		return false;
+
+	for (uint64_t i = (iova - BASE) / PAGE; i < (iova + len - BASE) / PAGE; i++) {
+		if (used[i] == in_use)
+			return false;
+
+		used[i] = in_use;
+	}
+
+	return true;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	bool valid = true, aligned = true;
+	iova_t iova;
+	int i;
+
+	plan_tests(16);
+
+	iova_allocator_init(&a);
+
+	ok(!iova_allocator_get(&a, PAGE, &iova), "get from empty allocator fails");
+
+	/* three separate ranges of 4, 2 and 8 pages */
+	iova_allocator_put(&a, BASE, 4 * PAGE);
+	iova_allocator_put(&a, BASE + 8 * PAGE, 2 * PAGE);
+	iova_allocator_put(&a, BASE + 16 * PAGE, 8 * PAGE);
+
+	ok(count_ranges() == 3, "put separate ranges");
+
+	ok(iova_allocator_get(&a, 2 * PAGE, &iova) && iova == BASE + 8 * PAGE,
+	   "get exact fit");
+	ok(iova_allocator_get(&a, 3 * PAGE, &iova) && iova == BASE,
+	   "get best fit");
+	ok(btree_find(&a.ranges, BASE + 3 * PAGE) && btree_find(&a.sizes, PAGE),
+	   "best fit leftover is kept");
+	ok(!iova_allocator_get(&a, 9 * PAGE, &iova), "get too large fails");
+
+	/* put back in an order that requires merging in both directions */
+	iova_allocator_put(&a, BASE + 8 * PAGE, 2 * PAGE);
+	iova_allocator_put(&a, BASE, 3 * PAGE);
+	iova_allocator_put(&a, BASE + 4 * PAGE, 4 * PAGE);
+	iova_allocator_put(&a, BASE + 10 * PAGE, 6 * PAGE);
+
+	ok(count_ranges() == 1 && btree_find(&a.sizes, 24 * PAGE), "put coalesces");
+
+	ok(iova_allocator_get_align(&a, 4 * PAGE, 16 * PAGE, &iova) && iova == BASE,
+	   "get aligned");
+	ok(iova_allocator_get_align(&a, 4 * PAGE, 16 * PAGE, &iova) && iova == BASE + 16 * PAGE,
+	   "get aligned skips unaligned space");
+	ok(count_ranges() == 2 && btree_find(&a.ranges, BASE + 4 * PAGE) &&
+	   btree_find(&a.ranges, BASE + 20 * PAGE), "alignment padding is kept");
+
+	iova_allocator_put(&a, BASE + 16 * PAGE, 4 * PAGE);
+	iova_allocator_put(&a, BASE, 4 * PAGE);
+
+	ok(count_ranges() == 1, "put aligned coalesces");
+
+	iova_allocator_clear(&a);
+
+	ok(count_ranges() == 0 && !a.sizes.root, "clear");
+
+	/* random churn, checked against a page map */
+	iova_allocator_put(&a, BASE, NPAGES * PAGE);
+
+	for (i = 0; i < ROUNDS && valid; i++) {
+		int j = rand() % NALLOCS;
+
+		if (allocs[j].len) {
+			valid = mark(allocs[j].iova, allocs[j].len, false);
+			iova_allocator_put(&a, allocs[j].iova, allocs[j].len);
+			allocs[j].len = 0;
+
+			continue;
+		}
+
+		allocs[j].len = (size_t)(1 + rand() % 16) * PAGE;
+
+		if (rand() % 4 == 0) {
+			size_t align = PAGE << (rand() % 6);
+
+			if (!iova_allocator_get_align(&a, allocs[j].len, align, &allocs[j].iova)) {
+				allocs[j].len = 0;
+				continue;
+			}
+
+			if (!ALIGNED(allocs[j].iova, align))
+				aligned = false;
+		} else if (!iova_allocator_get(&a, allocs[j].len, &allocs[j].iova)) {
+			allocs[j].len = 0;
+			continue;
+		}
+
+		valid = mark(allocs[j].iova, allocs[j].len, true);
+	}
+
+	ok(valid, "allocations do not overlap");
+	ok(aligned, "aligned allocations are aligned");
+	ok(count_ranges() > 0, "free ranges are sorted and coalesced");
+
+	for (i = 0; i < NALLOCS; i++) {
+		if (allocs[i].len)
+			iova_allocator_put(&a, allocs[i].iova, allocs[i].len);
+	}
+
+	ok(count_ranges() == 1 && btree_find(&a.ranges, BASE) &&
+	   btree_find(&a.sizes, NPAGES * PAGE), "all space is coalesced when released");
+
+	iova_allocator_destroy(&a);
+
+	return exit_status();
+}
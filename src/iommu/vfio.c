@@ -42,8 +42,59 @@
 #include "vfn/pci/util.h"
 
 #include "context.h"
+#include "iova_alloc.h"
 
-#define VFIO_IOMMU_TYPE1_IOVA_RESERVED 0x10000
+/*
+ * Ephemeral iovas are allocated from a dedicated area, split into chunks. A
+ * thread owns a chunk at a time and bump allocates from it without locking;
+ * when it runs out, the chunk is retired and the thread moves on to a free
+ * chunk. A retired chunk is freed (and its iovas recycled) when the last
+ * mapping in it is removed.
+ */
+#define VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK 0x40000
+#define VFIO_IOMMU_TYPE1_EPHEMERAL_LEN 0x400000
+
+enum vfio_ephemeral_chunk_state {
+	VFIO_EPHEMERAL_CHUNK_FREE,
+	VFIO_EPHEMERAL_CHUNK_OWNED,
+	VFIO_EPHEMERAL_CHUNK_RETIRED,
+};
+
+/*
+ * @next is only touched by the owning thread, @nrefs (the number of mappings in
+ * the chunk) may be dropped by any thread and @state is protected by the
+ * container lock.
+ */
+struct vfio_ephemeral_chunk {
+	iova_t next;
+	unsigned int nrefs;
+	int state;
+};
+
+/*
+ * The chunks of an ephemeral area. Threads bump allocate from their chunk
+ * without holding the container lock, and may do so concurrently with the
+ * area being reset, so the chunks are only freed with the container.
+ */
+struct vfio_ephemeral_area {
+	struct list_node list;
+
+	struct vfio_ephemeral_chunk chunks[];
+};
+
+/* per-thread ephemeral allocation state of a container */
+struct vfio_ephemeral_tls {
+	struct vfio_container *vfio;
+	struct list_node list;
+
+	/* the chunk is only valid if the epoch matches that of the container */
+	unsigned int epoch;
+	int chunk;
+
+	/* the owned chunk and the end of its iovas; used without the container lock */
+	struct vfio_ephemeral_chunk *c;
+	iova_t end;
+};
 
 /*
  * VFIO Container-Group Model
@@ -67,12 +118,6 @@ struct vfio_group {
 	int nr_devs;
 };
 
-struct vfio_iova_free_range {
-	iova_t start;
-	uint64_t len;
-	struct skiplist_node list;
-};
-
 struct vfio_container {
 	struct iommu_ctx ctx;
 	char *name;
@@ -84,10 +129,20 @@ struct vfio_container {
 	int nr_groups;
 
 	pthread_mutex_t lock;
-	iova_t next, next_ephemeral;
-	uint64_t nephemerals;
+	iova_t next;
+	struct iova_allocator free_iovas;
+
+	/* ephemeral area; reserved on first use */
+	size_t ephemeral_len;
 	struct iommu_iova_range ephemerals;
-	struct skiplist free_iovas;
+	struct vfio_ephemeral_chunk *chunks;
+	unsigned int nchunks, epoch;
+
+	/* all areas reserved since the container was created */
+	struct list_head areas;
+
+	pthread_key_t ephemeral_key;
+	struct list_head ephemeral_tls;
 
 	bool iommu_set;
 
@@ -285,191 +340,195 @@ static bool __iova_reserve_align(struct iommu_iova_range *ranges, int nranges,
 	return false;
 }
 
-static int iova_free_range_cmp(const void *iova, const struct skiplist_node *n)
+static int __vfio_iova_reserve(struct vfio_container *vfio, size_t len, iova_t *iova)
+{
+	__autolock(&vfio->lock);
+
+	if (iova_allocator_get(&vfio->free_iovas, len, iova))
+		return 0;
+
+	if (__iova_reserve(vfio->ctx.iova_ranges, vfio->ctx.nranges, &vfio->next, len, iova))
+		return 0;
+
+	errno = ENOMEM;
+	return -1;
+}
+
+/* must be called with vfio->lock held */
+static int __vfio_ephemerals_init(struct vfio_container *vfio)
 {
-	const uint64_t *start = iova;
-	struct vfio_iova_free_range *range = container_of_var(n, range, list);
+	size_t len = vfio->ephemeral_len ? vfio->ephemeral_len : VFIO_IOMMU_TYPE1_EPHEMERAL_LEN;
+	struct vfio_ephemeral_area *area;
+	iova_t iova;
 
-	if (*start < range->start)
+	if (!__iova_reserve_align(vfio->ctx.iova_ranges, vfio->ctx.nranges, &vfio->next, len,
+				  VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK, &iova)) {
+		log_debug("could not reserve iova range for ephemerals\n");
+		errno = ENOMEM;
 		return -1;
-	else if (*start > range->start)
-		return 1;
+	}
+
+	vfio->ephemerals.start = iova;
+	vfio->ephemerals.last = iova + len - 1;
+
+	vfio->nchunks = (unsigned int)(len / VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK);
+
+	area = zmalloc(sizeof(*area) + vfio->nchunks * sizeof(struct vfio_ephemeral_chunk));
+	list_add_tail(&vfio->areas, &area->list);
+
+	vfio->chunks = area->chunks;
+
+	if (logv(LOG_INFO)) {
+		__autofree char *str;
+
+		log_fatal_if(iommu_iova_range_to_string(&vfio->ephemerals, &str) < 0,
+			     "iommu_iova_range_to_string\n");
+
+		log_info("reserved %zuk for ephemerals %s\n", len >> 10, str);
+	}
 
 	return 0;
 }
 
-static struct vfio_iova_free_range *__iova_get_free_range(struct skiplist *free_list,
-							  size_t len)
+/* must be called with vfio->lock held */
+static void __vfio_ephemeral_chunk_release(struct vfio_container *vfio, unsigned int idx)
 {
-	struct vfio_iova_free_range *range, *best_fit = NULL;
-	struct skiplist_node *n, *next;
-	size_t best_fit_size = SIZE_MAX;
+	struct vfio_ephemeral_chunk *c = &vfio->chunks[idx];
 
-	/* Find best-fit free range (smallest range that fits) */
-	skiplist_for_each_safe(free_list, n, next, 0) {
-		if (n == NULL || n == &free_list->sentinel)
-			continue;
-		range = container_of_var(n, range, list);
-		if (range->len >= len && range->len < best_fit_size) {
-			best_fit = range;
-			best_fit_size = range->len;
-			if (range->len == len)
-				break;
-		}
+	if (c->state != VFIO_EPHEMERAL_CHUNK_RETIRED || atomic_load_acquire(&c->nrefs))
+		return;
+
+	trace_guard(VFIO_IOMMU_TYPE1_RECYCLE_EPHEMERAL_IOVAS) {
+		trace_emit("recycling ephemeral chunk %u (0x%" PRIx64 ")\n", idx,
+			   vfio->ephemerals.start + (iova_t)idx * VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK);
 	}
 
-	return best_fit;
+	c->state = VFIO_EPHEMERAL_CHUNK_FREE;
 }
 
-static bool __iova_get_free(struct skiplist *free_list, size_t len,
-			    iova_t *iova)
+/* must be called with vfio->lock held */
+static void __vfio_ephemeral_retire(struct vfio_ephemeral_tls *tls)
 {
-	struct vfio_iova_free_range *range;
+	struct vfio_container *vfio = tls->vfio;
 
-	range = __iova_get_free_range(free_list, len);
-	if (!range)
-		return false;
+	if (tls->chunk < 0 || tls->epoch != vfio->epoch)
+		return;
 
-	*iova = range->start;
+	vfio->chunks[tls->chunk].state = VFIO_EPHEMERAL_CHUNK_RETIRED;
+	__vfio_ephemeral_chunk_release(vfio, (unsigned int)tls->chunk);
 
-	if (range->len == len) {
-		struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+	tls->chunk = -1;
+	tls->c = NULL;
+}
 
-		skiplist_find(free_list, (void *)&range->start,
-			      iova_free_range_cmp, update);
-		skiplist_erase(free_list, &range->list, update);
-		free(range);
-	} else {
-		range->start += len;
-		range->len -= len;
-	}
+/* retire the current chunk of the thread and allocate from a free one */
+static int __vfio_ephemeral_refill(struct vfio_ephemeral_tls *tls, size_t len, iova_t *iova)
+{
+	struct vfio_container *vfio = tls->vfio;
+	struct vfio_ephemeral_chunk *c;
 
-	return true;
-}
+	__autolock(&vfio->lock);
 
-static void __iova_put_free(struct skiplist *free_list, iova_t start, size_t len);
+	if (!vfio->chunks && __vfio_ephemerals_init(vfio))
+		return -1;
 
-static bool __iova_get_free_align(struct skiplist *free_list, size_t len,
-				  size_t align, iova_t *iova)
-{
-	struct vfio_iova_free_range *range, *best_fit = NULL;
-	struct skiplist_node *n, *next;
-	iova_t best_aligned = (iova_t)0;
-	size_t best_fit_avail = SIZE_MAX;
+	__vfio_ephemeral_retire(tls);
 
-	/* Find best-fit free range accounting for alignment padding */
-	skiplist_for_each_safe(free_list, n, next, 0) {
-		iova_t aligned;
-		size_t pad, avail;
+	for (unsigned int i = 0; i < vfio->nchunks; i++) {
+		c = &vfio->chunks[i];
 
-		if (n == NULL || n == &free_list->sentinel)
+		if (c->state != VFIO_EPHEMERAL_CHUNK_FREE)
 			continue;
-		range = container_of_var(n, range, list);
 
-		aligned = ALIGN_UP(range->start, align);
-		if (aligned < range->start)	/* overflow */
-			continue;
+		c->state = VFIO_EPHEMERAL_CHUNK_OWNED;
+		c->next = vfio->ephemerals.start + (iova_t)i * VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK;
 
-		pad = aligned - range->start;
-		if (pad >= range->len)		/* alignment eats the entire range */
-			continue;
+		*iova = c->next;
+		c->next += len;
 
-		avail = range->len - pad;
-		if (avail < len)
-			continue;
+		atomic_inc(&c->nrefs);
 
-		if (avail < best_fit_avail) {
-			best_fit = range;
-			best_fit_avail = avail;
-			best_aligned = aligned;
-			if (avail == len)
-				break;
-		}
+		tls->chunk = (int)i;
+		tls->epoch = vfio->epoch;
+
+		tls->c = c;
+		tls->end = vfio->ephemerals.start +
+			(iova_t)(i + 1) * VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK;
+
+		return 0;
 	}
 
-	if (!best_fit)
-		return false;
+	log_debug("no free ephemeral chunks\n");
 
-	*iova = best_aligned;
+	errno = ENOMEM;
+	return -1;
+}
+
+static void __vfio_ephemeral_tls_release(void *p)
+{
+	struct vfio_ephemeral_tls *tls = p;
+	struct vfio_container *vfio = tls->vfio;
 
 	{
-		uint64_t orig_start = best_fit->start;
-		uint64_t orig_end = orig_start + best_fit->len;
-		size_t pad_len = best_aligned - orig_start;
-		struct skiplist_node *update[SKIPLIST_LEVELS] = {};
-
-		skiplist_find(free_list, &orig_start, iova_free_range_cmp, update);
-		skiplist_erase(free_list, &best_fit->list, update);
-		free(best_fit);
-
-		/* Return alignment padding before the allocated region */
-		if (pad_len)
-			__iova_put_free(free_list, orig_start, pad_len);
-
-		/* Return leftover after the allocated region */
-		if (best_aligned + len < orig_end)
-			__iova_put_free(free_list, best_aligned + len,
-					orig_end - (best_aligned + len));
+		__autolock(&vfio->lock);
+
+		__vfio_ephemeral_retire(tls);
+		list_del(&tls->list);
 	}
 
-	return true;
+	free(tls);
 }
 
-static void __iova_put_free(struct skiplist *free_list, iova_t start, size_t len)
+static struct vfio_ephemeral_tls *__vfio_ephemeral_tls(struct vfio_container *vfio)
 {
-	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
-	struct skiplist_node *prev_node, *next_node;
-	struct vfio_iova_free_range *new_range, *prev_range = NULL, *next_range = NULL;
-
-	/* Check if we can merge with adjacent ranges */
-	prev_node = skiplist_find_le(free_list, (void *)&start,
-				     iova_free_range_cmp, update);
-	if (prev_node) {
-		prev_range = container_of_var(prev_node, prev_range, list);
-		/* Check if we can merge with previous range */
-		if (prev_range->start + prev_range->len == start) {
-			/* Extend previous range */
-			prev_range->len += len;
-
-			/* Check if we can also merge with next range */
-			next_node = skiplist_next(free_list, prev_node, 0);
-			if (next_node) {
-				next_range = container_of_var(next_node, next_range, list);
-				if (prev_range->start + prev_range->len == next_range->start) {
-					/* Merge all three */
-					struct skiplist_node *del_update[SKIPLIST_LEVELS] = {};
-
-					prev_range->len += next_range->len;
-					skiplist_find(free_list, (void *)&next_range->start,
-							iova_free_range_cmp, del_update);
-					skiplist_erase(free_list, next_node, del_update);
-					free(next_range);
-				}
-			}
-			return;
-		}
+	struct vfio_ephemeral_tls *tls = pthread_getspecific(vfio->ephemeral_key);
+
+	if (likely(tls))
+		return tls;
+
+	tls = znew_t(struct vfio_ephemeral_tls, 1);
+	tls->vfio = vfio;
+	tls->chunk = -1;
+
+	if (pthread_setspecific(vfio->ephemeral_key, tls)) {
+		free(tls);
+		return NULL;
 	}
 
-	/* Check if we can merge with next range */
-	next_node = skiplist_find_ge(free_list, (void *)&start,
-				     iova_free_range_cmp, update);
-	if (next_node) {
-		next_range = container_of_var(next_node, next_range, list);
-		if (start + len == next_range->start) {
-			/* Extend next range backwards */
-			next_range->start = start;
-			next_range->len += len;
-			return;
-		}
+	{
+		__autolock(&vfio->lock);
+
+		list_add_tail(&vfio->ephemeral_tls, &tls->list);
 	}
 
-	/* No merge possible, add new range */
-	new_range = znew_t(struct vfio_iova_free_range, 1);
-	new_range->start = start;
-	new_range->len = len;
+	return tls;
+}
 
-	skiplist_find(free_list, (void *)&start, iova_free_range_cmp, update);
-	skiplist_link(free_list, &new_range->list, update);
+static int vfio_ephemeral_reserve(struct vfio_container *vfio, size_t len, iova_t *iova)
+{
+	struct vfio_ephemeral_tls *tls = __vfio_ephemeral_tls(vfio);
+	struct vfio_ephemeral_chunk *c;
+
+	if (!tls)
+		return -1;
+
+	/*
+	 * Fast path; bump allocate from the chunk owned by this thread. The
+	 * chunk stays allocated even if the area is reset concurrently.
+	 */
+	c = tls->c;
+	if (c && tls->epoch == atomic_load_acquire(&vfio->epoch)) {
+		if (tls->end - c->next >= len) {
+			atomic_inc(&c->nrefs);
+
+			*iova = c->next;
+			c->next += len;
+
+			return 0;
+		}
+	}
+
+	return __vfio_ephemeral_refill(tls, len, iova);
 }
 
 static int vfio_iommu_type1_iova_reserve(struct iommu_ctx *ctx, size_t len, iova_t *iova,
@@ -477,32 +536,45 @@ static int vfio_iommu_type1_iova_reserve(struct iommu_ctx *ctx, size_t len, iova
 {
 	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
 
-	__autolock(&vfio->lock);
-
 	if (!ALIGNED(len, __VFN_PAGESIZE)) {
 		log_debug("len is not page aligned\n");
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (flags & IOMMU_MAP_EPHEMERAL) {
-		if (!__iova_reserve(&vfio->ephemerals, 1, &vfio->next_ephemeral, len, iova))
-			goto enomem;
+	/* ephemeral mappings that do not fit a chunk are allocated as regular ones */
+	if ((flags & IOMMU_MAP_EPHEMERAL) && len <= VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK)
+		return vfio_ephemeral_reserve(vfio, len, iova);
 
-		atomic_inc(&vfio->nephemerals);
+	return __vfio_iova_reserve(vfio, len, iova);
+}
 
-		return 0;
+static int vfio_iommu_type1_iova_set_ephemeral_area(struct iommu_ctx *ctx, size_t len)
+{
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+
+	__autolock(&vfio->lock);
+
+	if (vfio->chunks) {
+		errno = EBUSY;
+		return -1;
 	}
 
-	if (__iova_get_free(&vfio->free_iovas, len, iova))
-		return 0;
+	vfio->ephemeral_len = ALIGN_UP(len, VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK);
 
-	if (__iova_reserve(ctx->iova_ranges, ctx->nranges, &vfio->next, len, iova))
-		return 0;
+	return 0;
+}
 
-enomem:
-	errno = ENOMEM;
-	return -1;
+/* must be called with vfio->lock held */
+static void __vfio_ephemerals_reset(struct vfio_container *vfio)
+{
+	/* the area is kept until the container is freed; see struct vfio_ephemeral_area */
+	vfio->chunks = NULL;
+	vfio->nchunks = 0;
+	vfio->ephemerals = (struct iommu_iova_range) {};
+
+	/* invalidate the chunks owned by threads */
+	atomic_inc(&vfio->epoch);
 }
 
 static int vfio_iommu_type1_iova_reserve_align(struct iommu_ctx *ctx, size_t len,
@@ -525,7 +597,7 @@ static int vfio_iommu_type1_iova_reserve_align(struct iommu_ctx *ctx, size_t len
 		return -1;
 	}
 
-	if (__iova_get_free_align(&vfio->free_iovas, len, align, iova))
+	if (iova_allocator_get_align(&vfio->free_iovas, len, align, iova))
 		return 0;
 
 	if (__iova_reserve_align(ctx->iova_ranges, ctx->nranges, &vfio->next,
@@ -538,8 +610,6 @@ static int vfio_iommu_type1_iova_reserve_align(struct iommu_ctx *ctx, size_t len
 
 static int vfio_iommu_type1_init(struct vfio_container *vfio)
 {
-	iova_t iova;
-
 	if (vfio->iommu_set)
 		return 0;
 
@@ -557,23 +627,6 @@ static int vfio_iommu_type1_init(struct vfio_container *vfio)
 	}
 #endif
 
-	if (vfio_iommu_type1_iova_reserve(&vfio->ctx, VFIO_IOMMU_TYPE1_IOVA_RESERVED, &iova, 0x0)) {
-		log_debug("could not reserve iova range\n");
-		return -1;
-	}
-
-	vfio->ephemerals.start = iova;
-	vfio->ephemerals.last = iova + VFIO_IOMMU_TYPE1_IOVA_RESERVED - 1;
-
-	if (logv(LOG_INFO)) {
-		__autofree char *str;
-
-		log_fatal_if(iommu_iova_range_to_string(&vfio->ephemerals, &str) < 0,
-			     "iommu_iova_range_to_string\n");
-
-		log_info("reserved 64k for ephemerals %s\n", str);
-	}
-
 	return 0;
 }
 
@@ -761,17 +814,22 @@ static int vfio_get_device_fd(struct iommu_ctx *ctx, const char *bdf)
 	return ret_fd;
 }
 
-static void free_iova_range_node(void *opaque UNUSED, struct skiplist_node *n)
+static void vfio_container_free(struct vfio_container *vfio)
 {
-	struct vfio_iova_free_range *range = container_of_var(n, range, list);
+	struct vfio_ephemeral_area *area, *next_area;
+	struct vfio_ephemeral_tls *tls, *next;
 
-	free(range);
-}
+	iommu_ctx_destroy(&vfio->ctx);
 
-static void vfio_container_free(struct vfio_container *vfio)
-{
-	skiplist_clear_with(&vfio->free_iovas, free_iova_range_node, NULL);
-	free(vfio->ctx.iova_ranges);
+	pthread_key_delete(vfio->ephemeral_key);
+
+	list_for_each_safe(&vfio->ephemeral_tls, tls, next, list)
+		free(tls);
+
+	list_for_each_safe(&vfio->areas, area, next_area, list)
+		free(area);
+
+	iova_allocator_destroy(&vfio->free_iovas);
 	free(vfio->name);
 	free(vfio);
 }
@@ -847,7 +905,7 @@ struct iommu_ctx *vfio_get_iommu_context(const char *bdf)
 
 	if (vfio_init_container(vfio) < 0) {
 		pthread_mutex_unlock(&active_containers_lock);
-		free(vfio->ctx.iova_ranges);
+		iommu_ctx_destroy(&vfio->ctx);
 		free(vfio);
 		return NULL;
 	}
@@ -874,6 +932,33 @@ struct iommu_ctx *vfio_get_iommu_context(const char *bdf)
 	return &vfio->ctx;
 }
 
+static void vfio_ctx_get(struct iommu_ctx *ctx)
+{
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+
+	__autolock(&active_containers_lock);
+
+	vfio->refcount++;
+}
+
+static void vfio_ctx_put(struct iommu_ctx *ctx)
+{
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+	bool do_free = false;
+
+	pthread_mutex_lock(&active_containers_lock);
+
+	if (--vfio->refcount == 0) {
+		list_del(&vfio->list);
+		do_free = true;
+	}
+
+	pthread_mutex_unlock(&active_containers_lock);
+
+	if (do_free)
+		vfio_container_free(vfio);
+}
+
 static int vfio_put_device_fd(struct iommu_ctx *ctx, const char *bdf)
 {
 	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
@@ -909,9 +994,13 @@ static int vfio_put_device_fd(struct iommu_ctx *ctx, const char *bdf)
 			vfio->fd = -1;
 			vfio->iommu_set = false;
 			vfio->next = (iova_t)0;
-			vfio->next_ephemeral = (iova_t)0;
-			vfio->nephemerals = 0;
-			skiplist_clear_with(&vfio->free_iovas, free_iova_range_node, NULL);
+			iova_allocator_clear(&vfio->free_iovas);
+
+			{
+				__autolock(&vfio->lock);
+
+				__vfio_ephemerals_reset(vfio);
+			}
 		}
 	}
 
@@ -968,13 +1057,23 @@ static int vfio_iommu_type1_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_
 static void vfio_iova_put(struct iommu_ctx *ctx, iova_t iova, size_t len)
 {
 	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+	struct iommu_iova_range *r = &vfio->ephemerals;
+	iova_t last = iova + len - 1;
 
 	__autolock(&vfio->lock);
 
-	if (iova >= vfio->ephemerals.start && iova <= vfio->ephemerals.last)
+	/* ephemeral iovas are recycled with their chunk */
+	if (!vfio->chunks || last < r->start || iova > r->last) {
+		iova_allocator_put(&vfio->free_iovas, iova, len);
 		return;
+	}
 
-	__iova_put_free(&vfio->free_iovas, iova, len);
+	/* a range may extend beyond the area if coalesced with a large ephemeral */
+	if (iova < r->start)
+		iova_allocator_put(&vfio->free_iovas, iova, r->start - iova);
+
+	if (last > r->last)
+		iova_allocator_put(&vfio->free_iovas, r->last + 1, last - r->last);
 }
 
 static int vfio_iommu_type1_do_dma_unmap(struct iommu_ctx *ctx, iova_t iova, size_t len)
@@ -1000,24 +1099,28 @@ static int vfio_iommu_type1_do_dma_unmap(struct iommu_ctx *ctx, iova_t iova, siz
 	return 0;
 }
 
-static void vfio_iommu_type1_recycle_ephemeral_iovas(struct vfio_container *vfio)
+static void vfio_iommu_type1_recycle_ephemeral_chunk(struct vfio_container *vfio,
+						     unsigned int idx)
 {
 	__autolock(&vfio->lock);
 
-	trace_guard(VFIO_IOMMU_TYPE1_RECYCLE_EPHEMERAL_IOVAS) {
-		trace_emit("recycling ephemeral range (0x%" PRIx64 " -> 0x%" PRIx64 ")\n",
-			   vfio->next_ephemeral, vfio->ephemerals.start);
-	}
-
-	vfio->next_ephemeral = vfio->ephemerals.start;
+	__vfio_ephemeral_chunk_release(vfio, idx);
 }
 
-static void vfio_iommu_type1_iova_put_ephemeral(struct iommu_ctx *ctx)
+static void vfio_iommu_type1_iova_put_ephemeral(struct iommu_ctx *ctx, iova_t iova)
 {
 	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+	struct vfio_ephemeral_chunk *chunks = atomic_load_acquire(&vfio->chunks);
+	unsigned int idx;
+
+	/* large ephemerals are allocated outside of the area */
+	if (!chunks || iova < vfio->ephemerals.start || iova > vfio->ephemerals.last)
+		return;
 
-	if (atomic_dec_fetch(&vfio->nephemerals) == 0)
-		vfio_iommu_type1_recycle_ephemeral_iovas(vfio);
+	idx = (unsigned int)((iova - vfio->ephemerals.start) / VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK);
+
+	if (atomic_dec_fetch(&chunks[idx].nrefs) == 0)
+		vfio_iommu_type1_recycle_ephemeral_chunk(vfio, idx);
 }
 
 #ifdef VFIO_UNMAP_ALL
@@ -1037,7 +1140,7 @@ static int vfio_iommu_type1_do_dma_unmap_all(struct iommu_ctx *ctx)
 
 	{
 		__autolock(&vfio->lock);
-		skiplist_clear_with(&vfio->free_iovas, NULL, NULL);
+		iova_allocator_clear(&vfio->free_iovas);
 	}
 
 	return 0;
@@ -1047,10 +1150,14 @@ static int vfio_iommu_type1_do_dma_unmap_all(struct iommu_ctx *ctx)
 static const struct iommu_ctx_ops vfio_ops = {
 	.get_device_fd = vfio_get_device_fd,
 	.put_device_fd = vfio_put_device_fd,
+	.ctx_get = vfio_ctx_get,
+	.ctx_put = vfio_ctx_put,
 
 	.iova_reserve = vfio_iommu_type1_iova_reserve,
 	.iova_reserve_align = vfio_iommu_type1_iova_reserve_align,
+	.iova_put = vfio_iova_put,
 	.iova_put_ephemeral = vfio_iommu_type1_iova_put_ephemeral,
+	.iova_set_ephemeral_area = vfio_iommu_type1_iova_set_ephemeral_area,
 
 	.dma_map = vfio_iommu_type1_do_dma_map,
 	.dma_unmap = vfio_iommu_type1_do_dma_unmap,
@@ -1077,7 +1184,15 @@ static int vfio_init_container(struct vfio_container *vfio)
 		return -1;
 	}
 
-	skiplist_init(&vfio->free_iovas);
+	if (pthread_key_create(&vfio->ephemeral_key, __vfio_ephemeral_tls_release)) {
+		log_debug("failed to create ephemeral key\n");
+		return -1;
+	}
+
+	list_head_init(&vfio->ephemeral_tls);
+	list_head_init(&vfio->areas);
+
+	iova_allocator_init(&vfio->free_iovas);
 	memcpy(&vfio->ctx.ops, &vfio_ops, sizeof(vfio->ctx.ops));
 
 	return 0;
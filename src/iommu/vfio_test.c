@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "vfio.c"
+
+#define PAGE 0x1000ULL
+#define CHUNK VFIO_IOMMU_TYPE1_EPHEMERAL_CHUNK
+
+static struct vfio_container vfio;
+
+static struct iommu_iova_range range = {
+	.start = 0x100000000ULL,
+	.last = 0x1ffffffffULL,
+};
+
+char *pci_get_iommu_group(const char *bdf UNUSED)
+{
+	return NULL;
+}
+
+bool pci_is_sriov_supported(const char *bdf UNUSED)
+{
+	return false;
+}
+
+void iommu_ctx_init(struct iommu_ctx *ctx UNUSED)
+{
+}
+
+void iommu_ctx_destroy(struct iommu_ctx *ctx UNUSED)
+{
+}
+
+int iommu_iova_range_to_string(struct iommu_iova_range *r UNUSED, char **str)
+{
+	*str = strdup("");
+
+	return 0;
+}
+
+static int reserve(size_t len, iova_t *iova)
+{
+	return vfio_iommu_type1_iova_reserve(&vfio.ctx, len, iova, IOMMU_MAP_EPHEMERAL);
+}
+
+static void put(iova_t iova)
+{
+	vfio_iommu_type1_iova_put_ephemeral(&vfio.ctx, iova);
+}
+
+struct thread_result {
+	int ret, err;
+	iova_t iova;
+};
+
+/* reserve an ephemeral page from another thread (which owns its own chunk) */
+static void *__thread_reserve(void *opaque)
+{
+	struct thread_result *res = opaque;
+
+	res->ret = reserve(PAGE, &res->iova);
+	res->err = errno;
+
+	return NULL;
+}
+
+static struct thread_result thread_reserve(void)
+{
+	struct thread_result res = {};
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, __thread_reserve, &res))
+		return (struct thread_result) {.ret = -1};
+
+	pthread_join(thread, NULL);
+
+	return res;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	struct thread_result res;
+	struct vfio_ephemeral_chunk *c;
+	iova_t iova[4], large, start;
+
+	plan_tests(14);
+
+	vfio.ctx.iova_ranges = &range;
+	vfio.ctx.nranges = 1;
+
+	pthread_mutex_init(&vfio.lock, NULL);
+	pthread_key_create(&vfio.ephemeral_key, __vfio_ephemeral_tls_release);
+	list_head_init(&vfio.ephemeral_tls);
+	list_head_init(&vfio.areas);
+	iova_allocator_init(&vfio.free_iovas);
+
+	ok(vfio_iommu_type1_iova_set_ephemeral_area(&vfio.ctx, CHUNK + 1) == 0 &&
+	   vfio.ephemeral_len == 2 * CHUNK, "area is rounded up to the chunk size");
+
+	ok(reserve(PAGE, &iova[0]) == 0 && iova[0] == range.start &&
+	   vfio.nchunks == 2, "area is reserved on first use");
+
+	start = vfio.ephemerals.start;
+
+	ok(reserve(PAGE, &iova[1]) == 0 && iova[1] == start + PAGE,
+	   "allocate from the chunk of the thread");
+
+	ok(vfio_iommu_type1_iova_set_ephemeral_area(&vfio.ctx, CHUNK) == -1 && errno == EBUSY,
+	   "area cannot be resized once reserved");
+
+	ok(reserve(2 * CHUNK, &large) == 0 && large > vfio.ephemerals.last,
+	   "large ephemeral is allocated outside of the area");
+
+	ok(reserve(CHUNK - 2 * PAGE, &iova[2]) == 0 && iova[2] == start + 2 * PAGE,
+	   "fill the chunk");
+
+	ok(reserve(PAGE, &iova[3]) == 0 && iova[3] == start + CHUNK &&
+	   vfio.chunks[0].state == VFIO_EPHEMERAL_CHUNK_RETIRED,
+	   "move on to a new chunk when full");
+
+	res = thread_reserve();
+	ok(res.ret == -1 && res.err == ENOMEM, "no free chunk for another thread");
+
+	put(iova[0]);
+	put(iova[1]);
+
+	ok(vfio.chunks[0].state == VFIO_EPHEMERAL_CHUNK_RETIRED,
+	   "retired chunk with mappings is not recycled");
+
+	put(iova[2]);
+
+	ok(vfio.chunks[0].state == VFIO_EPHEMERAL_CHUNK_FREE,
+	   "retired chunk is recycled with its last mapping");
+
+	res = thread_reserve();
+	ok(res.ret == 0 && res.iova == start, "another thread reuses the recycled chunk");
+
+	put(res.iova);
+
+	ok(vfio.chunks[0].state == VFIO_EPHEMERAL_CHUNK_FREE,
+	   "chunk is recycled once its thread has exited");
+
+	/* a range coalesced across the end of the area */
+	vfio_iova_put(&vfio.ctx, start + 2 * CHUNK - PAGE, PAGE + 2 * CHUNK);
+
+	ok(btree_find(&vfio.free_iovas.ranges, large) && !btree_find(&vfio.free_iovas.ranges, start),
+	   "only the iovas outside of the area are released");
+
+	/* the chunk owned by this thread outlives a reset of the area */
+	c = vfio.chunks;
+
+	pthread_mutex_lock(&vfio.lock);
+	__vfio_ephemerals_reset(&vfio);
+	pthread_mutex_unlock(&vfio.lock);
+
+	ok(reserve(PAGE, &iova[0]) == 0 && vfio.chunks != c && vfio.chunks[0].nrefs == 1 &&
+	   list_top(&vfio.areas, struct vfio_ephemeral_area, list)->chunks == c,
+	   "reset area is kept and a new one is reserved");
+
+	return exit_status();
+}
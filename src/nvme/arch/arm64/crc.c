@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * CRC folding using the polynomial multiply long (PMULL) instruction. See
+ * arch/x86_64/crc.c for a description of the algorithm and constants.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/auxv.h>
+
+#include <asm/hwcap.h>
+
+#include <arm_neon.h>
+
+#include "nvme/crc.h"
+
+/* { x^(D + 63) mod P, x^(D - 1) mod P }, bit reflected */
+#define CRC64_K128	0xeadc41fd2ba3d420ULL, 0x21e9761e252621acULL
+#define CRC64_K256	0xb0bc2e589204f500ULL, 0xe1e0bb9d45d7a44cULL
+#define CRC64_K384	0xbdd7ac0ee1a4a0f0ULL, 0xa3ffdc1fe8e82a8bULL
+#define CRC64_K512	0x0c32cdb31e18a84aULL, 0x62242240ace5045aULL
+
+/* { x^(D + 64) mod P, x^D mod P } */
+#define CRC16_K128	0x1faa, 0xa010
+#define CRC16_K256	0x7acc, 0x857d
+#define CRC16_K384	0x4a84, 0x84da
+#define CRC16_K512	0xdd31, 0x1069
+
+#define __pmull __attribute__((target("+crypto")))
+
+static __pmull __always_inline poly64x2_t __k(uint64_t lo, uint64_t hi)
+{
+	return vreinterpretq_p64_u64(vcombine_u64(vcreate_u64(lo), vcreate_u64(hi)));
+}
+
+/*
+ * For the reflected CRC64, the high part of the polynomial is in the low
+ * doubleword; for the byte swapped CRC16 it is in the high doubleword.
+ */
+#define __k64(h, l) __k((h), (l))
+#define __k16(h, l) __k((l), (h))
+#define k64(k) __k64(k)
+#define k16(k) __k16(k)
+
+static __pmull __always_inline uint8x16_t __fold(uint8x16_t x, poly64x2_t k)
+{
+	poly64x2_t p = vreinterpretq_p64_u8(x);
+
+	return veorq_u8(vreinterpretq_u8_p128(vmull_p64(vgetq_lane_p64(p, 0),
+							 vgetq_lane_p64(k, 0))),
+			vreinterpretq_u8_p128(vmull_high_p64(p, k)));
+}
+
+static __pmull __always_inline uint8x16_t __bswap(uint8x16_t x)
+{
+	uint8x16_t r = vrev64q_u8(x);
+
+	return vextq_u8(r, r, 8);
+}
+
+static __pmull __always_inline uint8x16_t __load(const unsigned char *p)
+{
+	return vld1q_u8(p);
+}
+
+static __pmull __always_inline uint8x16_t __load_bswap(const unsigned char *p)
+{
+	return __bswap(vld1q_u8(p));
+}
+
+static __pmull uint64_t __crc64_pmull(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	uint8x16_t x0, x1, x2, x3;
+	unsigned char tmp[16];
+
+	if (len < 64)
+		return __nvme_crc64_sb8(crc, buffer, len);
+
+	x0 = veorq_u8(__load(buffer), vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(crc),
+									vcreate_u64(0))));
+	x1 = __load(buffer + 16);
+	x2 = __load(buffer + 32);
+	x3 = __load(buffer + 48);
+
+	for (buffer += 64, len -= 64; len >= 64; buffer += 64, len -= 64) {
+		x0 = veorq_u8(__fold(x0, k64(CRC64_K512)), __load(buffer));
+		x1 = veorq_u8(__fold(x1, k64(CRC64_K512)), __load(buffer + 16));
+		x2 = veorq_u8(__fold(x2, k64(CRC64_K512)), __load(buffer + 32));
+		x3 = veorq_u8(__fold(x3, k64(CRC64_K512)), __load(buffer + 48));
+	}
+
+	x0 = veorq_u8(__fold(x0, k64(CRC64_K384)), __fold(x1, k64(CRC64_K256)));
+	x0 = veorq_u8(x0, veorq_u8(__fold(x2, k64(CRC64_K128)), x3));
+
+	for (; len >= 16; buffer += 16, len -= 16)
+		x0 = veorq_u8(__fold(x0, k64(CRC64_K128)), __load(buffer));
+
+	vst1q_u8(tmp, x0);
+
+	crc = __nvme_crc64_sb8(0, tmp, sizeof(tmp));
+
+	return __nvme_crc64_sb8(crc, buffer, len);
+}
+
+static __pmull uint16_t __crc16_pmull(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	uint8x16_t x0, x1, x2, x3;
+	unsigned char tmp[16];
+
+	if (len < 64)
+		return __nvme_crc16_t10dif_sb8(crc, buffer, len);
+
+	x0 = veorq_u8(__load_bswap(buffer),
+		      vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(0),
+							vcreate_u64((uint64_t)crc << 48))));
+	x1 = __load_bswap(buffer + 16);
+	x2 = __load_bswap(buffer + 32);
+	x3 = __load_bswap(buffer + 48);
+
+	for (buffer += 64, len -= 64; len >= 64; buffer += 64, len -= 64) {
+		x0 = veorq_u8(__fold(x0, k16(CRC16_K512)), __load_bswap(buffer));
+		x1 = veorq_u8(__fold(x1, k16(CRC16_K512)), __load_bswap(buffer + 16));
+		x2 = veorq_u8(__fold(x2, k16(CRC16_K512)), __load_bswap(buffer + 32));
+		x3 = veorq_u8(__fold(x3, k16(CRC16_K512)), __load_bswap(buffer + 48));
+	}
+
+	x0 = veorq_u8(__fold(x0, k16(CRC16_K384)), __fold(x1, k16(CRC16_K256)));
+	x0 = veorq_u8(x0, veorq_u8(__fold(x2, k16(CRC16_K128)), x3));
+
+	for (; len >= 16; buffer += 16, len -= 16)
+		x0 = veorq_u8(__fold(x0, k16(CRC16_K128)), __load_bswap(buffer));
+
+	vst1q_u8(tmp, __bswap(x0));
+
+	crc = __nvme_crc16_t10dif_sb8(0, tmp, sizeof(tmp));
+
+	return __nvme_crc16_t10dif_sb8(crc, buffer, len);
+}
+
+static bool __pmull_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+
+const struct nvme_crc_impl nvme_crc_impls_arch[] = {
+	{
+		.name = "pmull",
+		.supported = __pmull_supported,
+		.crc64 = __crc64_pmull,
+		.crc16 = __crc16_pmull,
+	},
+	{},
+};
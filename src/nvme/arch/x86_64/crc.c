@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * CRC folding using carry-less multiplication (see "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction", Intel, 2009).
+ *
+ * The input is folded into 128 bit accumulators; a 128 bit accumulator X
+ * (high part H, low part L) is folded forward across D bits by computing
+ * H * (x^(D + 64) mod P) + L * (x^D mod P). When the input is exhausted, the
+ * accumulator is congruent (modulo P) to the input processed so far and the
+ * final reduction is done by running it through the slicing-by-8 kernel.
+ *
+ * The NVMe CRC64 is bit reflected, so the constants are bit reflected as
+ * well. Since the carry-less product of two bit reflected 64 bit values is
+ * off by one bit, the CRC64 constants are x^(D - 1) and x^(D + 63) mod P. The
+ * T10-DIF CRC16 is not reflected and the input is byte swapped instead.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "nvme/crc.h"
+
+/* { x^(D + 63) mod P, x^(D - 1) mod P }, bit reflected */
+#define CRC64_K128	0xeadc41fd2ba3d420ULL, 0x21e9761e252621acULL
+#define CRC64_K256	0xb0bc2e589204f500ULL, 0xe1e0bb9d45d7a44cULL
+#define CRC64_K384	0xbdd7ac0ee1a4a0f0ULL, 0xa3ffdc1fe8e82a8bULL
+#define CRC64_K512	0x0c32cdb31e18a84aULL, 0x62242240ace5045aULL
+#define CRC64_K768	0x3c255f5ebc414423ULL, 0x34f5a24e22d66e90ULL
+#define CRC64_K1024	0xa1ca681e733f9c40ULL, 0x5f852fb61e8d92dcULL
+
+/* { x^(D + 64) mod P, x^D mod P } */
+#define CRC16_K128	0x1faa, 0xa010
+#define CRC16_K256	0x7acc, 0x857d
+#define CRC16_K384	0x4a84, 0x84da
+#define CRC16_K512	0xdd31, 0x1069
+#define CRC16_K768	0x4132, 0xdfcb
+#define CRC16_K1024	0x2295, 0x6123
+
+/*
+ * For the reflected CRC64, the high part of the polynomial is in the low
+ * quadword; for the byte swapped CRC16 it is in the high quadword.
+ */
+#define __k64(h, l) _mm_set_epi64x((long long)(l), (long long)(h))
+#define __k16(h, l) _mm_set_epi64x((h), (l))
+#define k64(k) __k64(k)
+#define k16(k) __k16(k)
+
+#define __k64_256(h, l) \
+	_mm256_set_epi64x((long long)(l), (long long)(h), (long long)(l), (long long)(h))
+#define __k16_256(h, l) _mm256_set_epi64x((h), (l), (h), (l))
+#define k64_256(k) __k64_256(k)
+#define k16_256(k) __k16_256(k)
+
+#define BSWAP128 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+
+/*
+ * The 128 bit helpers and kernels are always inlined such that they are VEX
+ * encoded when used from the 256 bit kernels (avoiding SSE/AVX transition
+ * penalties).
+ */
+#define __pclmul __attribute__((target("pclmul,ssse3")))
+#define __vpclmul __attribute__((target("pclmul,vpclmulqdq,avx2")))
+
+static __pclmul __always_inline __m128i __fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+static __vpclmul __always_inline __m256i __fold256(__m256i x, __m256i k)
+{
+	return _mm256_xor_si256(_mm256_clmulepi64_epi128(x, k, 0x00),
+				_mm256_clmulepi64_epi128(x, k, 0x11));
+}
+
+static __pclmul __always_inline __m128i __load(const unsigned char *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static __pclmul __always_inline __m128i __load_bswap(const unsigned char *p)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), _mm_setr_epi8(BSWAP128));
+}
+
+static __vpclmul __always_inline __m256i __load256(const unsigned char *p)
+{
+	return _mm256_loadu_si256((const __m256i *)p);
+}
+
+static __vpclmul __always_inline __m256i
+__load256_bswap(const unsigned char *p)
+{
+	return _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)p),
+				   _mm256_setr_epi8(BSWAP128, BSWAP128));
+}
+
+/*
+ * Fold the remaining 16 byte blocks into the accumulator and reduce.
+ */
+static __pclmul __always_inline uint64_t
+__crc64_pclmul_tail(__m128i x, const unsigned char *buffer, size_t len)
+{
+	unsigned char tmp[16];
+	uint64_t crc;
+
+	for (; len >= 16; buffer += 16, len -= 16)
+		x = _mm_xor_si128(__fold(x, k64(CRC64_K128)), __load(buffer));
+
+	_mm_storeu_si128((__m128i *)tmp, x);
+
+	crc = __nvme_crc64_sb8(0, tmp, sizeof(tmp));
+
+	return __nvme_crc64_sb8(crc, buffer, len);
+}
+
+static __pclmul __always_inline uint16_t
+__crc16_pclmul_tail(__m128i x, const unsigned char *buffer, size_t len)
+{
+	unsigned char tmp[16];
+	uint16_t crc;
+
+	for (; len >= 16; buffer += 16, len -= 16)
+		x = _mm_xor_si128(__fold(x, k16(CRC16_K128)), __load_bswap(buffer));
+
+	_mm_storeu_si128((__m128i *)tmp, _mm_shuffle_epi8(x, _mm_setr_epi8(BSWAP128)));
+
+	crc = __nvme_crc16_t10dif_sb8(0, tmp, sizeof(tmp));
+
+	return __nvme_crc16_t10dif_sb8(crc, buffer, len);
+}
+
+static __pclmul __always_inline uint64_t
+__crc64_pclmul(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	__m128i x0, x1, x2, x3;
+
+	if (len < 64)
+		return __nvme_crc64_sb8(crc, buffer, len);
+
+	x0 = _mm_xor_si128(__load(buffer), _mm_set_epi64x(0, (long long)crc));
+	x1 = __load(buffer + 16);
+	x2 = __load(buffer + 32);
+	x3 = __load(buffer + 48);
+
+	for (buffer += 64, len -= 64; len >= 64; buffer += 64, len -= 64) {
+		x0 = _mm_xor_si128(__fold(x0, k64(CRC64_K512)), __load(buffer));
+		x1 = _mm_xor_si128(__fold(x1, k64(CRC64_K512)), __load(buffer + 16));
+		x2 = _mm_xor_si128(__fold(x2, k64(CRC64_K512)), __load(buffer + 32));
+		x3 = _mm_xor_si128(__fold(x3, k64(CRC64_K512)), __load(buffer + 48));
+	}
+
+	x0 = _mm_xor_si128(__fold(x0, k64(CRC64_K384)), __fold(x1, k64(CRC64_K256)));
+	x0 = _mm_xor_si128(x0, _mm_xor_si128(__fold(x2, k64(CRC64_K128)), x3));
+
+	return __crc64_pclmul_tail(x0, buffer, len);
+}
+
+static __pclmul __always_inline uint16_t
+__crc16_pclmul(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	__m128i x0, x1, x2, x3;
+
+	if (len < 64)
+		return __nvme_crc16_t10dif_sb8(crc, buffer, len);
+
+	x0 = _mm_xor_si128(__load_bswap(buffer),
+			   _mm_set_epi64x((long long)((uint64_t)crc << 48), 0));
+	x1 = __load_bswap(buffer + 16);
+	x2 = __load_bswap(buffer + 32);
+	x3 = __load_bswap(buffer + 48);
+
+	for (buffer += 64, len -= 64; len >= 64; buffer += 64, len -= 64) {
+		x0 = _mm_xor_si128(__fold(x0, k16(CRC16_K512)), __load_bswap(buffer));
+		x1 = _mm_xor_si128(__fold(x1, k16(CRC16_K512)), __load_bswap(buffer + 16));
+		x2 = _mm_xor_si128(__fold(x2, k16(CRC16_K512)), __load_bswap(buffer + 32));
+		x3 = _mm_xor_si128(__fold(x3, k16(CRC16_K512)), __load_bswap(buffer + 48));
+	}
+
+	x0 = _mm_xor_si128(__fold(x0, k16(CRC16_K384)), __fold(x1, k16(CRC16_K256)));
+	x0 = _mm_xor_si128(x0, _mm_xor_si128(__fold(x2, k16(CRC16_K128)), x3));
+
+	return __crc16_pclmul_tail(x0, buffer, len);
+}
+
+/*
+ * Reduce a 256 bit accumulator (two 128 bit lanes) to a single 128 bit
+ * accumulator.
+ */
+static __vpclmul __always_inline __m128i __reduce256(__m256i y, __m128i k)
+{
+	return _mm_xor_si128(__fold(_mm256_castsi256_si128(y), k), _mm256_extracti128_si256(y, 1));
+}
+
+static __vpclmul uint64_t
+__crc64_vpclmul(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	__m256i y0, y1, y2, y3;
+
+	if (len < 256)
+		return __crc64_pclmul(crc, buffer, len);
+
+	y0 = _mm256_xor_si256(__load256(buffer), _mm256_set_epi64x(0, 0, 0, (long long)crc));
+	y1 = __load256(buffer + 32);
+	y2 = __load256(buffer + 64);
+	y3 = __load256(buffer + 96);
+
+	for (buffer += 128, len -= 128; len >= 128; buffer += 128, len -= 128) {
+		y0 = _mm256_xor_si256(__fold256(y0, k64_256(CRC64_K1024)), __load256(buffer));
+		y1 = _mm256_xor_si256(__fold256(y1, k64_256(CRC64_K1024)), __load256(buffer + 32));
+		y2 = _mm256_xor_si256(__fold256(y2, k64_256(CRC64_K1024)), __load256(buffer + 64));
+		y3 = _mm256_xor_si256(__fold256(y3, k64_256(CRC64_K1024)), __load256(buffer + 96));
+	}
+
+	y0 = _mm256_xor_si256(__fold256(y0, k64_256(CRC64_K768)),
+			      __fold256(y1, k64_256(CRC64_K512)));
+	y0 = _mm256_xor_si256(y0, _mm256_xor_si256(__fold256(y2, k64_256(CRC64_K256)), y3));
+
+	return __crc64_pclmul_tail(__reduce256(y0, k64(CRC64_K128)), buffer, len);
+}
+
+static __vpclmul uint16_t
+__crc16_vpclmul(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	__m256i y0, y1, y2, y3;
+
+	if (len < 256)
+		return __crc16_pclmul(crc, buffer, len);
+
+	y0 = _mm256_xor_si256(__load256_bswap(buffer),
+			      _mm256_set_epi64x(0, 0, (long long)((uint64_t)crc << 48), 0));
+	y1 = __load256_bswap(buffer + 32);
+	y2 = __load256_bswap(buffer + 64);
+	y3 = __load256_bswap(buffer + 96);
+
+	for (buffer += 128, len -= 128; len >= 128; buffer += 128, len -= 128) {
+		y0 = _mm256_xor_si256(__fold256(y0, k16_256(CRC16_K1024)), __load256_bswap(buffer));
+		y1 = _mm256_xor_si256(__fold256(y1, k16_256(CRC16_K1024)),
+				      __load256_bswap(buffer + 32));
+		y2 = _mm256_xor_si256(__fold256(y2, k16_256(CRC16_K1024)),
+				      __load256_bswap(buffer + 64));
+		y3 = _mm256_xor_si256(__fold256(y3, k16_256(CRC16_K1024)),
+				      __load256_bswap(buffer + 96));
+	}
+
+	y0 = _mm256_xor_si256(__fold256(y0, k16_256(CRC16_K768)),
+			      __fold256(y1, k16_256(CRC16_K512)));
+	y0 = _mm256_xor_si256(y0, _mm256_xor_si256(__fold256(y2, k16_256(CRC16_K256)), y3));
+
+	return __crc16_pclmul_tail(__reduce256(y0, k16(CRC16_K128)), buffer, len);
+}
+
+static bool __pclmul_supported(void)
+{
+	return cpu_supports("pclmul") && cpu_supports("ssse3");
+}
+
+static bool __vpclmul_supported(void)
+{
+	return __pclmul_supported() && cpu_supports("vpclmulqdq") && cpu_supports("avx2");
+}
+
+const struct nvme_crc_impl nvme_crc_impls_arch[] = {
+	{
+		.name = "vpclmulqdq",
+		.supported = __vpclmul_supported,
+		.crc64 = __crc64_vpclmul,
+		.crc16 = __crc16_vpclmul,
+	},
+	{
+		.name = "pclmulqdq",
+		.supported = __pclmul_supported,
+		.crc64 = __crc64_pclmul,
+		.crc16 = __crc16_pclmul,
+	},
+	{},
+};
@@ -43,6 +43,9 @@
 
 #include "types.h"
 
+/* a few slabs worth of small buffers; see src/iommu/dmapool.c */
+#define NVME_CTRL_DMAPOOL_SIZE (256 << 10)
+
 #define cqhdbl(doorbells, qid, dstrd) \
 	(doorbells + (2 * qid + 1) * (4 << dstrd))
 
@@ -109,13 +112,69 @@ int nvme_del_ctrl(struct nvme_ctrl *ctrl)
 	return 0;
 }
 
+/* the capabilities register is constant, so only read it once */
+static inline uint64_t __nvme_cap(struct nvme_ctrl *ctrl)
+{
+	uint64_t cap;
+
+	if (likely(ctrl->config.cap))
+		return ctrl->config.cap;
+
+	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	if (cap != UINT64_MAX)
+		ctrl->config.cap = cap;
+
+	return cap;
+}
+
+static inline int __nqnodes(struct nvme_ctrl *ctrl)
+{
+	return max_t(int, ctrl->opts.nsqr, ctrl->opts.ncqr) + 2;
+}
+
+static int __queue_node(struct nvme_ctrl *ctrl, int qid)
+{
+	if (ctrl->qnodes && ctrl->qnodes[qid])
+		return ctrl->qnodes[qid] - 1;
+
+	if (ctrl->opts.dmabuf_flags & IOMMU_DMABUF_NODE_MASK)
+		return iommu_dmabuf_node(ctrl->opts.dmabuf_flags);
+
+	return ctrl->pci.numa_node;
+}
+
+/* the dmabuf flags for the memory of the queue pair identified by qid */
+static unsigned long __queue_dmabuf_flags(struct nvme_ctrl *ctrl, int qid)
+{
+	unsigned long flags = ctrl->opts.dmabuf_flags & ~IOMMU_DMABUF_NODE_MASK;
+	int node = __queue_node(ctrl, qid);
+
+	if (node >= 0)
+		flags |= IOMMU_DMABUF_NODE(node);
+
+	return flags;
+}
+
+int nvme_set_queue_node(struct nvme_ctrl *ctrl, int qid, int node)
+{
+	if (!ctrl->qnodes || qid < 0 || qid >= __nqnodes(ctrl) || node < -1 ||
+	    node > PGMAP_MAX_NODE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctrl->qnodes[qid] = node + 1;
+
+	return 0;
+}
+
 static int __nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize,
                                int vector, struct nvme_cq *cq)
 {
 	uint64_t cap;
 	uint8_t dstrd;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	cap = __nvme_cap(ctrl);
 	if (cap == UINT64_MAX) {
 		log_error("failed to read cap; controller not accessible\n");
 
@@ -164,7 +223,8 @@ int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
 	if (__nvme_configure_cq(ctrl, qid, qsize, vector, cq) < 0)
 		return -1;
 
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &cq->mem, qsize << NVME_CQES, 0x0)) {
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &cq->mem, qsize << NVME_CQES,
+			     __queue_dmabuf_flags(ctrl, qid))) {
 		return -1;
 	}
 
@@ -211,11 +271,11 @@ static int __nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 {
 	uint64_t cap;
 	uint8_t dstrd;
-	size_t pagesize;
+	size_t pagesize, pages_len, meta_len;
 
 	pagesize = __mps_to_pagesize(ctrl->config.mps);
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	cap = __nvme_cap(ctrl);
 	if (cap == UINT64_MAX) {
 		log_error("failed to read cap; controller not accessible\n");
 
@@ -256,12 +316,23 @@ static int __nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 
 	/*
 	 * Use ctrl->config.mps instead of host page size, as we have the
-	 * opportunity to pack the allocations.
+	 * opportunity to pack the allocations. The metadata SGL descriptors of
+	 * the request trackers are packed after the pages.
 	 */
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->pages, __abort_on_overflow(qsize, pagesize), 0x0))
+	pages_len = __abort_on_overflow(qsize, pagesize);
+	meta_len = ALIGN_UP((qsize - 1) * sizeof(struct nvme_sgld), pagesize);
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->pages, pages_len + meta_len,
+			     __queue_dmabuf_flags(ctrl, qid)))
 		return -1;
 
-	sq->rqs = znew_t(struct nvme_rq, qsize - 1);
+	/* page mapped (and thus zeroed) such that it can be placed on the node */
+	if (pgmapf((void **)&sq->rqs, (qsize - 1) * sizeof(struct nvme_rq),
+		   PGMAP_NODE(__queue_node(ctrl, qid))) < 0) {
+		iommu_put_dmabuf(&sq->pages);
+		return -1;
+	}
+
 	sq->rq_top = &sq->rqs[qsize - 2];
 
 	for (int i = 0; i < qsize - 1; i++) {
@@ -273,6 +344,9 @@ static int __nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 		rq->page.vaddr = sq->pages.vaddr + (i << __mps_to_pageshift(ctrl->config.mps));
 		rq->page.iova = sq->pages.iova + (i << __mps_to_pageshift(ctrl->config.mps));
 
+		rq->meta.vaddr = sq->pages.vaddr + pages_len + i * sizeof(struct nvme_sgld);
+		rq->meta.iova = sq->pages.iova + pages_len + i * sizeof(struct nvme_sgld);
+
 		if (i > 0)
 			rq->rq_next = &sq->rqs[i - 1];
 	}
@@ -280,6 +354,11 @@ static int __nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 	return 0;
 }
 
+static void __nvme_free_rqs(struct nvme_sq *sq)
+{
+	pgunmap(sq->rqs, (sq->qsize - 1) * sizeof(struct nvme_rq));
+}
+
 int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 		      struct nvme_cq *cq, unsigned long UNUSED flags)
 {
@@ -288,8 +367,9 @@ int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 	if (__nvme_configure_sq(ctrl, qid, qsize, cq, sq) < 0)
 		return -1;
 
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->mem, qsize << NVME_SQES, 0x0)) {
-		free(sq->rqs);
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->mem, qsize << NVME_SQES,
+			     __queue_dmabuf_flags(ctrl, qid))) {
+		__nvme_free_rqs(sq);
 		iommu_put_dmabuf(&sq->pages);
 		return -1;
 	}
@@ -317,6 +397,38 @@ int nvme_configure_sq_mem(struct nvme_ctrl *ctrl, int qid, int qsize,
 	return 0;
 }
 
+int nvme_configure_sq_bounce(struct nvme_ctrl *ctrl, struct nvme_sq *sq, size_t len)
+{
+	size_t pagesize = __mps_to_pagesize(ctrl->config.mps);
+	int nrqs = sq->qsize - 1;
+
+	if (!sq->rqs || !len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (sq->bounce.vaddr) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	len = ALIGN_UP(len, pagesize);
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->bounce, __abort_on_overflow(nrqs, len),
+			     __queue_dmabuf_flags(ctrl, sq->id)))
+		return -1;
+
+	for (int i = 0; i < nrqs; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+
+		rq->bounce.vaddr = sq->bounce.vaddr + i * len;
+		rq->bounce.iova = sq->bounce.iova + i * len;
+		rq->bounce.len = len;
+	}
+
+	return 0;
+}
+
 void nvme_discard_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
 {
 	if (!sq->mem.vaddr)
@@ -325,9 +437,10 @@ void nvme_discard_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
 	if (!(sq->flags & NVME_Q_MEM_PREALLOCATED))
 		iommu_put_dmabuf(&sq->mem);
 
-	free(sq->rqs);
+	__nvme_free_rqs(sq);
 
 	iommu_put_dmabuf(&sq->pages);
+	iommu_put_dmabuf(&sq->bounce);
 
 	if (ctrl->dbbuf.doorbells.vaddr) {
 		__STORE_PTR(uint32_t *, sq->dbbuf.doorbell, 0);
@@ -347,6 +460,12 @@ static int __nvme_configure_adminq(struct nvme_ctrl *ctrl, int sq_size, int cq_s
 	ctrl->adminq.cq = cq;
 	ctrl->adminq.sq = sq;
 
+	/* kept across nvme_recover() */
+	if (!ctrl->admin_reqs) {
+		ctrl->admin_reqs = znew_t(struct nvme_admin_req *, sq_size - 1);
+		ctrl->aer_cqes = znew_t(struct nvme_cqe, sq_size - 1);
+	}
+
 	aqa = (sq_size - 1);
 	aqa |= (cq_size - 1) << 16;
 
@@ -410,32 +529,56 @@ static int __admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe)
 	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, NULL, 0, NULL);
 }
 
-int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+static void __nvme_prep_create_cq(union nvme_cmd *cmd, struct nvme_cq *cq)
 {
-	struct nvme_cq *cq = &ctrl->cq[qid];
-	union nvme_cmd cmd;
-
 	uint16_t qflags = NVME_Q_PC;
 	uint16_t iv = 0;
 
-	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
-		log_debug("could not configure io completion queue\n");
-		return -1;
-	}
-
-	if (vector != -1) {
+	if (cq->vector != -1) {
 		qflags |= NVME_CQ_IEN;
-		iv = (uint16_t)vector;
+		iv = (uint16_t)cq->vector;
 	}
 
-	cmd.create_cq = (struct nvme_cmd_create_cq) {
+	cmd->create_cq = (struct nvme_cmd_create_cq) {
 		.opcode = NVME_ADMIN_CREATE_CQ,
 		.prp1   = cpu_to_le64(cq->mem.iova),
-		.qid    = cpu_to_le16((uint16_t)qid),
-		.qsize  = cpu_to_le16((uint16_t)(qsize - 1)),
+		.qid    = cpu_to_le16((uint16_t)cq->id),
+		.qsize  = cpu_to_le16((uint16_t)(cq->qsize - 1)),
 		.qflags = cpu_to_le16(qflags),
 		.iv     = cpu_to_le16(iv),
 	};
+}
+
+static void __nvme_prep_create_sq(union nvme_cmd *cmd, struct nvme_sq *sq)
+{
+	cmd->create_sq = (struct nvme_cmd_create_sq) {
+		.opcode = NVME_ADMIN_CREATE_SQ,
+		.prp1   = cpu_to_le64(sq->mem.iova),
+		.qid    = cpu_to_le16((uint16_t)sq->id),
+		.qsize  = cpu_to_le16((uint16_t)(sq->qsize - 1)),
+		.qflags = cpu_to_le16(NVME_Q_PC),
+		.cqid   = cpu_to_le16((uint16_t)sq->cq->id),
+	};
+}
+
+static void __nvme_prep_delete_q(union nvme_cmd *cmd, uint8_t opcode, int qid)
+{
+	cmd->delete_q = (struct nvme_cmd_delete_q) {
+		.opcode = opcode,
+		.qid = cpu_to_le16((uint16_t)qid),
+	};
+}
+
+int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+{
+	union nvme_cmd cmd;
+
+	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
+		log_debug("could not configure io completion queue\n");
+		return -1;
+	}
+
+	__nvme_prep_create_cq(&cmd, &ctrl->cq[qid]);
 
 	return __admin(ctrl, &cmd);
 }
@@ -446,10 +589,7 @@ int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid)
 
 	nvme_discard_cq(ctrl, &ctrl->cq[qid]);
 
-	cmd.delete_q = (struct nvme_cmd_delete_q) {
-		.opcode = NVME_ADMIN_DELETE_CQ,
-		.qid = cpu_to_le16((uint16_t)qid),
-	};
+	__nvme_prep_delete_q(&cmd, NVME_ADMIN_DELETE_CQ, qid);
 
 	return __admin(ctrl, &cmd);
 }
@@ -457,7 +597,6 @@ int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid)
 int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
 		     unsigned long flags)
 {
-	struct nvme_sq *sq = &ctrl->sq[qid];
 	union nvme_cmd cmd;
 
 	if (nvme_configure_sq(ctrl, qid, qsize, cq, flags)) {
@@ -465,14 +604,7 @@ int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq
 		return -1;
 	}
 
-	cmd.create_sq = (struct nvme_cmd_create_sq) {
-		.opcode = NVME_ADMIN_CREATE_SQ,
-		.prp1   = cpu_to_le64(sq->mem.iova),
-		.qid    = cpu_to_le16((uint16_t)qid),
-		.qsize  = cpu_to_le16((uint16_t)(qsize - 1)),
-		.qflags = cpu_to_le16(NVME_Q_PC),
-		.cqid   = cpu_to_le16((uint16_t)cq->id),
-	};
+	__nvme_prep_create_sq(&cmd, &ctrl->sq[qid]);
 
 	return __admin(ctrl, &cmd);
 }
@@ -483,10 +615,7 @@ int nvme_delete_iosq(struct nvme_ctrl *ctrl, int qid)
 
 	nvme_discard_sq(ctrl, &ctrl->sq[qid]);
 
-	cmd.delete_q = (struct nvme_cmd_delete_q) {
-		.opcode = NVME_ADMIN_DELETE_SQ,
-		.qid = cpu_to_le16((uint16_t)qid),
-	};
+	__nvme_prep_delete_q(&cmd, NVME_ADMIN_DELETE_SQ, qid);
 
 	return __admin(ctrl, &cmd);
 }
@@ -521,38 +650,281 @@ int nvme_delete_ioqpair(struct nvme_ctrl *ctrl, int qid)
 	return 0;
 }
 
-static int nvme_wait_rdy(struct nvme_ctrl *ctrl, unsigned short rdy)
+/* a command of a pipelined batch; see __nvme_admin_batch() */
+struct nvme_batch_cmd {
+	union nvme_cmd cmd;
+
+	int *pending;
+	int err;
+};
+
+static void __nvme_batch_cb(struct nvme_ctrl *ctrl UNUSED, struct nvme_cqe *cqe, void *opaque)
 {
-	uint64_t cap;
-	uint32_t csts;
-	unsigned long timeout_ms;
-	struct timeabs deadline;
+	struct nvme_batch_cmd *c = opaque;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	c->err = nvme_set_errno_from_cqe(cqe) ? errno : 0;
+
+	(*c->pending)--;
+}
+
+/*
+ * Issue a batch of admin commands, keeping as many of them outstanding as there
+ * are admin request trackers available, and wait for all of them to complete.
+ * The status of each command is left in its err member.
+ */
+static int __nvme_admin_batch(struct nvme_ctrl *ctrl, struct nvme_batch_cmd *cmds, int n)
+{
+	int pending = 0, submitted = 0, err = 0;
+
+	while (submitted < n || pending) {
+		if (submitted < n) {
+			struct nvme_batch_cmd *c = &cmds[submitted];
+
+			c->pending = &pending;
+			c->err = 0;
+
+			if (!nvme_admin_async(ctrl, &c->cmd, NULL, 0, __nvme_batch_cb, c)) {
+				pending++;
+				submitted++;
+
+				continue;
+			}
+
+			/* give up on the rest, unless a tracker is freed up by a completion */
+			if (errno != EBUSY || !pending) {
+				err = errno;
+
+				for (; submitted < n; submitted++)
+					cmds[submitted].err = err;
+
+				continue;
+			}
+		}
+
+		nvme_admin_poll(ctrl, NULL);
+	}
+
+	for (int i = 0; i < n && !err; i++)
+		err = cmds[i].err;
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Delete the queues qid + i for which live[i] is set, clearing it for each queue
+ * that was deleted.
+ */
+static void __nvme_admin_batch_undo(struct nvme_ctrl *ctrl, struct nvme_batch_cmd *cmds, int n,
+				    uint8_t opcode, int qid, bool *live)
+{
+	__autofree int *idx = znew_t(int, n);
+	int m = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (!live[i])
+			continue;
+
+		idx[m] = i;
+		__nvme_prep_delete_q(&cmds[m++].cmd, opcode, qid + i);
+	}
+
+	if (!m)
+		return;
+
+	if (__nvme_admin_batch(ctrl, cmds, m))
+		log_debug("could not delete queues\n");
+
+	for (int j = 0; j < m; j++) {
+		if (!cmds[j].err)
+			live[idx[j]] = false;
+	}
+}
+
+int nvme_create_ioqpairs(struct nvme_ctrl *ctrl, int qid, int n, int qsize, int vector,
+			 unsigned long flags)
+{
+	__autofree struct nvme_batch_cmd *cmds = NULL;
+	__autofree bool *sq_live = NULL, *cq_live = NULL;
+	int i, err;
+
+	if (qid < 1 || n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* queues that exist on the controller */
+	sq_live = znew_t(bool, n);
+	cq_live = znew_t(bool, n);
+
+	for (i = 0; i < n; i++) {
+		int q = qid + i;
+
+		if (nvme_configure_cq(ctrl, q, qsize, vector == -1 ? -1 : vector + i)) {
+			log_debug("could not configure io completion queue\n");
+			goto discard;
+		}
+
+		if (nvme_configure_sq(ctrl, q, qsize, &ctrl->cq[q], flags)) {
+			log_debug("could not configure io submission queue\n");
+
+			nvme_discard_cq(ctrl, &ctrl->cq[q]);
+			goto discard;
+		}
+	}
+
+	cmds = znew_t(struct nvme_batch_cmd, n);
+
+	for (i = 0; i < n; i++)
+		__nvme_prep_create_cq(&cmds[i].cmd, &ctrl->cq[qid + i]);
+
+	if (__nvme_admin_batch(ctrl, cmds, n)) {
+		log_debug("could not create io completion queues\n");
+
+		err = errno;
+
+		for (i = 0; i < n; i++)
+			cq_live[i] = !cmds[i].err;
+
+		__nvme_admin_batch_undo(ctrl, cmds, n, NVME_ADMIN_DELETE_CQ, qid, cq_live);
+		goto discard_all;
+	}
+
+	for (i = 0; i < n; i++)
+		__nvme_prep_create_sq(&cmds[i].cmd, &ctrl->sq[qid + i]);
+
+	if (__nvme_admin_batch(ctrl, cmds, n)) {
+		log_debug("could not create io submission queues\n");
+
+		err = errno;
+
+		for (i = 0; i < n; i++)
+			sq_live[i] = !cmds[i].err;
+
+		__nvme_admin_batch_undo(ctrl, cmds, n, NVME_ADMIN_DELETE_SQ, qid, sq_live);
+
+		/* a completion queue cannot be deleted before its submission queue */
+		for (i = 0; i < n; i++)
+			cq_live[i] = !sq_live[i];
+
+		__nvme_admin_batch_undo(ctrl, cmds, n, NVME_ADMIN_DELETE_CQ, qid, cq_live);
+
+		for (i = 0; i < n; i++)
+			cq_live[i] |= sq_live[i];
+
+		goto discard_all;
+	}
+
+	return 0;
+
+discard:
+	err = errno;
+
+discard_all:
+	/* the controller may still use the memory of queues that were not deleted */
+	while (i--) {
+		if (sq_live[i] || cq_live[i])
+			log_error("io queue pair %d could not be deleted; left configured\n",
+				  qid + i);
+
+		if (!sq_live[i])
+			nvme_discard_sq(ctrl, &ctrl->sq[qid + i]);
+
+		if (!cq_live[i])
+			nvme_discard_cq(ctrl, &ctrl->cq[qid + i]);
+	}
+
+	errno = err;
+	return -1;
+}
+
+int nvme_delete_ioqpairs(struct nvme_ctrl *ctrl, int qid, int n)
+{
+	__autofree struct nvme_batch_cmd *cmds = NULL;
+	int ret = 0, err = 0;
+
+	if (qid < 1 || n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cmds = znew_t(struct nvme_batch_cmd, n);
+
+	for (int i = 0; i < n; i++)
+		__nvme_prep_delete_q(&cmds[i].cmd, NVME_ADMIN_DELETE_SQ, qid + i);
+
+	if (__nvme_admin_batch(ctrl, cmds, n)) {
+		log_debug("could not delete io submission queues\n");
+
+		ret = -1;
+		err = errno;
+	}
+
+	for (int i = 0; i < n; i++)
+		__nvme_prep_delete_q(&cmds[i].cmd, NVME_ADMIN_DELETE_CQ, qid + i);
+
+	if (__nvme_admin_batch(ctrl, cmds, n)) {
+		log_debug("could not delete io completion queues\n");
+
+		ret = -1;
+		err = err ? err : errno;
+	}
+
+	for (int i = 0; i < n; i++) {
+		nvme_discard_sq(ctrl, &ctrl->sq[qid + i]);
+		nvme_discard_cq(ctrl, &ctrl->cq[qid + i]);
+	}
+
+	if (ret)
+		errno = err;
+
+	return ret;
+}
+
+static uint64_t __nvme_rdy_deadline(struct nvme_ctrl *ctrl)
+{
+	uint64_t cap, timeout_ms;
+
+	cap = __nvme_cap(ctrl);
 	timeout_ms = 500 * (NVME_FIELD_GET(cap, CAP_TO) + 1);
-	deadline = timeabs_add(time_now(), time_from_msec(timeout_ms));
 
-	do {
-		if (time_after(time_now(), deadline)) {
+	return get_ticks() + timeout_ms * (__vfn_ticks_freq / 1000);
+}
+
+static inline bool __nvme_rdy(struct nvme_ctrl *ctrl, unsigned short rdy)
+{
+	uint32_t csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
+
+	return NVME_FIELD_GET(csts, CSTS_RDY) == rdy;
+}
+
+static int nvme_wait_rdy(struct nvme_ctrl *ctrl, unsigned short rdy)
+{
+	uint64_t deadline = __nvme_rdy_deadline(ctrl);
+
+	while (!__nvme_rdy(ctrl, rdy)) {
+		if (get_ticks() > deadline) {
 			log_debug("timed out\n");
 
 			errno = ETIMEDOUT;
 			return -1;
 		}
-
-		csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
-	} while (NVME_FIELD_GET(csts, CSTS_RDY) != rdy);
+	}
 
 	return 0;
 }
 
-int nvme_enable(struct nvme_ctrl *ctrl)
+static void __nvme_start_enable(struct nvme_ctrl *ctrl)
 {
 	uint8_t css;
 	uint32_t cc;
 	uint64_t cap;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	cap = __nvme_cap(ctrl);
 	css = NVME_FIELD_GET(cap, CAP_CSS);
 
 	cc =
@@ -571,30 +943,35 @@ int nvme_enable(struct nvme_ctrl *ctrl)
 		cc |= NVME_FIELD_SET(NVME_CC_CSS_NVM, CC_CSS);
 
 	mmio_write32(ctrl->regs + NVME_REG_CC, cpu_to_le32(cc));
+}
+
+int nvme_enable(struct nvme_ctrl *ctrl)
+{
+	__nvme_start_enable(ctrl);
 
 	return nvme_wait_rdy(ctrl, 1);
 }
 
-int nvme_reset(struct nvme_ctrl *ctrl)
+static void __nvme_start_reset(struct nvme_ctrl *ctrl)
 {
 	uint32_t cc;
 
 	cc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CC));
 	mmio_write32(ctrl->regs + NVME_REG_CC, cpu_to_le32(cc & 0xfe));
+}
+
+int nvme_reset(struct nvme_ctrl *ctrl)
+{
+	__nvme_start_reset(ctrl);
 
 	return nvme_wait_rdy(ctrl, 0);
 }
 
-static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
+/* issue doorbell buffer config with the already allocated buffers */
+static int __nvme_dbconfig(struct nvme_ctrl *ctrl)
 {
 	union nvme_cmd cmd;
 
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.doorbells, __VFN_PAGESIZE, 0x0))
-		return -1;
-
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.eventidxs, __VFN_PAGESIZE, 0x0))
-		goto put_doorbells;
-
 	cmd = (union nvme_cmd) {
 		.opcode = NVME_ADMIN_DBCONFIG,
 		.dptr.prp1 = cpu_to_le64(ctrl->dbbuf.doorbells.iova),
@@ -602,13 +979,13 @@ static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
 	};
 
 	if (__admin(ctrl, &cmd))
-		goto put_eventidxs;
+		return -1;
 
 	if (!(ctrl->opts.quirks & NVME_QUIRK_BROKEN_DBBUF)) {
 		uint64_t cap;
 		uint8_t dstrd;
 
-		cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+		cap = __nvme_cap(ctrl);
 		dstrd = NVME_FIELD_GET(cap, CAP_DSTRD);
 
 		ctrl->adminq.cq->dbbuf.doorbell =
@@ -623,6 +1000,24 @@ static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
 	}
 
 	return 0;
+}
+
+static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
+{
+	/* shadow doorbells are written by all processes driving a queue */
+	unsigned long flags = (ctrl->opts.dmabuf_flags & IOMMU_DMABUF_SHARED) |
+		IOMMU_DMABUF_NODE(__queue_node(ctrl, NVME_AQ));
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.doorbells, __VFN_PAGESIZE, flags))
+		return -1;
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.eventidxs, __VFN_PAGESIZE, flags))
+		goto put_doorbells;
+
+	if (__nvme_dbconfig(ctrl))
+		goto put_eventidxs;
+
+	return 0;
 
 put_eventidxs:
 	iommu_put_dmabuf(&ctrl->dbbuf.eventidxs);
@@ -675,18 +1070,21 @@ int nvme_ctrl_init(struct nvme_ctrl *ctrl, const char *bdf,
 	uint8_t mpsmin, mpsmax;
 	uint64_t cap;
 
-	if (nvme_init_pci(ctrl, bdf))
-		return -1;
-
 	if (opts)
 		memcpy(&ctrl->opts, opts, sizeof(*opts));
 	else
 		memcpy(&ctrl->opts, &nvme_ctrl_opts_default, sizeof(*opts));
 
+	if (ctrl->opts.ctx && !ctrl->pci.bdf)
+		ctrl->pci.dev.ctx = ctrl->opts.ctx;
+
+	if (nvme_init_pci(ctrl, bdf))
+		return -1;
+
 	if ((ctrl->pci.classcode & 0xff) == 0x03)
 		ctrl->flags = NVME_CTRL_F_ADMINISTRATIVE;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	cap = __nvme_cap(ctrl);
 	mpsmin = NVME_FIELD_GET(cap, CAP_MPSMIN);
 	mpsmax = NVME_FIELD_GET(cap, CAP_MPSMAX);
 
@@ -703,83 +1101,163 @@ int nvme_ctrl_init(struct nvme_ctrl *ctrl, const char *bdf,
 
 	ctrl->config.mqes = NVME_FIELD_GET(cap, CAP_MQES);
 
+	ctrl->dmapool = iommu_dmapool_create(__iommu_ctx(ctrl), NVME_CTRL_DMAPOOL_SIZE,
+					     IOMMU_DMABUF_NODE(__queue_node(ctrl, NVME_AQ)));
+	if (!ctrl->dmapool) {
+		log_debug("could not create dma pool\n");
+		return -1;
+	}
+
 	/* +2 because nsqr/ncqr are zero-based values and do not account for the admin queue */
 	ctrl->sq = znew_t(struct nvme_sq, ctrl->opts.nsqr + 2);
 	ctrl->cq = znew_t(struct nvme_cq, ctrl->opts.ncqr + 2);
 
+	ctrl->qnodes = znew_t(int, __nqnodes(ctrl));
+
 	return 0;
 }
 
-int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
-{
-	struct iommu_ctx *ctx;
+/*
+ * Per-controller state of nvme_init_ctrls(). Each phase is started on all
+ * controllers before waiting for any of them, such that the controller reset
+ * and enable times and the admin command latencies overlap.
+ */
+struct nvme_init_state {
+	struct nvme_ctrl *ctrl;
+	int err;
 
-	uint16_t oacs;
-	uint32_t sgls;
+	/* ready state deadline, in ticks */
+	uint64_t deadline;
 
-	__autovar_s(iommu_dmabuf) buffer = {};
+	/* ready state transition or outstanding admin commands */
+	int pending;
 
-	union nvme_cmd cmd = {};
-	struct nvme_cqe cqe;
+	struct nvme_cqe nrqs_cqe, id_cqe;
+	struct iommu_dmachunk buffer;
+};
 
-	if (nvme_ctrl_init(ctrl, bdf, opts))
-		return -1;
+static void __nvme_init_fail(struct nvme_init_state *st, const char *msg)
+{
+	log_debug("%s\n", msg);
 
-	ctx = __iommu_ctx(ctrl);
+	st->err = errno ? errno : EIO;
+}
 
-	if (nvme_reset(ctrl)) {
-		log_debug("could not reset controller\n");
-		return -1;
-	}
+static void __nvme_init_wait_rdy(struct nvme_init_state *st, int n, unsigned short rdy)
+{
+	int waiting;
 
-	if (nvme_configure_adminq(ctrl, 0x0)) {
-		log_debug("could not configure admin queue\n");
-		return -1;
-	}
+	for (int i = 0; i < n; i++) {
+		if (st[i].err)
+			continue;
 
-	if (nvme_enable(ctrl)) {
-		log_debug("could not enable controller\n");
-		return -1;
+		st[i].deadline = __nvme_rdy_deadline(st[i].ctrl);
+		st[i].pending = 1;
 	}
 
-	if (ctrl->flags & NVME_CTRL_F_ADMINISTRATIVE)
-		return 0;
+	do {
+		waiting = 0;
+
+		for (int i = 0; i < n; i++) {
+			if (!st[i].pending)
+				continue;
+
+			if (__nvme_rdy(st[i].ctrl, rdy)) {
+				st[i].pending = 0;
+			} else if (get_ticks() > st[i].deadline) {
+				log_debug("timed out\n");
+
+				st[i].pending = 0;
+				st[i].err = ETIMEDOUT;
+			} else {
+				waiting++;
+			}
+		}
+	} while (waiting);
+}
 
-	cmd = (union nvme_cmd) {
+static void __nvme_init_nrqs_cb(struct nvme_ctrl *ctrl UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	struct nvme_init_state *st = opaque;
+
+	memcpy(&st->nrqs_cqe, cqe, sizeof(*cqe));
+	st->pending--;
+}
+
+static void __nvme_init_id_cb(struct nvme_ctrl *ctrl UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	struct nvme_init_state *st = opaque;
+
+	memcpy(&st->id_cqe, cqe, sizeof(*cqe));
+	st->pending--;
+}
+
+/* issue the (independent) Set Features and Identify Controller commands */
+static void __nvme_init_submit(struct nvme_init_state *st)
+{
+	struct nvme_ctrl *ctrl = st->ctrl;
+	union nvme_cmd cmd = {};
+
+	cmd.features = (struct nvme_cmd_features) {
 		.opcode = NVME_ADMIN_SET_FEATURES,
+		.fid = NVME_FEAT_FID_NUM_QUEUES,
+		.cdw11 = cpu_to_le32(NVME_FIELD_SET(ctrl->opts.nsqr, FEAT_NRQS_NSQR) |
+				     NVME_FIELD_SET(ctrl->opts.ncqr, FEAT_NRQS_NCQR)),
 	};
 
-	cmd.features.fid = NVME_FEAT_FID_NUM_QUEUES;
-	cmd.features.cdw11 = cpu_to_le32(
-		NVME_FIELD_SET(ctrl->opts.nsqr, FEAT_NRQS_NSQR) |
-		NVME_FIELD_SET(ctrl->opts.ncqr, FEAT_NRQS_NCQR));
-
-	if (nvme_admin(ctrl, &cmd, NULL, 0, &cqe)) {
-		log_debug("could not set number of queues\n");
-		return -1;
+	if (nvme_admin_async(ctrl, &cmd, NULL, 0, __nvme_init_nrqs_cb, st)) {
+		__nvme_init_fail(st, "could not set number of queues");
+		return;
 	}
 
-	ctrl->config.nsqa = min_t(int, ctrl->opts.nsqr,
-				  NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_NRQS_NSQR));
-	ctrl->config.ncqa = min_t(int, ctrl->opts.ncqr,
-				  NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_NRQS_NCQR));
+	st->pending++;
 
-	if (iommu_get_dmabuf(ctx, &buffer, NVME_IDENTIFY_DATA_SIZE, IOMMU_MAP_EPHEMERAL))
-		return -1;
+	if (iommu_dmapool_get(ctrl->dmapool, &st->buffer, NVME_IDENTIFY_DATA_SIZE)) {
+		__nvme_init_fail(st, "could not allocate identify buffer");
+		return;
+	}
 
 	cmd.identify = (struct nvme_cmd_identify) {
 		.opcode = NVME_ADMIN_IDENTIFY,
 		.cns = NVME_IDENTIFY_CNS_CTRL,
 	};
 
-	if (nvme_admin(ctrl, &cmd, buffer.vaddr, buffer.len, NULL))
+	if (nvme_admin_async(ctrl, &cmd, st->buffer.vaddr, st->buffer.len, __nvme_init_id_cb, st)) {
+		__nvme_init_fail(st, "could not identify controller");
+		return;
+	}
+
+	st->pending++;
+}
+
+static int __nvme_init_complete(struct nvme_init_state *st)
+{
+	struct nvme_ctrl *ctrl = st->ctrl;
+	void *id = st->buffer.vaddr;
+	uint32_t nrqs, sgls;
+	uint16_t oacs;
+
+	if (nvme_set_errno_from_cqe(&st->nrqs_cqe)) {
+		log_debug("could not set number of queues\n");
+		return -1;
+	}
+
+	nrqs = le32_to_cpu(st->nrqs_cqe.dw0);
+
+	ctrl->config.nsqa = min_t(int, ctrl->opts.nsqr, NVME_FIELD_GET(nrqs, FEAT_NRQS_NSQR));
+	ctrl->config.ncqa = min_t(int, ctrl->opts.ncqr, NVME_FIELD_GET(nrqs, FEAT_NRQS_NCQR));
+
+	if (nvme_set_errno_from_cqe(&st->id_cqe)) {
+		log_debug("could not identify controller\n");
 		return -1;
+	}
 
-	oacs = le16_to_cpu(*(leint16_t *)(buffer.vaddr + NVME_IDENTIFY_CTRL_OACS));
+	/* doorbell buffer config depends on identify, so it is not overlapped */
+	oacs = le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_CTRL_OACS));
 	if (oacs & NVME_IDENTIFY_CTRL_OACS_DBCONFIG && nvme_init_dbconfig(ctrl))
 		return -1;
 
-	sgls = le32_to_cpu(*(leint32_t *)(buffer.vaddr + NVME_IDENTIFY_CTRL_SGLS));
+	sgls = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_CTRL_SGLS));
 	if (sgls) {
 		uint32_t alignment = NVME_FIELD_GET(sgls, IDENTIFY_CTRL_SGLS_ALIGNMENT);
 
@@ -787,13 +1265,304 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 
 		if (alignment == NVME_IDENTIFY_CTRL_SGLS_ALIGNMENT_DWORD)
 			ctrl->flags |= NVME_CTRL_F_SGLS_DWORD_ALIGNMENT;
+
+		if (sgls & NVME_IDENTIFY_CTRL_SGLS_MSGLS)
+			ctrl->flags |= NVME_CTRL_F_SGLS_MPTR_SGL;
+	}
+
+	return 0;
+}
+
+int nvme_init_ctrls(struct nvme_ctrl *ctrls, const char *const *bdfs, int n,
+		    const struct nvme_ctrl_opts *opts, int *errs)
+{
+	__autofree struct nvme_init_state *st = NULL;
+	int waiting, err = 0;
+
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	st = znew_t(struct nvme_init_state, n);
+
+	for (int i = 0; i < n; i++) {
+		st[i].ctrl = &ctrls[i];
+
+		if (nvme_ctrl_init(&ctrls[i], bdfs[i], opts)) {
+			__nvme_init_fail(&st[i], "could not initialize controller");
+			continue;
+		}
+
+		__nvme_start_reset(&ctrls[i]);
+	}
+
+	__nvme_init_wait_rdy(st, n, 0);
+
+	for (int i = 0; i < n; i++) {
+		if (st[i].err)
+			continue;
+
+		if (nvme_configure_adminq(&ctrls[i], 0x0)) {
+			__nvme_init_fail(&st[i], "could not configure admin queue");
+			continue;
+		}
+
+		__nvme_start_enable(&ctrls[i]);
+	}
+
+	__nvme_init_wait_rdy(st, n, 1);
+
+	for (int i = 0; i < n; i++) {
+		if (!st[i].err && !(ctrls[i].flags & NVME_CTRL_F_ADMINISTRATIVE))
+			__nvme_init_submit(&st[i]);
+	}
+
+	/* commands that were submitted must complete, even if another one failed */
+	do {
+		waiting = 0;
+
+		for (int i = 0; i < n; i++) {
+			if (!st[i].pending)
+				continue;
+
+			nvme_admin_poll(&ctrls[i], NULL);
+
+			if (st[i].pending)
+				waiting++;
+		}
+	} while (waiting);
+
+	for (int i = 0; i < n; i++) {
+		if (!st[i].err && !(ctrls[i].flags & NVME_CTRL_F_ADMINISTRATIVE) &&
+		    __nvme_init_complete(&st[i]))
+			st[i].err = errno;
+
+		iommu_dmapool_put(&st[i].buffer);
+
+		if (errs)
+			errs[i] = st[i].err;
+
+		if (st[i].err && !err)
+			err = st[i].err;
+	}
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
+{
+	return nvme_init_ctrls(ctrl, &bdf, 1, opts, NULL);
+}
+
+int nvme_set_secondary(struct nvme_ctrl *ctrl)
+{
+	if (!(ctrl->opts.dmabuf_flags & IOMMU_DMABUF_SHARED)) {
+		log_debug("queue memory is not shared\n");
+
+		errno = EINVAL;
+		return -1;
 	}
 
+	ctrl->flags |= NVME_CTRL_F_SECONDARY;
+
 	return 0;
 }
 
+int nvme_recover(struct nvme_ctrl *ctrl, nvme_recover_cb cb, void *opaque)
+{
+	__autofree struct nvme_batch_cmd *cmds = NULL;
+	__autofree bool *idle = NULL;
+	struct nvme_sq *asq = ctrl->adminq.sq;
+	struct nvme_cq *acq = ctrl->adminq.cq;
+	union nvme_cmd cmd = {};
+	int n = 0, nrqs = 0;
+
+	if (ctrl->flags & NVME_CTRL_F_SECONDARY) {
+		errno = EPERM;
+		return -1;
+	}
+
+	if (le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS)) == UINT32_MAX) {
+		log_debug("controller is gone\n");
+
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (nvme_reset(ctrl))
+		return -1;
+
+	/* the controller is disabled; rewind the queues to their initial state */
+	for (int i = 0; i < ctrl->opts.nsqr + 2; i++) {
+		ctrl->sq[i].tail = 0;
+		ctrl->sq[i].ptail = 0;
+	}
+
+	for (int i = 0; i < ctrl->opts.ncqr + 2; i++) {
+		struct nvme_cq *cq = &ctrl->cq[i];
+
+		if (!cq->mem.vaddr)
+			continue;
+
+		cq->head = 0;
+		cq->phase = 0;
+
+		memset(cq->mem.vaddr, 0x0, (size_t)cq->qsize << NVME_CQES);
+	}
+
+	/* shadow doorbells are not used until doorbell buffer config is reissued */
+	if (ctrl->dbbuf.doorbells.vaddr) {
+		memset(ctrl->dbbuf.doorbells.vaddr, 0x0, ctrl->dbbuf.doorbells.len);
+		memset(ctrl->dbbuf.eventidxs.vaddr, 0x0, ctrl->dbbuf.eventidxs.len);
+
+		memset(&asq->dbbuf, 0x0, sizeof(asq->dbbuf));
+		memset(&acq->dbbuf, 0x0, sizeof(acq->dbbuf));
+	}
+
+	if (ctrl->cmb.vaddr) {
+		uint64_t cmbmsc = NVME_FIELD_SET(1, CMBMSC_CRE) | NVME_FIELD_SET(1, CMBMSC_CMSE) |
+			(ctrl->cmb.iova >> NVME_CMBMSC_CBA_SHIFT) << NVME_CMBMSC_CBA_SHIFT;
+
+		mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC, cpu_to_le64(cmbmsc));
+	}
+
+	__nvme_configure_adminq(ctrl, asq->qsize, acq->qsize);
+
+	if (nvme_enable(ctrl))
+		return -1;
+
+	/* asynchronous event requests are dropped along with the commands */
+	if (nvme_admin_abort(ctrl, NULL) < 0)
+		return -1;
+
+	cmd.features = (struct nvme_cmd_features) {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+		.fid = NVME_FEAT_FID_NUM_QUEUES,
+		.cdw11 = cpu_to_le32(NVME_FIELD_SET(ctrl->opts.nsqr, FEAT_NRQS_NSQR) |
+				     NVME_FIELD_SET(ctrl->opts.ncqr, FEAT_NRQS_NCQR)),
+	};
+
+	if (__admin(ctrl, &cmd)) {
+		log_debug("could not set number of queues\n");
+		return -1;
+	}
+
+	if (ctrl->dbbuf.doorbells.vaddr && __nvme_dbconfig(ctrl)) {
+		log_debug("could not configure doorbell buffers\n");
+		return -1;
+	}
+
+	cmds = znew_t(struct nvme_batch_cmd, max_t(int, ctrl->opts.nsqr, ctrl->opts.ncqr) + 1);
+
+	for (int i = 1; i < ctrl->opts.ncqr + 2; i++) {
+		if (ctrl->cq[i].mem.vaddr)
+			__nvme_prep_create_cq(&cmds[n++].cmd, &ctrl->cq[i]);
+	}
+
+	if (n && __nvme_admin_batch(ctrl, cmds, n)) {
+		log_debug("could not recreate io completion queues\n");
+		return -1;
+	}
+
+	n = 0;
+
+	for (int i = 1; i < ctrl->opts.nsqr + 2; i++) {
+		if (ctrl->sq[i].mem.vaddr)
+			__nvme_prep_create_sq(&cmds[n++].cmd, &ctrl->sq[i]);
+	}
+
+	if (n && __nvme_admin_batch(ctrl, cmds, n)) {
+		log_debug("could not recreate io submission queues\n");
+		return -1;
+	}
+
+	/* hand back the requests that were in flight */
+	for (int i = 1; i < ctrl->opts.nsqr + 2; i++) {
+		struct nvme_sq *sq = &ctrl->sq[i];
+		struct nvme_rq *rq;
+
+		if (!sq->rqs)
+			continue;
+
+		free(idle);
+		idle = znew_t(bool, sq->qsize - 1);
+
+		for (rq = atomic_load_acquire(&sq->rq_top); rq; rq = rq->rq_next)
+			idle[rq->cid] = true;
+
+		for (int cid = 0; cid < sq->qsize - 1; cid++) {
+			if (idle[cid])
+				continue;
+
+			nrqs++;
+
+			if (cb)
+				cb(ctrl, &sq->rqs[cid], opaque);
+		}
+	}
+
+	return nrqs;
+}
+
+/* the asynchronous admin command state; must be called before ctrl->sq is freed */
+static void __nvme_free_admin_reqs(struct nvme_ctrl *ctrl)
+{
+	if (ctrl->admin_reqs) {
+		for (int cid = 0; cid < ctrl->adminq.sq->qsize - 1; cid++)
+			free(ctrl->admin_reqs[cid]);
+
+		free(ctrl->admin_reqs);
+	}
+
+	free(ctrl->aer_cqes);
+}
+
+/*
+ * Release what is private to a secondary process; the queue memory and the
+ * iommu and vfio state (through the inherited file descriptors) are shared
+ * with the primary process.
+ */
+static void nvme_close_secondary(struct nvme_ctrl *ctrl)
+{
+	/* the copies of the outstanding commands made by fork() */
+	__nvme_free_admin_reqs(ctrl);
+
+	for (int i = 0; i < ctrl->opts.nsqr + 2; i++) {
+		if (ctrl->sq[i].rqs)
+			__nvme_free_rqs(&ctrl->sq[i]);
+	}
+
+	free(ctrl->sq);
+	free(ctrl->cq);
+	free(ctrl->qnodes);
+
+	iommu_dmapool_forget(ctrl->dmapool);
+
+	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->regs, 0x1000, 0);
+	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->doorbells, SIZE_MAX, 0x1000);
+
+	log_fatal_if(close(ctrl->pci.dev.fd), "close");
+
+	free(ctrl->pci.bdf);
+
+	memset(ctrl, 0x0, sizeof(*ctrl));
+}
+
 void nvme_close(struct nvme_ctrl *ctrl)
 {
+	if (ctrl->flags & NVME_CTRL_F_SECONDARY) {
+		nvme_close_secondary(ctrl);
+		return;
+	}
+
+	__nvme_free_admin_reqs(ctrl);
+
 	for (int i = 0; i < ctrl->opts.nsqr + 2; i++)
 		nvme_discard_sq(ctrl, &ctrl->sq[i]);
 
@@ -803,6 +1572,7 @@ void nvme_close(struct nvme_ctrl *ctrl)
 		nvme_discard_cq(ctrl, &ctrl->cq[i]);
 
 	free(ctrl->cq);
+	free(ctrl->qnodes);
 
 	nvme_discard_cmb(ctrl);
 
@@ -811,6 +1581,8 @@ void nvme_close(struct nvme_ctrl *ctrl)
 		iommu_put_dmabuf(&ctrl->dbbuf.eventidxs);
 	}
 
+	iommu_dmapool_destroy(ctrl->dmapool);
+
 	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->regs, 0x1000, 0);
 	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->doorbells, SIZE_MAX, 0x1000);
 
@@ -827,7 +1599,7 @@ int nvme_configure_cmb(struct nvme_ctrl *ctrl)
 	uint64_t cap;
 	int bar;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	cap = __nvme_cap(ctrl);
 	if (!NVME_FIELD_GET(cap, CAP_CMBS))
 		return 0;
 
@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vfn/support.h>
+#include <vfn/nvme.h>
+
+#include "crc.h"
+
+#include "crc16table.h"
+#include "crc64table.h"
+
+uint64_t __nvme_crc64_table(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = (crc >> 8) ^ crc64_nvme_table[0][(crc & 0xff) ^ buffer[i]];
+
+	return crc;
+}
+
+uint64_t __nvme_crc64_sb8(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, buffer, sizeof(v));
+
+		v = crc ^ le64_to_cpu((__force leint64_t)v);
+
+		crc = crc64_nvme_table[7][v & 0xff] ^
+			crc64_nvme_table[6][(v >> 8) & 0xff] ^
+			crc64_nvme_table[5][(v >> 16) & 0xff] ^
+			crc64_nvme_table[4][(v >> 24) & 0xff] ^
+			crc64_nvme_table[3][(v >> 32) & 0xff] ^
+			crc64_nvme_table[2][(v >> 40) & 0xff] ^
+			crc64_nvme_table[1][(v >> 48) & 0xff] ^
+			crc64_nvme_table[0][v >> 56];
+
+		buffer += 8;
+		len -= 8;
+	}
+
+	return __nvme_crc64_table(crc, buffer, len);
+}
+
+uint16_t __nvme_crc16_t10dif_table(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = (uint16_t)((crc << 8) ^
+				 crc16_t10dif_table[0][((crc >> 8) ^ buffer[i]) & 0xff]);
+
+	return crc;
+}
+
+uint16_t __nvme_crc16_t10dif_sb8(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	while (len >= 8) {
+		crc = crc16_t10dif_table[7][buffer[0] ^ (crc >> 8)] ^
+			crc16_t10dif_table[6][buffer[1] ^ (crc & 0xff)] ^
+			crc16_t10dif_table[5][buffer[2]] ^
+			crc16_t10dif_table[4][buffer[3]] ^
+			crc16_t10dif_table[3][buffer[4]] ^
+			crc16_t10dif_table[2][buffer[5]] ^
+			crc16_t10dif_table[1][buffer[6]] ^
+			crc16_t10dif_table[0][buffer[7]];
+
+		buffer += 8;
+		len -= 8;
+	}
+
+	return __nvme_crc16_t10dif_table(crc, buffer, len);
+}
+
+static bool __nvme_crc_supported(void)
+{
+	return true;
+}
+
+const struct nvme_crc_impl nvme_crc_impl_table = {
+	.name = "table",
+	.supported = __nvme_crc_supported,
+	.crc64 = __nvme_crc64_table,
+	.crc16 = __nvme_crc16_t10dif_table,
+};
+
+const struct nvme_crc_impl nvme_crc_impl_sb8 = {
+	.name = "sb8",
+	.supported = __nvme_crc_supported,
+	.crc64 = __nvme_crc64_sb8,
+	.crc16 = __nvme_crc16_t10dif_sb8,
+};
+
+static const struct nvme_crc_impl *nvme_crc_impl = &nvme_crc_impl_sb8;
+
+static void __attribute__((constructor)) init_crc_impl(void)
+{
+#ifdef NVME_CRC_ARCH
+	for (const struct nvme_crc_impl *impl = nvme_crc_impls_arch; impl->name; impl++) {
+		if (impl->supported()) {
+			nvme_crc_impl = impl;
+			break;
+		}
+	}
+#endif
+}
+
+uint16_t nvme_crc16_t10dif(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	return nvme_crc_impl->crc16(crc, buffer, len);
+}
+
+uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	return nvme_crc_impl->crc64(crc, buffer, len) ^ (uint64_t)~0;
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_SRC_NVME_CRC_H
+#define LIBVFN_SRC_NVME_CRC_H
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define NVME_CRC_ARCH
+#endif
+
+/*
+ * The crc kernels update the crc register; the CRC64 kernels do not invert
+ * the result (nvme_crc64() does).
+ */
+typedef uint64_t (*nvme_crc64_fn)(uint64_t crc, const unsigned char *buffer, size_t len);
+typedef uint16_t (*nvme_crc16_fn)(uint16_t crc, const unsigned char *buffer, size_t len);
+
+struct nvme_crc_impl {
+	const char *name;
+	bool (*supported)(void);
+
+	nvme_crc64_fn crc64;
+	nvme_crc16_fn crc16;
+};
+
+/* byte-wise table lookup (reference) */
+uint64_t __nvme_crc64_table(uint64_t crc, const unsigned char *buffer, size_t len);
+uint16_t __nvme_crc16_t10dif_table(uint16_t crc, const unsigned char *buffer, size_t len);
+
+/* slicing-by-8 (portable fallback) */
+uint64_t __nvme_crc64_sb8(uint64_t crc, const unsigned char *buffer, size_t len);
+uint16_t __nvme_crc16_t10dif_sb8(uint16_t crc, const unsigned char *buffer, size_t len);
+
+extern const struct nvme_crc_impl nvme_crc_impl_table;
+extern const struct nvme_crc_impl nvme_crc_impl_sb8;
+
+#ifdef NVME_CRC_ARCH
+/*
+ * Architecture specific implementations, fastest first and terminated by an
+ * entry with a NULL name. Defined in arch/<arch>/crc.c.
+ */
+extern const struct nvme_crc_impl nvme_crc_impls_arch[];
+#endif
+
+#endif /* LIBVFN_SRC_NVME_CRC_H */
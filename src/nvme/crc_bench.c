@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * CRC throughput benchmark; reports MB/s for each supported implementation
+ * and a range of buffer sizes.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vfn/support.h>
+#include <vfn/nvme.h>
+
+#include "ccan/time/time.h"
+
+#include "crc.h"
+
+#define BENCH_BYTES (256ULL << 20)
+
+static const size_t sizes[] = {512, 4096, 65536, 1 << 20};
+
+static volatile uint64_t sink;
+
+static double bench_crc64(const struct nvme_crc_impl *impl, const unsigned char *buf, size_t len)
+{
+	uint64_t iters = BENCH_BYTES / len, crc = 0;
+	struct timemono start = time_mono();
+
+	for (uint64_t i = 0; i < iters; i++)
+		crc = impl->crc64(crc, buf, len);
+
+	sink = crc;
+
+	return (double)(iters * len) / (double)time_to_nsec(timemono_since(start)) * 1e3;
+}
+
+static double bench_crc16(const struct nvme_crc_impl *impl, const unsigned char *buf, size_t len)
+{
+	uint64_t iters = BENCH_BYTES / len;
+	struct timemono start = time_mono();
+	uint16_t crc = 0;
+
+	for (uint64_t i = 0; i < iters; i++)
+		crc = impl->crc16(crc, buf, len);
+
+	sink = crc;
+
+	return (double)(iters * len) / (double)time_to_nsec(timemono_since(start)) * 1e3;
+}
+
+static void bench(const struct nvme_crc_impl *impl, const unsigned char *buf)
+{
+	if (!impl->supported()) {
+		printf("%-12s not supported\n", impl->name);
+		return;
+	}
+
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		printf("%-12s %8zu  crc64 %9.1f MB/s  crc16 %9.1f MB/s\n", impl->name, sizes[i],
+		       bench_crc64(impl, buf, sizes[i]), bench_crc16(impl, buf, sizes[i]));
+	}
+}
+
+int main(void)
+{
+	unsigned char *buf = malloc(1 << 20);
+
+	if (!buf)
+		return 1;
+
+	for (size_t i = 0; i < 1 << 20; i++)
+		buf[i] = (unsigned char)rand();
+
+	bench(&nvme_crc_impl_table, buf);
+	bench(&nvme_crc_impl_sb8, buf);
+
+#ifdef NVME_CRC_ARCH
+	for (const struct nvme_crc_impl *impl = nvme_crc_impls_arch; impl->name; impl++)
+		bench(impl, buf);
+#endif
+
+	free(buf);
+
+	return 0;
+}
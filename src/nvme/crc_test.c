@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "crc.c"
+
+#define MAX_LEN 4096
+
+static unsigned char buf[MAX_LEN + 16];
+
+static bool check_crc64(const struct nvme_crc_impl *impl)
+{
+	for (size_t off = 0; off < 16; off += 3) {
+		for (size_t len = 0; len <= MAX_LEN; len += (len < 600 ? 1 : 61)) {
+			uint64_t crc = (uint64_t)rand() << 32 | (uint64_t)rand();
+
+			if (impl->crc64(crc, buf + off, len) !=
+			    __nvme_crc64_table(crc, buf + off, len)) {
+				diag("%s: crc64 mismatch (off %zu len %zu)", impl->name, off, len);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool check_crc16(const struct nvme_crc_impl *impl)
+{
+	for (size_t off = 0; off < 16; off += 3) {
+		for (size_t len = 0; len <= MAX_LEN; len += (len < 600 ? 1 : 61)) {
+			uint16_t crc = (uint16_t)rand();
+
+			if (impl->crc16(crc, buf + off, len) !=
+			    __nvme_crc16_t10dif_table(crc, buf + off, len)) {
+				diag("%s: crc16 mismatch (off %zu len %zu)", impl->name, off, len);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void check_impl(const struct nvme_crc_impl *impl)
+{
+	const unsigned char check[] = "123456789";
+
+	if (!impl->supported()) {
+		skip(4, "%s not supported", impl->name);
+		return;
+	}
+
+	ok(impl->crc64(~0ULL, check, 9) == ~0xae8b14860a799888ULL, "%s crc64 check value",
+	   impl->name);
+	ok(impl->crc16(0, check, 9) == 0xd0db, "%s crc16 check value", impl->name);
+	ok(check_crc64(impl), "%s crc64 matches table", impl->name);
+	ok(check_crc16(impl), "%s crc16 matches table", impl->name);
+}
+
+int main(void)
+{
+	const struct nvme_crc_impl *impls[] = {&nvme_crc_impl_table, &nvme_crc_impl_sb8};
+	unsigned int nimpls = 2;
+
+#ifdef NVME_CRC_ARCH
+	for (const struct nvme_crc_impl *impl = nvme_crc_impls_arch; impl->name; impl++)
+		nimpls++;
+#endif
+
+	plan_tests(4 * nimpls + 2);
+
+	srand(0);
+
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = (unsigned char)rand();
+
+	for (unsigned int i = 0; i < 2; i++)
+		check_impl(impls[i]);
+
+#ifdef NVME_CRC_ARCH
+	for (const struct nvme_crc_impl *impl = nvme_crc_impls_arch; impl->name; impl++)
+		check_impl(impl);
+#endif
+
+	diag("using %s", nvme_crc_impl->name);
+
+	ok1(nvme_crc64(~0ULL, buf, MAX_LEN) == ~__nvme_crc64_table(~0ULL, buf, MAX_LEN));
+	ok1(nvme_crc16_t10dif(0, buf, MAX_LEN) == __nvme_crc16_t10dif_table(0, buf, MAX_LEN));
+
+	return exit_status();
+}
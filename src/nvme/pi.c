@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/pi: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vfn/support.h>
+#include <vfn/nvme.h>
+
+#define NVME_PI_APPTAG_ESCAPE 0xffff
+
+/* PRINFO is bits 29:26 of cdw12; bits 13:10 of the control field */
+#define NVME_RW_CONTROL_PRINFO_SHIFT 10
+#define NVME_RW_CONTROL_PRINFO_MASK 0xf
+#define NVME_RW_PRINFO_PRACT (1 << 3)
+
+struct __pi_tuple {
+	uint64_t guard;
+	uint16_t apptag;
+	uint64_t reftag;
+};
+
+static inline size_t __pi_tuple_size(const struct nvme_pi_conf *conf)
+{
+	if (conf->format == NVME_PI_FORMAT_64B_GUARD)
+		return sizeof(struct nvme_crc64_pi_tuple);
+
+	return sizeof(struct nvme_crc16_pi_tuple);
+}
+
+static inline uint64_t __pi_reftag_mask(const struct nvme_pi_conf *conf)
+{
+	if (conf->format == NVME_PI_FORMAT_64B_GUARD)
+		return (1ULL << 48) - 1;
+
+	return UINT32_MAX;
+}
+
+static int __pi_check_conf(const struct nvme_pi_conf *conf)
+{
+	if (conf->format != NVME_PI_FORMAT_16B_GUARD && conf->format != NVME_PI_FORMAT_64B_GUARD) {
+		log_debug("unsupported protection information format %d\n", conf->format);
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (conf->type < NVME_PI_TYPE1 || conf->type > NVME_PI_TYPE3) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!conf->lbads || conf->ms < __pi_tuple_size(conf)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Locate the logical block data and metadata of block @i.
+ */
+static inline void __pi_block(const struct nvme_pi_conf *conf, const void *data,
+			      const void *meta, unsigned int i,
+			      const uint8_t **blk, const uint8_t **md)
+{
+	if (conf->extended) {
+		*blk = (const uint8_t *)data + i * (conf->lbads + conf->ms);
+		*md = *blk + conf->lbads;
+
+		return;
+	}
+
+	*blk = (const uint8_t *)data + i * conf->lbads;
+	*md = (const uint8_t *)meta + i * conf->ms;
+}
+
+static inline size_t __pi_offset(const struct nvme_pi_conf *conf)
+{
+	return conf->pi_first ? 0 : conf->ms - __pi_tuple_size(conf);
+}
+
+static uint64_t __pi_guard(const struct nvme_pi_conf *conf, const uint8_t *blk, const uint8_t *md)
+{
+	size_t off = __pi_offset(conf);
+
+	if (conf->format == NVME_PI_FORMAT_64B_GUARD) {
+		uint64_t crc = nvme_crc64(~0ULL, blk, conf->lbads);
+
+		if (off)
+			crc = nvme_crc64(~crc, md, off);
+
+		return crc;
+	}
+
+	return nvme_crc16_t10dif(nvme_crc16_t10dif(0, blk, conf->lbads), md, off);
+}
+
+/*
+ * The protection information may not be naturally aligned within the metadata
+ * (e.g. with extended LBAs), so copy it in and out.
+ */
+static void __pi_load(const struct nvme_pi_conf *conf, const uint8_t *pi, struct __pi_tuple *t)
+{
+	if (conf->format == NVME_PI_FORMAT_64B_GUARD) {
+		struct nvme_crc64_pi_tuple tuple;
+
+		memcpy(&tuple, pi, sizeof(tuple));
+
+		t->guard = be64_to_cpu(tuple.guard);
+		t->apptag = be16_to_cpu(tuple.apptag);
+		t->reftag = 0;
+
+		/* the storage and reference tag (48 bits, big endian) */
+		for (int i = 0; i < 6; i++)
+			t->reftag = (t->reftag << 8) | tuple.sr[i];
+	} else {
+		struct nvme_crc16_pi_tuple tuple;
+
+		memcpy(&tuple, pi, sizeof(tuple));
+
+		t->guard = be16_to_cpu(tuple.guard);
+		t->apptag = be16_to_cpu(tuple.apptag);
+		t->reftag = be32_to_cpu(tuple.reftag);
+	}
+}
+
+static void __pi_store(const struct nvme_pi_conf *conf, uint8_t *pi, const struct __pi_tuple *t)
+{
+	if (conf->format == NVME_PI_FORMAT_64B_GUARD) {
+		struct nvme_crc64_pi_tuple tuple = {
+			.guard = cpu_to_be64(t->guard),
+			.apptag = cpu_to_be16(t->apptag),
+		};
+
+		for (int i = 0; i < 6; i++)
+			tuple.sr[i] = (uint8_t)(t->reftag >> (8 * (5 - i)));
+
+		memcpy(pi, &tuple, sizeof(tuple));
+	} else {
+		struct nvme_crc16_pi_tuple tuple = {
+			.guard = cpu_to_be16((uint16_t)t->guard),
+			.apptag = cpu_to_be16(t->apptag),
+			.reftag = cpu_to_be32((uint32_t)t->reftag),
+		};
+
+		memcpy(pi, &tuple, sizeof(tuple));
+	}
+}
+
+static inline uint64_t __pi_reftag(const struct nvme_pi_conf *conf, unsigned int i)
+{
+	if (conf->type == NVME_PI_TYPE3)
+		return conf->reftag & __pi_reftag_mask(conf);
+
+	return (conf->reftag + i) & __pi_reftag_mask(conf);
+}
+
+int nvme_pi_generate(const struct nvme_pi_conf *conf, void *data, void *meta, unsigned int nlb)
+{
+	size_t off;
+
+	if (__pi_check_conf(conf))
+		return -1;
+
+	off = __pi_offset(conf);
+
+	for (unsigned int i = 0; i < nlb; i++) {
+		const uint8_t *blk, *md;
+		struct __pi_tuple t;
+
+		__pi_block(conf, data, meta, i, &blk, &md);
+
+		t.guard = __pi_guard(conf, blk, md);
+		t.apptag = conf->apptag;
+		t.reftag = __pi_reftag(conf, i);
+
+		__pi_store(conf, (uint8_t *)md + off, &t);
+	}
+
+	return 0;
+}
+
+static inline bool __pi_escape(const struct nvme_pi_conf *conf, const struct __pi_tuple *t)
+{
+	if (t->apptag != NVME_PI_APPTAG_ESCAPE)
+		return false;
+
+	if (conf->type == NVME_PI_TYPE3)
+		return t->reftag == __pi_reftag_mask(conf);
+
+	return true;
+}
+
+static inline int __pi_fail(struct nvme_pi_error *err, unsigned int i, enum nvme_pi_check check,
+			    uint64_t expected, uint64_t actual)
+{
+	log_debug("block %u: %s check failed (expected 0x%" PRIx64 ", actual 0x%" PRIx64 ")\n",
+		  i, check == NVME_PI_CHECK_GUARD ? "guard" :
+		  check == NVME_PI_CHECK_APPTAG ? "application tag" : "reference tag",
+		  expected, actual);
+
+	if (err)
+		*err = (struct nvme_pi_error) {
+			.block = i,
+			.check = check,
+			.expected = expected,
+			.actual = actual,
+		};
+
+	errno = EBADMSG;
+	return -1;
+}
+
+int nvme_pi_verify(const struct nvme_pi_conf *conf, const void *data, const void *meta,
+		   unsigned int nlb, struct nvme_pi_error *err)
+{
+	size_t off;
+
+	if (__pi_check_conf(conf))
+		return -1;
+
+	off = __pi_offset(conf);
+
+	for (unsigned int i = 0; i < nlb; i++) {
+		const uint8_t *blk, *md;
+		struct __pi_tuple t;
+		uint64_t v;
+
+		__pi_block(conf, data, meta, i, &blk, &md);
+		__pi_load(conf, md + off, &t);
+
+		if (__pi_escape(conf, &t))
+			continue;
+
+		if (conf->prchk & NVME_PI_CHECK_GUARD) {
+			v = __pi_guard(conf, blk, md);
+			if (v != t.guard)
+				return __pi_fail(err, i, NVME_PI_CHECK_GUARD, v, t.guard);
+		}
+
+		if (conf->prchk & NVME_PI_CHECK_APPTAG) {
+			uint16_t expected = conf->apptag & conf->appmask;
+			uint16_t actual = t.apptag & conf->appmask;
+
+			if (actual != expected)
+				return __pi_fail(err, i, NVME_PI_CHECK_APPTAG, expected, actual);
+		}
+
+		if ((conf->prchk & NVME_PI_CHECK_REFTAG) && conf->type != NVME_PI_TYPE3) {
+			v = __pi_reftag(conf, i);
+			if (v != t.reftag)
+				return __pi_fail(err, i, NVME_PI_CHECK_REFTAG, v, t.reftag);
+		}
+	}
+
+	return 0;
+}
+
+void nvme_pi_prep_rw(const struct nvme_pi_conf *conf, union nvme_cmd *cmd, bool pract)
+{
+	uint16_t control = le16_to_cpu(cmd->rw.control);
+	uint16_t prinfo = (uint16_t)(conf->prchk & (NVME_PI_CHECK_REFTAG | NVME_PI_CHECK_APPTAG |
+						    NVME_PI_CHECK_GUARD));
+
+	if (pract)
+		prinfo |= NVME_RW_PRINFO_PRACT;
+
+	control &= (uint16_t)~(NVME_RW_CONTROL_PRINFO_MASK << NVME_RW_CONTROL_PRINFO_SHIFT);
+	control |= (uint16_t)(prinfo << NVME_RW_CONTROL_PRINFO_SHIFT);
+
+	cmd->rw.control = cpu_to_le16(control);
+
+	/* the lower 32 bits of the reference tag go in cdw14 */
+	cmd->rw.reftag = cpu_to_le32((uint32_t)conf->reftag);
+
+	/* with 64b guard, bits 47:32 of the reference tag go in cdw3 */
+	if (conf->format == NVME_PI_FORMAT_64B_GUARD)
+		cmd->rw.cdw3 = cpu_to_le32((uint32_t)(conf->reftag >> 32) & 0xffff);
+
+	cmd->rw.apptag = cpu_to_le16(conf->apptag);
+	cmd->rw.appmask = cpu_to_le16(conf->appmask);
+}
@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "pi.c"
+
+#define NLB 8
+#define LBADS 512
+
+static uint8_t data[NLB * (LBADS + 64)];
+static uint8_t meta[NLB * 64];
+
+static void fill(void)
+{
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t)(i * 7 + 3);
+
+	memset(meta, 0xa5, sizeof(meta));
+}
+
+int main(void)
+{
+	const unsigned char check[] = "123456789";
+	struct nvme_pi_conf conf;
+	struct nvme_pi_error err;
+	union nvme_cmd cmd;
+	uint64_t crc64;
+	uint16_t crc16;
+
+	plan_tests(38);
+
+	/*
+	 * CRC check values
+	 */
+
+	ok1(nvme_crc16_t10dif(0, check, 9) == 0xd0db);
+	ok1(nvme_crc64(~0ULL, check, 9) == 0xae8b14860a799888ULL);
+
+	crc16 = nvme_crc16_t10dif(0, check, 4);
+	ok1(nvme_crc16_t10dif(crc16, check + 4, 5) == 0xd0db);
+
+	crc64 = nvme_crc64(~0ULL, check, 4);
+	ok1(nvme_crc64(~crc64, check + 4, 5) == 0xae8b14860a799888ULL);
+
+	/*
+	 * 16b guard, separate metadata
+	 */
+
+	fill();
+
+	conf = (struct nvme_pi_conf) {
+		.format = NVME_PI_FORMAT_16B_GUARD,
+		.type = NVME_PI_TYPE1,
+		.lbads = LBADS,
+		.ms = 8,
+		.prchk = NVME_PI_CHECK_GUARD | NVME_PI_CHECK_APPTAG | NVME_PI_CHECK_REFTAG,
+		.reftag = 0x1000,
+		.apptag = 0x1234,
+		.appmask = 0xffff,
+	};
+
+	ok1(nvme_pi_generate(&conf, data, meta, NLB) == 0);
+	ok1(be16_to_cpu(((struct nvme_crc16_pi_tuple *)meta)->guard) ==
+	    nvme_crc16_t10dif(0, data, LBADS));
+	ok1(be32_to_cpu(((struct nvme_crc16_pi_tuple *)(meta + 8 * 7))->reftag) == 0x1007);
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, NULL) == 0);
+
+	data[3 * LBADS + 17] ^= 0x1;
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, &err) == -1 && errno == EBADMSG);
+	ok1(err.block == 3 && err.check == NVME_PI_CHECK_GUARD);
+	data[3 * LBADS + 17] ^= 0x1;
+
+	conf.apptag = 0x4321;
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, &err) == -1);
+	ok1(err.block == 0 && err.check == NVME_PI_CHECK_APPTAG);
+
+	conf.appmask = 0x0;
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, NULL) == 0);
+	conf.apptag = 0x1234;
+	conf.appmask = 0xffff;
+
+	conf.reftag = 0x1001;
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, &err) == -1);
+	ok1(err.block == 0 && err.check == NVME_PI_CHECK_REFTAG && err.expected == 0x1001 &&
+	    err.actual == 0x1000);
+
+	/* reference tag is not checked for type 3 */
+	conf.type = NVME_PI_TYPE3;
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, NULL) == 0);
+	conf.type = NVME_PI_TYPE1;
+	conf.reftag = 0x1000;
+
+	/* escaped blocks are not checked */
+	data[5 * LBADS] ^= 0x1;
+	((struct nvme_crc16_pi_tuple *)(meta + 8 * 5))->apptag = cpu_to_be16(0xffff);
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, NULL) == 0);
+	data[5 * LBADS] ^= 0x1;
+
+	/*
+	 * 16b guard, extended lba, protection information in the last bytes
+	 */
+
+	fill();
+
+	conf.ms = 16;
+	conf.extended = true;
+
+	ok1(nvme_pi_generate(&conf, data, NULL, NLB) == 0);
+	ok1(be16_to_cpu(((struct nvme_crc16_pi_tuple *)(data + LBADS + 8))->guard) ==
+	    nvme_crc16_t10dif(0, data, LBADS + 8));
+	ok1(nvme_pi_verify(&conf, data, NULL, NLB, NULL) == 0);
+
+	/* the guard covers the metadata preceding the protection information */
+	data[(LBADS + 16) * 2 + LBADS + 1] ^= 0x1;
+	ok1(nvme_pi_verify(&conf, data, NULL, NLB, &err) == -1);
+	ok1(err.block == 2 && err.check == NVME_PI_CHECK_GUARD);
+
+	/*
+	 * 64b guard, separate metadata
+	 */
+
+	fill();
+
+	conf = (struct nvme_pi_conf) {
+		.format = NVME_PI_FORMAT_64B_GUARD,
+		.type = NVME_PI_TYPE1,
+		.lbads = LBADS,
+		.ms = 16,
+		.prchk = NVME_PI_CHECK_GUARD | NVME_PI_CHECK_APPTAG | NVME_PI_CHECK_REFTAG,
+		.reftag = 0x123456789abcULL,
+		.apptag = 0x1234,
+		.appmask = 0xffff,
+	};
+
+	ok1(nvme_pi_generate(&conf, data, meta, NLB) == 0);
+	ok1(be64_to_cpu(((struct nvme_crc64_pi_tuple *)meta)->guard) ==
+	    nvme_crc64(~0ULL, data, LBADS));
+	ok1(((struct nvme_crc64_pi_tuple *)(meta + 16))->sr[0] == 0x12 &&
+	    ((struct nvme_crc64_pi_tuple *)(meta + 16))->sr[5] == 0xbd);
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, NULL) == 0);
+
+	data[7 * LBADS + LBADS - 1] ^= 0x80;
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, &err) == -1);
+	ok1(err.block == 7 && err.check == NVME_PI_CHECK_GUARD);
+	data[7 * LBADS + LBADS - 1] ^= 0x80;
+
+	/* the reference tag wraps at 48 bits */
+	conf.reftag = (1ULL << 48) - 4;
+	ok1(nvme_pi_generate(&conf, data, meta, NLB) == 0);
+	ok1(nvme_pi_verify(&conf, data, meta, NLB, NULL) == 0);
+
+	/*
+	 * 64b guard, extended lba, protection information in the first bytes
+	 */
+
+	fill();
+
+	conf.ms = 24;
+	conf.extended = true;
+	conf.pi_first = true;
+
+	ok1(nvme_pi_generate(&conf, data, NULL, NLB) == 0);
+	ok1(nvme_pi_verify(&conf, data, NULL, NLB, NULL) == 0);
+
+	/* metadata following the protection information is not covered */
+	data[LBADS + 20] ^= 0x1;
+	ok1(nvme_pi_verify(&conf, data, NULL, NLB, NULL) == 0);
+
+	/*
+	 * Invalid configurations
+	 */
+
+	conf.ms = 8;
+	ok1(nvme_pi_generate(&conf, data, NULL, NLB) == -1 && errno == EINVAL);
+
+	conf.format = NVME_PI_FORMAT_32B_GUARD;
+	ok1(nvme_pi_generate(&conf, data, NULL, NLB) == -1 && errno == ENOTSUP);
+
+	/*
+	 * Command setup
+	 */
+
+	conf = (struct nvme_pi_conf) {
+		.format = NVME_PI_FORMAT_64B_GUARD,
+		.type = NVME_PI_TYPE1,
+		.prchk = NVME_PI_CHECK_GUARD | NVME_PI_CHECK_REFTAG,
+		.reftag = 0x123456789abcULL,
+		.apptag = 0x1234,
+		.appmask = 0xff00,
+	};
+
+	memset(&cmd, 0x0, sizeof(cmd));
+	cmd.rw.nlb = cpu_to_le16(NLB - 1);
+
+	nvme_pi_prep_rw(&conf, &cmd, true);
+	ok1(le32_to_cpu(cmd.cdw12) == ((NLB - 1) | (0xd << 26)));
+	ok1(le32_to_cpu(cmd.cdw14) == 0x56789abc && le32_to_cpu(cmd.cdw3) == 0x1234);
+	ok1(le32_to_cpu(cmd.cdw15) == 0xff001234);
+
+	return exit_status();
+}
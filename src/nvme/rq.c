@@ -35,6 +35,9 @@
 #include <vfn/vfio.h>
 #include <vfn/nvme.h>
 
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+
 #include "iommu/context.h"
 #include "types.h"
 
@@ -44,9 +47,123 @@ int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *
 	return nvme_map_prp(ctrl, rq->page.vaddr, 1, cmd, iova, len);
 }
 
+/*
+ * Check if the iovec can be mapped directly, i.e. all entries are mapped in
+ * the IOMMU and satisfy the alignment requirements of the data pointer.
+ */
+static bool __nvme_rq_need_bounce(struct nvme_ctrl *ctrl, struct iovec *iov, int niov,
+				  bool sgl)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	size_t pagesize = 1 << pageshift;
+	iova_t iova, iovas[64];
+
+	if (sgl && niov > 1 << (pageshift - 4))
+		return true;
+
+	for (int i = 0; i < niov; i++) {
+		if (!(i % 64)) {
+			int n = min_t(int, niov - i, 64);
+
+			if (iommu_translate_vaddrv(ctx, &iov[i], n, iovas) != n)
+				return true;
+		}
+
+		iova = iovas[i % 64];
+
+		if (sgl) {
+			if ((ctrl->flags & NVME_CTRL_F_SGLS_DWORD_ALIGNMENT) && (iova & 0x3))
+				return true;
+
+			continue;
+		}
+
+		if (iova & 0x3)
+			return true;
+
+		/* all entries but the first must be page size aligned */
+		if (i > 0 && !ALIGNED(iova, pagesize))
+			return true;
+
+		/* all entries but the last must end on a page size boundary */
+		if (i < niov - 1 && !ALIGNED(iova + iov[i].iov_len, pagesize))
+			return true;
+	}
+
+	return false;
+}
+
+static int __nvme_rq_bounce(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+			    struct iovec *iov, int niov, bool sgl)
+{
+	size_t len = 0;
+	int ret;
+
+	for (int i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+
+	if (len > rq->bounce.len) {
+		log_debug("transfer size %zu exceeds bounce buffer size %zu\n",
+			  len, rq->bounce.len);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cmd->opcode & NVME_OPCODE_DTD_H2C) {
+		size_t off = 0;
+
+		for (int i = 0; i < niov; i++) {
+			memcpy(rq->bounce.vaddr + off, iov[i].iov_base, iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+	}
+
+	if (sgl) {
+		struct iova_vec iova = {.iova = rq->bounce.iova, .len = len};
+
+		ret = nvme_mapv_iova_sgl(ctrl, rq->page.vaddr, rq->page.iova, cmd, &iova, 1);
+	} else {
+		ret = nvme_map_prp(ctrl, rq->page.vaddr, 1, cmd, rq->bounce.iova, len);
+	}
+
+	if (ret)
+		return -1;
+
+	/* only copy back on completion if the command was actually mapped */
+	if (cmd->opcode & NVME_OPCODE_DTD_C2H) {
+		rq->bounce.iov = iov;
+		rq->bounce.niov = niov;
+	}
+
+	return 0;
+}
+
+void nvme_rq_unbounce(struct nvme_rq *rq)
+{
+	size_t off = 0;
+
+	if (!rq->bounce.iov)
+		return;
+
+	for (int i = 0; i < rq->bounce.niov; i++) {
+		memcpy(rq->bounce.iov[i].iov_base, rq->bounce.vaddr + off,
+		       rq->bounce.iov[i].iov_len);
+		off += rq->bounce.iov[i].iov_len;
+	}
+
+	rq->bounce.iov = NULL;
+	rq->bounce.niov = 0;
+}
+
 int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		     struct iovec *iov, int niov)
 {
+	if (rq->bounce.vaddr && __nvme_rq_need_bounce(ctrl, iov, niov, false))
+		return __nvme_rq_bounce(ctrl, rq, cmd, iov, niov, false);
+
 	return nvme_mapv_prp(ctrl, rq->page.vaddr, 1, cmd, iov, niov);
 }
 
@@ -59,6 +176,9 @@ int nvme_rq_mapv_iova_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme
 int nvme_rq_mapv_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		     struct iovec *iov, int niov)
 {
+	if (rq->bounce.vaddr && __nvme_rq_need_bounce(ctrl, iov, niov, true))
+		return __nvme_rq_bounce(ctrl, rq, cmd, iov, niov, true);
+
 	return nvme_mapv_sgl(ctrl, rq->page.vaddr, rq->page.iova, cmd, iov, niov);
 }
 
@@ -79,6 +199,78 @@ int nvme_rq_mapv(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd
 	return nvme_rq_mapv_sgl(ctrl, rq, cmd, iov, niov);
 }
 
+int nvme_rq_map_region(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		       const struct iommu_region *region, size_t offset, size_t len)
+{
+	struct iova_vec iov = {
+		.iova = iommu_region_iova(region, offset),
+		.len = len,
+	};
+
+	if (!len || !iommu_region_contains(region, offset, len)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((ctrl->flags & NVME_CTRL_F_SGLS_SUPPORTED) == 0 || rq->sq->id == 0)
+		return nvme_rq_mapv_iova_prp(ctrl, rq, cmd, &iov, 1);
+
+	return nvme_rq_mapv_iova_sgl(ctrl, rq, cmd, &iov, 1);
+}
+
+int nvme_rq_map_meta(struct nvme_ctrl *ctrl, struct nvme_rq *rq UNUSED, union nvme_cmd *cmd,
+		     void *vaddr)
+{
+	iova_t iova;
+
+	if (!iommu_translate_vaddr(__iommu_ctx(ctrl), vaddr, &iova)) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	if (iova & 0x3) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cmd->mptr = cpu_to_le64(iova);
+
+	return 0;
+}
+
+int nvme_rq_map_meta_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+			 void *vaddr, size_t len)
+{
+	struct nvme_sgld *sgld = rq->meta.vaddr;
+	iova_t iova;
+
+	if (!(ctrl->flags & NVME_CTRL_F_SGLS_MPTR_SGL)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (!iommu_translate_vaddr(__iommu_ctx(ctrl), vaddr, &iova)) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	if ((ctrl->flags & NVME_CTRL_F_SGLS_DWORD_ALIGNMENT) && (iova & 0x3)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sgld->addr = cpu_to_le64(iova);
+	sgld->len = cpu_to_le32((uint32_t)len);
+	sgld->type = NVME_SGLD_TYPE_DATA_BLOCK << 4;
+
+	cmd->mptr = cpu_to_le64(rq->meta.iova);
+
+	cmd->flags &= (uint8_t)~(NVME_CMD_FLAGS_PSDT_MASK << NVME_CMD_FLAGS_PSDT_SHIFT);
+	cmd->flags |= NVME_FIELD_SET(NVME_CMD_FLAGS_PSDT_SGL_MPTR_SGL, CMD_FLAGS_PSDT);
+
+	return 0;
+}
+
 int nvme_rq_wait(struct nvme_rq *rq, struct nvme_cqe *cqe_copy, struct timespec *ts)
 {
 	struct nvme_cq *cq = rq->sq->cq;
@@ -97,6 +289,8 @@ int nvme_rq_wait(struct nvme_rq *rq, struct nvme_cqe *cqe_copy, struct timespec
 		return -1;
 	}
 
+	nvme_rq_unbounce(rq);
+
 	if (!nvme_cqe_ok(&cqe)) {
 		if (logv(LOG_DEBUG)) {
 			uint16_t status = le16_to_cpu(cqe.sfp) >> 1;
@@ -16,6 +16,8 @@
  * more details.
  */
 
+#include <pthread.h>
+
 #include "ccan/tap/tap.h"
 
 #include "rq.c"
@@ -32,6 +34,15 @@ bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, iova_t *io
 	return true;
 }
 
+int iommu_translate_vaddrv(struct iommu_ctx *ctx, const struct iovec *iov, int niov,
+			   iova_t *iova)
+{
+	for (int i = 0; i < niov; i++)
+		iommu_translate_vaddr(ctx, iov[i].iov_base, &iova[i]);
+
+	return niov;
+}
+
 int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
 		    iova_t *iova UNUSED, unsigned long flags UNUSED)
 {
@@ -43,24 +54,183 @@ int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *
 	return 0;
 }
 
-int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer UNUSED,
-		     size_t len UNUSED, unsigned long flags UNUSED)
+/* references held on the (fake) mapping cache, if enabled */
+static bool map_cache;
+static int map_cache_users;
+
+int iommu_map_cache_get(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len UNUSED,
+			iova_t *iova)
 {
+	if (!map_cache) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	map_cache_users++;
+
+	*iova = (uint64_t)vaddr;
+
 	return 0;
 }
 
-void iommu_put_dmabuf(struct iommu_dmabuf *buffer UNUSED)
+void iommu_map_cache_put(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED)
+{
+	map_cache_users--;
+}
+
+int iommu_get_dmabuf(struct iommu_ctx *ctx, struct iommu_dmabuf *buffer, size_t len,
+		     unsigned long flags UNUSED)
+{
+	ssize_t ret = pgmap(&buffer->vaddr, len);
+
+	if (ret < 0)
+		return -1;
+
+	buffer->ctx = ctx;
+	buffer->iova = (uint64_t)buffer->vaddr;
+	buffer->len = ret;
+
+	return 0;
+}
+
+void iommu_put_dmabuf(struct iommu_dmabuf *buffer)
+{
+	if (!buffer->len)
+		return;
+
+	pgunmap(buffer->vaddr, buffer->len);
+
+	memset(buffer, 0x0, sizeof(*buffer));
+}
+
+int iommu_dmapool_get(struct iommu_dmapool *pool UNUSED, struct iommu_dmachunk *chunk UNUSED,
+		      size_t len UNUSED)
+{
+	return 0;
+}
+
+void iommu_dmapool_put(struct iommu_dmachunk *chunk UNUSED)
 {
 	;
 }
 
+struct iommu_dmapool *iommu_dmapool_create(struct iommu_ctx *ctx UNUSED, size_t len UNUSED,
+					   unsigned long flags UNUSED)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void iommu_dmapool_destroy(struct iommu_dmapool *pool UNUSED)
+{
+	;
+}
+
+void iommu_dmapool_forget(struct iommu_dmapool *pool UNUSED)
+{
+	;
+}
+
+int vfio_pci_open(struct vfio_pci_device *pci UNUSED, const char *bdf UNUSED)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int vfio_pci_close(struct vfio_pci_device *pci UNUSED)
+{
+	return 0;
+}
+
+void *vfio_pci_map_bar(struct vfio_pci_device *pci UNUSED, int idx UNUSED, size_t len UNUSED,
+		       uint64_t offset UNUSED, int prot UNUSED)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void vfio_pci_unmap_bar(struct vfio_pci_device *pci UNUSED, int idx UNUSED, void *mem UNUSED,
+			size_t len UNUSED, uint64_t offset UNUSED)
+{
+	;
+}
+
+/* fake controller side of the admin completion queue */
+static uint16_t ctrl_cq_tail;
+static uint16_t ctrl_cq_phase = 1;
+
+static void complete(struct nvme_cq *cq, uint16_t cid, uint16_t status)
+{
+	struct nvme_cqe *cqe = (struct nvme_cqe *)cq->mem.vaddr + ctrl_cq_tail;
+
+	cqe->cid = cid;
+
+	/* the phase tag publishes the entry to a concurrent poller */
+	atomic_store_release(&cqe->sfp, cpu_to_le16((uint16_t)(status << 1 | ctrl_cq_phase)));
+
+	if (++ctrl_cq_tail == cq->qsize) {
+		ctrl_cq_tail = 0;
+		ctrl_cq_phase ^= 0x1;
+	}
+}
+
+/* fake controller side of the admin submission queue; see ctrl_thread() */
+static struct nvme_sq *ctrl_sq;
+static uint16_t ctrl_sq_head;
+static bool ctrl_stop;
+static int ctrl_ncmds;
+
+/* commands with these opcodes fail for the queue identifiers in the mask */
+static uint32_t ctrl_fail_qids[NVME_ADMIN_CREATE_CQ + 1];
+
+static uint16_t ctrl_status(union nvme_cmd *cmd)
+{
+	uint16_t qid = le16_to_cpu(cmd->delete_q.qid);
+
+	if (cmd->opcode <= NVME_ADMIN_CREATE_CQ && ctrl_fail_qids[cmd->opcode] & (1 << qid))
+		return 0x101; /* invalid queue identifier */
+
+	return 0x0;
+}
+
+/* complete the commands submitted to ctrl_sq until ctrl_stop is set */
+static void *ctrl_thread(void *arg UNUSED)
+{
+	while (!atomic_load_acquire(&ctrl_stop)) {
+		uint32_t tail = le32_to_cpu(mmio_read32(ctrl_sq->doorbell));
+
+		for (; ctrl_sq_head != tail; ctrl_sq_head = (ctrl_sq_head + 1) % ctrl_sq->qsize) {
+			union nvme_cmd *cmd = (union nvme_cmd *)ctrl_sq->mem.vaddr + ctrl_sq_head;
+
+			complete(ctrl_sq->cq, cmd->cid, ctrl_status(cmd));
+			ctrl_ncmds++;
+		}
+	}
+
+	return NULL;
+}
+
+static int ncbs;
+static bool cb_rq_free;
+static void *cb_opaque;
+static struct nvme_cqe cb_cqe;
+
+static void admin_cb(struct nvme_ctrl *ctrl, struct nvme_cqe *cqe, void *opaque)
+{
+	ncbs++;
+
+	cb_rq_free = ctrl->adminq.sq->rq_top == &ctrl->adminq.sq->rqs[cqe->cid];
+	cb_opaque = opaque;
+	cb_cqe = *cqe;
+}
+
 int main(void)
 {
 	struct nvme_ctrl ctrl = {
 		.config.mps = 0,
 	};
 
-	struct nvme_rq rq;
+	struct nvme_rq rq = {};
 	union nvme_cmd cmd;
 	leint64_t *prplist;
 	struct nvme_sgld *sglds;
@@ -71,7 +241,36 @@ int main(void)
 	leint64_t *mprplists;
 	void *mppages;
 
-	plan_tests(179 + 18);
+	/* user data for bounce buffer tests */
+	void *data;
+
+	/* metadata sgl descriptor */
+	struct nvme_sgld msgld;
+
+	/* registered region and an i/o queue for region tests */
+	struct iommu_region region = {.iova = 0x1000000, .len = 0x10000};
+	struct nvme_sq sq = {.id = 1};
+
+	/* admin queue pair for asynchronous admin command tests */
+	struct nvme_cq acq = {.qsize = 4};
+	struct nvme_sq asq = {.cq = &acq, .qsize = 4};
+	struct nvme_rq arqs[3] = {};
+	struct nvme_admin_req *areqs[3] = {};
+	struct nvme_cqe aer_cqes[3];
+	struct nvme_rq *next;
+	uint32_t asq_doorbell, acq_doorbell;
+	int cookie, aer_cookie;
+
+	/* i/o queue pairs 1 to 3 for batched queue creation tests */
+	struct nvme_sq iosqs[4] = {};
+	struct nvme_cq iocqs[4] = {};
+	uint32_t iodoorbells[8];
+	pthread_t ctrl_tid;
+
+	/* buffer of asynchronous admin commands */
+	void *abuf;
+
+	plan_tests(179 + 18 + 19 + 9 + 10 + 11 + 3 + 3 + 6 + 7 + 3);
 
 	assert(pgmap((void **)&rq.page.vaddr, __VFN_PAGESIZE) > 0);
 
@@ -602,5 +801,298 @@ int main(void)
 	ok1(le64_to_cpu(sglds[0].addr) == 0x1000000);
 	ok1(le64_to_cpu(sglds[1].addr) == 0x1002000);
 
+
+	/*
+	 * Bounce buffer tests
+	 */
+
+	assert(pgmap((void **)&rq.bounce.vaddr, 2 * __VFN_PAGESIZE) > 0);
+	assert(pgmap((void **)&data, 4 * __VFN_PAGESIZE) > 0);
+
+	rq.bounce.iova = (uint64_t)rq.bounce.vaddr;
+	rq.bounce.len = 2 * __VFN_PAGESIZE;
+
+	for (size_t i = 0; i < 4 * __VFN_PAGESIZE; i++)
+		((uint8_t *)data)[i] = (uint8_t)i;
+
+	/* aligned iovec; mapped directly */
+	memset(&cmd, 0x0, sizeof(cmd));
+	cmd.opcode = 0x1;
+	iov[0] = (struct iovec) {.iov_base = data, .iov_len = 0x1000};
+	iov[1] = (struct iovec) {.iov_base = data + 0x2000, .iov_len = 0x1000};
+	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == (uint64_t)data);
+	ok1(rq.bounce.iov == NULL);
+
+	/* unaligned iovec; data copied to the bounce buffer */
+	memset(&cmd, 0x0, sizeof(cmd));
+	cmd.opcode = 0x1;
+	iov[0] = (struct iovec) {.iov_base = data, .iov_len = 0x800};
+	iov[1] = (struct iovec) {.iov_base = data + 0x2010, .iov_len = 0x100};
+	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == rq.bounce.iova);
+	ok1(memcmp(rq.bounce.vaddr, data, 0x800) == 0);
+	ok1(memcmp(rq.bounce.vaddr + 0x800, data + 0x2010, 0x100) == 0);
+	ok1(rq.bounce.iov == NULL);
+
+	/* unaligned iovec; data copied back from the bounce buffer */
+	memset(&cmd, 0x0, sizeof(cmd));
+	cmd.opcode = 0x2;
+	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == rq.bounce.iova);
+	ok1(rq.bounce.iov == iov && rq.bounce.niov == 2);
+
+	memset(rq.bounce.vaddr, 0xab, 0x900);
+	nvme_rq_unbounce(&rq);
+	ok1(((uint8_t *)data)[0x7ff] == 0xab && ((uint8_t *)data)[0x800] == 0x00);
+	ok1(((uint8_t *)data)[0x2010] == 0xab && ((uint8_t *)data)[0x210f] == 0xab);
+	ok1(rq.bounce.iov == NULL);
+
+	/* failed mapping (too large for a single prp list); nothing is copied back */
+	rq.bounce.len = SIZE_MAX;
+
+	memset(&cmd, 0x0, sizeof(cmd));
+	cmd.opcode = 0x2;
+	iov[0] = (struct iovec) {.iov_base = data, .iov_len = 0x800};
+	iov[1] = (struct iovec) {.iov_base = data + 0x2010, .iov_len = 0x400000};
+	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == -1 && errno == EINVAL);
+	ok1(rq.bounce.iov == NULL);
+
+	memset(rq.bounce.vaddr, 0xcd, 0x900);
+	nvme_rq_unbounce(&rq);
+	ok1(((uint8_t *)data)[0x0] == 0xab && ((uint8_t *)data)[0x2010] == 0xab);
+
+	rq.bounce.len = 2 * __VFN_PAGESIZE;
+
+	/* transfer exceeds the bounce buffer */
+	memset(&cmd, 0x0, sizeof(cmd));
+	cmd.opcode = 0x1;
+	iov[0] = (struct iovec) {.iov_base = data + 0x10, .iov_len = 0x1000};
+	iov[1] = (struct iovec) {.iov_base = data + 0x2000, .iov_len = 0x1001};
+	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == -1 && errno == EINVAL);
+
+	/* sgl with dword alignment requirement */
+	ctrl.flags |= NVME_CTRL_F_SGLS_DWORD_ALIGNMENT;
+
+	/* start from a command with garbage in the data pointer */
+	memset(&cmd, 0xff, sizeof(cmd));
+	cmd.opcode = 0x1;
+	cmd.flags = 0x0;
+	iov[0] = (struct iovec) {.iov_base = data + 0x1, .iov_len = 0x10};
+	iov[1] = (struct iovec) {.iov_base = data + 0x2000, .iov_len = 0x10};
+	ok1(nvme_rq_mapv_sgl(&ctrl, &rq, &cmd, iov, 2) == 0);
+	ok1(le64_to_cpu(cmd.dptr.sgl.addr) == rq.bounce.iova);
+	ok1(le32_to_cpu(cmd.dptr.sgl.len) == 0x20);
+	ok1(cmd.dptr.sgl.type == NVME_SGLD_TYPE_DATA_BLOCK << 4);
+
+	ctrl.flags &= ~NVME_CTRL_F_SGLS_DWORD_ALIGNMENT;
+
+
+	/*
+	 * Registered region tests
+	 */
+
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_map_region(&ctrl, &rq, &cmd, &region, 0x1000, 0x2000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1001000);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x1002000);
+
+	ok1(nvme_rq_map_region(&ctrl, &rq, &cmd, &region, 0xf000, 0x2000) == -1 &&
+	    errno == EINVAL);
+	ok1(nvme_rq_map_region(&ctrl, &rq, &cmd, &region, 0x10000, 0x0) == -1 &&
+	    errno == EINVAL);
+	ok1(nvme_rq_map_region(&ctrl, &rq, &cmd, &region, SIZE_MAX, 0x2) == -1 &&
+	    errno == EINVAL);
+
+	ctrl.flags |= NVME_CTRL_F_SGLS_SUPPORTED;
+	rq.sq = &sq;
+
+	memset((void *)sglds, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_map_region(&ctrl, &rq, &cmd, &region, 0x800, 0x1000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.sgl.addr) == 0x1000800);
+	ok1(le32_to_cpu(cmd.dptr.sgl.len) == 0x1000);
+	ok1(cmd.dptr.sgl.type == NVME_SGLD_TYPE_DATA_BLOCK);
+
+	ctrl.flags &= ~NVME_CTRL_F_SGLS_SUPPORTED;
+	rq.sq = NULL;
+
+
+	/*
+	 * Metadata pointer tests
+	 */
+
+	rq.meta.vaddr = &msgld;
+	rq.meta.iova = (uint64_t)&msgld;
+
+	memset(&cmd, 0x0, sizeof(cmd));
+	ok1(nvme_rq_map_meta(&ctrl, &rq, &cmd, (void *)0x2000000) == 0);
+	ok1(le64_to_cpu(cmd.mptr) == 0x2000000);
+	ok1(nvme_rq_map_meta(&ctrl, &rq, &cmd, (void *)0x2000002) == -1 && errno == EINVAL);
+
+	memset(&cmd, 0x0, sizeof(cmd));
+	ok1(nvme_rq_map_meta_sgl(&ctrl, &rq, &cmd, (void *)0x2000000, 0x40) == -1 &&
+	    errno == ENOTSUP);
+
+	ctrl.flags |= NVME_CTRL_F_SGLS_MPTR_SGL;
+
+	cmd.flags = NVME_FIELD_SET(NVME_CMD_FLAGS_PSDT_SGL_MPTR_CONTIG, CMD_FLAGS_PSDT);
+	ok1(nvme_rq_map_meta_sgl(&ctrl, &rq, &cmd, (void *)0x2000000, 0x40) == 0);
+	ok1(le64_to_cpu(cmd.mptr) == rq.meta.iova);
+	ok1(le64_to_cpu(msgld.addr) == 0x2000000 && le32_to_cpu(msgld.len) == 0x40);
+	ok1(msgld.type == NVME_SGLD_TYPE_DATA_BLOCK << 4);
+	ok1(NVME_FIELD_GET(cmd.flags, CMD_FLAGS_PSDT) == NVME_CMD_FLAGS_PSDT_SGL_MPTR_SGL);
+
+	ctrl.flags &= ~NVME_CTRL_F_SGLS_MPTR_SGL;
+
+
+	/*
+	 * Asynchronous admin command tests
+	 */
+
+	assert(pgmap(&asq.mem.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&acq.mem.vaddr, __VFN_PAGESIZE) > 0);
+
+	asq.doorbell = &asq_doorbell;
+	acq.doorbell = &acq_doorbell;
+
+	for (uint16_t i = 0; i < 3; i++) {
+		arqs[i].sq = &asq;
+		arqs[i].cid = i;
+		arqs[i].rq_next = i ? &arqs[i - 1] : NULL;
+	}
+
+	asq.rqs = arqs;
+	asq.rq_top = &arqs[2];
+
+	ctrl.adminq.sq = &asq;
+	ctrl.adminq.cq = &acq;
+	ctrl.admin_reqs = areqs;
+	ctrl.aer_cqes = aer_cqes;
+
+	memset(&cmd, 0x0, sizeof(cmd));
+	ok1(nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, &cookie) == 0 && asq.tail == 1 &&
+	    ((union nvme_cmd *)asq.mem.vaddr)->cid == (2 | NVME_CID_ASYNC));
+
+	ok1(nvme_admin_poll(&ctrl, NULL) == 0 && ncbs == 0);
+
+	complete(&acq, 2 | NVME_CID_ASYNC, 0x2);
+	ok1(nvme_admin_poll(&ctrl, NULL) == 1 && ncbs == 1 && cb_opaque == &cookie &&
+	    cb_cqe.cid == 2 && !nvme_cqe_ok(&cb_cqe));
+	ok1(cb_rq_free && asq.rq_top == &arqs[2] && acq_doorbell == 1);
+
+	/* aer completions are passed to the aer callback */
+	ok1(nvme_aer(&ctrl, &aer_cookie) == 0);
+	complete(&acq, 2 | NVME_CID_AER, 0x0);
+	ok1(nvme_admin_poll(&ctrl, admin_cb) == 1 && ncbs == 2 && cb_opaque == &aer_cookie &&
+	    asq.rq_top == &arqs[2]);
+
+	/* aer completions are kept until a poller handles them */
+	ok1(nvme_aer(&ctrl, &aer_cookie) == 0);
+	complete(&acq, 2 | NVME_CID_AER, 0x0);
+	ok1(nvme_admin_poll(&ctrl, NULL) == 1 && ncbs == 2 && asq.rq_top == &arqs[1]);
+	ok1(nvme_admin_poll(&ctrl, admin_cb) == 1 && ncbs == 3 && cb_opaque == &aer_cookie &&
+	    cb_cqe.cid == 2 && cb_rq_free);
+
+	ok1(nvme_aer(&ctrl, &aer_cookie) == 0);
+	next = asq.rq_top;
+	complete(&acq, 2 | NVME_CID_AER, 0x0);
+	complete(&acq, next->cid, 0x0);
+	ok1(nvme_admin(&ctrl, &cmd, NULL, 0, NULL) == 0 && ncbs == 3 && ctrl.naer_cqes == 1);
+	ok1(nvme_admin_poll(&ctrl, admin_cb) == 1 && ncbs == 4 && asq.rq_top == &arqs[2]);
+
+	/* pipelined */
+	ok1(nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, NULL) == 0 &&
+	    nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, NULL) == 0 &&
+	    nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, NULL) == 0 &&
+	    nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, NULL) == -1 && errno == EBUSY);
+
+	complete(&acq, 0 | NVME_CID_ASYNC, 0x0);
+	complete(&acq, 2 | NVME_CID_ASYNC, 0x0);
+	complete(&acq, 1 | NVME_CID_ASYNC, 0x0);
+	ok1(nvme_admin_poll(&ctrl, NULL) == 3 && ncbs == 7 && asq.rq_top == &arqs[1]);
+
+	/* synchronous commands dispatch asynchronous completions */
+	ok1(nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, &cookie) == 0);
+	next = asq.rq_top;
+
+	complete(&acq, 1 | NVME_CID_ASYNC, 0x0);
+	complete(&acq, next->cid, 0x0);
+	ok1(nvme_admin(&ctrl, &cmd, NULL, 0, NULL) == 0 && ncbs == 8 && cb_opaque == &cookie);
+
+	/* abort */
+	ok1(nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, &cookie) == 0 &&
+	    nvme_admin_abort(&ctrl, NULL) == 1 && ncbs == 9 && cb_opaque == &cookie && cb_rq_free &&
+	    le16_to_cpu(cb_cqe.sfp) >> 1 == NVME_STATUS_HOST_ABORTED);
+
+	ok1(nvme_aer(&ctrl, &aer_cookie) == 0 && nvme_admin_abort(&ctrl, admin_cb) == 1 &&
+	    ncbs == 10 && cb_opaque == &aer_cookie && cb_rq_free);
+
+	ok1(nvme_admin_abort(&ctrl, admin_cb) == 0 && ncbs == 10 &&
+	    asq.rq_top && asq.rq_top->rq_next && asq.rq_top->rq_next->rq_next);
+
+	/* cached buffer mappings stay in use until the command completes */
+	assert(pgmap(&abuf, __VFN_PAGESIZE) > 0);
+	map_cache = true;
+
+	next = asq.rq_top;
+	ok1(nvme_admin_async(&ctrl, &cmd, abuf, 0x1000, admin_cb, &cookie) == 0 &&
+	    map_cache_users == 1);
+
+	complete(&acq, next->cid | NVME_CID_ASYNC, 0x0);
+	ok1(nvme_admin_poll(&ctrl, NULL) == 1 && ncbs == 11 && map_cache_users == 0);
+
+	ok1(nvme_admin_async(&ctrl, &cmd, abuf, 0x1000, admin_cb, &cookie) == 0 &&
+	    map_cache_users == 1 && nvme_admin_abort(&ctrl, NULL) == 1 && ncbs == 12 &&
+	    map_cache_users == 0);
+
+	map_cache = false;
+	pgunmap(abuf, __VFN_PAGESIZE);
+
+	ctrl.flags |= NVME_CTRL_F_SECONDARY;
+
+	ok1(nvme_admin_async(&ctrl, &cmd, NULL, 0, admin_cb, NULL) == -1 && errno == EPERM &&
+	    nvme_admin_poll(&ctrl, NULL) == -1 && errno == EPERM &&
+	    nvme_admin_abort(&ctrl, NULL) == -1 && errno == EPERM);
+
+	ctrl.flags &= ~NVME_CTRL_F_SECONDARY;
+
+	/* batched i/o queue pair creation */
+	ctrl.sq = iosqs;
+	ctrl.cq = iocqs;
+	ctrl.doorbells = iodoorbells;
+	ctrl.config.cap = 0xff; /* mqes 255, dstrd 0 */
+	ctrl.config.nsqa = ctrl.config.ncqa = 2;
+	ctrl.config.mqes = 3;
+	ctrl.pci.numa_node = -1;
+
+	ctrl_sq = &asq;
+	ctrl_sq_head = asq.tail;
+
+	assert(pthread_create(&ctrl_tid, NULL, ctrl_thread, NULL) == 0);
+
+	ok1(nvme_create_ioqpairs(&ctrl, 1, 3, 4, -1, 0x0) == 0 && ctrl_ncmds == 6 &&
+	    iosqs[1].qsize == 4 && iocqs[3].qsize == 4 && iosqs[3].cq == &iocqs[3]);
+	ok1(nvme_delete_ioqpairs(&ctrl, 1, 3) == 0 && ctrl_ncmds == 12 &&
+	    !iosqs[1].qsize && !iocqs[3].qsize);
+
+	/* queues that could not be deleted again are left configured */
+	ctrl_fail_qids[NVME_ADMIN_CREATE_SQ] = 1 << 2;
+	ctrl_fail_qids[NVME_ADMIN_DELETE_SQ] = 1 << 3;
+	ctrl_fail_qids[NVME_ADMIN_DELETE_CQ] = 1 << 1;
+
+	ok1(nvme_create_ioqpairs(&ctrl, 1, 3, 4, -1, 0x0) == -1 && errno == EIO &&
+	    ctrl_ncmds == 12 + 3 + 3 + 2 + 2);
+	ok1(!iosqs[1].qsize && iocqs[1].qsize == 4);
+	ok1(!iosqs[2].qsize && !iocqs[2].qsize);
+	ok1(iosqs[3].qsize == 4 && iocqs[3].qsize == 4);
+
+	memset(ctrl_fail_qids, 0x0, sizeof(ctrl_fail_qids));
+
+	ok1(nvme_delete_ioqpairs(&ctrl, 1, 3) == 0 && !iocqs[1].qsize && !iosqs[3].qsize &&
+	    !iocqs[3].qsize);
+
+	atomic_store_release(&ctrl_stop, true);
+	pthread_join(ctrl_tid, NULL);
+
 	return exit_status();
 }
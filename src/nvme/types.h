@@ -139,6 +139,14 @@ enum nvme_admin_opcode {
 	NVME_ADMIN_DBCONFIG		= 0x7c,
 };
 
+/*
+ * Bits 1:0 of the opcode specify the data transfer direction of the command.
+ */
+enum nvme_opcode_dtd {
+	NVME_OPCODE_DTD_H2C		= 1 << 0,
+	NVME_OPCODE_DTD_C2H		= 1 << 1,
+};
+
 enum nvme_identify_cns {
 	NVME_IDENTIFY_CNS_CTRL			= 0x01,
 	NVME_IDENTIFY_CNS_PRIMARY_CTRL_CAP	= 0x14,
@@ -160,6 +168,8 @@ enum nvme_identify_ctrl_sgls {
 
 	NVME_IDENTIFY_CTRL_SGLS_ALIGNMENT_NONE	= 0x1,
 	NVME_IDENTIFY_CTRL_SGLS_ALIGNMENT_DWORD	= 0x2,
+
+	NVME_IDENTIFY_CTRL_SGLS_MSGLS		= 1 << 19,
 };
 
 struct nvme_primary_ctrl_cap {
@@ -202,6 +212,11 @@ struct nvme_secondary_ctrl_list {
 	struct nvme_secondary_ctrl sc_entry[NVME_ID_SECONDARY_CTRL_MAX];
 };
 
+enum nvme_status {
+	/* Command Aborted By Host (Path Related Status) */
+	NVME_STATUS_HOST_ABORTED	= (0x3 << 8) | 0x71,
+};
+
 enum nvme_virt_mgmt_rt {
 	NVME_VIRT_MGMT_RESOURCE_TYPE_VQ = 0x0,
 	NVME_VIRT_MGMT_RESOURCE_TYPE_VI = 0x1,
@@ -36,18 +36,6 @@
 #include "ccan/minmax/minmax.h"
 #include "types.h"
 
-#include "crc64table.h"
-
-uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len)
-{
-	size_t i;
-
-	for (i = 0; i < len; i++)
-		crc = (crc >> 8) ^ crc64_nvme_table[(crc & 0xff) ^ buffer[i]];
-
-	return crc ^ (uint64_t)~0;
-}
-
 int nvme_set_errno_from_cqe(struct nvme_cqe *cqe)
 {
 	errno = le16_to_cpu(cqe->sfp) >> 1 ? EIO : 0;
@@ -75,31 +63,170 @@ int nvme_aer(struct nvme_ctrl *ctrl, void *opaque)
 	return 0;
 }
 
+/* how __nvme_sync_map() got the iova of a caller buffer */
+enum nvme_buf_map {
+	NVME_BUF_MAPPED,	/* mapped by the caller */
+	NVME_BUF_CACHED,	/* in use in the mapping cache */
+	NVME_BUF_EPHEMERAL,	/* mapped for the duration of the command */
+};
+
+/*
+ * Get the iova of a caller buffer, mapping it for the duration of the command
+ * unless it is already mapped or the mapping cache is enabled. Release it with
+ * __nvme_sync_unmap() when the command has completed.
+ */
+static int __nvme_sync_map(struct iommu_ctx *ctx, void *buf, size_t len, iova_t *iova,
+			   enum nvme_buf_map *how)
+{
+	if (!iommu_map_cache_get(ctx, buf, len, iova)) {
+		*how = NVME_BUF_CACHED;
+		return 0;
+	}
+
+	/* disabled, or full of mappings in use by other commands */
+	if (errno != EOPNOTSUPP && errno != EBUSY)
+		return -1;
+
+	if (iommu_translate_vaddr(ctx, buf, iova)) {
+		*how = NVME_BUF_MAPPED;
+		return 0;
+	}
+
+	*how = NVME_BUF_EPHEMERAL;
+
+	return iommu_map_vaddr(ctx, buf, len, iova, IOMMU_MAP_EPHEMERAL);
+}
+
+static void __nvme_sync_unmap(struct iommu_ctx *ctx, void *buf, enum nvme_buf_map how)
+{
+	switch (how) {
+	case NVME_BUF_MAPPED:
+		break;
+
+	case NVME_BUF_CACHED:
+		iommu_map_cache_put(ctx, buf);
+		break;
+
+	case NVME_BUF_EPHEMERAL:
+		log_fatal_if(iommu_unmap_vaddr(ctx, buf, NULL), "iommu_unmap_vaddr\n");
+		break;
+	}
+}
+
+/*
+ * The admin queue and the iommu mappings belong to the primary process; a
+ * secondary process may only use caller buffers that are already mapped.
+ */
+static int __nvme_sync_secondary(struct nvme_ctrl *ctrl, struct nvme_sq *sq, void *buf,
+				 iova_t *iova)
+{
+	if (sq == ctrl->adminq.sq || (buf && !iommu_translate_vaddr(__iommu_ctx(ctrl), buf, iova))) {
+		errno = EPERM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* a command submitted with nvme_admin_async(); see ctrl->admin_reqs */
+struct nvme_admin_req {
+	nvme_admin_cb cb;
+	void *opaque;
+
+	/* the buffer, released with __nvme_sync_unmap() on completion */
+	void *buf;
+	enum nvme_buf_map how;
+};
+
+static void __nvme_admin_complete(struct nvme_ctrl *ctrl, struct nvme_cqe *cqe)
+{
+	struct nvme_sq *sq = ctrl->adminq.sq;
+	struct nvme_admin_req *req;
+	uint16_t cid = cqe->cid & ~NVME_CID_ASYNC;
+
+	if (cid >= sq->qsize - 1 || !ctrl->admin_reqs[cid]) {
+		log_error("SPURIOUS CQE (cq %" PRIu16 " cid %" PRIu16 ")\n", sq->cq->id, cqe->cid);
+		return;
+	}
+
+	req = ctrl->admin_reqs[cid];
+	ctrl->admin_reqs[cid] = NULL;
+
+	/* release first, so the callback may submit another command */
+	nvme_rq_release_atomic(&sq->rqs[cid]);
+
+	if (req->buf)
+		__nvme_sync_unmap(__iommu_ctx(ctrl), req->buf, req->how);
+
+	cqe->cid = cid;
+
+	if (req->cb)
+		req->cb(ctrl, cqe, req->opaque);
+
+	free(req);
+}
+
+/* the tracker stays acquired until the completion is delivered */
+static void __nvme_admin_defer_aer(struct nvme_ctrl *ctrl, struct nvme_cqe *cqe)
+{
+	struct nvme_cqe *aer = &ctrl->aer_cqes[ctrl->naer_cqes++];
+
+	memcpy(aer, cqe, sizeof(*aer));
+	aer->cid &= ~NVME_CID_AER;
+}
+
+static int __nvme_admin_deliver_aers(struct nvme_ctrl *ctrl, nvme_admin_cb aer_cb)
+{
+	struct nvme_sq *sq = ctrl->adminq.sq;
+	struct nvme_cqe cqe;
+	int n = 0;
+
+	/* the callback may poll again, so pop one at a time */
+	while (ctrl->naer_cqes) {
+		struct nvme_rq *rq;
+		void *aer_opaque;
+
+		memcpy(&cqe, &ctrl->aer_cqes[0], sizeof(cqe));
+		memmove(&ctrl->aer_cqes[0], &ctrl->aer_cqes[1],
+			--ctrl->naer_cqes * sizeof(cqe));
+
+		rq = &sq->rqs[cqe.cid];
+		aer_opaque = rq->opaque;
+
+		nvme_rq_release_atomic(rq);
+
+		aer_cb(ctrl, &cqe, aer_opaque);
+
+		n++;
+	}
+
+	return n;
+}
+
 int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, void *buf,
 	      size_t len, struct nvme_cqe *cqe_copy)
 {
 	struct nvme_cqe cqe;
 	struct nvme_rq *rq;
 	iova_t iova;
-	bool do_unmap = false;
+	enum nvme_buf_map how = NVME_BUF_MAPPED;
 	int ret = 0;
 
-	if (buf) {
-		struct iommu_ctx *ctx = __iommu_ctx(ctrl);
-
-		if (!iommu_translate_vaddr(ctx, buf, &iova)) {
-			do_unmap = true;
-
-			if (iommu_map_vaddr(ctx, buf, len, &iova, IOMMU_MAP_EPHEMERAL)) {
-				log_debug("failed to map vaddr\n");
-				return -1;
-			}
-		}
+	if (ctrl->flags & NVME_CTRL_F_SECONDARY) {
+		if (__nvme_sync_secondary(ctrl, sq, buf, &iova))
+			return -1;
+	} else if (buf && __nvme_sync_map(__iommu_ctx(ctrl), buf, len, &iova, &how)) {
+		log_debug("failed to map vaddr\n");
+		return -1;
 	}
 
 	rq = nvme_rq_acquire_atomic(sq);
-	if (!rq)
+	if (!rq) {
+		if (buf)
+			__nvme_sync_unmap(__iommu_ctx(ctrl), buf, how);
+
 		return -1;
+	}
 
 	if (buf) {
 		ret = nvme_rq_map_prp(ctrl, rq, sqe, iova, len);
@@ -112,6 +239,17 @@ int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, v
 
 	while (nvme_rq_spin(rq, &cqe) < 0) {
 		if (errno == EAGAIN) {
+			if (sq == ctrl->adminq.sq && (cqe.cid & NVME_CID_ASYNC)) {
+				__nvme_admin_complete(ctrl, &cqe);
+				continue;
+			}
+
+			if (sq == ctrl->adminq.sq && (cqe.cid & NVME_CID_AER) &&
+			    (cqe.cid & ~NVME_CID_AER) < sq->qsize - 1) {
+				__nvme_admin_defer_aer(ctrl, &cqe);
+				continue;
+			}
+
 			log_error("SPURIOUS CQE (cq %" PRIu16 " cid %" PRIu16 ")\n",
 				  rq->sq->cq->id, cqe.cid);
 
@@ -129,9 +267,8 @@ int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, v
 release_rq:
 	nvme_rq_release_atomic(rq);
 
-	if (buf && do_unmap)
-		log_fatal_if(iommu_unmap_vaddr(__iommu_ctx(ctrl), buf, NULL),
-			     "iommu_unmap_vaddr\n");
+	if (buf)
+		__nvme_sync_unmap(__iommu_ctx(ctrl), buf, how);
 
 	return ret;
 }
@@ -142,6 +279,169 @@ int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t le
 	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, buf, len, cqe_copy);
 }
 
+int nvme_admin_async(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
+		     nvme_admin_cb cb, void *opaque)
+{
+	struct nvme_admin_req *req;
+	struct nvme_rq *rq;
+	iova_t iova;
+	enum nvme_buf_map how = NVME_BUF_MAPPED;
+
+	if (ctrl->flags & NVME_CTRL_F_SECONDARY) {
+		errno = EPERM;
+		return -1;
+	}
+
+	if (buf && __nvme_sync_map(__iommu_ctx(ctrl), buf, len, &iova, &how)) {
+		log_debug("failed to map vaddr\n");
+		return -1;
+	}
+
+	rq = nvme_rq_acquire_atomic(ctrl->adminq.sq);
+	if (!rq)
+		goto unmap;
+
+	if (buf && nvme_rq_map_prp(ctrl, rq, sqe, iova, len))
+		goto release_rq;
+
+	req = znew_t(struct nvme_admin_req, 1);
+	req->cb = cb;
+	req->opaque = opaque;
+	req->buf = buf;
+	req->how = how;
+
+	ctrl->admin_reqs[rq->cid] = req;
+
+	/* rq_exec overwrites the command identifier, so use sq_exec */
+	sqe->cid = rq->cid | NVME_CID_ASYNC;
+	nvme_sq_exec(ctrl->adminq.sq, sqe);
+
+	return 0;
+
+release_rq:
+	nvme_rq_release_atomic(rq);
+
+unmap:
+	if (buf)
+		__nvme_sync_unmap(__iommu_ctx(ctrl), buf, how);
+
+	return -1;
+}
+
+int nvme_admin_poll(struct nvme_ctrl *ctrl, nvme_admin_cb aer_cb)
+{
+	struct nvme_sq *sq = ctrl->adminq.sq;
+	struct nvme_cq *cq = ctrl->adminq.cq;
+	struct nvme_cqe *head, cqe;
+	int n = 0;
+
+	if (ctrl->flags & NVME_CTRL_F_SECONDARY) {
+		errno = EPERM;
+		return -1;
+	}
+
+	if (aer_cb)
+		n += __nvme_admin_deliver_aers(ctrl, aer_cb);
+
+	while ((head = nvme_cq_get_cqe(cq))) {
+		uint16_t cid;
+
+		/* callbacks may reap the queue themselves (e.g., with nvme_admin()) */
+		memcpy(&cqe, head, sizeof(cqe));
+		nvme_cq_update_head(cq);
+
+		n++;
+
+		if (cqe.cid & NVME_CID_ASYNC) {
+			__nvme_admin_complete(ctrl, &cqe);
+			continue;
+		}
+
+		cid = cqe.cid & ~NVME_CID_AER;
+
+		if ((cqe.cid & NVME_CID_AER) && cid < sq->qsize - 1) {
+			struct nvme_rq *rq = &sq->rqs[cid];
+			void *aer_opaque = rq->opaque;
+
+			/* leave it for a poller that handles it */
+			if (!aer_cb) {
+				__nvme_admin_defer_aer(ctrl, &cqe);
+				continue;
+			}
+
+			nvme_rq_release_atomic(rq);
+
+			cqe.cid = cid;
+
+			aer_cb(ctrl, &cqe, aer_opaque);
+
+			continue;
+		}
+
+		log_error("SPURIOUS CQE (cq %" PRIu16 " cid %" PRIu16 ")\n", cq->id, cqe.cid);
+	}
+
+	return n;
+}
+
+int nvme_admin_abort(struct nvme_ctrl *ctrl, nvme_admin_cb aer_cb)
+{
+	struct nvme_sq *sq = ctrl->adminq.sq;
+	int nrqs = sq->qsize - 1, n = 0;
+	struct nvme_rq *rq;
+
+	__autofree bool *idle = NULL;
+
+	if (ctrl->flags & NVME_CTRL_F_SECONDARY) {
+		errno = EPERM;
+		return -1;
+	}
+
+	/* completions that were set aside are delivered as is */
+	if (aer_cb)
+		n += __nvme_admin_deliver_aers(ctrl, aer_cb);
+	else
+		ctrl->naer_cqes = 0;
+
+	/* trackers acquired by callbacks below are not aborted */
+	idle = znew_t(bool, nrqs);
+
+	for (rq = atomic_load_acquire(&sq->rq_top); rq; rq = rq->rq_next)
+		idle[rq->cid] = true;
+
+	for (uint16_t cid = 0; cid < nrqs; cid++) {
+		struct nvme_cqe cqe = {
+			.sfp = cpu_to_le16(NVME_STATUS_HOST_ABORTED << 1),
+		};
+		void *aer_opaque;
+
+		if (idle[cid])
+			continue;
+
+		n++;
+
+		if (ctrl->admin_reqs[cid]) {
+			cqe.cid = cid | NVME_CID_ASYNC;
+			__nvme_admin_complete(ctrl, &cqe);
+
+			continue;
+		}
+
+		/* otherwise, an asynchronous event request */
+		rq = &sq->rqs[cid];
+		aer_opaque = rq->opaque;
+
+		nvme_rq_release_atomic(rq);
+
+		cqe.cid = cid;
+
+		if (aer_cb)
+			aer_cb(ctrl, &cqe, aer_opaque);
+	}
+
+	return n;
+}
+
 /*
  * PRP list chaining cursor.
  *
@@ -328,6 +628,25 @@ int nvme_map_prp(struct nvme_ctrl *ctrl, leint64_t *prplists, int nprplists,
 	return 0;
 }
 
+/*
+ * Vectored mappings translate the iovec in batches of __IOV_BATCH entries,
+ * taking the iova map lock only once per batch.
+ */
+#define __IOV_BATCH 64
+
+static inline int __translate_batch(struct iommu_ctx *ctx, struct iovec *iov, int niov, int i,
+				    iova_t *iovas)
+{
+	int n = min_t(int, niov - i, __IOV_BATCH);
+
+	if (iommu_translate_vaddrv(ctx, &iov[i], n, iovas) != n) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	return 0;
+}
+
 static int nvme_virt_mgmt(struct nvme_ctrl *ctrl, uint16_t cntlid, enum nvme_virt_mgmt_rt rt,
 			  enum nvme_virt_mgmt_act act, uint16_t nr)
 {
@@ -343,14 +662,12 @@ static int nvme_virt_mgmt(struct nvme_ctrl *ctrl, uint16_t cntlid, enum nvme_vir
 
 int nvme_vm_assign_max_flexible(struct nvme_ctrl *ctrl, uint16_t scid)
 {
-	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
-
 	union nvme_cmd cmd;
 	struct nvme_primary_ctrl_cap *cap;
 
-	__autovar_s(iommu_dmabuf) buffer = {};
+	__autovar_s(iommu_dmachunk) buffer = {};
 
-	if (iommu_get_dmabuf(ctx, &buffer, NVME_IDENTIFY_DATA_SIZE, IOMMU_MAP_EPHEMERAL))
+	if (iommu_dmapool_get(ctrl->dmapool, &buffer, NVME_IDENTIFY_DATA_SIZE))
 		return -1;
 
 	cmd.identify = (struct nvme_cmd_identify) {
@@ -386,7 +703,7 @@ int nvme_mapv_prp(struct nvme_ctrl *ctrl, leint64_t *prplists, int nprplists,
 	size_t pagesize = 1 << pageshift;
 	int max_prps = 1 << (pageshift - 3);
 	int ret, prpcount;
-	iova_t iova, prplist_iova;
+	iova_t iova, prplist_iova, iovas[__IOV_BATCH];
 	struct __prp_cursor c;
 
 	if (nprplists < 1) {
@@ -394,10 +711,10 @@ int nvme_mapv_prp(struct nvme_ctrl *ctrl, leint64_t *prplists, int nprplists,
 		return -1;
 	}
 
-	if (!iommu_translate_vaddr(ctx, iov->iov_base, &iova)) {
-		errno = EFAULT;
+	if (__translate_batch(ctx, iov, niov, 0, iovas))
 		return -1;
-	}
+
+	iova = iovas[0];
 
 	if (!iommu_translate_vaddr(ctx, prplists, &prplist_iova)) {
 		errno = EFAULT;
@@ -429,11 +746,10 @@ int nvme_mapv_prp(struct nvme_ctrl *ctrl, leint64_t *prplists, int nprplists,
 
 	/* map remaining iovec entries; these must be page size aligned */
 	for (int i = 1; i < niov; i++) {
-		if (!iommu_translate_vaddr(ctx, iov[i].iov_base, &iova)) {
-			errno = EFAULT;
+		if (!(i % __IOV_BATCH) && __translate_batch(ctx, iov, niov, i, iovas))
 			return -1;
-		}
 
+		iova = iovas[i % __IOV_BATCH];
 		len = iov[i].iov_len;
 
 		/* all entries but the last must have a page size aligned len */
@@ -559,7 +875,7 @@ int nvme_mapv_sgl(struct nvme_ctrl *ctrl, struct nvme_sgld *seg, iova_t seg_iova
 	int max_sglds = 1 << (pageshift - 4);
 	int dword_align = ctrl->flags & NVME_CTRL_F_SGLS_DWORD_ALIGNMENT;
 
-	iova_t iova;
+	iova_t iova, iovas[__IOV_BATCH];
 
 	if (niov == 1) {
 		if (!iommu_translate_vaddr(ctx, iov->iov_base, &iova)) {
@@ -580,10 +896,10 @@ int nvme_mapv_sgl(struct nvme_ctrl *ctrl, struct nvme_sgld *seg, iova_t seg_iova
 	__sgl_segment(&cmd->dptr.sgl, seg_iova, niov);
 
 	for (int i = 0; i < niov; i++) {
-		if (!iommu_translate_vaddr(ctx, iov[i].iov_base, &iova)) {
-			errno = EFAULT;
+		if (!(i % __IOV_BATCH) && __translate_batch(ctx, iov, niov, i, iovas))
 			return -1;
-		}
+
+		iova = iovas[i % __IOV_BATCH];
 
 		if (dword_align && (iova & 0x3)) {
 			errno = EINVAL;
@@ -633,14 +949,12 @@ int nvme_mapv_iova_sgl(struct nvme_ctrl *ctrl, struct nvme_sgld *seg, iova_t seg
 
 int nvme_get_vf_cntlid(struct nvme_ctrl *ctrl, int vfnum, uint16_t *cntlid)
 {
-	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
-
 	union nvme_cmd cmd;
 	struct nvme_secondary_ctrl_list *list;
 
-	__autovar_s(iommu_dmabuf) buffer = {};
+	__autovar_s(iommu_dmachunk) buffer = {};
 
-	if (iommu_get_dmabuf(ctx, &buffer, NVME_IDENTIFY_DATA_SIZE, IOMMU_MAP_EPHEMERAL))
+	if (iommu_dmapool_get(ctrl->dmapool, &buffer, NVME_IDENTIFY_DATA_SIZE))
 		return -1;
 
 	cmd.identify = (struct nvme_cmd_identify) {
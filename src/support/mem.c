@@ -26,6 +26,23 @@
 #include <unistd.h>
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
 
 #include <vfn/support/align.h>
 #include <vfn/support/atomic.h>
@@ -68,15 +85,159 @@ void backtrace_abort(void)
 
 ssize_t pgmap(void **mem, size_t sz)
 {
-	ssize_t len = ALIGN_UP(sz, __VFN_PAGESIZE);
+	return pgmapf(mem, sz, 0x0);
+}
+
+static void __prefault(void *mem, size_t len)
+{
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(mem, len, MADV_POPULATE_WRITE))
+		return;
+#endif
+
+	for (size_t off = 0; off < len; off += __VFN_PAGESIZE)
+		((volatile char *)mem)[off] = 0;
+}
+
+/* best effort; the memory is still usable if placed on another node */
+static void __bind_node(void *mem, size_t len, int node)
+{
+	unsigned long nodemask[(PGMAP_MAX_NODE + 1) / (8 * sizeof(unsigned long)) + 1] = {};
+	const unsigned long bits = 8 * sizeof(unsigned long);
+
+	nodemask[node / bits] |= 1UL << (node % bits);
+
+	/* the kernel only considers maxnode - 1 bits */
+	if (syscall(SYS_mbind, mem, len, MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8 + 1, 0))
+		log_debug("mbind(MPOL_PREFERRED, node %d) failed\n", node);
+}
+
+/* create a memfd of @len bytes to back a shared allocation */
+static int __memfd(size_t len, unsigned long flags)
+{
+	unsigned int mfd_flags = MFD_CLOEXEC;
+	int fd;
+
+	if (flags & (PGMAP_HUGETLB_2M | PGMAP_HUGETLB_1G))
+		mfd_flags |= MFD_HUGETLB |
+			((unsigned int)__builtin_ctzl(pgmap_pagesize(flags)) << MFD_HUGE_SHIFT);
+
+	fd = memfd_create("libvfn", mfd_flags);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, (off_t)len)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* map at @fixed, if given, without replacing existing mappings */
+static ssize_t __pgmapf(void **mem, void *fixed, size_t sz, unsigned long flags)
+{
+	int mmap_flags = (flags & PGMAP_SHARED) ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS;
+	unsigned long huge = flags & PGMAP_HUGE_MASK;
+	size_t pagesize = pgmap_pagesize(flags);
+	int node = pgmap_node(flags);
+	size_t maplen, head;
+	ssize_t len;
+	void *addr;
+	int fd = -1;
+
+	if (huge & (huge - 1)) {
+		log_debug("at most one huge page flag may be given\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fixed && !ALIGNED((uintptr_t)fixed, pagesize)) {
+		log_debug("%p is not aligned to the page size (%zu)\n", fixed, pagesize);
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = ALIGN_UP(sz, pagesize);
+	maplen = len;
+
+	/* for shared allocations, the page size is given by the memfd */
+	if ((flags & (PGMAP_HUGETLB_2M | PGMAP_HUGETLB_1G)) && !(flags & PGMAP_SHARED))
+		mmap_flags |= MAP_HUGETLB | (__builtin_ctzl(pagesize) << MAP_HUGE_SHIFT);
+
+	if (fixed)
+		mmap_flags |= MAP_FIXED_NOREPLACE;
+
+	/* transparent huge pages must be naturally aligned; over-allocate and trim */
+	if ((flags & PGMAP_THP) && !fixed)
+		maplen += pagesize - __VFN_PAGESIZE;
+	else if ((flags & PGMAP_PREFAULT) && !(flags & PGMAP_THP) && node < 0)
+		mmap_flags |= MAP_POPULATE;
 
-	*mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-	if (*mem == MAP_FAILED)
+	if (flags & PGMAP_SHARED) {
+		fd = __memfd(maplen, flags);
+		if (fd < 0)
+			return -1;
+	}
+
+	addr = mmap(fixed, maplen, PROT_READ | PROT_WRITE, mmap_flags, fd, 0);
+
+	/* the mapping holds a reference on the file */
+	if (fd >= 0)
+		close(fd);
+
+	if (addr == MAP_FAILED)
 		return -1;
 
+	/* kernels prior to v4.17 treat MAP_FIXED_NOREPLACE as a hint */
+	if (fixed && addr != fixed) {
+		pgunmap(addr, maplen);
+
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (flags & PGMAP_THP) {
+		head = ALIGN_UP((uintptr_t)addr, pagesize) - (uintptr_t)addr;
+
+		if (head)
+			pgunmap(addr, head);
+
+		if (maplen - head > (size_t)len)
+			pgunmap((char *)addr + head + len, maplen - head - len);
+
+		addr = (char *)addr + head;
+
+		/* best effort; the memory is still usable with base pages */
+		if (madvise(addr, len, MADV_HUGEPAGE))
+			log_debug("madvise(MADV_HUGEPAGE) failed\n");
+	}
+
+	/* the memory policy only applies to pages faulted in after it is set */
+	if (node >= 0)
+		__bind_node(addr, len, node);
+
+	/* fault in after the advice so that huge pages are allocated */
+	if ((flags & PGMAP_PREFAULT) && ((flags & PGMAP_THP) || node >= 0))
+		__prefault(addr, len);
+
+	*mem = addr;
+
 	return len;
 }
 
+ssize_t pgmapf(void **mem, size_t sz, unsigned long flags)
+{
+	return __pgmapf(mem, NULL, sz, flags);
+}
+
+ssize_t pgmapf_at(void *addr, size_t sz, unsigned long flags)
+{
+	void *mem;
+
+	return __pgmapf(&mem, addr, sz, flags);
+}
+
 ssize_t pgmapn(void **mem, unsigned int n, size_t sz)
 {
 	if (would_overflow(n, sz)) {
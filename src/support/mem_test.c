@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "vfn/support.h"
+
+#include "ccan/tap/tap.h"
+
+#define HUGE_2M (1ULL << 21)
+
+/* get_mempolicy(2) flags */
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+/* write to mem from a child process; returns true if the child succeeded */
+static bool child_write(void *mem, char val)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return false;
+
+	if (!pid) {
+		*(volatile char *)mem = val;
+		_exit(0);
+	}
+
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	void *mem;
+	ssize_t len;
+	int node;
+
+	plan_tests(18);
+
+	len = pgmap(&mem, 1);
+	ok(len == (ssize_t)__VFN_PAGESIZE && ALIGNED((uintptr_t)mem, __VFN_PAGESIZE),
+	   "pgmap rounds up to the page size");
+	pgunmap(mem, len);
+
+	len = pgmapf(&mem, 3 * __VFN_PAGESIZE, PGMAP_PREFAULT);
+	ok(len == 3 * (ssize_t)__VFN_PAGESIZE, "pgmapf prefault");
+	ok(((volatile char *)mem)[2 * __VFN_PAGESIZE] == 0, "prefaulted memory is zeroed");
+	pgunmap(mem, len);
+
+	ok(pgmap_pagesize(PGMAP_THP) == HUGE_2M && pgmap_pagesize(PGMAP_HUGETLB_1G) == 1ULL << 30,
+	   "huge page sizes");
+
+	len = pgmapf(&mem, HUGE_2M + 1, PGMAP_THP | PGMAP_PREFAULT);
+	ok(len == 2 * HUGE_2M && ALIGNED((uintptr_t)mem, HUGE_2M),
+	   "pgmapf thp is aligned to 2 MiB");
+	ok(((volatile char *)mem)[len - 1] == 0, "thp memory is usable");
+	pgunmap(mem, len);
+
+	ok(pgmapf(&mem, __VFN_PAGESIZE, PGMAP_THP | PGMAP_HUGETLB_2M) == -1 && errno == EINVAL,
+	   "pgmapf with multiple huge page sizes fails");
+
+	/* the hugetlbfs pool is most likely empty; only check the result if not */
+	len = pgmapf(&mem, __VFN_PAGESIZE, PGMAP_HUGETLB_2M);
+	if (len < 0) {
+		skip(2, "no 2 MiB hugetlbfs pages available");
+	} else {
+		ok(len == HUGE_2M && ALIGNED((uintptr_t)mem, HUGE_2M), "pgmapf hugetlb");
+		ok(((volatile char *)mem)[0] == 0, "hugetlb memory is usable");
+		pgunmap(mem, len);
+	}
+
+	ok(pgmap_node(PGMAP_NODE(3) | PGMAP_PREFAULT) == 3 && pgmap_node(PGMAP_PREFAULT) == -1 &&
+	   PGMAP_NODE(-1) == 0, "numa node flag encoding");
+
+	len = pgmapf(&mem, 2 * __VFN_PAGESIZE, PGMAP_NODE(0) | PGMAP_PREFAULT);
+	ok(len == 2 * (ssize_t)__VFN_PAGESIZE && ((volatile char *)mem)[len - 1] == 0,
+	   "pgmapf on numa node");
+
+	/* node 0 always exists; mempolicy syscalls may be filtered though */
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, mem, MPOL_F_NODE | MPOL_F_ADDR))
+		skip(1, "get_mempolicy not available");
+	else
+		ok(node == 0, "memory is placed on the node");
+
+	pgunmap(mem, len);
+
+	len = pgmapf(&mem, HUGE_2M, PGMAP_THP | PGMAP_NODE(0) | PGMAP_PREFAULT);
+	ok(len == HUGE_2M && ((volatile char *)mem)[len - 1] == 0, "pgmapf thp on numa node");
+	pgunmap(mem, len);
+
+	len = pgmapf(&mem, __VFN_PAGESIZE, PGMAP_SHARED);
+	ok(len == (ssize_t)__VFN_PAGESIZE && child_write(mem, 0x5a) &&
+	   *(volatile char *)mem == 0x5a, "shared memory is shared with child processes");
+	pgunmap(mem, len);
+
+	len = pgmapf(&mem, __VFN_PAGESIZE, 0x0);
+	ok(len == (ssize_t)__VFN_PAGESIZE && child_write(mem, 0x5a) && *(volatile char *)mem == 0,
+	   "private memory is not shared with child processes");
+
+	/* reuse the address of the private mapping */
+	pgunmap(mem, len);
+
+	ok(pgmapf_at(mem, __VFN_PAGESIZE, PGMAP_SHARED) == (ssize_t)__VFN_PAGESIZE &&
+	   child_write(mem, 0x5a) && *(volatile char *)mem == 0x5a, "pgmapf_at");
+	ok(pgmapf_at(mem, __VFN_PAGESIZE, 0x0) == -1 && errno == EEXIST,
+	   "pgmapf_at does not replace existing mappings");
+	pgunmap(mem, __VFN_PAGESIZE);
+
+	len = pgmapf(&mem, HUGE_2M, PGMAP_THP | PGMAP_SHARED | PGMAP_PREFAULT);
+	ok(len == HUGE_2M && ALIGNED((uintptr_t)mem, HUGE_2M) && child_write(mem + len - 1, 0x5a) &&
+	   ((volatile char *)mem)[len - 1] == 0x5a, "pgmapf shared thp");
+	pgunmap(mem, len);
+
+	return exit_status();
+}
@@ -0,0 +1,476 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/support.h"
+
+#include "btree.h"
+
+#define T BTREE_MIN_DEGREE
+
+/*
+ * Elements are moved one at a time (instead of with memmove) so that a
+ * concurrent reader never observes a partially written pointer.
+ */
+static inline void __copy(struct btree_node *dst, unsigned int d, struct btree_node *src,
+			  unsigned int s, unsigned int n)
+{
+	if (dst == src && d > s) {
+		for (unsigned int j = n; j-- > 0;) {
+			dst->keys[d + j] = src->keys[s + j];
+			dst->vals[d + j] = src->vals[s + j];
+		}
+
+		return;
+	}
+
+	for (unsigned int j = 0; j < n; j++) {
+		dst->keys[d + j] = src->keys[s + j];
+		dst->vals[d + j] = src->vals[s + j];
+	}
+}
+
+static inline void __copy_children(struct btree_node *dst, unsigned int d,
+				   struct btree_node *src, unsigned int s, unsigned int n)
+{
+	if (dst == src && d > s) {
+		for (unsigned int j = n; j-- > 0;)
+			dst->children[d + j] = src->children[s + j];
+
+		return;
+	}
+
+	for (unsigned int j = 0; j < n; j++)
+		dst->children[d + j] = src->children[s + j];
+}
+
+static struct btree_node *__node_new(struct btree *tree, unsigned int level)
+{
+	struct btree_node *x = tree->free;
+
+	if (x)
+		tree->free = x->next_free;
+	else
+		x = znew_t(struct btree_node, 1);
+
+	x->level = level;
+	x->n = 0;
+
+	return x;
+}
+
+static void __node_recycle(struct btree *tree, struct btree_node *x)
+{
+	x->next_free = tree->free;
+	tree->free = x;
+}
+
+void btree_init(struct btree *tree)
+{
+	tree->root = NULL;
+	tree->free = NULL;
+}
+
+static void __clear(struct btree *tree, struct btree_node *x,
+		    void (*fn)(void *opaque, void *val), void *opaque)
+{
+	for (unsigned int i = 0; i < x->n; i++) {
+		if (x->level)
+			__clear(tree, x->children[i], fn, opaque);
+
+		if (fn)
+			fn(opaque, x->vals[i]);
+	}
+
+	if (x->level)
+		__clear(tree, x->children[x->n], fn, opaque);
+
+	__node_recycle(tree, x);
+}
+
+void btree_clear_with(struct btree *tree, void (*fn)(void *opaque, void *val), void *opaque)
+{
+	struct btree_node *root = tree->root;
+
+	if (!root)
+		return;
+
+	atomic_store_release(&tree->root, NULL);
+
+	__clear(tree, root, fn, opaque);
+}
+
+void btree_destroy(struct btree *tree)
+{
+	struct btree_node *x, *next;
+
+	btree_clear_with(tree, NULL, NULL);
+
+	for (x = tree->free; x; x = next) {
+		next = x->next_free;
+		free(x);
+	}
+
+	tree->free = NULL;
+}
+
+/*
+ * Lookups may run concurrently with updates, so everything read from a node
+ * is sanity checked before use: the number of keys is clamped, and the level
+ * of each child must be exactly one less than its parent.
+ */
+static void *__find(struct btree *tree, uint64_t key, int dir)
+{
+	struct btree_node *x = atomic_load_acquire(&tree->root);
+	void *best = NULL;
+
+	if (!x || x->level >= BTREE_MAX_LEVELS)
+		return NULL;
+
+	for (;;) {
+		unsigned int i = 0, n = min_t(unsigned int, x->n, BTREE_MAX_KEYS);
+		unsigned int level = x->level;
+
+		while (i < n && x->keys[i] <= key)
+			i++;
+
+		if (i) {
+			if (x->keys[i - 1] == key)
+				return x->vals[i - 1];
+
+			if (dir < 0)
+				best = x->vals[i - 1];
+		}
+
+		/* keys[i] is the smallest key in this node that is greater than key */
+		if (dir > 0 && i < n)
+			best = x->vals[i];
+
+		if (!level)
+			return best;
+
+		x = x->children[i];
+
+		if (!x || x->level != level - 1)
+			return NULL;
+	}
+}
+
+void *btree_find(struct btree *tree, uint64_t key)
+{
+	return __find(tree, key, 0);
+}
+
+void *btree_find_le(struct btree *tree, uint64_t key)
+{
+	return __find(tree, key, -1);
+}
+
+void *btree_find_ge(struct btree *tree, uint64_t key)
+{
+	return __find(tree, key, 1);
+}
+
+static bool __for_each(struct btree_node *x, btree_iter_fn fn, void *opaque)
+{
+	for (unsigned int i = 0; i < x->n; i++) {
+		if (x->level && !__for_each(x->children[i], fn, opaque))
+			return false;
+
+		if (!fn(opaque, x->keys[i], x->vals[i]))
+			return false;
+	}
+
+	if (x->level)
+		return __for_each(x->children[x->n], fn, opaque);
+
+	return true;
+}
+
+bool btree_for_each(struct btree *tree, btree_iter_fn fn, void *opaque)
+{
+	if (!tree->root)
+		return true;
+
+	return __for_each(tree->root, fn, opaque);
+}
+
+/* split the full child i of x; x must not be full */
+static void __split_child(struct btree *tree, struct btree_node *x, unsigned int i)
+{
+	struct btree_node *y = x->children[i];
+	struct btree_node *z = __node_new(tree, y->level);
+
+	__copy(z, 0, y, T, T - 1);
+
+	if (y->level)
+		__copy_children(z, 0, y, T, T);
+
+	z->n = T - 1;
+
+	__copy_children(x, i + 2, x, i + 1, x->n - i);
+	x->children[i + 1] = z;
+
+	__copy(x, i + 1, x, i, x->n - i);
+	x->keys[i] = y->keys[T - 1];
+	x->vals[i] = y->vals[T - 1];
+
+	x->n++;
+	y->n = T - 1;
+}
+
+int btree_insert(struct btree *tree, uint64_t key, void *val)
+{
+	struct btree_node *x = tree->root;
+	unsigned int i;
+
+	if (btree_find(tree, key)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (!x) {
+		x = __node_new(tree, 0);
+		atomic_store_release(&tree->root, x);
+	} else if (x->n == BTREE_MAX_KEYS) {
+		struct btree_node *s;
+
+		if (x->level + 1 >= BTREE_MAX_LEVELS) {
+			errno = ENOSPC;
+			return -1;
+		}
+
+		s = __node_new(tree, x->level + 1);
+		s->children[0] = x;
+
+		__split_child(tree, s, 0);
+
+		atomic_store_release(&tree->root, s);
+
+		x = s;
+	}
+
+	/* descend, splitting full nodes on the way down */
+	while (x->level) {
+		i = 0;
+
+		while (i < x->n && x->keys[i] < key)
+			i++;
+
+		if (x->children[i]->n == BTREE_MAX_KEYS) {
+			__split_child(tree, x, i);
+
+			if (key > x->keys[i])
+				i++;
+		}
+
+		x = x->children[i];
+	}
+
+	i = 0;
+
+	while (i < x->n && x->keys[i] < key)
+		i++;
+
+	__copy(x, i + 1, x, i, x->n - i);
+
+	x->keys[i] = key;
+	x->vals[i] = val;
+	x->n++;
+
+	return 0;
+}
+
+/* merge child i + 1 of x and the separating key into child i */
+static void __merge(struct btree *tree, struct btree_node *x, unsigned int i)
+{
+	struct btree_node *y = x->children[i], *z = x->children[i + 1];
+
+	y->keys[y->n] = x->keys[i];
+	y->vals[y->n] = x->vals[i];
+
+	__copy(y, y->n + 1, z, 0, z->n);
+
+	if (y->level)
+		__copy_children(y, y->n + 1, z, 0, z->n + 1);
+
+	y->n += z->n + 1;
+
+	__copy(x, i, x, i + 1, x->n - i - 1);
+	__copy_children(x, i + 1, x, i + 2, x->n - i - 1);
+	x->n--;
+
+	__node_recycle(tree, z);
+}
+
+/* move a key from child i - 1 through x into child i */
+static void __rotate_right(struct btree_node *x, unsigned int i)
+{
+	struct btree_node *c = x->children[i], *l = x->children[i - 1];
+
+	__copy(c, 1, c, 0, c->n);
+
+	if (c->level)
+		__copy_children(c, 1, c, 0, c->n + 1);
+
+	c->keys[0] = x->keys[i - 1];
+	c->vals[0] = x->vals[i - 1];
+
+	if (c->level)
+		c->children[0] = l->children[l->n];
+
+	c->n++;
+
+	x->keys[i - 1] = l->keys[l->n - 1];
+	x->vals[i - 1] = l->vals[l->n - 1];
+
+	l->n--;
+}
+
+/* move a key from child i + 1 through x into child i */
+static void __rotate_left(struct btree_node *x, unsigned int i)
+{
+	struct btree_node *c = x->children[i], *r = x->children[i + 1];
+
+	c->keys[c->n] = x->keys[i];
+	c->vals[c->n] = x->vals[i];
+
+	if (c->level)
+		c->children[c->n + 1] = r->children[0];
+
+	c->n++;
+
+	x->keys[i] = r->keys[0];
+	x->vals[i] = r->vals[0];
+
+	__copy(r, 0, r, 1, r->n - 1);
+
+	if (r->level)
+		__copy_children(r, 0, r, 1, r->n);
+
+	r->n--;
+}
+
+/*
+ * Make sure child i of x has at least T keys before descending into it.
+ * Returns the index of the child to descend into (merging with the left
+ * sibling moves the keys one child to the left).
+ */
+static unsigned int __fill_child(struct btree *tree, struct btree_node *x, unsigned int i)
+{
+	if (x->children[i]->n >= T)
+		return i;
+
+	if (i > 0 && x->children[i - 1]->n >= T) {
+		__rotate_right(x, i);
+		return i;
+	}
+
+	if (i < x->n && x->children[i + 1]->n >= T) {
+		__rotate_left(x, i);
+		return i;
+	}
+
+	if (i < x->n) {
+		__merge(tree, x, i);
+		return i;
+	}
+
+	__merge(tree, x, i - 1);
+
+	return i - 1;
+}
+
+static void __remove(struct btree *tree, struct btree_node *x, uint64_t key)
+{
+	for (;;) {
+		unsigned int i = 0;
+
+		while (i < x->n && x->keys[i] < key)
+			i++;
+
+		if (i < x->n && x->keys[i] == key) {
+			struct btree_node *y, *z;
+
+			if (!x->level) {
+				__copy(x, i, x, i + 1, x->n - i - 1);
+				x->n--;
+
+				return;
+			}
+
+			y = x->children[i];
+			z = x->children[i + 1];
+
+			if (y->n >= T) {
+				/* replace with the predecessor and remove that instead */
+				struct btree_node *p = y;
+
+				while (p->level)
+					p = p->children[p->n];
+
+				x->keys[i] = key = p->keys[p->n - 1];
+				x->vals[i] = p->vals[p->n - 1];
+
+				x = y;
+			} else if (z->n >= T) {
+				/* replace with the successor and remove that instead */
+				struct btree_node *s = z;
+
+				while (s->level)
+					s = s->children[0];
+
+				x->keys[i] = key = s->keys[0];
+				x->vals[i] = s->vals[0];
+
+				x = z;
+			} else {
+				__merge(tree, x, i);
+
+				x = y;
+			}
+
+			continue;
+		}
+
+		if (!x->level)
+			return;
+
+		/* the key is not in this node; it must be in the subtree at i */
+		x = x->children[__fill_child(tree, x, i)];
+	}
+}
+
+void *btree_remove(struct btree *tree, uint64_t key)
+{
+	struct btree_node *root = tree->root;
+	void *val = btree_find(tree, key);
+
+	if (!val)
+		return NULL;
+
+	__remove(tree, root, key);
+
+	/* shrink the tree if the root became empty */
+	if (!root->n) {
+		atomic_store_release(&tree->root, root->level ? root->children[0] : NULL);
+
+		__node_recycle(tree, root);
+	}
+
+	return val;
+}
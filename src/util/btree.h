@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_SRC_UTIL_BTREE_H
+#define LIBVFN_SRC_UTIL_BTREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * B-tree (in the CLRS sense; values are stored in inner nodes as well) mapping
+ * unique 64 bit keys to opaque, non-NULL values.
+ *
+ * Nodes are type-stable; removed nodes are kept on a free list for reuse and
+ * only released by btree_destroy(). Combined with an external sequence
+ * counter, this allows the btree_find*() functions to be used by readers
+ * that do not exclude writers; such a reader may see an inconsistent tree,
+ * but it will never follow a pointer to something that is not a node or loop
+ * forever.
+ */
+
+#ifndef BTREE_MIN_DEGREE
+#define BTREE_MIN_DEGREE 8
+#endif
+
+#define BTREE_MAX_KEYS (2 * BTREE_MIN_DEGREE - 1)
+#define BTREE_MAX_LEVELS 16
+
+struct btree_node {
+	unsigned int level;
+	unsigned int n;
+
+	uint64_t keys[BTREE_MAX_KEYS];
+	void *vals[BTREE_MAX_KEYS];
+
+	/* not used in leaves (level 0) */
+	struct btree_node *children[BTREE_MAX_KEYS + 1];
+
+	struct btree_node *next_free;
+};
+
+struct btree {
+	struct btree_node *root;
+	struct btree_node *free;
+};
+
+/* return false to stop the iteration */
+typedef bool (*btree_iter_fn)(void *opaque, uint64_t key, void *val);
+
+void btree_init(struct btree *tree);
+void btree_destroy(struct btree *tree);
+void btree_clear_with(struct btree *tree, void (*fn)(void *opaque, void *val), void *opaque);
+int btree_insert(struct btree *tree, uint64_t key, void *val);
+void *btree_remove(struct btree *tree, uint64_t key);
+void *btree_find(struct btree *tree, uint64_t key);
+void *btree_find_le(struct btree *tree, uint64_t key);
+void *btree_find_ge(struct btree *tree, uint64_t key);
+bool btree_for_each(struct btree *tree, btree_iter_fn fn, void *opaque);
+
+#endif /* LIBVFN_SRC_UTIL_BTREE_H */
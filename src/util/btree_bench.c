@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Index benchmark; compares the b-tree and skiplist iova map backends by
+ * reporting the average time (in nanoseconds) to insert ("map"), look up an
+ * address within ("translate") and remove ("unmap") non-overlapping,
+ * page-aligned ranges with 10^2 to 10^6 live ranges.
+ *
+ * With a fixed number of levels, the skiplist degrades to a linear scan as the
+ * number of ranges grows; it is not run beyond SKIPLIST_MAX_RANGES.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/time/time.h"
+
+#include "vfn/support/compiler.h"
+#include "vfn/support/mem.h"
+
+#include "btree.h"
+#include "skiplist.h"
+
+#define MAX_RANGES 1000000
+#define SKIPLIST_MAX_RANGES 100000
+#define RANGE_LEN 0x4000ULL
+#define RANGE_STRIDE 0x10000ULL
+
+#define LOOKUPS 2000000
+
+struct range {
+	uint64_t start, len;
+
+	struct skiplist_node list;
+};
+
+static struct range *ranges;
+static uint64_t *order;
+
+static int range_cmp(const void *key, const struct skiplist_node *n)
+{
+	struct range *r = container_of_var(n, r, list);
+	uint64_t addr = *(const uint64_t *)key;
+
+	if (addr < r->start)
+		return -1;
+	else if (addr >= r->start + r->len)
+		return 1;
+
+	return 0;
+}
+
+static void shuffle(uint64_t *a, unsigned int n)
+{
+	for (unsigned int i = n - 1; i > 0; i--) {
+		unsigned int j = (unsigned int)(random() % (i + 1));
+		uint64_t tmp = a[i];
+
+		a[i] = a[j];
+		a[j] = tmp;
+	}
+}
+
+static inline uint64_t random_addr(unsigned int n)
+{
+	uint64_t i = (uint64_t)random() % n;
+
+	return ranges[i].start + (uint64_t)random() % RANGE_LEN;
+}
+
+static double nsec_per_op(struct timemono start, unsigned int nops)
+{
+	return (double)time_to_nsec(timemono_since(start)) / nops;
+}
+
+static void bench_btree(unsigned int n, double *map, double *translate, double *unmap)
+{
+	struct btree tree;
+	struct timemono start;
+	uint64_t hits = 0;
+
+	btree_init(&tree);
+
+	start = time_mono();
+	for (unsigned int i = 0; i < n; i++) {
+		struct range *r = &ranges[order[i]];
+
+		if (btree_insert(&tree, r->start, r))
+			err(1, "btree_insert");
+	}
+	*map = nsec_per_op(start, n);
+
+	start = time_mono();
+	for (unsigned int i = 0; i < LOOKUPS; i++) {
+		uint64_t addr = random_addr(n);
+		struct range *r = btree_find_le(&tree, addr);
+
+		if (r && addr < r->start + r->len)
+			hits++;
+	}
+	*translate = nsec_per_op(start, LOOKUPS);
+
+	if (hits != LOOKUPS)
+		errx(1, "btree: lookups failed");
+
+	start = time_mono();
+	for (unsigned int i = 0; i < n; i++) {
+		if (!btree_remove(&tree, ranges[order[i]].start))
+			errx(1, "btree_remove");
+	}
+	*unmap = nsec_per_op(start, n);
+
+	btree_destroy(&tree);
+}
+
+static void bench_skiplist(unsigned int n, double *map, double *translate, double *unmap)
+{
+	struct skiplist list;
+	struct timemono start;
+	uint64_t hits = 0;
+
+	skiplist_init(&list);
+
+	start = time_mono();
+	for (unsigned int i = 0; i < n; i++) {
+		struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+		struct range *r = &ranges[order[i]];
+
+		if (skiplist_find(&list, &r->start, range_cmp, update))
+			errx(1, "skiplist_find");
+
+		skiplist_link(&list, &r->list, update);
+	}
+	*map = nsec_per_op(start, n);
+
+	start = time_mono();
+	for (unsigned int i = 0; i < LOOKUPS; i++) {
+		uint64_t addr = random_addr(n);
+
+		if (skiplist_find(&list, &addr, range_cmp, NULL))
+			hits++;
+	}
+	*translate = nsec_per_op(start, LOOKUPS);
+
+	if (hits != LOOKUPS)
+		errx(1, "skiplist: lookups failed");
+
+	start = time_mono();
+	for (unsigned int i = 0; i < n; i++) {
+		struct skiplist_node *node, *update[SKIPLIST_LEVELS] = {};
+
+		node = skiplist_find(&list, &ranges[order[i]].start, range_cmp, update);
+		if (!node)
+			errx(1, "skiplist_find");
+
+		skiplist_erase(&list, node, update);
+	}
+	*unmap = nsec_per_op(start, n);
+}
+
+int main(void)
+{
+	ranges = znew_t(struct range, MAX_RANGES);
+	order = znew_t(uint64_t, MAX_RANGES);
+
+	printf("%-8s %8s %10s %10s %10s  (ns/op)\n", "index", "ranges", "map", "translate",
+	       "unmap");
+
+	for (unsigned int n = 100; n <= MAX_RANGES; n *= 10) {
+		double map, translate, unmap;
+
+		for (unsigned int i = 0; i < n; i++) {
+			ranges[i].start = 0x100000000000ULL + i * RANGE_STRIDE;
+			ranges[i].len = RANGE_LEN;
+			order[i] = i;
+		}
+
+		shuffle(order, n);
+
+		bench_btree(n, &map, &translate, &unmap);
+		printf("%-8s %8u %10.1f %10.1f %10.1f\n", "btree", n, map, translate, unmap);
+
+		if (n > SKIPLIST_MAX_RANGES) {
+			printf("%-8s %8u %10s %10s %10s\n", "skiplist", n, "-", "-", "-");
+			continue;
+		}
+
+		bench_skiplist(n, &map, &translate, &unmap);
+		printf("%-8s %8u %10.1f %10.1f %10.1f\n", "skiplist", n, map, translate, unmap);
+	}
+
+	free(order);
+	free(ranges);
+
+	return 0;
+}
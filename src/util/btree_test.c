@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/tap/tap.h"
+
+#include "vfn/support/compiler.h"
+#include "vfn/support/mem.h"
+
+#include "btree.c"
+
+#define NKEYS 10000
+
+static struct btree tree;
+
+static uint64_t keys[NKEYS];
+
+/* keys are multiples of 4 so that there are holes for find_le */
+#define KEY(i) (((uint64_t)(i) + 1) * 4)
+#define VAL(k) ((void *)(uintptr_t)(k))
+
+static void shuffle(uint64_t *a, int n)
+{
+	for (int i = n - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		uint64_t tmp = a[i];
+
+		a[i] = a[j];
+		a[j] = tmp;
+	}
+}
+
+/* verify ordering, levels and minimum occupancy; returns the number of keys */
+static long check(struct btree_node *x, bool root, uint64_t lo, uint64_t hi)
+{
+	long count = x->n;
+
+	if (!root && x->n < T - 1)
+		return -1;
+
+	for (unsigned int i = 0; i < x->n; i++) {
+		if (x->keys[i] <= lo || x->keys[i] >= hi)
+			return -1;
+
+		if (i && x->keys[i - 1] >= x->keys[i])
+			return -1;
+	}
+
+	if (!x->level)
+		return count;
+
+	for (unsigned int i = 0; i <= x->n; i++) {
+		struct btree_node *c = x->children[i];
+		long ret;
+
+		if (c->level != x->level - 1)
+			return -1;
+
+		ret = check(c, false, i ? x->keys[i - 1] : lo, i < x->n ? x->keys[i] : hi);
+		if (ret < 0)
+			return -1;
+
+		count += ret;
+	}
+
+	return count;
+}
+
+static long check_tree(void)
+{
+	if (!tree.root)
+		return 0;
+
+	return check(tree.root, true, 0, UINT64_MAX);
+}
+
+struct iter_state {
+	uint64_t prev;
+	long count;
+	bool sorted;
+};
+
+static bool __iter(void *opaque, uint64_t key, void *val)
+{
+	struct iter_state *s = opaque;
+
+	if (key <= s->prev || val != VAL(key))
+		s->sorted = false;
+
+	s->prev = key;
+	s->count++;
+
+	return true;
+}
+
+static void __count(void *opaque, void *val UNUSED)
+{
+	(*(long *)opaque)++;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	struct iter_state s = {.sorted = true};
+	bool found = true, found_le = true, found_ge = true, gone = true;
+	long cleared = 0;
+	int i;
+
+	plan_tests(22);
+
+	btree_init(&tree);
+
+	ok(btree_find(&tree, KEY(0)) == NULL, "find in empty tree");
+	ok(btree_find_le(&tree, KEY(0)) == NULL, "find_le in empty tree");
+	ok(btree_find_ge(&tree, KEY(0)) == NULL, "find_ge in empty tree");
+
+	for (i = 0; i < NKEYS; i++)
+		keys[i] = KEY(i);
+
+	shuffle(keys, NKEYS);
+
+	for (i = 0; i < NKEYS; i++) {
+		if (btree_insert(&tree, keys[i], VAL(keys[i])))
+			break;
+	}
+
+	ok(i == NKEYS, "insert %d keys", NKEYS);
+	ok(check_tree() == NKEYS, "tree is valid after inserts");
+	ok(btree_insert(&tree, KEY(42), VAL(KEY(42))) && errno == EEXIST, "insert duplicate");
+
+	for (i = 0; i < NKEYS; i++) {
+		if (btree_find(&tree, KEY(i)) != VAL(KEY(i)))
+			found = false;
+
+		if (btree_find_le(&tree, KEY(i) + 3) != VAL(KEY(i)))
+			found_le = false;
+
+		if (btree_find_ge(&tree, KEY(i) - 3) != VAL(KEY(i)))
+			found_ge = false;
+
+		if (btree_find(&tree, KEY(i) + 1))
+			gone = false;
+	}
+
+	ok(found, "find all keys");
+	ok(found_le, "find_le all keys");
+	ok(found_ge, "find_ge all keys");
+	ok(gone, "find absent keys");
+	ok(btree_find_le(&tree, KEY(0) - 1) == NULL, "find_le below smallest key");
+	ok(btree_find_le(&tree, UINT64_MAX) == VAL(KEY(NKEYS - 1)), "find_le above largest key");
+	ok(btree_find_ge(&tree, KEY(NKEYS - 1) + 1) == NULL, "find_ge above largest key");
+
+	btree_for_each(&tree, __iter, &s);
+	ok(s.sorted && s.count == NKEYS, "for_each visits all keys in order");
+
+	/* remove half of the keys in random order */
+	shuffle(keys, NKEYS);
+
+	for (i = 0; i < NKEYS / 2; i++) {
+		if (btree_remove(&tree, keys[i]) != VAL(keys[i]))
+			break;
+	}
+
+	ok(i == NKEYS / 2, "remove %d keys", NKEYS / 2);
+	ok(check_tree() == NKEYS - NKEYS / 2, "tree is valid after removals");
+	ok(btree_remove(&tree, keys[0]) == NULL, "remove absent key");
+
+	found = true;
+	gone = true;
+
+	for (i = 0; i < NKEYS; i++) {
+		void *val = btree_find(&tree, keys[i]);
+
+		if (i < NKEYS / 2 && val)
+			gone = false;
+		else if (i >= NKEYS / 2 && val != VAL(keys[i]))
+			found = false;
+	}
+
+	ok(gone, "removed keys are gone");
+	ok(found, "remaining keys are found");
+
+	for (i = NKEYS / 2; i < NKEYS; i++) {
+		if (btree_remove(&tree, keys[i]) != VAL(keys[i]))
+			break;
+	}
+
+	ok(i == NKEYS && tree.root == NULL, "remove remaining keys");
+
+	for (i = 0; i < NKEYS; i++)
+		btree_insert(&tree, KEY(i), VAL(KEY(i)));
+
+	btree_clear_with(&tree, __count, &cleared);
+
+	ok(cleared == NKEYS && tree.root == NULL, "clear visits all values");
+
+	btree_insert(&tree, KEY(0), VAL(KEY(0)));
+	ok(btree_find(&tree, KEY(0)) == VAL(KEY(0)), "insert after clear reuses nodes");
+
+	btree_destroy(&tree);
+
+	return exit_status();
+}
@@ -18,6 +18,9 @@ void skiplist_init(struct skiplist *list)
 {
 	list->height = 0;
 
+	/* any non-zero seed will do; xorshift never leaves the zero state */
+	list->rnd = ((uint64_t)(uintptr_t)list * 0x9e3779b97f4a7c15ULL) | 1;
+
 	for (int k = 0; k < SKIPLIST_LEVELS; k++) {
 		list_head_init(&list->heads[k]);
 		skiplist_add(list, &list->sentinel, k);
@@ -77,6 +80,52 @@ struct skiplist_node *skiplist_find(struct skiplist *list, const void *key,
 	return NULL;
 }
 
+/*
+ * Finger search; like skiplist_find(), but resume from the path recorded by a
+ * previous search (skiplist_find() or skiplist_find_from()) instead of from
+ * the top. The list must not have been modified since the path was recorded.
+ *
+ * This is cheap if the key is close to (and larger than) the key of the
+ * previous search. If the key is smaller, fall back to a regular search.
+ */
+struct skiplist_node *skiplist_find_from(struct skiplist *list, const void *key,
+					 int (*cmp)(const void *key, const struct skiplist_node *n),
+					 struct skiplist_node **path)
+{
+	struct skiplist_node *next, *p;
+	int k = 0;
+
+	if (path[0] != &list->sentinel && cmp(key, path[0]) <= 0)
+		return skiplist_find(list, key, cmp, path);
+
+	/* climb up as long as the next node at the level above is smaller than key */
+	while (k < list->height) {
+		next = skiplist_next(list, path[k + 1], k + 1);
+		if (!next || cmp(key, next) <= 0)
+			break;
+
+		k++;
+	}
+
+	p = path[k];
+
+	do {
+		next = skiplist_next(list, p, k);
+
+		while (next && cmp(key, next) > 0) {
+			p = next;
+			next = skiplist_next(list, p, k);
+		}
+
+		path[k] = p;
+	} while (--k >= 0);
+
+	if (next && cmp(key, next) == 0)
+		return next;
+
+	return NULL;
+}
+
 struct skiplist_node *skiplist_find_le(struct skiplist *list, const void *key,
 				       int (*cmp)(const void *key, const struct skiplist_node *n),
 				       struct skiplist_node **path)
@@ -140,22 +189,34 @@ struct skiplist_node *skiplist_find_ge(struct skiplist *list, const void *key,
 	return next;
 }
 
-static inline int __skiplist_random_level(void)
+/* xorshift64 (Marsaglia) */
+static inline uint64_t __skiplist_random(struct skiplist *list)
 {
-	int k = 0;
+	uint64_t x = list->rnd;
 
-	while (k < SKIPLIST_LEVELS - 1 && (rand() > (RAND_MAX / 2)))
-		k++;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
 
-	return k;
+	return list->rnd = x;
+}
+
+/*
+ * Each bit of a random number is set with probability 1/2, so the number of
+ * trailing one bits is the level of a new node with a promotion probability
+ * of 1/2. Setting bit SKIPLIST_LEVELS - 1 of the complement caps the level.
+ */
+static inline int __skiplist_random_level(struct skiplist *list)
+{
+	return __builtin_ctzll(~__skiplist_random(list) | (1ULL << (SKIPLIST_LEVELS - 1)));
 }
 
-#define SKIPLIST_RANDOM_LEVEL __skiplist_random_level()
+#define SKIPLIST_RANDOM_LEVEL(list) __skiplist_random_level(list)
 
 void skiplist_link(struct skiplist *list, struct skiplist_node *n,
 		   struct skiplist_node *update[SKIPLIST_LEVELS])
 {
-	int k = SKIPLIST_RANDOM_LEVEL;
+	int k = SKIPLIST_RANDOM_LEVEL(list);
 
 	if (k > list->height) {
 		/* increase the height of the skiplist */
@@ -10,6 +10,8 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include <stdint.h>
+
 #include "ccan/list/list.h"
 
 #ifndef SKIPLIST_LEVELS
@@ -40,8 +42,15 @@ struct skiplist_node {
 
 #define skiplist_entry(ptr, type, member) container_of(ptr, type, member)
 
+/*
+ * The list is not internally synchronized; updates must be serialized by the
+ * user. This includes the state of the (per-list) generator used to pick the
+ * level of new nodes, so lists that are updated under different locks (or by
+ * different threads) do not contend on or perturb any shared state.
+ */
 struct skiplist {
 	int height;
+	uint64_t rnd;
 	struct skiplist_node sentinel;
 	struct list_head heads[SKIPLIST_LEVELS];
 };
@@ -54,6 +63,9 @@ void skiplist_clear_with(struct skiplist *list, skiplist_iter_fn fn, void *opaqu
 struct skiplist_node *skiplist_find(struct skiplist *list, const void *key,
 				    int (*cmp)(const void *key, const struct skiplist_node *n),
 				    struct skiplist_node **path);
+struct skiplist_node *skiplist_find_from(struct skiplist *list, const void *key,
+					 int (*cmp)(const void *key, const struct skiplist_node *n),
+					 struct skiplist_node **path);
 struct skiplist_node *skiplist_find_le(struct skiplist *list, const void *key,
 				       int (*cmp)(const void *key, const struct skiplist_node *n),
 				       struct skiplist_node **path);
@@ -16,10 +16,12 @@
  * more details.
  */
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/mman.h>
 
@@ -31,6 +33,11 @@
 
 #include "skiplist.c"
 
+#define STRESS_THREADS 8
+#define STRESS_KEYS 512
+#define STRESS_ROUNDS 50000
+#define STRESS_SEED 42
+
 static struct skiplist list;
 
 struct entry {
@@ -93,12 +100,143 @@ static void __clear(void *opaque UNUSED, struct skiplist_node *n)
 	free(skiplist_entry(n, struct entry, list));
 }
 
+/* checks that all levels are sorted and returns the number of nodes (or -1) */
+static int check_levels(struct skiplist *l)
+{
+	struct skiplist_node *n, *next;
+	int count = 0;
+
+	for (int k = 0; k <= l->height; k++) {
+		struct entry *prev = NULL;
+
+		skiplist_for_each_safe(l, n, next, k) {
+			struct entry *e;
+
+			if (n == &l->sentinel)
+				continue;
+
+			e = skiplist_entry(n, struct entry, list);
+
+			if (prev && prev->v >= e->v)
+				return -1;
+
+			prev = e;
+
+			if (k == 0)
+				count++;
+		}
+	}
+
+	return count;
+}
+
+struct stress {
+	struct skiplist list;
+	struct entry entries[STRESS_KEYS];
+	bool present[STRESS_KEYS];
+
+	unsigned int seed;
+	bool valid;
+
+	/* number of nodes in each level at the end of the run */
+	int nodes[SKIPLIST_LEVELS];
+};
+
+/*
+ * Each thread updates its own list; since the lists do not share any state
+ * (in particular, not the level generator), no synchronization is required,
+ * and the shape of the list only depends on the seeds of the thread.
+ */
+static void *stress_thread(void *opaque)
+{
+	struct stress *st = opaque;
+	struct skiplist_node *n, *next, *update[SKIPLIST_LEVELS];
+	int count = 0;
+
+	skiplist_init(&st->list);
+	st->list.rnd = STRESS_SEED;
+
+	for (unsigned int i = 0; i < STRESS_KEYS; i++)
+		st->entries[i].v = i;
+
+	for (int i = 0; i < STRESS_ROUNDS; i++) {
+		unsigned int v = (unsigned int)rand_r(&st->seed) % STRESS_KEYS;
+
+		n = skiplist_find(&st->list, &v, __cmp, update);
+
+		if (!!n != st->present[v]) {
+			st->valid = false;
+			break;
+		}
+
+		if (n) {
+			skiplist_erase(&st->list, n, update);
+			count--;
+		} else {
+			skiplist_link(&st->list, &st->entries[v].list, update);
+			count++;
+		}
+
+		st->present[v] = !st->present[v];
+	}
+
+	if (check_levels(&st->list) != count)
+		st->valid = false;
+
+	for (int k = 0; k <= st->list.height; k++) {
+		skiplist_for_each_safe(&st->list, n, next, k)
+			st->nodes[k]++;
+	}
+
+	skiplist_clear_with(&st->list, NULL, NULL);
+
+	return NULL;
+}
+
+/*
+ * Run the same updates concurrently in all threads and check that the lists
+ * end up with the same shape as when updated by a single thread. Any state
+ * shared by the level generators would make them diverge.
+ */
+static bool stress(void)
+{
+	static struct stress ref, st[STRESS_THREADS];
+	pthread_t threads[STRESS_THREADS];
+	bool valid = true;
+
+	ref.seed = STRESS_SEED;
+	ref.valid = true;
+
+	stress_thread(&ref);
+
+	if (!ref.valid)
+		return false;
+
+	for (int i = 0; i < STRESS_THREADS; i++) {
+		st[i].seed = STRESS_SEED;
+		st[i].valid = true;
+
+		if (pthread_create(&threads[i], NULL, stress_thread, &st[i]))
+			return false;
+	}
+
+	for (int i = 0; i < STRESS_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+
+		valid &= st[i].valid && !memcmp(st[i].nodes, ref.nodes, sizeof(ref.nodes));
+	}
+
+	return valid;
+}
+
 int main(int argc UNUSED, char *argv[] UNUSED)
 {
 	struct skiplist_node *n, *update[SKIPLIST_LEVELS];
+	bool found = true, missing = true;
 	unsigned int v;
+	int r;
 
-	plan_tests(31);
+	plan_tests(39);
 
 	skiplist_init(&list);
 
@@ -194,5 +332,54 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 	n = skiplist_find_ge(&list, &v, __cmp, NULL);
 	ok(n && skiplist_entry(n, struct entry, list)->v == 3, "find_ge(3) returns 3");
 
+	/* Test skiplist_find_from - list has [1, 2, 3, 10, 12, ..., 1998] */
+	for (v = 10; v < 2000; v += 2)
+		add(v);
+
+	v = 1;
+	n = skiplist_find(&list, &v, __cmp, update);
+	ok(n && skiplist_entry(n, struct entry, list)->v == 1, "find(1) records path");
+
+	for (v = 10; v < 2000; v += 2) {
+		n = skiplist_find_from(&list, &v, __cmp, update);
+		if (!n || skiplist_entry(n, struct entry, list)->v != v)
+			found = false;
+
+		v++;
+
+		if (skiplist_find_from(&list, &v, __cmp, update))
+			missing = false;
+
+		v--;
+	}
+
+	ok(found, "find_from finds all present keys in ascending order");
+	ok(missing, "find_from does not find absent keys");
+
+	v = 2;
+	n = skiplist_find_from(&list, &v, __cmp, update);
+	ok(n && skiplist_entry(n, struct entry, list)->v == 2,
+	   "find_from(2) after find_from(1999) falls back");
+
+	ok(check_levels(&list) == 998, "all levels are sorted");
+	ok(list.height >= 4, "levels are used");
+
+	skiplist_clear_with(&list, __clear, NULL);
+
+	/* the level generator must not consume from the application's rand() */
+	srand(42);
+	r = rand();
+
+	srand(42);
+
+	for (v = 0; v < 64; v++)
+		add(v);
+
+	ok(rand() == r, "linking does not perturb rand()");
+
+	skiplist_clear_with(&list, __clear, NULL);
+
+	ok(stress(), "level generation is independent across threads");
+
 	return exit_status();
 }
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -154,6 +155,11 @@ void vfio_pci_unmap_bar(struct vfio_pci_device *pci, int idx, void *mem, size_t
 
 int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
 {
+	bool shared = pci->dev.ctx != NULL;
+	unsigned long long node;
+	struct iommu_ctx *ctx;
+	int err;
+
 	if (pci->bdf) {
 		errno = EALREADY;
 		return -1;
@@ -166,20 +172,32 @@ int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
 
 	log_info("pci class code is 0x%06llx\n", pci->classcode);
 
+	/* sysfs reports -1 (parsed as ULLONG_MAX) if the node is unknown */
+	if (pci_device_info_get_ull(bdf, "numa_node", &node) || node > INT_MAX)
+		pci->numa_node = -1;
+	else
+		pci->numa_node = (int)node;
+
+	log_info("pci numa node is %d\n", pci->numa_node);
+
 	if (!pci->dev.ctx)
 		pci->dev.ctx = iommu_get_context(bdf);
+	else if (pci->dev.ctx->ops.ctx_get)
+		pci->dev.ctx->ops.ctx_get(pci->dev.ctx);
 
-	pci->dev.fd = pci->dev.ctx->ops.get_device_fd(pci->dev.ctx, bdf);
+	ctx = pci->dev.ctx;
+
+	pci->dev.fd = ctx->ops.get_device_fd(ctx, bdf);
 	if (pci->dev.fd < 0) {
 		log_debug("failed to get device fd\n");
-		return -1;
+		goto put_ctx;
 	}
 
 	pci->dev.device_info.argsz = sizeof(struct vfio_device_info);
 
 	if (ioctl(pci->dev.fd, VFIO_DEVICE_GET_INFO, &pci->dev.device_info)) {
 		log_debug("failed to get device info\n");
-		return -1;
+		goto close_dev;
 	}
 
 	assert(pci->dev.device_info.flags & VFIO_DEVICE_FLAGS_PCI);
@@ -191,27 +209,51 @@ int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
 
 	if (ioctl(pci->dev.fd, VFIO_DEVICE_GET_REGION_INFO, &pci->config_region_info)) {
 		log_debug("failed to get config region info\n");
-		return -1;
+		goto close_dev;
 	}
 
 	for (int i = 0; i < PCI_STD_NUM_BARS; i++) {
 		if (vfio_pci_init_bar(pci, i))
-			return -1;
+			goto close_dev;
 	}
 
 	if (pci_set_bus_master(pci)) {
 		log_debug("failed to set pci bus master\n");
-		return -1;
+		goto close_dev;
 	}
 
 	if (vfio_pci_init_irq(pci)) {
 		log_debug("failed to initialize irq\n");
-		return -1;
+		goto close_dev;
 	}
 
 	pci->bdf = strdup(bdf);
 
 	return 0;
+
+close_dev:
+	err = errno;
+
+	log_fatal_if(close(pci->dev.fd), "close");
+
+	/* also drops the reference on the context */
+	if (ctx->ops.put_device_fd && ctx->ops.put_device_fd(ctx, bdf))
+		log_debug("failed to put device fd\n");
+
+	if (!shared)
+		pci->dev.ctx = NULL;
+
+	errno = err;
+	return -1;
+
+put_ctx:
+	err = errno;
+
+	if (shared && ctx->ops.ctx_put)
+		ctx->ops.ctx_put(ctx);
+
+	errno = err;
+	return -1;
 }
 
 int vfio_pci_close(struct vfio_pci_device *pci)
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nvme/types.h>
+
+#include "ccan/minmax/minmax.h"
+#include "ccan/opt/opt.h"
+#include "ccan/tap/tap.h"
+
+#include "vfn/nvme.h"
+
+#include "common.h"
+
+#define NR_QPAIRS 8
+
+static int flush_all(int n)
+{
+	union nvme_cmd cmd = {
+		.opcode = nvme_cmd_flush,
+		.nsid = cpu_to_le32(NVME_NSID_ALL),
+	};
+
+	for (int qid = 1; qid <= n; qid++) {
+		if (nvme_sync(&ctrl, &ctrl.sq[qid], &cmd, NULL, 0, NULL))
+			return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int n;
+
+	setup(argc, argv);
+
+	plan_tests(4);
+
+	n = min_t(int, NR_QPAIRS, min_t(int, ctrl.config.nsqa, ctrl.config.ncqa) + 1);
+
+	ok(nvme_create_ioqpairs(&ctrl, 1, n, 8, -1, 0x0) == 0, "create queue pairs");
+	ok(flush_all(n) == 0, "flush on all queue pairs");
+	ok(nvme_delete_ioqpairs(&ctrl, 1, n) == 0 && !ctrl.sq[1].mem.vaddr,
+	   "delete queue pairs");
+
+	ok(nvme_create_ioqpairs(&ctrl, 1, n, 8, -1, 0x0) == 0 &&
+	   nvme_delete_ioqpairs(&ctrl, 1, n) == 0, "recreate queue pairs");
+
+	teardown();
+
+	return 0;
+}
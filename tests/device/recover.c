@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nvme/types.h>
+
+#include "ccan/err/err.h"
+#include "ccan/opt/opt.h"
+#include "ccan/tap/tap.h"
+
+#include "vfn/nvme.h"
+
+#include "common.h"
+
+static struct nvme_rq *outstanding;
+
+static void recover_cb(struct nvme_ctrl *c UNUSED, struct nvme_rq *rq, void *opaque)
+{
+	(*(int *)opaque)++;
+
+	outstanding = rq;
+}
+
+int main(int argc, char **argv)
+{
+	union nvme_cmd cmd = {
+		.opcode = nvme_cmd_flush,
+		.nsid = cpu_to_le32(NVME_NSID_ALL),
+	};
+	struct nvme_rq *rq;
+	int n = 0;
+
+	setup(argc, argv);
+
+	plan_tests(3);
+
+	if (nvme_create_ioqpair(&ctrl, 1, 8, -1, 0x0))
+		err(1, "could not create io queue pair");
+
+	if (nvme_aer(&ctrl, NULL))
+		err(1, "could not enable aen");
+
+	/* left outstanding (or at least not reaped) across the reset */
+	rq = nvme_rq_acquire(&ctrl.sq[1]);
+	nvme_rq_exec(rq, &cmd);
+
+	ok(nvme_recover(&ctrl, recover_cb, &n) == 1 && n == 1 && outstanding == rq,
+	   "outstanding request is handed back");
+
+	nvme_rq_exec(rq, &cmd);
+
+	ok(nvme_rq_spin(rq, NULL) == 0, "resubmit request");
+
+	nvme_rq_release(rq);
+
+	ok(nvme_sync(&ctrl, &ctrl.sq[1], &cmd, NULL, 0, NULL) == 0 &&
+	   nvme_delete_ioqpair(&ctrl, 1) == 0, "queues are usable");
+
+	teardown();
+
+	return 0;
+}